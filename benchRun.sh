@@ -0,0 +1,27 @@
+#!/bin/bash
+
+# runs payoutbench against payoutd, arguments are passed to payoutbench (e.g. -n 10000 -c 8)
+# the devices are simulated by payoutsim unless PAYOUT_DEVICE names the serial device of real hardware,
+# PAYOUTSIM_ARGS are passed to the simulator (e.g. "-d 20 -e 10") and PAYOUTD_ARGS to payoutd (e.g. "-a -t")
+# redis has to be running, the results are printed as JSON to stdout
+
+export LD_LIBRARY_PATH=.
+
+PIDS=""
+trap 'kill $PIDS 2>/dev/null' EXIT
+
+DEVICE="${PAYOUT_DEVICE}"
+if [ -z "${DEVICE}" ]; then
+	DEVICE=/tmp/payoutsim-bench
+	./payoutsim -L "${DEVICE}" ${PAYOUTSIM_ARGS} > /dev/null &
+	PIDS="$!"
+	sleep 1
+fi
+
+./payoutd -d "${DEVICE}" ${PAYOUTD_ARGS} &
+PIDS="${PIDS} $!"
+
+# the devices are initialized before payoutd subscribes to the request topics
+sleep 3
+
+./payoutbench "$@"
@@ -1,6 +1,14 @@
 #include "Encryption.h"
 
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <wmmintrin.h>
+#define AES_HAVE_NI
+#endif
 
 #include "itl_types.h"
 
@@ -36,12 +44,8 @@
 
 
 
-  // compute S-Box substitutions during execution
-#define FORWARD_SUB_BYTE(input) forward_s_box_compute((input))
-
-
-   // compute S-Box substitution during execution
-#define INVERSE_SUB_BYTE(input) inverse_s_box_compute((input))
+  // S-Box substitutions from the table computed by aes_init_tables()
+#define FORWARD_SUB_BYTE(input) aes_sbox[(input)]
 
 
 /***************************************************************************
@@ -68,6 +72,43 @@ static const UINT8 rcon[10] =
 };
 
 
+// number of expanded keys kept (one per device and key in use is enough)
+#define AES_KEY_CACHE_SIZE 4
+
+typedef struct
+{
+  UINT8    valid;                 /* the entry holds the expansion of key  */
+  UINT8    key[C_MAX_KEY_LENGTH]; /* the key the entry has been expanded from */
+  uint32_t enc[44];               /* encryption round keys                 */
+  uint32_t dec[44];               /* round keys of the equivalent inverse cipher */
+#ifdef AES_HAVE_NI
+  __m128i  ni_enc[11];            /* encryption round keys for AES-NI      */
+  __m128i  ni_dec[11];            /* decryption round keys for AES-NI      */
+#endif
+} aes_key_entry;
+
+typedef struct
+{
+  const char *name;
+  void (*encrypt_blocks)( const aes_key_entry *entry, const UINT8 *in, UINT8 *out, UINT32 num_blocks );
+  void (*decrypt_blocks)( const aes_key_entry *entry, const UINT8 *in, UINT8 *out, UINT32 num_blocks );
+} aes_implementation;
+
+static UINT8 aes_sbox[256];
+static UINT8 aes_inv_sbox[256];
+static uint32_t aes_te[4][256];
+static uint32_t aes_td[4][256];
+
+// the devices may be driven by several threads (redis thread, hardware thread), an entry is
+// only used while aes_key_cache_lock is held as it may be replaced by the next lookup
+static aes_key_entry aes_key_cache[AES_KEY_CACHE_SIZE];
+static int aes_key_cache_next = 0;
+static pthread_mutex_t aes_key_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const aes_implementation *aes_impl = NULL;
+static pthread_once_t aes_impl_once = PTHREAD_ONCE_INIT;
+
+
 
 
 void mem_copy(UINT8* dest, const UINT8* source)
@@ -103,88 +144,6 @@ static UINT8 GF2_8_field_mult_by_2( UINT8 a )
 
 
 
-static UINT32 forward_mix_col(UINT32 state_in)
-{
-  // declarations
-  UINT32 state_out;
-  UINT8 t, v;
-
-  // t = a[0] + a[1] + a[2] + a[3]
-  t = BYTE_0( state_in ) ^ BYTE_1( state_in ) ^ BYTE_2( state_in ) ^ BYTE_3( state_in );
-
-  // v = a[0] + a[1]
-  // v = x*v
-  // r[0] = a[0] + v + t
-  v = BYTE_0 ( state_in ) ^ BYTE_1( state_in );
-  v = GF2_8_field_mult_by_2( v );
-  state_out = ( BYTE_0( state_in ) ^ v ^ t) << 24;
-
-  // v = a[1] + a[2]
-  // v = x*v
-  // r[1] = a[1] + v + t
-  v = BYTE_1( state_in ) ^ BYTE_2( state_in );
-  v = GF2_8_field_mult_by_2( v );
-  state_out ^= ( BYTE_1( state_in ) ^ v ^ t) << 16;
-
-  // v = a[2] + a[3]
-  // v = x*v
-  // r[2] = a[2] + v + t
-  v = BYTE_2( state_in ) ^ BYTE_3( state_in );
-  v = GF2_8_field_mult_by_2( v );
-  state_out ^= ( BYTE_2( state_in ) ^ v ^ t) << 8;
-
-  // v = a[3] + a[0]
-  // v = x*v
-  // r[3] = a[3] + v + t
-  v = BYTE_3( state_in ) ^ BYTE_0( state_in );
-  v = GF2_8_field_mult_by_2( v );
-  state_out ^= ( BYTE_3( state_in ) ^ v ^ t);
-
-  // return result
-  return state_out;
-}
-
-
-
-
-
-
-static UINT32 inverse_mix_col(UINT32 state_in)
-{
-  // declarations
-  UINT32 state_out;
-  UINT8 u, v;
-
-  // u = x*(x*(a[0] + a[2]))
-  u = GF2_8_field_mult_by_2( BYTE_0(state_in) ^ BYTE_2(state_in) );
-  u = GF2_8_field_mult_by_2( u );
-
-  // v = v*(v*(a[1] + a[3]))
-  v = GF2_8_field_mult_by_2( BYTE_1(state_in) ^ BYTE_3(state_in) );
-  v = GF2_8_field_mult_by_2( v );
-
-  // a[0] = a[0] + u
-  // a[1] = a[1] + v
-  // a[2] = a[2] + u
-  // a[3] = a[3] + v
-  state_out = ( ( (BYTE_0(state_in) ^ u) << 24) ^
-                ( (BYTE_1(state_in) ^ v) << 16) ^
-                ( (BYTE_2(state_in) ^ u) <<  8) ^
-                ( (BYTE_3(state_in) ^ v)      ) );
-
-  // MixCol( a )
-  state_out = forward_mix_col( state_out );
-
-  // return result
-  return state_out;
-}
-
-
-
-
-
-
-
 static UINT8 highbit( const UINT8 x )
 {
   // declarations
@@ -336,199 +295,380 @@ static int aes_set_key( /*@out@*/ aes_context *ctx,
 
 
 
-static int aes_encrypt_16_byte_block( const aes_context *ctx,
-                                      const UINT8       *plain,
-                                  /*@out@*/ UINT8       *cipher )
+/***************************************************************************
+ * T-table and AES-NI implementations                                      *
+ *                                                                         *
+ * The original byte oriented implementation computed every S-box entry   *
+ * (inverse element by Euclid) and expanded the key for every packet.     *
+ * The S-boxes, the combined SubBytes/MixColumns tables and the expanded  *
+ * keys are now computed once. The byte order of the state columns is the *
+ * one of the original code (BYTE_0 is row 0).                            *
+ ***************************************************************************/
+
+
+
+
+static UINT8 GF2_8_field_mult( UINT8 a, UINT8 b )
 {
-  // declarations
-  UINT32 *round_key;          // pointer to round key
-  UINT32 cx0, cx1, cx2, cx3;  // state array columns, cx for input
-  UINT32 cy0, cy1, cy2, cy3;  // state array columns, cy for output
-  UINT8 i;                    // counter for encryption loop
+  UINT8 r = 0;
+
+  while ( b )
+  {
+    if ( b & 1 )
+      r ^= a;
+    a = GF2_8_field_mult_by_2( a );
+    b >>= 1;
+  }
+
+  return r;
+}
+
+
+
+static uint32_t rotate_right_8( uint32_t w32 )
+{
+  return ( w32 >> 8 ) | ( w32 << 24 );
+}
+
 
 
+static void aes_init_tables( void )
+{
+  int i, j;
+
+  for ( i = 0; i < 256; i++ )
+  {
+    aes_sbox[i] = forward_s_box_compute( (UINT8) i );
+    aes_inv_sbox[i] = inverse_s_box_compute( (UINT8) i );
+  }
+
+  for ( i = 0; i < 256; i++ )
+  {
+    UINT8 s = aes_sbox[i];
+    UINT8 si = aes_inv_sbox[i];
+
+    // column ( 2s, s, s, 3s ) of MixColumns applied to SubBytes(i)
+    aes_te[0][i] = ( (uint32_t) GF2_8_field_mult( s, 2 ) << 24 ) |
+                   ( (uint32_t) s << 16 ) |
+                   ( (uint32_t) s <<  8 ) |
+                   ( (uint32_t) GF2_8_field_mult( s, 3 ) );
+
+    // column ( 14si, 9si, 13si, 11si ) of InvMixColumns applied to InvSubBytes(i)
+    aes_td[0][i] = ( (uint32_t) GF2_8_field_mult( si, 14 ) << 24 ) |
+                   ( (uint32_t) GF2_8_field_mult( si,  9 ) << 16 ) |
+                   ( (uint32_t) GF2_8_field_mult( si, 13 ) <<  8 ) |
+                   ( (uint32_t) GF2_8_field_mult( si, 11 ) );
+
+    for ( j = 1; j < 4; j++ )
+    {
+      aes_te[j][i] = rotate_right_8( aes_te[j - 1][i] );
+      aes_td[j][i] = rotate_right_8( aes_td[j - 1][i] );
+    }
+  }
+}
+
+
+
+// InvMixColumns of one column, used for the round keys of the equivalent inverse cipher
+static uint32_t inverse_mix_col( uint32_t w32 )
+{
+  return aes_td[0][aes_sbox[BYTE_0( w32 )]] ^
+         aes_td[1][aes_sbox[BYTE_1( w32 )]] ^
+         aes_td[2][aes_sbox[BYTE_2( w32 )]] ^
+         aes_td[3][aes_sbox[BYTE_3( w32 )]];
+}
 
-  // get encryption round keys
-  round_key = (UINT32 *) ctx->enc_round_keys;
 
-  // read 16 plain text bytes into four 32-bit words (FIPS-197: state = in )
-  CONCAT_4_BYTES( cx0, plain,  0 );
-  CONCAT_4_BYTES( cx1, plain,  4 );
-  CONCAT_4_BYTES( cx2, plain,  8 );
-  CONCAT_4_BYTES( cx3, plain,  12 );
 
-  // XOR it with encryption round_key[0..3] (FIPS-197: AddRoundKey(state))
-  cx0 ^= round_key[0];
-  cx1 ^= round_key[1];
-  cx2 ^= round_key[2];
-  cx3 ^= round_key[3];
+static void aes_table_encrypt_blocks( const aes_key_entry *entry,
+                                      const UINT8 *in, UINT8 *out, UINT32 num_blocks )
+{
+  uint32_t cx0, cx1, cx2, cx3;  // state array columns, cx for input
+  uint32_t cy0, cy1, cy2, cy3;  // state array columns, cy for output
+  const uint32_t *round_key;
+  UINT32 n;
+  int i;
 
-   // do encryption rounds 1..9
-   // forward S-box, ShiftRows() via input structure, MixCol, XOR round_key
-  round_key+=4;
-  i = 0;
-  while ( i < 9 )
+  for ( n = 0; n < num_blocks; n++, in += 16, out += 16 )
   {
-    cy0 = round_key[0] ^ forward_mix_col( ( ( (UINT32) (FORWARD_SUB_BYTE( (int) BYTE_0( cx0 ) ) ) ) << 24 ) ^
-                                          ( ( (UINT32) (FORWARD_SUB_BYTE( (int) BYTE_1( cx1 ) ) ) ) << 16 ) ^
-                                          ( ( (UINT32) (FORWARD_SUB_BYTE( (int) BYTE_2( cx2 ) ) ) ) <<  8 ) ^
-                                          ( ( (UINT32) (FORWARD_SUB_BYTE( (int) BYTE_3( cx3 ) ) ) )       ) );
-
-    cy1 = round_key[1] ^ forward_mix_col( ( ( (UINT32) (FORWARD_SUB_BYTE( (int) BYTE_0( cx1 ) ) ) ) << 24 ) ^
-                                          ( ( (UINT32) (FORWARD_SUB_BYTE( (int) BYTE_1( cx2 ) ) ) ) << 16 ) ^
-                                          ( ( (UINT32) (FORWARD_SUB_BYTE( (int) BYTE_2( cx3 ) ) ) ) <<  8 ) ^
-                                          ( ( (UINT32) (FORWARD_SUB_BYTE( (int) BYTE_3( cx0 ) ) ) )       ) );
-
-    cy2 = round_key[2] ^ forward_mix_col( ( ( (UINT32) (FORWARD_SUB_BYTE( (int) BYTE_0( cx2 ) ) ) ) << 24 ) ^
-                                          ( ( (UINT32) (FORWARD_SUB_BYTE( (int) BYTE_1( cx3 ) ) ) ) << 16 ) ^
-                                          ( ( (UINT32) (FORWARD_SUB_BYTE( (int) BYTE_2( cx0 ) ) ) ) <<  8 ) ^
-                                          ( ( (UINT32) (FORWARD_SUB_BYTE( (int) BYTE_3( cx1 ) ) ) )       ) );
-
-    cy3 = round_key[3] ^ forward_mix_col( ( ( (UINT32) (FORWARD_SUB_BYTE( (int) BYTE_0( cx3 ) ) ) ) << 24 ) ^
-                                          ( ( (UINT32) (FORWARD_SUB_BYTE( (int) BYTE_1( cx0 ) ) ) ) << 16 ) ^
-                                          ( ( (UINT32) (FORWARD_SUB_BYTE( (int) BYTE_2( cx1 ) ) ) ) <<  8 ) ^
-                                          ( ( (UINT32) (FORWARD_SUB_BYTE( (int) BYTE_3( cx2 ) ) ) )       ) );
+    round_key = entry->enc;
+
+    CONCAT_4_BYTES( cx0, in,  0 );
+    CONCAT_4_BYTES( cx1, in,  4 );
+    CONCAT_4_BYTES( cx2, in,  8 );
+    CONCAT_4_BYTES( cx3, in, 12 );
+
+    cx0 ^= round_key[0];
+    cx1 ^= round_key[1];
+    cx2 ^= round_key[2];
+    cx3 ^= round_key[3];
+
+    // rounds 1..9: SubBytes, ShiftRows (via the input columns) and MixColumns in one lookup per byte
+    for ( i = 1; i < C_NUMBER_ROUNDS; i++ )
+    {
+      round_key += 4;
 
+      cy0 = aes_te[0][BYTE_0( cx0 )] ^ aes_te[1][BYTE_1( cx1 )] ^ aes_te[2][BYTE_2( cx2 )] ^ aes_te[3][BYTE_3( cx3 )] ^ round_key[0];
+      cy1 = aes_te[0][BYTE_0( cx1 )] ^ aes_te[1][BYTE_1( cx2 )] ^ aes_te[2][BYTE_2( cx3 )] ^ aes_te[3][BYTE_3( cx0 )] ^ round_key[1];
+      cy2 = aes_te[0][BYTE_0( cx2 )] ^ aes_te[1][BYTE_1( cx3 )] ^ aes_te[2][BYTE_2( cx0 )] ^ aes_te[3][BYTE_3( cx1 )] ^ round_key[2];
+      cy3 = aes_te[0][BYTE_0( cx3 )] ^ aes_te[1][BYTE_1( cx0 )] ^ aes_te[2][BYTE_2( cx1 )] ^ aes_te[3][BYTE_3( cx2 )] ^ round_key[3];
+
+      cx0 = cy0;
+      cx1 = cy1;
+      cx2 = cy2;
+      cx3 = cy3;
+    }
+
+    // final round without MixColumns
     round_key += 4;
-    i++;
 
-    // copy cy --> cx for input for next round
-    cx0 = cy0;
-    cx1 = cy1;
-    cx2 = cy2;
-    cx3 = cy3;
+    cy0 = ( ( (uint32_t) aes_sbox[BYTE_0( cx0 )] << 24 ) | ( (uint32_t) aes_sbox[BYTE_1( cx1 )] << 16 ) |
+            ( (uint32_t) aes_sbox[BYTE_2( cx2 )] <<  8 ) | ( (uint32_t) aes_sbox[BYTE_3( cx3 )] ) ) ^ round_key[0];
+    cy1 = ( ( (uint32_t) aes_sbox[BYTE_0( cx1 )] << 24 ) | ( (uint32_t) aes_sbox[BYTE_1( cx2 )] << 16 ) |
+            ( (uint32_t) aes_sbox[BYTE_2( cx3 )] <<  8 ) | ( (uint32_t) aes_sbox[BYTE_3( cx0 )] ) ) ^ round_key[1];
+    cy2 = ( ( (uint32_t) aes_sbox[BYTE_0( cx2 )] << 24 ) | ( (uint32_t) aes_sbox[BYTE_1( cx3 )] << 16 ) |
+            ( (uint32_t) aes_sbox[BYTE_2( cx0 )] <<  8 ) | ( (uint32_t) aes_sbox[BYTE_3( cx1 )] ) ) ^ round_key[2];
+    cy3 = ( ( (uint32_t) aes_sbox[BYTE_0( cx3 )] << 24 ) | ( (uint32_t) aes_sbox[BYTE_1( cx0 )] << 16 ) |
+            ( (uint32_t) aes_sbox[BYTE_2( cx1 )] <<  8 ) | ( (uint32_t) aes_sbox[BYTE_3( cx2 )] ) ) ^ round_key[3];
+
+    SPLIT_INTO_4_BYTES( cy0, out,  0 );
+    SPLIT_INTO_4_BYTES( cy1, out,  4 );
+    SPLIT_INTO_4_BYTES( cy2, out,  8 );
+    SPLIT_INTO_4_BYTES( cy3, out, 12 );
   }
+}
 
-  // final forward S-box round inluding ShiftRows() via input structure
-  cy0 = round_key[0] ^ ( ( ( (UINT32) (FORWARD_SUB_BYTE( (int) BYTE_0( cx0 ) ) ) ) << 24 ) ^
-                          ( ( (UINT32) (FORWARD_SUB_BYTE( (int) BYTE_1( cx1 ) ) ) ) << 16 ) ^
-                          ( ( (UINT32) (FORWARD_SUB_BYTE( (int) BYTE_2( cx2 ) ) ) ) <<  8 ) ^
-                          ( ( (UINT32) (FORWARD_SUB_BYTE( (int) BYTE_3( cx3 ) ) ) )       ) );
-
-  cy1 = round_key[1] ^ ( ( ( (UINT32) (FORWARD_SUB_BYTE( (int) BYTE_0( cx1 ) ) ) ) << 24 ) ^
-                          ( ( (UINT32) (FORWARD_SUB_BYTE( (int) BYTE_1( cx2 ) ) ) ) << 16 ) ^
-                          ( ( (UINT32) (FORWARD_SUB_BYTE( (int) BYTE_2( cx3 ) ) ) ) <<  8 ) ^
-                          ( ( (UINT32) (FORWARD_SUB_BYTE( (int) BYTE_3( cx0 ) ) ) )       ) );
-
-  cy2 = round_key[2] ^ ( ( ( (UINT32) (FORWARD_SUB_BYTE( (int) BYTE_0( cx2 ) ) ) ) << 24 ) ^
-                          ( ( (UINT32) (FORWARD_SUB_BYTE( (int) BYTE_1( cx3 ) ) ) ) << 16 ) ^
-                          ( ( (UINT32) (FORWARD_SUB_BYTE( (int) BYTE_2( cx0 ) ) ) ) <<  8 ) ^
-                          ( ( (UINT32) (FORWARD_SUB_BYTE( (int) BYTE_3( cx1 ) ) ) )       ) );
-
-  cy3 = round_key[3] ^ ( ( ( (UINT32) (FORWARD_SUB_BYTE( (int) BYTE_0( cx3 ) ) ) ) << 24 ) ^
-                          ( ( (UINT32) (FORWARD_SUB_BYTE( (int) BYTE_1( cx0 ) ) ) ) << 16 ) ^
-                          ( ( (UINT32) (FORWARD_SUB_BYTE( (int) BYTE_2( cx1 ) ) ) ) <<  8 ) ^
-                          ( ( (UINT32) (FORWARD_SUB_BYTE( (int) BYTE_3( cx2 ) ) ) )       ) );
-
-  // write result into cipher text byte array (FIPS 197: out = state )
-  SPLIT_INTO_4_BYTES( cy0, cipher,  0 );
-  SPLIT_INTO_4_BYTES( cy1, cipher,  4 );
-  SPLIT_INTO_4_BYTES( cy2, cipher,  8 );
-  SPLIT_INTO_4_BYTES( cy3, cipher, 12 );
 
-  // successful
-  return 0;
+
+static void aes_table_decrypt_blocks( const aes_key_entry *entry,
+                                      const UINT8 *in, UINT8 *out, UINT32 num_blocks )
+{
+  uint32_t cx0, cx1, cx2, cx3;  // state array columns, cx for input
+  uint32_t cy0, cy1, cy2, cy3;  // state array columns, cy for output
+  const uint32_t *round_key;
+  UINT32 n;
+  int i;
+
+  for ( n = 0; n < num_blocks; n++, in += 16, out += 16 )
+  {
+    round_key = entry->dec;
+
+    CONCAT_4_BYTES( cx0, in,  0 );
+    CONCAT_4_BYTES( cx1, in,  4 );
+    CONCAT_4_BYTES( cx2, in,  8 );
+    CONCAT_4_BYTES( cx3, in, 12 );
+
+    cx0 ^= round_key[0];
+    cx1 ^= round_key[1];
+    cx2 ^= round_key[2];
+    cx3 ^= round_key[3];
+
+    // rounds 9..1 of the equivalent inverse cipher (FIPS-197 5.3.5)
+    for ( i = 1; i < C_NUMBER_ROUNDS; i++ )
+    {
+      round_key += 4;
+
+      cy0 = aes_td[0][BYTE_0( cx0 )] ^ aes_td[1][BYTE_1( cx3 )] ^ aes_td[2][BYTE_2( cx2 )] ^ aes_td[3][BYTE_3( cx1 )] ^ round_key[0];
+      cy1 = aes_td[0][BYTE_0( cx1 )] ^ aes_td[1][BYTE_1( cx0 )] ^ aes_td[2][BYTE_2( cx3 )] ^ aes_td[3][BYTE_3( cx2 )] ^ round_key[1];
+      cy2 = aes_td[0][BYTE_0( cx2 )] ^ aes_td[1][BYTE_1( cx1 )] ^ aes_td[2][BYTE_2( cx0 )] ^ aes_td[3][BYTE_3( cx3 )] ^ round_key[2];
+      cy3 = aes_td[0][BYTE_0( cx3 )] ^ aes_td[1][BYTE_1( cx2 )] ^ aes_td[2][BYTE_2( cx1 )] ^ aes_td[3][BYTE_3( cx0 )] ^ round_key[3];
+
+      cx0 = cy0;
+      cx1 = cy1;
+      cx2 = cy2;
+      cx3 = cy3;
+    }
+
+    // final round without InvMixColumns
+    round_key += 4;
+
+    cy0 = ( ( (uint32_t) aes_inv_sbox[BYTE_0( cx0 )] << 24 ) | ( (uint32_t) aes_inv_sbox[BYTE_1( cx3 )] << 16 ) |
+            ( (uint32_t) aes_inv_sbox[BYTE_2( cx2 )] <<  8 ) | ( (uint32_t) aes_inv_sbox[BYTE_3( cx1 )] ) ) ^ round_key[0];
+    cy1 = ( ( (uint32_t) aes_inv_sbox[BYTE_0( cx1 )] << 24 ) | ( (uint32_t) aes_inv_sbox[BYTE_1( cx0 )] << 16 ) |
+            ( (uint32_t) aes_inv_sbox[BYTE_2( cx3 )] <<  8 ) | ( (uint32_t) aes_inv_sbox[BYTE_3( cx2 )] ) ) ^ round_key[1];
+    cy2 = ( ( (uint32_t) aes_inv_sbox[BYTE_0( cx2 )] << 24 ) | ( (uint32_t) aes_inv_sbox[BYTE_1( cx1 )] << 16 ) |
+            ( (uint32_t) aes_inv_sbox[BYTE_2( cx0 )] <<  8 ) | ( (uint32_t) aes_inv_sbox[BYTE_3( cx3 )] ) ) ^ round_key[2];
+    cy3 = ( ( (uint32_t) aes_inv_sbox[BYTE_0( cx3 )] << 24 ) | ( (uint32_t) aes_inv_sbox[BYTE_1( cx2 )] << 16 ) |
+            ( (uint32_t) aes_inv_sbox[BYTE_2( cx1 )] <<  8 ) | ( (uint32_t) aes_inv_sbox[BYTE_3( cx0 )] ) ) ^ round_key[3];
+
+    SPLIT_INTO_4_BYTES( cy0, out,  0 );
+    SPLIT_INTO_4_BYTES( cy1, out,  4 );
+    SPLIT_INTO_4_BYTES( cy2, out,  8 );
+    SPLIT_INTO_4_BYTES( cy3, out, 12 );
+  }
 }
 
 
 
+static const aes_implementation aes_table_implementation =
+{
+  "table", aes_table_encrypt_blocks, aes_table_decrypt_blocks
+};
+
+
 
-static int aes_decrypt_16_byte_block( const aes_context *ctx,
-                                      const UINT8       *cipher,
-                                  /*@out@*/ UINT8       *plain )
+#ifdef AES_HAVE_NI
+
+__attribute__((target("aes,sse2")))
+static void aes_ni_prepare_key( aes_key_entry *entry )
 {
-  // declarations
-  UINT32 *round_key;           // pointer to round key
-  UINT32 cx0, cx1, cx2, cx3;   // state array columns, cx for input
-  UINT32 cy0, cy1, cy2, cy3;   // state array columns, cy for output
-  int i;                       // counter for decryption loop
-
-
-
-  // get decryption round keys --> changed: get encryption round keys
-  round_key = (UINT32 *) ctx->enc_round_keys;
-  round_key += 40;
-
-  // read 16 cipher text bytes into four 32-bit words (FIPS-197: state = in )
-  CONCAT_4_BYTES( cx0, cipher,  0 );
-  CONCAT_4_BYTES( cx1, cipher,  4 );
-  CONCAT_4_BYTES( cx2, cipher,  8 );
-  CONCAT_4_BYTES( cx3, cipher, 12 );
-
-  // XOR it with enc_round_key[43..40]
-  cx0 ^= round_key[0];
-  cx1 ^= round_key[1];
-  cx2 ^= round_key[2];
-  cx3 ^= round_key[3];
-
-  // do decryption rounds 9..1
-  // inverse S-box, inverse ShiftRows() via input structure, inverseMixCol, XOR round_key
-  i = 0;
-  round_key -= 4;
-  while ( i < 9 )
+  UINT8 bytes[16];
+  int i, j;
+
+  // the AES-NI round keys are the round key bytes in memory order
+  for ( i = 0; i <= C_NUMBER_ROUNDS; i++ )
   {
+    for ( j = 0; j < 4; j++ )
+    {
+      SPLIT_INTO_4_BYTES( entry->enc[i * 4 + j], bytes, j * 4 );
+    }
+    entry->ni_enc[i] = _mm_loadu_si128( (const __m128i *) bytes );
+  }
 
+  entry->ni_dec[0] = entry->ni_enc[C_NUMBER_ROUNDS];
+  for ( i = 1; i < C_NUMBER_ROUNDS; i++ )
+  {
+    entry->ni_dec[i] = _mm_aesimc_si128( entry->ni_enc[C_NUMBER_ROUNDS - i] );
+  }
+  entry->ni_dec[C_NUMBER_ROUNDS] = entry->ni_enc[0];
+}
 
-    cy0 = inverse_mix_col( round_key[0] ^ ( ( (UINT32) INVERSE_SUB_BYTE( (int)( BYTE_0( cx0 ) ) ) << 24 ) ^
-                                            ( (UINT32) INVERSE_SUB_BYTE( (int)( BYTE_1( cx3 ) ) ) << 16 ) ^
-                                            ( (UINT32) INVERSE_SUB_BYTE( (int)( BYTE_2( cx2 ) ) ) <<  8 ) ^
-                                            ( (UINT32) INVERSE_SUB_BYTE( (int)( BYTE_3( cx1 ) ) )       ) ) );
 
-    cy1 = inverse_mix_col( round_key[1] ^ ( ( (UINT32) INVERSE_SUB_BYTE( (int)( BYTE_0( cx1 ) ) ) << 24 ) ^
-                                            ( (UINT32) INVERSE_SUB_BYTE( (int)( BYTE_1( cx0 ) ) ) << 16 ) ^
-                                            ( (UINT32) INVERSE_SUB_BYTE( (int)( BYTE_2( cx3 ) ) ) <<  8 ) ^
-                                            ( (UINT32) INVERSE_SUB_BYTE( (int)( BYTE_3( cx2 ) ) )       ) ) );
 
-    cy2 = inverse_mix_col( round_key[2] ^ ( ( (UINT32) INVERSE_SUB_BYTE( (int)( BYTE_0 ( cx2 ) ) ) << 24 ) ^
-                                            ( (UINT32) INVERSE_SUB_BYTE( (int)( BYTE_1 ( cx1 ) ) ) << 16 ) ^
-                                            ( (UINT32) INVERSE_SUB_BYTE( (int)( BYTE_2 ( cx0 ) ) ) <<  8 ) ^
-                                            ( (UINT32) INVERSE_SUB_BYTE( (int)( BYTE_3 ( cx3 ) ) )       ) ) );
+__attribute__((target("aes,sse2")))
+static void aes_ni_encrypt_blocks( const aes_key_entry *entry,
+                                   const UINT8 *in, UINT8 *out, UINT32 num_blocks )
+{
+  UINT32 n;
+  int i;
 
-    cy3 = inverse_mix_col( round_key[3] ^ ( ( (UINT32) INVERSE_SUB_BYTE( (int)( BYTE_0 ( cx3 ) ) ) << 24 ) ^
-                                            ( (UINT32) INVERSE_SUB_BYTE( (int)( BYTE_1 ( cx2 ) ) ) << 16 ) ^
-                                            ( (UINT32) INVERSE_SUB_BYTE( (int)( BYTE_2 ( cx1 ) ) ) <<  8 ) ^
-                                            ( (UINT32) INVERSE_SUB_BYTE( (int)( BYTE_3 ( cx0 ) ) )       ) ) );
+  for ( n = 0; n < num_blocks; n++, in += 16, out += 16 )
+  {
+    __m128i state = _mm_xor_si128( _mm_loadu_si128( (const __m128i *) in ), entry->ni_enc[0] );
 
-     i++;
-     round_key -= 4;
+    for ( i = 1; i < C_NUMBER_ROUNDS; i++ )
+    {
+      state = _mm_aesenc_si128( state, entry->ni_enc[i] );
+    }
+    state = _mm_aesenclast_si128( state, entry->ni_enc[C_NUMBER_ROUNDS] );
 
-     // copy cy --> cx for input for next round
-     cx0 = cy0;
-     cx1 = cy1;
-     cx2 = cy2;
-     cx3 = cy3;
+    _mm_storeu_si128( (__m128i *) out, state );
   }
+}
 
-  // final round:
-  cy0 = round_key[0] ^ ( ( (UINT32) INVERSE_SUB_BYTE( (int)( BYTE_0( cx0 ) ) ) << 24 ) ^
-                         ( (UINT32) INVERSE_SUB_BYTE( (int)( BYTE_1( cx3 ) ) ) << 16 ) ^
-                         ( (UINT32) INVERSE_SUB_BYTE( (int)( BYTE_2( cx2 ) ) ) <<  8 ) ^
-                         ( (UINT32) INVERSE_SUB_BYTE( (int)( BYTE_3( cx1 ) ) )       ) );
-
-  cy1 = round_key[1] ^ ( ( (UINT32) INVERSE_SUB_BYTE( (int)( BYTE_0( cx1 ) ) ) << 24 ) ^
-                         ( (UINT32) INVERSE_SUB_BYTE( (int)( BYTE_1( cx0 ) ) ) << 16 ) ^
-                         ( (UINT32) INVERSE_SUB_BYTE( (int)( BYTE_2( cx3 ) ) ) <<  8 ) ^
-                         ( (UINT32) INVERSE_SUB_BYTE( (int)( BYTE_3( cx2 ) ) )       ) );
-
-  cy2 = round_key[2] ^ ( ( (UINT32) INVERSE_SUB_BYTE( (int)( BYTE_0( cx2 ) ) ) << 24 ) ^
-                         ( (UINT32) INVERSE_SUB_BYTE( (int)( BYTE_1( cx1 ) ) ) << 16 ) ^
-                         ( (UINT32) INVERSE_SUB_BYTE( (int)( BYTE_2( cx0 ) ) ) <<  8 ) ^
-                         ( (UINT32) INVERSE_SUB_BYTE( (int)( BYTE_3( cx3 ) ) )       ) );
-
-  cy3 = round_key[3] ^ ( ( (UINT32) INVERSE_SUB_BYTE( (int)( BYTE_0( cx3 ) ) ) << 24 ) ^
-                         ( (UINT32) INVERSE_SUB_BYTE( (int)( BYTE_1( cx2 ) ) ) << 16 ) ^
-                         ( (UINT32) INVERSE_SUB_BYTE( (int)( BYTE_2( cx1 ) ) ) <<  8 ) ^
-                         ( (UINT32) INVERSE_SUB_BYTE( (int)( BYTE_3( cx0 ) ) )       ) );
-
-  // write result into plain text byte array
-  SPLIT_INTO_4_BYTES( cy0, plain,  0 );
-  SPLIT_INTO_4_BYTES( cy1, plain,  4 );
-  SPLIT_INTO_4_BYTES( cy2, plain,  8 );
-  SPLIT_INTO_4_BYTES( cy3, plain, 12 );
 
-  // successful
-  return 0;
 
+__attribute__((target("aes,sse2")))
+static void aes_ni_decrypt_blocks( const aes_key_entry *entry,
+                                   const UINT8 *in, UINT8 *out, UINT32 num_blocks )
+{
+  UINT32 n;
+  int i;
+
+  for ( n = 0; n < num_blocks; n++, in += 16, out += 16 )
+  {
+    __m128i state = _mm_xor_si128( _mm_loadu_si128( (const __m128i *) in ), entry->ni_dec[0] );
+
+    for ( i = 1; i < C_NUMBER_ROUNDS; i++ )
+    {
+      state = _mm_aesdec_si128( state, entry->ni_dec[i] );
+    }
+    state = _mm_aesdeclast_si128( state, entry->ni_dec[C_NUMBER_ROUNDS] );
+
+    _mm_storeu_si128( (__m128i *) out, state );
+  }
+}
+
+
+
+static const aes_implementation aes_ni_implementation =
+{
+  "aes-ni", aes_ni_encrypt_blocks, aes_ni_decrypt_blocks
+};
+
+#endif
+
+
+
+// computes the tables and picks AES-NI if the cpu supports it (unless AES_NO_NI is set), runs once
+static void aes_init_implementation( void )
+{
+  aes_init_tables();
+
+  aes_impl = &aes_table_implementation;
+#ifdef AES_HAVE_NI
+  __builtin_cpu_init();
+  if ( __builtin_cpu_supports( "aes" ) && getenv( "AES_NO_NI" ) == NULL )
+  {
+    aes_impl = &aes_ni_implementation;
+  }
+#endif
+}
+
+
+
+// selects the implementation on first use, whichever thread gets there first
+static const aes_implementation *aes_select_implementation( void )
+{
+  pthread_once( &aes_impl_once, aes_init_implementation );
+
+  return aes_impl;
+}
+
+
+
+// returns the expanded key, computing it only if the key is not in the cache (the caller holds aes_key_cache_lock)
+static const aes_key_entry *aes_lookup_key( const UINT8 *key )
+{
+  aes_context aes_ctx;
+  aes_key_entry *entry;
+  int i;
+
+  for ( i = 0; i < AES_KEY_CACHE_SIZE; i++ )
+  {
+    entry = &aes_key_cache[i];
+    if ( entry->valid && memcmp( entry->key, key, C_MAX_KEY_LENGTH ) == 0 )
+    {
+      return entry;
+    }
+  }
+
+  entry = &aes_key_cache[aes_key_cache_next];
+  aes_key_cache_next = ( aes_key_cache_next + 1 ) % AES_KEY_CACHE_SIZE;
+
+  aes_set_key( &aes_ctx, key, NULL );
+
+  for ( i = 0; i < 44; i++ )
+  {
+    entry->enc[i] = (uint32_t) ( aes_ctx.enc_round_keys[i] & 0xFFFFFFFF );
+  }
+
+  // equivalent inverse cipher: reversed round keys, InvMixColumns applied to rounds 1..9
+  for ( i = 0; i <= C_NUMBER_ROUNDS; i++ )
+  {
+    int j;
+    for ( j = 0; j < 4; j++ )
+    {
+      uint32_t w32 = entry->enc[( C_NUMBER_ROUNDS - i ) * 4 + j];
+      entry->dec[i * 4 + j] = ( i == 0 || i == C_NUMBER_ROUNDS ) ? w32 : inverse_mix_col( w32 );
+    }
+  }
+
+#ifdef AES_HAVE_NI
+  aes_ni_prepare_key( entry );
+#endif
+
+  memcpy( entry->key, key, C_MAX_KEY_LENGTH );
+  entry->valid = 1;
+
+  return entry;
+}
+
+
+
+extern const char *aes_implementation_name( void )
+{
+  return aes_select_implementation()->name;
 }
 
 
@@ -544,47 +684,27 @@ extern UINT8 aes_encrypt( const UINT8   aes_mode,
                           const UINT32  data_length )
 {
   // declarations
-  aes_context aes_ctx; // aes context
-  UINT8 aes_buf[16];   // temporary buffer of one block
-  UINT32 num_blocks;   // number of blocks to encrypt
-  UINT8 *p_plain;      // pointer to plain text block
-  UINT8 *p_cipher;     // pointer to cipher text block
-  UINT32 i;
-  int ret;
+  const aes_implementation *impl; // implementation selected for this cpu
+  const aes_key_entry *key;       // cached expanded key
+  UINT32 num_blocks;              // number of blocks to encrypt
 
 
 
-  // init encryption keys
-  ret = aes_set_key( &aes_ctx, aes_key, IV );
-  assert( ret == 0 );
+  impl = aes_select_implementation();
 
   // get number of blocks and padding
   num_blocks = (UINT32) ( data_length / 16 );
 
-  // get pointers
-  p_plain  = plain_data;
-  p_cipher = cipher_data;
-
   // --- Electronic Codebook Mode (ECB) -------------------------------------
   if ( aes_mode == C_AES_MODE_ECB )
   {
-    // encrypt all 16 byte blocks
-    for ( i = 0; i < num_blocks; i++ )
-    {
-      // fill buffer with plain
-      mem_copy( aes_buf, p_plain );
-
-      // encrypt buffer
-      ret = aes_encrypt_16_byte_block( &aes_ctx, aes_buf, aes_buf );
-      assert( ret == 0 );
+    // get the expanded encryption keys (only computed when the key changes)
+    pthread_mutex_lock( &aes_key_cache_lock );
+    key = aes_lookup_key( aes_key );
 
-      // write cipher
-      mem_copy( p_cipher, aes_buf );
-
-      // next block
-      p_plain  += 16;
-      p_cipher += 16;
-    }
+    // encrypt all 16 byte blocks (plain_data and cipher_data may be the same)
+    impl->encrypt_blocks( key, plain_data, cipher_data, num_blocks );
+    pthread_mutex_unlock( &aes_key_cache_lock );
   }else
 	  return E_AES_WRONG_MODE;
 
@@ -609,52 +729,28 @@ extern UINT8 aes_decrypt( const UINT8   aes_mode,
                           const UINT32  data_length )
 {
   // declarations
-  aes_context aes_ctx; // aes context
-  UINT8 aes_buf1[16];  // buffer for one 16-byte block
-//  UINT8 aes_buf2[16];  // buffer for one 16-byte block
-  UINT32 num_blocks;   // number of blocks to decrypt
-  UINT8 *p_plain;      // pointer to plain data block
-  UINT8 *p_cipher;     // pointer to cipher data block
-  UINT32 i;
-  int ret;
-
+  const aes_implementation *impl; // implementation selected for this cpu
+  const aes_key_entry *key;       // cached expanded key
+  UINT32 num_blocks;              // number of blocks to decrypt
 
 
 
-  // init encryption keys
-  ret = aes_set_key( &aes_ctx, aes_key, IV );
-  assert( ret == 0 );
+  impl = aes_select_implementation();
 
   // get number of blocks and padding
   num_blocks = (UINT32) ( data_length / 16 );
 
-  // get pointers
-  p_plain  = plain_data;
-  p_cipher = cipher_data;
-
   // --- Electronic Codebook Mode (ECB) -------------------------------------
 
   if ( aes_mode == C_AES_MODE_ECB )
   {
+    // get the expanded keys (only computed when the key changes)
+    pthread_mutex_lock( &aes_key_cache_lock );
+    key = aes_lookup_key( aes_key );
 
-    // decrypt 16 byte blocks
-    for ( i = 0; i < num_blocks; i++ )
-    {
-      // fill buffer 1 with cipher
-      mem_copy( aes_buf1, p_cipher );
-
-      // decrypt buffer 1
-      ret = aes_decrypt_16_byte_block( &aes_ctx, aes_buf1, aes_buf1 );
-      assert( ret == 0 );
-
-      // write buffer 1 to plain
-      mem_copy( p_plain, aes_buf1 );
-
-      // next block
-      p_plain  += 16;
-      p_cipher += 16;
-    }
-
+    // decrypt 16 byte blocks (plain_data and cipher_data may be the same)
+    impl->decrypt_blocks( key, cipher_data, plain_data, num_blocks );
+    pthread_mutex_unlock( &aes_key_cache_lock );
   }else
 	  return E_AES_WRONG_MODE;
 
@@ -666,7 +762,56 @@ extern UINT8 aes_decrypt( const UINT8   aes_mode,
 
 
 
-unsigned short cal_crc_loop_CCITT_A( short l, unsigned char* p, unsigned short seed,unsigned short cd )
+// CRC-16 with the SSP polynomial x^16 + x^15 + x^2 + 1 (0x8005), one entry per value of the high byte
+const unsigned short crc_ssp_table[256] =
+{
+	0x0000, 0x8005, 0x800F, 0x000A, 0x801B, 0x001E, 0x0014, 0x8011,
+	0x8033, 0x0036, 0x003C, 0x8039, 0x0028, 0x802D, 0x8027, 0x0022,
+	0x8063, 0x0066, 0x006C, 0x8069, 0x0078, 0x807D, 0x8077, 0x0072,
+	0x0050, 0x8055, 0x805F, 0x005A, 0x804B, 0x004E, 0x0044, 0x8041,
+	0x80C3, 0x00C6, 0x00CC, 0x80C9, 0x00D8, 0x80DD, 0x80D7, 0x00D2,
+	0x00F0, 0x80F5, 0x80FF, 0x00FA, 0x80EB, 0x00EE, 0x00E4, 0x80E1,
+	0x00A0, 0x80A5, 0x80AF, 0x00AA, 0x80BB, 0x00BE, 0x00B4, 0x80B1,
+	0x8093, 0x0096, 0x009C, 0x8099, 0x0088, 0x808D, 0x8087, 0x0082,
+	0x8183, 0x0186, 0x018C, 0x8189, 0x0198, 0x819D, 0x8197, 0x0192,
+	0x01B0, 0x81B5, 0x81BF, 0x01BA, 0x81AB, 0x01AE, 0x01A4, 0x81A1,
+	0x01E0, 0x81E5, 0x81EF, 0x01EA, 0x81FB, 0x01FE, 0x01F4, 0x81F1,
+	0x81D3, 0x01D6, 0x01DC, 0x81D9, 0x01C8, 0x81CD, 0x81C7, 0x01C2,
+	0x0140, 0x8145, 0x814F, 0x014A, 0x815B, 0x015E, 0x0154, 0x8151,
+	0x8173, 0x0176, 0x017C, 0x8179, 0x0168, 0x816D, 0x8167, 0x0162,
+	0x8123, 0x0126, 0x012C, 0x8129, 0x0138, 0x813D, 0x8137, 0x0132,
+	0x0110, 0x8115, 0x811F, 0x011A, 0x810B, 0x010E, 0x0104, 0x8101,
+	0x8303, 0x0306, 0x030C, 0x8309, 0x0318, 0x831D, 0x8317, 0x0312,
+	0x0330, 0x8335, 0x833F, 0x033A, 0x832B, 0x032E, 0x0324, 0x8321,
+	0x0360, 0x8365, 0x836F, 0x036A, 0x837B, 0x037E, 0x0374, 0x8371,
+	0x8353, 0x0356, 0x035C, 0x8359, 0x0348, 0x834D, 0x8347, 0x0342,
+	0x03C0, 0x83C5, 0x83CF, 0x03CA, 0x83DB, 0x03DE, 0x03D4, 0x83D1,
+	0x83F3, 0x03F6, 0x03FC, 0x83F9, 0x03E8, 0x83ED, 0x83E7, 0x03E2,
+	0x83A3, 0x03A6, 0x03AC, 0x83A9, 0x03B8, 0x83BD, 0x83B7, 0x03B2,
+	0x0390, 0x8395, 0x839F, 0x039A, 0x838B, 0x038E, 0x0384, 0x8381,
+	0x0280, 0x8285, 0x828F, 0x028A, 0x829B, 0x029E, 0x0294, 0x8291,
+	0x82B3, 0x02B6, 0x02BC, 0x82B9, 0x02A8, 0x82AD, 0x82A7, 0x02A2,
+	0x82E3, 0x02E6, 0x02EC, 0x82E9, 0x02F8, 0x82FD, 0x82F7, 0x02F2,
+	0x02D0, 0x82D5, 0x82DF, 0x02DA, 0x82CB, 0x02CE, 0x02C4, 0x82C1,
+	0x8243, 0x0246, 0x024C, 0x8249, 0x0258, 0x825D, 0x8257, 0x0252,
+	0x0270, 0x8275, 0x827F, 0x027A, 0x826B, 0x026E, 0x0264, 0x8261,
+	0x0220, 0x8225, 0x822F, 0x022A, 0x823B, 0x023E, 0x0234, 0x8231,
+	0x8213, 0x0216, 0x021C, 0x8219, 0x0208, 0x820D, 0x8207, 0x0202
+};
+
+// -1 not tested yet, 0 the table does not match the bitwise computation, 1 table verified
+static int crc_ssp_table_ok = -1;
+static pthread_once_t crc_ssp_table_once = PTHREAD_ONCE_INIT;
+
+static void crc_ssp_table_check( void )
+{
+  crc_ssp_table_ok = crc_ssp_self_test();
+}
+
+
+
+// the original bitwise computation, used for other polynomials and as reference for the table
+static unsigned short cal_crc_loop_bitwise( short l, const unsigned char* p, unsigned short seed, unsigned short cd )
 {
 	int i, j;
 	unsigned short crc = seed;
@@ -684,3 +829,44 @@ unsigned short cal_crc_loop_CCITT_A( short l, unsigned char* p, unsigned short s
 	}
 	return crc;
 }
+
+
+
+extern int crc_ssp_self_test( void )
+{
+	unsigned char data[255];
+	int i, l;
+
+	for ( i = 0; i < 255; i++ )
+		data[i] = (unsigned char) ( i * 167 + 13 );
+
+	for ( l = 0; l <= 255; l += 17 )
+	{
+		unsigned short crc = CRC_SSP_SEED;
+		for ( i = 0; i < l; i++ )
+			crc = crc_ssp_update( crc, data[i] );
+
+		if ( crc != cal_crc_loop_bitwise( l, data, CRC_SSP_SEED, CRC_SSP_POLY ) )
+			return 0;
+	}
+
+	return 1;
+}
+
+
+
+unsigned short cal_crc_loop_CCITT_A( short l, unsigned char* p, unsigned short seed,unsigned short cd )
+{
+	int i;
+	unsigned short crc = seed;
+
+	pthread_once( &crc_ssp_table_once, crc_ssp_table_check );
+
+	if ( cd != CRC_SSP_POLY || !crc_ssp_table_ok )
+		return cal_crc_loop_bitwise( l, p, seed, cd );
+
+	for ( i = 0; i < l; ++i )
+		crc = crc_ssp_update( crc, p[ i ] );
+
+	return crc;
+}
@@ -74,12 +74,24 @@ extern UINT8 aes_decrypt( const UINT8   aes_mode,              // the AES mode (
                                 UINT8  *cipher_data,           // pointer to encrypted data to decrypt (might be same as plain_data)
                           const UINT32  data_length );         // length of data to decrypt in bytes (must be a multiple of 16)
 
+/* returns the name of the AES implementation selected for this cpu ("aes-ni" or "table") */
+extern const char *aes_implementation_name( void );
 
 unsigned short cal_crc_loop_CCITT_A( short l, unsigned char* p, unsigned short seed,unsigned short cd );
+
+/* CRC-16 table for the SSP polynomial, used by crc_ssp_update() */
+extern const unsigned short crc_ssp_table[256];
+
+/* compares the table driven SSP CRC with the bitwise computation, returns 1 if they match */
+extern int crc_ssp_self_test( void );
 /***************************************************************************
  * 6. MACRO FUNCTIONS                                                      *
  ***************************************************************************/
 
+/* adds one byte to a running SSP CRC (seed CRC_SSP_SEED, polynomial CRC_SSP_POLY) */
+#define crc_ssp_update(crc, byte) \
+	((unsigned short) (((crc) << 8) ^ crc_ssp_table[(((crc) >> 8) ^ (byte)) & 0xFF]))
+
 /***************************************************************************
  * 7. END                                                                  *
  ***************************************************************************/
@@ -53,8 +53,20 @@ int GetProcDLLVersion(unsigned char *ver)
 }
 
 
-/*    DLL function call to generate host intermediate numbers to send to slave  */
-int InitiateSSPHostKeys(SSP_KEYS * keyArray, const unsigned char ssp_address)
+/*    pool of precomputed host key material, filled by a background thread (see SSPKeyPoolStart)  */
+#define SSP_KEY_POOL_MAX 8
+
+static SSP_KEYS keyPool[SSP_KEY_POOL_MAX];
+static int keyPoolCount = 0;
+static int keyPoolSize = 0;
+static int keyPoolRunning = 0;
+static pthread_t keyPoolThread;
+static pthread_mutex_t keyPoolMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t keyPoolCond = PTHREAD_COND_INITIALIZER;
+
+
+/*    creates the generator, modulus and host intermediate key (the expensive part of a key negotiation)  */
+static int CreateSSPHostKeyMaterial(SSP_KEYS * keyArray)
 {
 
 
@@ -74,6 +86,115 @@ int InitiateSSPHostKeys(SSP_KEYS * keyArray, const unsigned char ssp_address)
 	if (CreateHostInterKey(keyArray) == -1)
 		return 0;
 
+	return 1;
+}
+
+
+/*    takes precomputed key material from the pool, returns 0 if the pool is empty  */
+static int KeyPoolTake(SSP_KEYS * keyArray)
+{
+	int taken = 0;
+
+	pthread_mutex_lock(&keyPoolMutex);
+	if (keyPoolCount > 0) {
+		*keyArray = keyPool[--keyPoolCount];
+		taken = 1;
+		/* wake the filler thread to replace it  */
+		pthread_cond_signal(&keyPoolCond);
+	}
+	pthread_mutex_unlock(&keyPoolMutex);
+
+	return taken;
+}
+
+
+/*    background thread which keeps the pool filled  */
+static void *KeyPoolFiller(void *arg)
+{
+	SSP_KEYS keys;
+	int created;
+
+	pthread_mutex_lock(&keyPoolMutex);
+	while (keyPoolRunning) {
+		if (keyPoolCount >= keyPoolSize) {
+			pthread_cond_wait(&keyPoolCond, &keyPoolMutex);
+			continue;
+		}
+
+		/* the primes are computed without holding the lock  */
+		pthread_mutex_unlock(&keyPoolMutex);
+		created = CreateSSPHostKeyMaterial(&keys);
+		pthread_mutex_lock(&keyPoolMutex);
+
+		if (created && keyPoolCount < keyPoolSize)
+			keyPool[keyPoolCount++] = keys;
+	}
+	pthread_mutex_unlock(&keyPoolMutex);
+
+	return NULL;
+}
+
+
+int SSPKeyPoolStart(int size)
+{
+	if (size > SSP_KEY_POOL_MAX)
+		size = SSP_KEY_POOL_MAX;
+	if (size <= 0)
+		return 0;
+
+	pthread_mutex_lock(&keyPoolMutex);
+	if (keyPoolRunning) {
+		pthread_mutex_unlock(&keyPoolMutex);
+		return 0;
+	}
+	keyPoolSize = size;
+	keyPoolRunning = 1;
+	pthread_mutex_unlock(&keyPoolMutex);
+
+	if (pthread_create(&keyPoolThread, NULL, KeyPoolFiller, NULL) != 0) {
+		keyPoolRunning = 0;
+		return 0;
+	}
+
+	return 1;
+}
+
+
+void SSPKeyPoolStop(void)
+{
+	pthread_mutex_lock(&keyPoolMutex);
+	if (!keyPoolRunning) {
+		pthread_mutex_unlock(&keyPoolMutex);
+		return;
+	}
+	keyPoolRunning = 0;
+	pthread_cond_signal(&keyPoolCond);
+	pthread_mutex_unlock(&keyPoolMutex);
+
+	pthread_join(keyPoolThread, NULL);
+	keyPoolCount = 0;
+}
+
+
+int SSPKeyPoolAvailable(void)
+{
+	int count;
+
+	pthread_mutex_lock(&keyPoolMutex);
+	count = keyPoolCount;
+	pthread_mutex_unlock(&keyPoolMutex);
+
+	return count;
+}
+
+
+/*    DLL function call to generate host intermediate numbers to send to slave  */
+int InitiateSSPHostKeys(SSP_KEYS * keyArray, const unsigned char ssp_address)
+{
+	/* use precomputed key material if there is some, otherwise compute it now  */
+	if (!KeyPoolTake(keyArray) && !CreateSSPHostKeyMaterial(keyArray))
+		return 0;
+
 
 	/* reset the apcket counter here for a successful key neg  */
 	encPktCount[ssp_address] = 0;
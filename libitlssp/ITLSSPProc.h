@@ -74,6 +74,7 @@ void __attribute__ ((destructor)) my_fini(void);
 
 //private
 clock_t GetClockMs();
+int CompileSSPCommand(SSP_COMMAND * cmd, SSP_TX_RX_PACKET * ss);
 void SSPDataIn(unsigned char RxChar, SSP_TX_RX_PACKET * ss);
 int EncryptSSPPacket(unsigned char ptNum, unsigned char *dataIn, unsigned char *dataOut, unsigned char *lengthIn,
 		     unsigned char *lengthOut, unsigned long long *key);
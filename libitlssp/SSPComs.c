@@ -1,13 +1,18 @@
 
 #include "../libitlssp/SSPComs.h"
 
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/time.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "../libitlssp/Encryption.h"
 #include "../libitlssp/ITLSSPProc.h"
 #include "../libitlssp/serialfunc.h"
 #include "../libitlssp/ssp_defines.h"
+#include "../libitlssp/ssp_trace.h"
 
 
 
@@ -81,6 +86,116 @@ int CompileSSPCommand(SSP_COMMAND * cmd, SSP_TX_RX_PACKET * ss)
 	return 1;
 }
 
+/* the frame trace, NULL unless SSPTraceOpen has been called */
+static SSP_TRACE_HEADER *traceHeader = NULL;
+static SSP_TRACE_RECORD *traceRecords = NULL;
+static size_t traceSize = 0;
+
+int SSPTraceOpen(const char *path, unsigned long capacity)
+{
+	void *map;
+	int fd;
+
+	if (capacity == 0)
+		capacity = SSP_TRACE_CAPACITY;
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return 0;
+
+	traceSize = sizeof(SSP_TRACE_HEADER) + capacity * sizeof(SSP_TRACE_RECORD);
+	if (ftruncate(fd, traceSize) != 0) {
+		close(fd);
+		return 0;
+	}
+
+	map = mmap(NULL, traceSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return 0;
+
+	/* the file is all zeros, so no record is valid yet */
+	traceHeader = map;
+	memcpy(traceHeader->Magic, SSP_TRACE_MAGIC, sizeof(SSP_TRACE_MAGIC));
+	traceHeader->Version = SSP_TRACE_VERSION;
+	traceHeader->RecordSize = sizeof(SSP_TRACE_RECORD);
+	traceHeader->Capacity = capacity;
+	traceHeader->Next = 0;
+	traceRecords = (SSP_TRACE_RECORD *) (traceHeader + 1);
+
+	return 1;
+}
+
+void SSPTraceClose(void)
+{
+	if (traceHeader == NULL)
+		return;
+
+	munmap(traceHeader, traceSize);
+	traceHeader = NULL;
+	traceRecords = NULL;
+}
+
+static uint64_t SSPTraceClock(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* appends a record, data may be NULL. the sequence is written last so a torn record is never valid */
+static void SSPTraceRecord(unsigned char type, uint64_t time, const SSP_COMMAND * cmd, unsigned char address,
+			   unsigned char seqBit, const unsigned char *data, unsigned char length, uint32_t value)
+{
+	uint64_t n = __atomic_fetch_add(&traceHeader->Next, 1, __ATOMIC_RELAXED);
+	SSP_TRACE_RECORD *record = &traceRecords[n % traceHeader->Capacity];
+
+	__atomic_store_n(&record->Sequence, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	record->Time = time;
+	record->Value = value;
+	record->Type = type;
+	record->Address = address;
+	record->SeqBit = seqBit;
+	if (cmd) {
+		record->Bus = cmd->PortNumber;
+		record->Retry = cmd->RetryCount;
+		record->Status = cmd->ResponseStatus;
+		record->PacketError = cmd->PacketError;
+		record->Encrypted = cmd->EncryptionStatus;
+	} else {
+		record->Bus = 0;
+		record->Retry = 0;
+		record->Status = 0;
+		record->PacketError = 0;
+		record->Encrypted = 0;
+	}
+	record->Length = data ? length : 0;
+	if (data)
+		memcpy(record->Data, data, length < SSP_TRACE_DATA_SIZE ? length : SSP_TRACE_DATA_SIZE);
+
+	__atomic_store_n(&record->Sequence, n + 1, __ATOMIC_RELEASE);
+}
+
+void SSPTraceWait(const unsigned char ssp_address, unsigned long long ns)
+{
+	if (traceHeader == NULL)
+		return;
+
+	SSPTraceRecord(SSP_TRACE_WAIT, SSPTraceClock(), NULL, ssp_address, 0, NULL, 0,
+		       ns > UINT32_MAX ? UINT32_MAX : (uint32_t) ns);
+}
+
+static SSP_SEND_HOOK sendHook = NULL;
+static void *sendHookData = NULL;
+
+void SSPSetSendHook(SSP_SEND_HOOK hook, void *userdata)
+{
+	sendHook = hook;
+	sendHookData = userdata;
+}
+
 /*
 Name: SSPSendCommand
 Inputs:
@@ -93,56 +208,150 @@ Notes:
     In the ssp_command structure:
     EncryptionStatus,SSPAddress,Timeout,RetryLevel,CommandData,CommandDataLength (and Key if using encrpytion) must be set before calling this function
     ResponseStatus,ResponseData,ResponseDataLength will be altered by this function call.
+    If a send hook has been installed with SSPSetSendHook the command is handed over to the hook instead.
 */
 int SSPSendCommand(const SSP_PORT port, SSP_COMMAND * cmd)
+{
+	if (sendHook)
+		return sendHook(port, cmd, sendHookData);
+
+	return SSPSendCommandBlocking(port, cmd);
+}
+
+int SSPSendCommandBlocking(const SSP_PORT port, SSP_COMMAND * cmd)
 {
 	SSP_TX_RX_PACKET ssp;
 	clock_t txTime, currentTime;
-	int i;
-	unsigned char encryptLength;
-	unsigned short crcR;
-	unsigned char buffer;
-	unsigned char tData[255];
+	unsigned char buffer[255];
 	unsigned char retry;
-	unsigned int slaveCount;
+	long remaining;
+	int n, i;
+
 	/* complie the SSP packet and check for errors  */
-	if (!CompileSSPCommand(cmd, &ssp)) {
-		cmd->ResponseStatus = SSP_PACKET_ERROR;
+	if (!SSPStartCommand(port, cmd, &ssp))
 		return 0;
-	}
 
 	retry = cmd->RetryLevel;
 	/* transmit the packet    */
 	do {
-		ssp.NewResponse = 0;	/* set flag to wait for a new reply from slave   */
-		if (WriteData(ssp.txData, ssp.txBufferLength, port) == 0) {
-			//if(WritePort(&ssp) != TRUE){
-			cmd->ResponseStatus = PORT_ERROR;
-			return 0;
-		}
-
 		/* wait for out reply   */
 		cmd->ResponseStatus = SSP_REPLY_OK;
 		txTime = GetClockMs();
 		while (!ssp.NewResponse) {
 			/* check for reply timeout   */
 			currentTime = GetClockMs();
-			if (currentTime - txTime > cmd->Timeout) {
+			remaining = cmd->Timeout - (currentTime - txTime);
+			if (remaining < 0) {
 				cmd->ResponseStatus = SSP_CMD_TIMEOUT;
 				break;
 			}
-			while (BytesInBuffer(port) > 0) {
-				ReadData(port, &buffer, 1);
-				SSPDataIn(buffer, &ssp);
+			/* sleep until bytes arrive, then take everything available at once */
+			n = WaitForData(port, remaining);
+			if (n < 0) {
+				/* hung up or broken, poll would return at once again and again */
+				cmd->ResponseStatus = PORT_ERROR;
+				break;
 			}
+			if (n == 0)
+				continue;
+			n = ReadAvailable(port, buffer, sizeof(buffer));
+			if (n < 0) {
+				/* readable but nothing to read: hung up (poll reports POLLIN with POLLHUP) */
+				cmd->ResponseStatus = PORT_ERROR;
+				break;
+			}
+			for (i = 0; i < n && !ssp.NewResponse; i++)
+				SSPDataIn(buffer[i], &ssp);
 		}
 
-		if (cmd->ResponseStatus == SSP_REPLY_OK)
+		if (cmd->ResponseStatus == SSP_REPLY_OK || cmd->ResponseStatus == PORT_ERROR)
 			break;
 
 		retry--;
-	} while (retry > 0);
+		if (retry > 0)
+			cmd->RetryCount++;
+	} while (retry > 0 && SSPTransmitPacket(port, cmd, &ssp));
+
+	return SSPCompleteCommand(cmd, &ssp);
+}
 
+/* transmits the compiled packet, with a trace open the command data before the encryption
+   (plain, only for the first transmission) or a retry is recorded  */
+static int SSPWritePacket(const SSP_PORT port, SSP_COMMAND * cmd, SSP_TX_RX_PACKET * ssp,
+			  const unsigned char *plain, unsigned char plainLength)
+{
+	uint64_t txTime = traceHeader ? SSPTraceClock() : 0;
+
+	ssp->NewResponse = 0;	/* set flag to wait for a new reply from slave   */
+	if (WriteData(ssp->txData, ssp->txBufferLength, port) == 0) {
+		//if(WritePort(&ssp) != TRUE){
+		cmd->ResponseStatus = PORT_ERROR;
+	} else
+		cmd->ResponseStatus = SSP_REPLY_OK;
+
+	if (traceHeader)
+		SSPTraceRecord(plain ? SSP_TRACE_TX : SSP_TRACE_RETRY, txTime, cmd, cmd->SSPAddress,
+			       ssp->txData[1] & 0x80, plain, plainLength, 0);
+
+	return cmd->ResponseStatus == SSP_REPLY_OK;
+}
+
+int SSPStartCommand(const SSP_PORT port, SSP_COMMAND * cmd, SSP_TX_RX_PACKET * ssp)
+{
+	unsigned char plain[SSP_TRACE_DATA_SIZE];
+	unsigned char plainLength = cmd->CommandDataLength;
+
+	cmd->RetryCount = 0;
+	cmd->PacketError = SSP_PACKET_ERROR_NONE;
+
+	/* the command data is replaced by the encrypted packet  */
+	if (traceHeader)
+		memcpy(plain, cmd->CommandData, plainLength < sizeof(plain) ? plainLength : sizeof(plain));
+
+	/* complie the SSP packet and check for errors  */
+	if (!CompileSSPCommand(cmd, ssp)) {
+		cmd->ResponseStatus = SSP_PACKET_ERROR;
+		cmd->PacketError = SSP_PACKET_ERROR_COMPILE;
+		return 0;
+	}
+
+	return SSPWritePacket(port, cmd, ssp, plain, plainLength);
+}
+
+int SSPTransmitPacket(const SSP_PORT port, SSP_COMMAND * cmd, SSP_TX_RX_PACKET * ssp)
+{
+	return SSPWritePacket(port, cmd, ssp, NULL, 0);
+}
+
+static int SSPDecodeResponse(SSP_COMMAND * cmd, SSP_TX_RX_PACKET * ssp);
+
+int SSPCompleteCommand(SSP_COMMAND * cmd, SSP_TX_RX_PACKET * ssp)
+{
+	int result = SSPDecodeResponse(cmd, ssp);
+
+	if (traceHeader) {
+		if (result)
+			SSPTraceRecord(SSP_TRACE_RX, SSPTraceClock(), cmd, cmd->SSPAddress, ssp->rxData[1] & 0x80,
+				       cmd->ResponseData, cmd->ResponseDataLength, 0);
+		else
+			SSPTraceRecord(SSP_TRACE_FAIL, SSPTraceClock(), cmd, cmd->SSPAddress, ssp->txData[1] & 0x80,
+				       NULL, 0, 0);
+	}
+
+	return result;
+}
+
+/* checks, decrypts and copies the received packet into the command  */
+static int SSPDecodeResponse(SSP_COMMAND * cmd, SSP_TX_RX_PACKET * ssp)
+{
+	int i;
+	unsigned char encryptLength;
+	unsigned short crcR;
+	unsigned char tData[255];
+	unsigned int slaveCount;
+
+	if (cmd->ResponseStatus == PORT_ERROR)
+		return 0;
 
 	if (cmd->ResponseStatus == SSP_CMD_TIMEOUT) {
 		cmd->ResponseData[0] = SSP_RESPONSE_TIMEOUT;
@@ -152,39 +361,41 @@ int SSPSendCommand(const SSP_PORT port, SSP_COMMAND * cmd)
 
 
 	/* load the command structure with ssp packet data   */
-	if (ssp.rxData[3] == SSP_STEX) {	/* check for encrpted packet    */
-		encryptLength = ssp.rxData[2] - 1;
-		DecryptSSPPacket(&ssp.rxData[4], &ssp.rxData[4], &encryptLength, &encryptLength,
+	if (ssp->rxData[3] == SSP_STEX) {	/* check for encrpted packet    */
+		encryptLength = ssp->rxData[2] - 1;
+		DecryptSSPPacket(&ssp->rxData[4], &ssp->rxData[4], &encryptLength, &encryptLength,
 				 (unsigned long long *) &cmd->Key);
 		/* check the checsum    */
-		crcR = cal_crc_loop_CCITT_A(encryptLength - 2, &ssp.rxData[4], CRC_SSP_SEED, CRC_SSP_POLY);
-		if ((unsigned char) (crcR & 0xFF) != ssp.rxData[ssp.rxData[2] + 1]
-		    || (unsigned char) ((crcR >> 8) & 0xFF) != ssp.rxData[ssp.rxData[2] + 2]) {
+		crcR = cal_crc_loop_CCITT_A(encryptLength - 2, &ssp->rxData[4], CRC_SSP_SEED, CRC_SSP_POLY);
+		if ((unsigned char) (crcR & 0xFF) != ssp->rxData[ssp->rxData[2] + 1]
+		    || (unsigned char) ((crcR >> 8) & 0xFF) != ssp->rxData[ssp->rxData[2] + 2]) {
 			cmd->ResponseStatus = SSP_PACKET_ERROR;
+			cmd->PacketError = SSP_PACKET_ERROR_CRC;
 			return 0;
 		}
 		/* check the slave count against the host count  */
 		slaveCount = 0;
 		for (i = 0; i < 4; i++)
-			slaveCount += (unsigned int) (ssp.rxData[5 + i]) << (i * 8);
+			slaveCount += (unsigned int) (ssp->rxData[5 + i]) << (i * 8);
 		/* no match then we discard this packet and do not act on it's info  */
 		if (slaveCount != encPktCount[cmd->SSPAddress]) {
 			cmd->ResponseStatus = SSP_PACKET_ERROR;
+			cmd->PacketError = SSP_PACKET_ERROR_COUNTER;
 			return 0;
 		}
 
 		/* restore data for correct decode  */
-		ssp.rxBufferLength = ssp.rxData[4] + 5;
-		tData[0] = ssp.rxData[0];
-		tData[1] = ssp.rxData[1];
-		tData[2] = ssp.rxData[4];
-		for (i = 0; i < ssp.rxData[4]; i++)
-			tData[3 + i] = ssp.rxData[9 + i];
-		crcR = cal_crc_loop_CCITT_A(ssp.rxBufferLength - 3, &tData[1], CRC_SSP_SEED, CRC_SSP_POLY);
-		tData[3 + ssp.rxData[4]] = (unsigned char) (crcR & 0xFF);
-		tData[4 + ssp.rxData[4]] = (unsigned char) ((crcR >> 8) & 0xFF);
-		for (i = 0; i < ssp.rxBufferLength; i++)
-			ssp.rxData[i] = tData[i];
+		ssp->rxBufferLength = ssp->rxData[4] + 5;
+		tData[0] = ssp->rxData[0];
+		tData[1] = ssp->rxData[1];
+		tData[2] = ssp->rxData[4];
+		for (i = 0; i < ssp->rxData[4]; i++)
+			tData[3 + i] = ssp->rxData[9 + i];
+		crcR = cal_crc_loop_CCITT_A(ssp->rxBufferLength - 3, &tData[1], CRC_SSP_SEED, CRC_SSP_POLY);
+		tData[3 + ssp->rxData[4]] = (unsigned char) (crcR & 0xFF);
+		tData[4 + ssp->rxData[4]] = (unsigned char) ((crcR >> 8) & 0xFF);
+		for (i = 0; i < ssp->rxBufferLength; i++)
+			ssp->rxData[i] = tData[i];
 
 		/* for decrypted resonse with encrypted command, increment the counter here  */
 		//  if(!cmd->EncryptionStatus)
@@ -193,12 +404,12 @@ int SSPSendCommand(const SSP_PORT port, SSP_COMMAND * cmd)
 
 	}
 
-	/*for(i = 0; i < ssp.rxBufferLength; i++)
-	   printf("%x ", ssp.rxData[i]);
+	/*for(i = 0; i < ssp->rxBufferLength; i++)
+	   printf("%x ", ssp->rxData[i]);
 	   printf("\n"); */
-	cmd->ResponseDataLength = ssp.rxData[2];
+	cmd->ResponseDataLength = ssp->rxData[2];
 	for (i = 0; i < cmd->ResponseDataLength; i++)
-		cmd->ResponseData[i] = ssp.rxData[i + 3];
+		cmd->ResponseData[i] = ssp->rxData[i + 3];
 
 
 	/* alternate the seq bit   */
@@ -225,24 +436,35 @@ clock_t GetClockMs()
 }
 
 
-void SSPDataIn(unsigned char RxChar, SSP_TX_RX_PACKET * ss)
+/* stores a received (unstuffed) byte, the CRC is updated for all bytes except STX and the CRC itself  */
+static void SSPStoreRxByte(SSP_TX_RX_PACKET * ss, unsigned char RxChar)
 {
-	unsigned short crc;
+	unsigned char pos = ss->rxPtr;
+
+	ss->rxData[ss->rxPtr++] = RxChar;
+	if (pos == 0)
+		ss->rxCrc = CRC_SSP_SEED;
+	else if (pos < 3 || pos + 2 < ss->rxBufferLength)
+		ss->rxCrc = crc_ssp_update(ss->rxCrc, RxChar);
+}
 
+
+void SSPDataIn(unsigned char RxChar, SSP_TX_RX_PACKET * ss)
+{
 	//printf("REC:%d\n",RxChar);
 	if (RxChar == SSP_STX && ss->rxPtr == 0) {
 		// packet start
-		ss->rxData[ss->rxPtr++] = RxChar;
+		SSPStoreRxByte(ss, RxChar);
 	} else {
 		// if last byte was start byte, and next is not then
 		// restart the packet
 		if (ss->CheckStuff == 1) {
 			if (RxChar != SSP_STX) {
-				ss->rxData[0] = SSP_STX;
-				ss->rxData[1] = RxChar;
-				ss->rxPtr = 2;
+				ss->rxPtr = 0;
+				SSPStoreRxByte(ss, SSP_STX);
+				SSPStoreRxByte(ss, RxChar);
 			} else
-				ss->rxData[ss->rxPtr++] = RxChar;
+				SSPStoreRxByte(ss, RxChar);
 			// reset stuff check flag
 			ss->CheckStuff = 0;
 		} else {
@@ -251,7 +473,7 @@ void SSPDataIn(unsigned char RxChar, SSP_TX_RX_PACKET * ss)
 				ss->CheckStuff = 1;
 			else {
 				// add data to packet
-				ss->rxData[ss->rxPtr++] = RxChar;
+				SSPStoreRxByte(ss, RxChar);
 				// get the packet length
 				if (ss->rxPtr == 3)
 					ss->rxBufferLength = ss->rxData[2] + 5;
@@ -261,12 +483,9 @@ void SSPDataIn(unsigned char RxChar, SSP_TX_RX_PACKET * ss)
 		if (ss->rxPtr == ss->rxBufferLength) {
 			// is this packet for us ??
 			if ((ss->rxData[1] & SSP_STX) == ss->SSPAddress) {
-				// is the checksum correct
-				crc =
-				    cal_crc_loop_CCITT_A(ss->rxBufferLength - 3, &ss->rxData[1], CRC_SSP_SEED,
-							 CRC_SSP_POLY);
-				if ((unsigned char) (crc & 0xFF) == ss->rxData[ss->rxBufferLength - 2]
-				    && (unsigned char) ((crc >> 8) & 0xFF) == ss->rxData[ss->rxBufferLength - 1])
+				// is the checksum correct (computed while the bytes arrived)
+				if ((unsigned char) (ss->rxCrc & 0xFF) == ss->rxData[ss->rxBufferLength - 2]
+				    && (unsigned char) ((ss->rxCrc >> 8) & 0xFF) == ss->rxData[ss->rxBufferLength - 1])
 					ss->NewResponse = 1;	/* we have a new response so set flag  */
 			}
 			// reset packet
@@ -50,8 +50,18 @@ extern "C" {
 		unsigned char ResponseDataLength;
 		unsigned char ResponseData[255];
 		unsigned char IgnoreError;
+		unsigned char RetryCount;	/* retransmissions needed by the last command */
+		unsigned char PacketError;	/* cause of the last SSP_PACKET_ERROR (SSP_PACKET_ERROR_CAUSE) */
 	} SSP_COMMAND;
 
+/* cause of a SSP_PACKET_ERROR in the ResponseStatus of SSP_COMMAND */
+	typedef enum {
+		SSP_PACKET_ERROR_NONE,
+		SSP_PACKET_ERROR_COMPILE,
+		SSP_PACKET_ERROR_CRC,
+		SSP_PACKET_ERROR_COUNTER,
+	} SSP_PACKET_ERROR_CAUSE;
+
 
 	typedef struct {
 		unsigned char txData[255];
@@ -63,6 +73,7 @@ extern "C" {
 		unsigned char SSPAddress;
 		unsigned char NewResponse;
 		unsigned char CheckStuff;
+		unsigned short rxCrc;	/* CRC of the received bytes so far, updated by SSPDataIn */
 	} SSP_TX_RX_PACKET;
 
 
@@ -153,6 +164,148 @@ Notes:
 */
 	int SSPSendCommand(const SSP_PORT, SSP_COMMAND * cmd);
 
+/*
+Name: SSPSendCommandBlocking
+Inputs:
+    SSP_PORT The port handle (returned from OpenSSPPort) of the port to use
+    SSP_COMMAND The command structure to be used.
+Return:
+    1 on success
+    0 on failure
+Notes:
+    Same as SSPSendCommand but never hands the command over to an installed send hook.
+    Waits until the response has been received or all retries timed out. A port which
+    hung up or reports an error ends the command at once with ResponseStatus PORT_ERROR.
+*/
+	int SSPSendCommandBlocking(const SSP_PORT port, SSP_COMMAND * cmd);
+
+/*
+Name: SSP_SEND_HOOK
+Inputs:
+    SSP_PORT The port handle the command should be sent on
+    SSP_COMMAND The command structure to be used.
+    void * userdata: The pointer provided to SSPSetSendHook
+Return:
+    1 on success
+    0 on failure
+Notes:
+    Must behave exactly like SSPSendCommandBlocking from the callers point of view.
+*/
+	typedef int (*SSP_SEND_HOOK) (const SSP_PORT port, SSP_COMMAND * cmd, void *userdata);
+
+/*
+Name: SSPSetSendHook
+Inputs:
+    SSP_SEND_HOOK hook: The function which should send all further commands, NULL to restore the default
+    void * userdata: Passed through to the hook
+Return:
+    void
+Notes:
+    Every command sent by this library (including the ones from NegotiateSSPEncryption)
+    goes through SSPSendCommand and thus through the hook. This allows applications to
+    provide their own (e.g. non-blocking, event driven) transport built on top of
+    SSPStartCommand, SSPTransmitPacket, SSPDataIn and SSPCompleteCommand.
+*/
+	void SSPSetSendHook(SSP_SEND_HOOK hook, void *userdata);
+
+/*
+Name: SSPStartCommand
+Inputs:
+    SSP_PORT The port handle (returned from OpenSSPPort) of the port to use
+    SSP_COMMAND The command structure to be used.
+    SSP_TX_RX_PACKET The packet state used for this command until SSPCompleteCommand has been called
+Return:
+    1 on success
+    0 on failure (ResponseStatus is set to SSP_PACKET_ERROR or PORT_ERROR)
+Notes:
+    Compiles (and encrypts if needed) the command and transmits it once. Received
+    bytes have to be fed into SSPDataIn until the NewResponse flag of the packet is set.
+*/
+	int SSPStartCommand(const SSP_PORT port, SSP_COMMAND * cmd, SSP_TX_RX_PACKET * ssp);
+
+/*
+Name: SSPTransmitPacket
+Inputs:
+    SSP_PORT The port handle (returned from OpenSSPPort) of the port to use
+    SSP_COMMAND The command structure to be used.
+    SSP_TX_RX_PACKET The packet compiled by SSPStartCommand
+Return:
+    1 on success
+    0 on failure (ResponseStatus is set to PORT_ERROR)
+Notes:
+    (Re)transmits an already compiled packet, used for retries after a reply timeout.
+*/
+	int SSPTransmitPacket(const SSP_PORT port, SSP_COMMAND * cmd, SSP_TX_RX_PACKET * ssp);
+
+/*
+Name: SSPCompleteCommand
+Inputs:
+    SSP_COMMAND The command structure to be used.
+    SSP_TX_RX_PACKET The packet which received the response
+Return:
+    1 on success
+    0 on failure
+Notes:
+    Call after the NewResponse flag of the packet has been set, or with ResponseStatus set to
+    SSP_CMD_TIMEOUT if no reply has been received. Decrypts and verifies the response, fills
+    ResponseData/ResponseDataLength and toggles the sequence bit of the device.
+*/
+	int SSPCompleteCommand(SSP_COMMAND * cmd, SSP_TX_RX_PACKET * ssp);
+
+/*
+Name: SSPDataIn
+Inputs:
+    unsigned char RxChar: The byte received from the port
+    SSP_TX_RX_PACKET The packet state of the command in flight
+Return:
+    void
+Notes:
+    Sets the NewResponse flag of the packet as soon as a complete packet with a valid checksum has been received.
+*/
+	void SSPDataIn(unsigned char RxChar, SSP_TX_RX_PACKET * ss);
+
+/*
+Name: SSPTraceOpen
+Inputs:
+    char * path: The file the frames should be recorded in, it is created or overwritten
+    unsigned long capacity: The number of records kept, 0 for SSP_TRACE_CAPACITY
+Return:
+    1 on success
+    0 on failure (errno is set)
+Notes:
+    From now on every frame sent by SSPStartCommand/SSPTransmitPacket and every result of
+    SSPCompleteCommand is recorded in a memory mapped ring (see ssp_trace.h), the oldest
+    records are overwritten. Commands are recorded before they are encrypted and responses
+    after they have been decrypted, so the trace contains the encryption key exchange in clear.
+    Must be called before the first command is sent.
+*/
+	int SSPTraceOpen(const char *path, unsigned long capacity);
+
+/*
+Name: SSPTraceClose
+Inputs:
+    void
+Return:
+    void
+Notes:
+    Stops recording and unmaps the trace file, must not be called while commands are sent.
+*/
+	void SSPTraceClose(void);
+
+/*
+Name: SSPTraceWait
+Inputs:
+    unsigned char ssp_address: The device the application waits for
+    unsigned long long ns: The time waited before the next command in ns
+Return:
+    void
+Notes:
+    Records a wait of the application (ex. for the minimum gap between two frames), so the
+    time between two commands can be told apart from the time the application itself took.
+    Does nothing if no trace is open.
+*/
+	void SSPTraceWait(const unsigned char ssp_address, unsigned long long ns);
+
 /*
 Name: OpenSSPPort
 Inputs:
@@ -281,6 +434,42 @@ Notes:
 */
 	int NegotiateSSPEncryption(SSP_PORT port, const char ssp_address, SSP_FULL_KEY * key);
 
+/*
+Name: SSPKeyPoolStart
+Inputs:
+    int size: The number of key material sets to keep ready (at most 8)
+Return:
+    1 on success
+    0 on failure (or if the pool is already running)
+Notes:
+    Starts a background thread which precomputes the generator, modulus and host intermediate
+    key used by NegotiateSSPEncryption. A negotiation takes a set from the pool if there is one,
+    so it only costs the serial round trips instead of the prime search. The thread computes a
+    replacement for every set taken.
+*/
+	int SSPKeyPoolStart(int size);
+
+/*
+Name: SSPKeyPoolStop
+Inputs:
+    void
+Return:
+    void
+Notes:
+    Stops the background thread started by SSPKeyPoolStart and drops the precomputed sets.
+*/
+	void SSPKeyPoolStop(void);
+
+/*
+Name: SSPKeyPoolAvailable
+Inputs:
+    void
+Return:
+    The number of precomputed key material sets which are ready
+Notes:
+*/
+	int SSPKeyPoolAvailable(void);
+
 
 //SSP functions
 /*
@@ -7,7 +7,8 @@
 #include "../libitlssp/port_linux.h"
 
 
-static int open_port = 0;
+/* -1 while no port is open, so close_ssp_port never closes fd 0 */
+static int open_port = -1;
 
 /* Some helper funtions for detecting keyboard input */
 void changemode(int dir)
@@ -57,7 +58,15 @@ int open_ssp_port(const char *port)
 
 void close_ssp_port()
 {
+	if (open_port == -1)
+		return;
 	CloseSSPPort(open_port);
+	open_port = -1;
+}
+
+SSP_PORT get_ssp_port()
+{
+	return open_port;
 }
 
 int send_ssp_command(SSP_COMMAND * sspC)
@@ -16,6 +16,7 @@ int kbhit(void);
 
 int open_ssp_port(const char *port);
 void close_ssp_port();
+SSP_PORT get_ssp_port();
 int send_ssp_command(SSP_COMMAND * sspC);
 int negotiate_ssp_encryption(SSP_COMMAND * sspC, SSP_FULL_KEY * hostKey);
 
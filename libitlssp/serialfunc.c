@@ -7,6 +7,7 @@
 #include <errno.h>		/* Error number definitions */
 #include <termios.h>		/* POSIX terminal control definitions */
 #include <sys/ioctl.h>
+#include <poll.h>
 #include "../libitlssp/itl_types.h"
 #include "../libitlssp/serialfunc.h"
 //#include <asm/termios.h>
@@ -49,6 +50,19 @@ void CloseSSPPort(const SSP_PORT port)
 	}
 }
 
+/*
+Name: WriteData
+Inputs:
+    unsigned char * data: The bytes to write
+    unsigned long length: The number of bytes to write
+    SSP_PORT port: The port to write to
+Return:
+    1 on success
+    0 on failure
+Notes:
+    Waits with tcdrain until a previous frame has left the UART before writing, a full
+    output queue is waited for with poll instead of sleeping a fixed time.
+*/
 int WriteData(const unsigned char *data, unsigned long length, const SSP_PORT port)
 {
 	long n;
@@ -58,13 +72,21 @@ int WriteData(const unsigned char *data, unsigned long length, const SSP_PORT po
 	   printf("\n"); */
 	long offset;
 	long bytes_left = length;
+	struct pollfd pfd;
+
+	if (TransmitComplete(port) == 0)
+		tcdrain(port);
+
 	offset = 0;
 	while (bytes_left > 0) {
-		while (TransmitComplete(port) == 0)
-			usleep(100);
 		n = write(port, &data[offset], bytes_left);
-		usleep(500);
 		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR) {
+				pfd.fd = port;
+				pfd.events = POLLOUT;
+				poll(&pfd, 1, -1);
+				continue;
+			}
 			perror("Write Port Failed");
 			return 0;
 		}
@@ -127,6 +149,60 @@ int ReadData(const SSP_PORT port, unsigned char *buffer, unsigned long bytes_to_
 	return read(port, buffer, bytes_to_read);
 }
 
+/*
+Name: ReadAvailable
+Inputs:
+    SSP_PORT port: The port to read from
+    unsigned char * buffer: Where to store the bytes
+    unsigned long size: The size of the buffer
+Return:
+    The number of bytes read, 0 if nothing was available
+    -1 if the port is unusable (end of file after a hang up, EIO, ...)
+Notes:
+    Reads everything which is available (up to size) with one syscall, never blocks.
+    A hung up tty is reported readable by poll, the read then returns 0 or fails with EIO.
+*/
+int ReadAvailable(const SSP_PORT port, unsigned char *buffer, unsigned long size)
+{
+	int n = read(port, buffer, size);
+	if (n == 0)
+		return -1;
+	if (n < 0)
+		return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+	return n;
+}
+
+/*
+Name: WaitForData
+Inputs:
+    SSP_PORT port: The port to wait for
+    long timeout: The maximum time to wait in ms
+Return:
+    1 if data is available
+    0 on timeout (or if a signal interrupted the wait)
+    -1 if the port is unusable (hung up, error condition, not open)
+Notes:
+    Data which arrived before a hang up is still reported as available first.
+*/
+int WaitForData(const SSP_PORT port, long timeout)
+{
+	struct pollfd pfd;
+	int n;
+	pfd.fd = port;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	n = poll(&pfd, 1, timeout);
+	if (n < 0)
+		return errno == EINTR ? 0 : -1;
+	if (n == 0)
+		return 0;
+	if (pfd.revents & POLLIN)
+		return 1;
+	if (pfd.revents & (POLLHUP | POLLERR | POLLNVAL))
+		return -1;
+	return 0;
+}
+
 void SetBaud(const SSP_PORT port, const unsigned long baud)
 {
 	struct termios options;
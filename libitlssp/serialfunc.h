@@ -8,6 +8,10 @@ int BytesInBuffer(SSP_PORT port);
 
 int ReadData(const SSP_PORT port, unsigned char *buffer, unsigned long bytes_to_read);
 
+int ReadAvailable(const SSP_PORT port, unsigned char *buffer, unsigned long size);
+
+int WaitForData(const SSP_PORT port, long timeout);
+
 void SetBaud(const SSP_PORT port, const unsigned long baud);
 
 int TransmitComplete(SSP_PORT port);
@@ -0,0 +1,65 @@
+/*
+    Layout of the SSP frame trace written by SSPTraceOpen (see SSPComs.h) and read by payouttrace.
+
+    The trace is a memory mapped file of fixed size: a SSP_TRACE_HEADER followed by Capacity
+    SSP_TRACE_RECORD slots used as a ring. Record n (counting from 0) lives in slot n % Capacity
+    and is valid if its Sequence is n + 1, a Sequence of 0 means the record was being written.
+    Commands are recorded before they are encrypted and responses after they have been
+    decrypted. All numbers are stored in the byte order of the host.
+*/
+
+#ifndef __SSP_TRACE_H
+#define __SSP_TRACE_H
+
+#include <stdint.h>
+
+/* magic at the start of the trace file */
+#define SSP_TRACE_MAGIC "SSPTRAC"
+/* version of the layout below */
+#define SSP_TRACE_VERSION 1
+/* number of records used if SSPTraceOpen is called with a capacity of 0 (8 MB) */
+#define SSP_TRACE_CAPACITY 65536
+/* number of bytes of command or response data kept per record */
+#define SSP_TRACE_DATA_SIZE 96
+
+/* a command has been transmitted the first time, Data holds the command data */
+#define SSP_TRACE_TX 1
+/* the command has been transmitted again after a reply timeout */
+#define SSP_TRACE_RETRY 2
+/* a valid response has been received, Data holds the response data */
+#define SSP_TRACE_RX 3
+/* the command finished without a valid response (timeout, port or packet error, see Status and PacketError) */
+#define SSP_TRACE_FAIL 4
+/* the application waited Value ns before the next command to the device (frame gap) */
+#define SSP_TRACE_WAIT 5
+
+typedef struct {
+	char Magic[8];		/* SSP_TRACE_MAGIC */
+	uint32_t Version;	/* SSP_TRACE_VERSION */
+	uint32_t RecordSize;	/* sizeof(SSP_TRACE_RECORD) */
+	uint64_t Capacity;	/* number of record slots following the header */
+	uint64_t Next;		/* number of records written so far */
+	unsigned char Reserved[96];
+} SSP_TRACE_HEADER;
+
+typedef struct {
+	uint64_t Sequence;	/* number of the record + 1 */
+	uint64_t Time;		/* CLOCK_MONOTONIC in ns */
+	uint32_t Value;		/* SSP_TRACE_WAIT: the time waited in ns, otherwise 0 */
+	uint8_t Type;		/* SSP_TRACE_* */
+	uint8_t Bus;		/* PortNumber of the command */
+	uint8_t Address;	/* SSP address of the device */
+	uint8_t SeqBit;		/* sequence bit of the frame (0x80 or 0) */
+	uint8_t Retry;		/* RetryCount of the command */
+	uint8_t Status;		/* ResponseStatus of the command (PORT_STATUS) */
+	uint8_t PacketError;	/* PacketError of the command (SSP_PACKET_ERROR_CAUSE) */
+	uint8_t Encrypted;	/* EncryptionStatus of the command */
+	uint8_t Length;		/* length of the command or response data, only SSP_TRACE_DATA_SIZE bytes are kept */
+	uint8_t Reserved[3];
+	uint8_t Data[SSP_TRACE_DATA_SIZE];
+} SSP_TRACE_RECORD;
+
+_Static_assert(sizeof(SSP_TRACE_HEADER) == 128, "trace header must be 128 bytes");
+_Static_assert(sizeof(SSP_TRACE_RECORD) == 128, "trace record must be 128 bytes");
+
+#endif
@@ -0,0 +1,328 @@
+/*
+    Microbenchmarks for the functions every SSP frame goes through.
+
+    Usage: bin/sspbench [-t min ms per benchmark] [name filter]
+
+    Prints one line per benchmark: name, iterations, ns/op and allocations/op (malloc, calloc
+    and realloc are wrapped by the linker, see the bench target in the Makefile). The frames
+    are the ones seen during a hopper payout: an encrypted poll, a poll response with
+    dispensing/coin credit/dispensed events and a GET ALL LEVELS response which needs byte
+    stuffing.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../libitlssp/ssp_commands.h"
+#include "../libitlssp/Encryption.h"
+#include "../libitlssp/ITLSSPProc.h"
+#include "../libitlssp/Random.h"
+#include "../libitlssp/ssp_defines.h"
+
+#define BENCH_ADDRESS 0x10
+#define BENCH_FIXED_KEY 0x0123456701234567ULL
+#define BENCH_ENCRYPT_KEY 0x0000000012345678ULL
+
+typedef void (*BENCH_FN) (long iterations);
+
+static unsigned long allocations = 0;
+static volatile unsigned long sink = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+	allocations++;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+	allocations++;
+	return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	allocations++;
+	return __real_realloc(ptr, size);
+}
+
+
+/* poll response of the hopper: dispensing 1.50, coin credit 1.00, dispensed 1.50, disabled */
+static const unsigned char pollResponse[] = {
+	0xF0,
+	SSP_POLL_DISPENSING, 0x01, 0x96, 0x00, 0x00, 0x00, 'E', 'U', 'R',
+	SSP_POLL_COIN_CREDIT, 0x64, 0x00, 0x00, 0x00, 'E', 'U', 'R',
+	SSP_POLL_DISPENSED, 0x01, 0x96, 0x00, 0x00, 0x00, 'E', 'U', 'R',
+	SSP_POLL_DISABLED,
+};
+
+/* GET ALL LEVELS response for 8 coins, the levels 127 and 383 have to be stuffed */
+static const unsigned char levelsResponse[] = {
+	0xF0, 0x08,
+	0x7F, 0x00, 0x01, 0x00, 0x00, 0x00, 'E', 'U', 'R',
+	0x32, 0x00, 0x02, 0x00, 0x00, 0x00, 'E', 'U', 'R',
+	0x7F, 0x01, 0x05, 0x00, 0x00, 0x00, 'E', 'U', 'R',
+	0x10, 0x00, 0x0A, 0x00, 0x00, 0x00, 'E', 'U', 'R',
+	0x7F, 0x00, 0x14, 0x00, 0x00, 0x00, 'E', 'U', 'R',
+	0x28, 0x00, 0x32, 0x00, 0x00, 0x00, 'E', 'U', 'R',
+	0x19, 0x00, 0x64, 0x00, 0x00, 0x00, 'E', 'U', 'R',
+	0x0C, 0x00, 0xC8, 0x00, 0x00, 0x00, 'E', 'U', 'R',
+};
+
+/* wire frames created by bench_setup */
+static SSP_TX_RX_PACKET levelsFrame;
+static SSP_TX_RX_PACKET encryptedPollFrame;
+static unsigned char encryptedBlock[32];
+static unsigned char encryptedBlockLength;
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void setup_command(SSP_COMMAND * cmd, int encrypted)
+{
+	memset(cmd, 0, sizeof(*cmd));
+	cmd->SSPAddress = BENCH_ADDRESS;
+	cmd->EncryptionStatus = encrypted;
+	cmd->Key.FixedKey = BENCH_FIXED_KEY;
+	cmd->Key.EncryptKey = BENCH_ENCRYPT_KEY;
+	cmd->Timeout = 1000;
+	cmd->RetryLevel = 3;
+}
+
+/* answers every command with the poll response, so ssp6_poll only decodes */
+static int poll_hook(const SSP_PORT port, SSP_COMMAND * cmd, void *userdata)
+{
+	memcpy(cmd->ResponseData, pollResponse, sizeof(pollResponse));
+	cmd->ResponseDataLength = sizeof(pollResponse);
+	cmd->ResponseStatus = SSP_REPLY_OK;
+	return 1;
+}
+
+static void bench_setup(void)
+{
+	SSP_COMMAND cmd;
+	unsigned char length = 1;
+
+	/* a response frame has the same layout as a command frame */
+	setup_command(&cmd, 0);
+	memcpy(cmd.CommandData, levelsResponse, sizeof(levelsResponse));
+	cmd.CommandDataLength = sizeof(levelsResponse);
+	CompileSSPCommand(&cmd, &levelsFrame);
+
+	setup_command(&cmd, 1);
+	cmd.CommandData[0] = SSP_CMD_POLL;
+	cmd.CommandDataLength = 1;
+	CompileSSPCommand(&cmd, &encryptedPollFrame);
+
+	/* the encrypted part of the frame (without the STEX) */
+	setup_command(&cmd, 1);
+	cmd.CommandData[0] = SSP_CMD_POLL;
+	EncryptSSPPacket(BENCH_ADDRESS, cmd.CommandData, encryptedBlock, &length, &encryptedBlockLength,
+			 (unsigned long long *) &cmd.Key);
+	memmove(encryptedBlock, encryptedBlock + 1, --encryptedBlockLength);
+
+	SSPSetSendHook(poll_hook, NULL);
+}
+
+static void bench_crc_64(long n)
+{
+	unsigned char data[64];
+	long i;
+
+	memcpy(data, levelsResponse, sizeof(data));
+	for (i = 0; i < n; i++) {
+		data[0] = (unsigned char) i;
+		sink += cal_crc_loop_CCITT_A(sizeof(data), data, CRC_SSP_SEED, CRC_SSP_POLY);
+	}
+}
+
+static void bench_compile_poll(long n)
+{
+	SSP_COMMAND cmd;
+	SSP_TX_RX_PACKET ss;
+	long i;
+
+	setup_command(&cmd, 0);
+	for (i = 0; i < n; i++) {
+		cmd.CommandData[0] = SSP_CMD_POLL;
+		cmd.CommandDataLength = 1;
+		CompileSSPCommand(&cmd, &ss);
+		sink += ss.txBufferLength;
+	}
+}
+
+static void bench_compile_poll_encrypted(long n)
+{
+	SSP_COMMAND cmd;
+	SSP_TX_RX_PACKET ss;
+	long i;
+
+	setup_command(&cmd, 1);
+	for (i = 0; i < n; i++) {
+		cmd.CommandData[0] = SSP_CMD_POLL;
+		cmd.CommandDataLength = 1;
+		CompileSSPCommand(&cmd, &ss);
+		sink += ss.txBufferLength;
+	}
+}
+
+static void feed(const SSP_TX_RX_PACKET * frame, long n)
+{
+	SSP_TX_RX_PACKET ss;
+	long i;
+	int j;
+
+	memset(&ss, 0, sizeof(ss));
+	ss.SSPAddress = BENCH_ADDRESS;
+	for (i = 0; i < n; i++) {
+		ss.NewResponse = 0;
+		ss.rxPtr = 0;
+		ss.CheckStuff = 0;
+		for (j = 0; j < frame->txBufferLength; j++)
+			SSPDataIn(frame->txData[j], &ss);
+		sink += ss.NewResponse;
+	}
+}
+
+static void bench_datain_levels_stuffed(long n)
+{
+	feed(&levelsFrame, n);
+}
+
+static void bench_datain_encrypted_poll(long n)
+{
+	feed(&encryptedPollFrame, n);
+}
+
+static void bench_encrypt_packet(long n)
+{
+	SSP_COMMAND cmd;
+	unsigned char out[64];
+	unsigned char length, outLength;
+	long i;
+
+	setup_command(&cmd, 1);
+	/* payout command: value, country and option */
+	cmd.CommandData[0] = SSP_CMD_PAYOUT_VALUE;
+	memcpy(&cmd.CommandData[1], "\x96\x00\x00\x00" "EUR" "\x58", 8);
+	for (i = 0; i < n; i++) {
+		length = 9;
+		EncryptSSPPacket(BENCH_ADDRESS, cmd.CommandData, out, &length, &outLength,
+				 (unsigned long long *) &cmd.Key);
+		sink += out[1];
+	}
+}
+
+static void bench_decrypt_packet(long n)
+{
+	SSP_FULL_KEY key = { BENCH_FIXED_KEY, BENCH_ENCRYPT_KEY };
+	unsigned char out[32];
+	unsigned char length;
+	long i;
+
+	for (i = 0; i < n; i++) {
+		length = encryptedBlockLength;
+		DecryptSSPPacket(encryptedBlock, out, &length, &length, (unsigned long long *) &key);
+		sink += out[0];
+	}
+}
+
+static void bench_ssp6_poll_decode(long n)
+{
+	SSP_COMMAND cmd;
+	SSP_POLL_DATA6 poll;
+	long i;
+
+	setup_command(&cmd, 0);
+	for (i = 0; i < n; i++) {
+		ssp6_poll(&cmd, &poll);
+		sink += poll.event_count;
+	}
+}
+
+static void bench_generate_prime(long n)
+{
+	long i;
+
+	for (i = 0; i < n; i++)
+		sink += GeneratePrime();
+}
+
+static const struct {
+	const char *name;
+	BENCH_FN fn;
+} benchmarks[] = {
+	{ "crc_64", bench_crc_64 },
+	{ "compile_poll", bench_compile_poll },
+	{ "compile_poll_encrypted", bench_compile_poll_encrypted },
+	{ "datain_levels_stuffed", bench_datain_levels_stuffed },
+	{ "datain_encrypted_poll", bench_datain_encrypted_poll },
+	{ "encrypt_packet", bench_encrypt_packet },
+	{ "decrypt_packet", bench_decrypt_packet },
+	{ "ssp6_poll_decode", bench_ssp6_poll_decode },
+	{ "generate_prime", bench_generate_prime },
+};
+
+/* runs the benchmark with growing iteration counts until it took at least minNs */
+static void run(const char *name, BENCH_FN fn, long long minNs)
+{
+	long n = 1;
+	long long ns;
+	unsigned long allocs;
+
+	for (;;) {
+		allocs = allocations;
+		ns = now_ns();
+		fn(n);
+		ns = now_ns() - ns;
+		allocs = allocations - allocs;
+
+		if (ns >= minNs || n >= (1L << 30))
+			break;
+		/* aim a bit above minNs, but grow by 100x at most */
+		if (ns <= 0 || minNs * 12 / 10 / ns > 100)
+			n *= 100;
+		else
+			n = n * (minNs * 12 / 10) / ns + 1;
+	}
+
+	printf("%-28s %12ld %12.1f %10.2f\n", name, n, (double) ns / n, (double) allocs / n);
+}
+
+int main(int argc, char *argv[])
+{
+	long long minNs = 200000000LL;
+	const char *filter = NULL;
+	unsigned int i;
+
+	for (i = 1; i < (unsigned int) argc; i++) {
+		if (strcmp(argv[i], "-t") == 0 && i + 1 < (unsigned int) argc)
+			minNs = atoll(argv[++i]) * 1000000LL;
+		else
+			filter = argv[i];
+	}
+
+	bench_setup();
+
+	printf("aes: %s\n", aes_implementation_name());
+	printf("%-28s %12s %12s %10s\n", "benchmark", "iterations", "ns/op", "allocs/op");
+	for (i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+		if (filter && strstr(benchmarks[i].name, filter) == NULL)
+			continue;
+		run(benchmarks[i].name, benchmarks[i].fn, minNs);
+	}
+
+	return (int) (sink & 0);
+}
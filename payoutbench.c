@@ -0,0 +1,649 @@
+/** \file payoutbench.c
+ *  \brief End-to-end benchmark for payoutd: replays recorded requests via redis and measures the responses.
+ *
+ *  In a nutshell:
+ *  - the recorded requests are read from a JSON lines file (-f, default bench/requests.jsonl), one request per line:
+ *    ``{"topic":"hopper-request","message":{"cmd":"get-all-levels"}}``
+ *  - the requests are published round robin to their topics, each with a unique msgId which payoutd returns as correlId
+ *  - the responses are matched by correlId on the 'hopper-response' and 'validator-response' topics
+ *  - with -T the prefix payoutd was started with is put in front of the request and response topics
+ *  - with -s the requests are added with XADD to the request streams and the responses are read with XREAD from the
+ *    response streams, for a payoutd started with -s
+ *  - with -c the given number of requests is kept outstanding (closed loop), with -r requests are sent at a fixed rate
+ *    per second no matter how fast payoutd answers (open loop)
+ *  - a request without response after -t ms counts as timeout
+ *  - the result is printed as one JSON object to stdout: throughput plus count, errors, busy replies, timeouts and the
+ *    p50/p99/p999/max latency (in us) per command, a short summary goes to stderr
+ *  - main() function supports arguments -h (redis hostname), -p (redis port), -f, -n (number of requests), -c, -r, -t,
+ *    -T (topic prefix), -s (redis streams) and -?
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <jansson.h>
+
+#include <hiredis/hiredis.h>
+#include <hiredis/async.h>
+#include <hiredis/adapters/libevent.h>
+
+/** \brief Maximum number of different commands in the request file */
+#define BENCH_MAX_COMMANDS 64
+/** \brief Size of a topic name including the prefix set with -T */
+#define BENCH_TOPIC_SIZE 96
+/** \brief Maximum number of responses read with a single XREAD (-s) */
+#define BENCH_STREAM_COUNT 100
+/** \brief Time in ms a XREAD waits for new responses (-s) */
+#define BENCH_STREAM_BLOCK 1000
+
+/** \brief State of a request which was not sent yet */
+#define BENCH_PENDING 0
+/** \brief State of a request which waits for its response */
+#define BENCH_SENT 1
+/** \brief State of a request which got a response without error */
+#define BENCH_OK 2
+/** \brief State of a request which got an error response */
+#define BENCH_ERROR 3
+/** \brief State of a request which was answered with "busy" (queue full) */
+#define BENCH_BUSY 4
+/** \brief State of a request which got no response in time */
+#define BENCH_TIMEOUT 5
+
+/**
+ * \brief A recorded request (one line of the request file).
+ */
+struct m_benchLine {
+	int command; // index in m_bench.command
+	char *topic; // including the prefix
+	char *body; // the serialized message without the opening '{'
+	size_t bodyLength;
+	int empty; // the message has no properties, so no ',' after the msgId
+};
+
+/**
+ * \brief A command for which the statistics are kept (topic + cmd).
+ */
+struct m_benchCommand {
+	char *topic;
+	char *cmd;
+};
+
+/**
+ * \brief One replayed request.
+ */
+struct m_benchRequest {
+	long long sent; // us
+	long long latency; // us
+	unsigned short command;
+	unsigned char state;
+};
+
+/**
+ * \brief Configuration and state of the benchmark.
+ */
+struct m_bench {
+	const char *redisHost;
+	int redisPort;
+	const char *file;
+	long count;
+	int concurrency;
+	long rate; // requests per second, 0 = closed loop with concurrency
+	long timeout; // ms
+	const char *prefix; // topic prefix (-T)
+	int streams; // !=0 to use the redis streams (-s)
+
+	char responseTopic[2][BENCH_TOPIC_SIZE];
+	char nextId[2][48]; // last entry read from the response streams (-s)
+	struct m_benchLine *lines;
+	int lineCount;
+	struct m_benchCommand command[BENCH_MAX_COMMANDS];
+	int commandCount;
+
+	struct m_benchRequest *requests;
+	long sent;
+	long finished;
+	long oldest; // first request which may still wait for its response
+	long outstanding;
+	long unmatched; // responses which don't belong to this run
+	long long started;
+	long long stopped;
+	int subscribed;
+	int pid;
+
+	struct event_base *eventBase;
+	struct event evTick;
+	redisAsyncContext *publishCtx;
+	redisAsyncContext *subscribeCtx; // reads the response streams with -s
+};
+
+/**
+ * \brief Returns the microseconds of the monotonic clock.
+ */
+long long benchClockUs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * \brief Returns the index of the command (topic + cmd), a new one is added if it's not known yet.
+ */
+int benchCommand(struct m_bench *bench, const char *topic, const char *cmd) {
+	for (int i = 0; i < bench->commandCount; i++) {
+		if (strcmp(bench->command[i].topic, topic) == 0 && strcmp(bench->command[i].cmd, cmd) == 0) {
+			return i;
+		}
+	}
+	if (bench->commandCount == BENCH_MAX_COMMANDS) {
+		return -1;
+	}
+	bench->command[bench->commandCount].topic = strdup(topic);
+	bench->command[bench->commandCount].cmd = strdup(cmd);
+	return bench->commandCount++;
+}
+
+/**
+ * \brief Reads the recorded requests from the file.
+ */
+int benchLoad(struct m_bench *bench) {
+	FILE *f = fopen(bench->file, "r");
+	if (f == NULL) {
+		fprintf(stderr, "opening %s failed: %s\n", bench->file, strerror(errno));
+		return 1;
+	}
+
+	char *line = NULL;
+	size_t size = 0;
+	int number = 0;
+	int capacity = 0;
+
+	while (getline(&line, &size, f) != -1) {
+		number++;
+		if (line[strspn(line, " \t\r\n")] == '\0') {
+			continue;
+		}
+
+		json_error_t error;
+		json_t *jLine = json_loads(line, 0, &error);
+		json_t *jTopic = json_object_get(jLine, "topic");
+		json_t *jMessage = json_object_get(jLine, "message");
+		json_t *jCmd = json_object_get(jMessage, "cmd");
+
+		if (! json_is_string(jTopic) || ! json_is_object(jMessage) || ! json_is_string(jCmd)) {
+			fprintf(stderr, "%s:%d: expected {\"topic\":\"...\",\"message\":{\"cmd\":\"...\"}}\n", bench->file, number);
+			json_decref(jLine);
+			continue;
+		}
+
+		int command = benchCommand(bench, json_string_value(jTopic), json_string_value(jCmd));
+		if (command < 0) {
+			fprintf(stderr, "%s:%d: too many different commands\n", bench->file, number);
+			json_decref(jLine);
+			continue;
+		}
+
+		if (bench->lineCount == capacity) {
+			capacity = capacity ? capacity * 2 : 16;
+			bench->lines = realloc(bench->lines, capacity * sizeof(struct m_benchLine));
+		}
+
+		struct m_benchLine *l = &bench->lines[bench->lineCount++];
+		char *message = json_dumps(jMessage, JSON_COMPACT);
+		l->command = command;
+		if (asprintf(&l->topic, "%s%s", bench->prefix, json_string_value(jTopic)) < 0) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+		l->body = strdup(message + 1);
+		l->bodyLength = strlen(l->body);
+		l->empty = l->body[0] == '}';
+		free(message);
+		json_decref(jLine);
+	}
+
+	free(line);
+	fclose(f);
+
+	if (bench->lineCount == 0) {
+		fprintf(stderr, "no requests found in %s\n", bench->file);
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * \brief Publishes the next request.
+ */
+void benchSend(struct m_bench *bench) {
+	long i = bench->sent++;
+	struct m_benchLine *l = &bench->lines[i % bench->lineCount];
+	struct m_benchRequest *request = &bench->requests[i];
+	char message[4096];
+
+	int n = snprintf(message, sizeof(message), "{\"msgId\":\"bench-%d-%ld\"%s%.*s", bench->pid, i,
+			l->empty ? "" : ",", (int) l->bodyLength, l->body);
+	if (n >= (int) sizeof(message)) {
+		n = sizeof(message) - 1;
+	}
+
+	request->command = l->command;
+	request->state = BENCH_SENT;
+	request->sent = benchClockUs();
+	bench->outstanding++;
+
+	if (bench->streams) {
+		redisAsyncCommand(bench->publishCtx, NULL, NULL, "XADD %s * message %b", l->topic, message, (size_t) n);
+	} else {
+		redisAsyncCommand(bench->publishCtx, NULL, NULL, "PUBLISH %s %b", l->topic, message, (size_t) n);
+	}
+}
+
+/**
+ * \brief Marks the request as finished, stops the event loop once all are.
+ */
+void benchFinish(struct m_bench *bench, struct m_benchRequest *request, unsigned char state, long long now) {
+	request->state = state;
+	request->latency = now - request->sent;
+	bench->outstanding--;
+	bench->finished++;
+
+	if (bench->finished == bench->count) {
+		bench->stopped = now;
+		event_base_loopbreak(bench->eventBase);
+	}
+}
+
+/**
+ * \brief Sends as many requests as the concurrency or rate allows right now.
+ */
+void benchFill(struct m_bench *bench, long long now) {
+	long due = bench->count;
+
+	if (bench->rate > 0) {
+		due = (long) ((now - bench->started) * bench->rate / 1000000) + 1;
+		if (due > bench->count) {
+			due = bench->count;
+		}
+	}
+
+	while (bench->sent < due && (bench->rate > 0 || bench->outstanding < bench->concurrency)) {
+		benchSend(bench);
+	}
+}
+
+/**
+ * \brief Timer callback, expires old requests and keeps the rate up.
+ */
+void cbOnTick(int fd, short event, void *privdata) {
+	struct m_bench *bench = privdata;
+	long long now = benchClockUs();
+
+	// the requests are sent in order, so the oldest waiting one expires first
+	while (bench->oldest < bench->sent) {
+		struct m_benchRequest *request = &bench->requests[bench->oldest];
+		if (request->state == BENCH_SENT) {
+			if (now - request->sent < bench->timeout * 1000) {
+				break;
+			}
+			benchFinish(bench, request, BENCH_TIMEOUT, now);
+		}
+		bench->oldest++;
+	}
+
+	if (bench->started && bench->finished < bench->count) {
+		benchFill(bench, now);
+	}
+}
+
+/**
+ * \brief Matches a response with its request by the correlId.
+ */
+void benchResponse(struct m_bench *bench, const char *message, size_t length, long long now) {
+	json_error_t error;
+	json_t *json = json_loadb(message, length, 0, &error);
+	json_t *jCorrelId = json_object_get(json, "correlId");
+	int pid;
+	long i;
+
+	if (! json_is_string(jCorrelId) || sscanf(json_string_value(jCorrelId), "bench-%d-%ld", &pid, &i) != 2
+			|| pid != bench->pid || i < 0 || i >= bench->sent || bench->requests[i].state != BENCH_SENT) {
+		bench->unmatched++;
+		json_decref(json);
+		return;
+	}
+
+	json_t *jError = json_object_get(json, "error");
+	unsigned char state = BENCH_OK;
+	if (json_is_string(jError)) {
+		state = strcmp(json_string_value(jError), "busy") == 0 ? BENCH_BUSY : BENCH_ERROR;
+	}
+	json_decref(json);
+
+	benchFinish(bench, &bench->requests[i], state, now);
+
+	if (bench->finished < bench->count) {
+		benchFill(bench, now);
+	}
+}
+
+/**
+ * \brief Callback for the messages on the response topics.
+ */
+void cbOnResponseMessage(redisAsyncContext *c, void *r, void *privdata) {
+	struct m_bench *bench = privdata;
+	redisReply *reply = r;
+
+	if (reply == NULL || reply->type != REDIS_REPLY_ARRAY || reply->elements != 3) {
+		return;
+	}
+
+	if (strcmp(reply->element[0]->str, "subscribe") == 0) {
+		// start once both response topics are subscribed, otherwise the first responses could be missed
+		if (++bench->subscribed == 2) {
+			bench->started = benchClockUs();
+			benchFill(bench, bench->started);
+		}
+		return;
+	}
+
+	benchResponse(bench, reply->element[2]->str, reply->element[2]->len, benchClockUs());
+}
+
+void cbOnStreamResponses(redisAsyncContext *c, void *r, void *privdata);
+
+/**
+ * \brief Reads the next responses from the response streams (-s).
+ */
+void benchReadStreams(struct m_bench *bench) {
+	redisAsyncCommand(bench->subscribeCtx, cbOnStreamResponses, bench, "XREAD COUNT %d BLOCK %d STREAMS %s %s %s %s",
+			BENCH_STREAM_COUNT, BENCH_STREAM_BLOCK, bench->responseTopic[0], bench->responseTopic[1],
+			bench->nextId[0], bench->nextId[1]);
+}
+
+/**
+ * \brief Callback for the reply to XREAD, matches the responses and reads the next ones (-s).
+ */
+void cbOnStreamResponses(redisAsyncContext *c, void *r, void *privdata) {
+	struct m_bench *bench = privdata;
+	redisReply *reply = r;
+
+	if (reply == NULL) {
+		return;
+	}
+
+	if (reply->type == REDIS_REPLY_ERROR) {
+		fprintf(stderr, "reading the response streams failed: %s\n", reply->str);
+		exit(1);
+	}
+
+	// nil if BLOCK expired, otherwise [[stream, [[id, [field, value, ...]], ...]], ...]
+	if (reply->type == REDIS_REPLY_ARRAY) {
+		long long now = benchClockUs();
+
+		for (size_t s = 0; s < reply->elements; s++) {
+			redisReply *stream = reply->element[s];
+			if (stream->type != REDIS_REPLY_ARRAY || stream->elements != 2) {
+				continue;
+			}
+			int index = strcmp(stream->element[0]->str, bench->responseTopic[0]) == 0 ? 0 : 1;
+
+			for (size_t e = 0; e < stream->element[1]->elements; e++) {
+				redisReply *entry = stream->element[1]->element[e];
+				if (entry->type != REDIS_REPLY_ARRAY || entry->elements != 2) {
+					continue;
+				}
+				snprintf(bench->nextId[index], sizeof(bench->nextId[index]), "%s", entry->element[0]->str);
+
+				redisReply *fields = entry->element[1];
+				for (size_t f = 0; f + 1 < fields->elements; f += 2) {
+					if (strcmp(fields->element[f]->str, "message") == 0) {
+						benchResponse(bench, fields->element[f + 1]->str, fields->element[f + 1]->len, now);
+					}
+				}
+			}
+		}
+	}
+
+	if (bench->finished < bench->count) {
+		benchReadStreams(bench);
+	}
+}
+
+/**
+ * \brief Callback for the reply to TIME, reads the response streams from then on and starts (-s).
+ * \details "$" as the id would miss the responses added before the XREAD gets to redis, the time of
+ * redis itself is the id of the first entry added afterwards. One ms is taken off, responses of an
+ * earlier run only count as unmatched.
+ */
+void cbOnStreamTime(redisAsyncContext *c, void *r, void *privdata) {
+	struct m_bench *bench = privdata;
+	redisReply *reply = r;
+
+	if (reply == NULL || reply->type != REDIS_REPLY_ARRAY || reply->elements != 2) {
+		fprintf(stderr, "reading the time of redis failed\n");
+		exit(1);
+	}
+
+	long long ms = atoll(reply->element[0]->str) * 1000 + atoll(reply->element[1]->str) / 1000 - 1;
+	snprintf(bench->nextId[0], sizeof(bench->nextId[0]), "%lld-0", ms);
+	snprintf(bench->nextId[1], sizeof(bench->nextId[1]), "%lld-0", ms);
+
+	benchReadStreams(bench);
+
+	bench->started = benchClockUs();
+	benchFill(bench, bench->started);
+}
+
+/**
+ * \brief Callback function triggered by the redis client on connecting with the "subscribe" context.
+ */
+void cbOnConnectSubscribeContext(const redisAsyncContext *c, int status) {
+	if (status != REDIS_OK) {
+		fprintf(stderr, "connecting to redis failed: %s\n", c->errstr);
+		exit(1);
+	}
+
+	redisAsyncContext *cNotConst = (redisAsyncContext*) c; // get rids of discarding qualifier "const" warning
+	struct m_bench *bench = c->data;
+
+	if (bench->streams) {
+		redisAsyncCommand(cNotConst, cbOnStreamTime, bench, "TIME");
+		return;
+	}
+
+	redisAsyncCommand(cNotConst, cbOnResponseMessage, bench, "SUBSCRIBE %s", bench->responseTopic[0]);
+	redisAsyncCommand(cNotConst, cbOnResponseMessage, bench, "SUBSCRIBE %s", bench->responseTopic[1]);
+}
+
+/**
+ * \brief Compares two latencies (for qsort).
+ */
+int compareLatency(const void *a, const void *b) {
+	long long x = *(const long long *) a;
+	long long y = *(const long long *) b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * \brief Returns the nearest rank percentile (given in 1/1000) of the sorted latencies.
+ */
+long long benchPercentile(const long long *sorted, long n, long permille) {
+	if (n == 0) {
+		return 0;
+	}
+	long rank = (permille * n + 999) / 1000;
+	return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+/**
+ * \brief Prints the results as JSON to stdout and a summary to stderr.
+ */
+void benchReport(struct m_bench *bench) {
+	long long *latency = malloc(bench->count * sizeof(long long));
+	long long duration = (bench->stopped ? bench->stopped : benchClockUs()) - bench->started;
+	long totals[BENCH_TIMEOUT + 1] = { 0 };
+
+	for (long i = 0; i < bench->sent; i++) {
+		totals[bench->requests[i].state]++;
+	}
+
+	printf("{\"requests\":%ld,\"ok\":%ld,\"errors\":%ld,\"busy\":%ld,\"timeouts\":%ld,\"unmatched\":%ld,"
+			"\"concurrency\":%d,\"rate\":%ld,\"durationUs\":%lld,\"throughput\":%.1f,\"commands\":[",
+			bench->sent, totals[BENCH_OK], totals[BENCH_ERROR], totals[BENCH_BUSY], totals[BENCH_TIMEOUT],
+			bench->unmatched, bench->concurrency, bench->rate, duration,
+			duration > 0 ? bench->finished * 1e6 / duration : 0.0);
+
+	fprintf(stderr, "%ld requests in %.3fs (%.1f/s), %ld errors, %ld busy, %ld timeouts\n", bench->sent,
+			duration / 1e6, duration > 0 ? bench->finished * 1e6 / duration : 0.0, totals[BENCH_ERROR],
+			totals[BENCH_BUSY], totals[BENCH_TIMEOUT]);
+	fprintf(stderr, "%-18s %-32s %8s %8s %10s %10s %10s %10s\n", "topic", "cmd", "count", "errors", "p50 us",
+			"p99 us", "p999 us", "max us");
+
+	for (int c = 0; c < bench->commandCount; c++) {
+		long n = 0;
+		long counts[BENCH_TIMEOUT + 1] = { 0 };
+
+		// latencies of the answered requests only, timeouts would just show the timeout
+		for (long i = 0; i < bench->sent; i++) {
+			struct m_benchRequest *request = &bench->requests[i];
+			if (request->command != c) {
+				continue;
+			}
+			counts[request->state]++;
+			if (request->state != BENCH_TIMEOUT && request->state != BENCH_SENT) {
+				latency[n++] = request->latency;
+			}
+		}
+		qsort(latency, n, sizeof(long long), compareLatency);
+
+		long long p50 = benchPercentile(latency, n, 500);
+		long long p99 = benchPercentile(latency, n, 990);
+		long long p999 = benchPercentile(latency, n, 999);
+		long long max = n > 0 ? latency[n - 1] : 0;
+
+		printf("%s{\"topic\":\"%s\",\"cmd\":\"%s\",\"count\":%ld,\"errors\":%ld,\"busy\":%ld,\"timeouts\":%ld,"
+				"\"p50Us\":%lld,\"p99Us\":%lld,\"p999Us\":%lld,\"maxUs\":%lld}", c > 0 ? "," : "",
+				bench->command[c].topic, bench->command[c].cmd, n + counts[BENCH_TIMEOUT] + counts[BENCH_SENT],
+				counts[BENCH_ERROR], counts[BENCH_BUSY], counts[BENCH_TIMEOUT], p50, p99, p999, max);
+		fprintf(stderr, "%-18s %-32s %8ld %8ld %10lld %10lld %10lld %10lld\n", bench->command[c].topic,
+				bench->command[c].cmd, n + counts[BENCH_TIMEOUT] + counts[BENCH_SENT],
+				counts[BENCH_ERROR] + counts[BENCH_BUSY] + counts[BENCH_TIMEOUT], p50, p99, p999, max);
+	}
+
+	printf("]}\n");
+	free(latency);
+}
+
+/**
+ * \brief Parses the command line arguments.
+ */
+int benchParseCmdLine(int argc, char *argv[], struct m_bench *bench) {
+	int opt;
+	while ((opt = getopt(argc, argv, "h:p:f:n:c:r:t:T:s")) != -1) {
+		switch (opt) {
+		case 'h':
+			bench->redisHost = optarg;
+			break;
+		case 'p':
+			bench->redisPort = atoi(optarg);
+			break;
+		case 'f':
+			bench->file = optarg;
+			break;
+		case 'n':
+			bench->count = atol(optarg);
+			break;
+		case 'c':
+			bench->concurrency = atoi(optarg);
+			break;
+		case 'r':
+			bench->rate = atol(optarg);
+			break;
+		case 't':
+			bench->timeout = atol(optarg);
+			break;
+		case 'T':
+			bench->prefix = optarg;
+			break;
+		case 's':
+			bench->streams = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-h redis host] [-p redis port] [-f request file] [-n requests] "
+					"[-c concurrency] [-r requests/s] [-t timeout ms] [-T topic prefix] [-s]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (bench->count <= 0 || bench->concurrency <= 0 || bench->rate < 0 || bench->timeout <= 0) {
+		fprintf(stderr, "-n, -c and -t must be positive and -r must not be negative\n");
+		return 1;
+	}
+	if (snprintf(bench->responseTopic[0], BENCH_TOPIC_SIZE, "%shopper-response", bench->prefix) >= BENCH_TOPIC_SIZE
+			|| snprintf(bench->responseTopic[1], BENCH_TOPIC_SIZE, "%svalidator-response", bench->prefix) >= BENCH_TOPIC_SIZE) {
+		fprintf(stderr, "topic prefix too long\n");
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	struct m_bench bench;
+
+	memset(&bench, 0, sizeof(bench));
+	bench.redisHost = "127.0.0.1";
+	bench.redisPort = 6379;
+	bench.file = "bench/requests.jsonl";
+	bench.count = 1000;
+	bench.concurrency = 1;
+	bench.timeout = 5000;
+	bench.prefix = "";
+	bench.pid = getpid();
+
+	if (benchParseCmdLine(argc, argv, &bench) || benchLoad(&bench)) {
+		return 1;
+	}
+
+	bench.requests = calloc(bench.count, sizeof(struct m_benchRequest));
+	bench.eventBase = event_base_new();
+
+	bench.publishCtx = redisAsyncConnect(bench.redisHost, bench.redisPort);
+	bench.subscribeCtx = redisAsyncConnect(bench.redisHost, bench.redisPort);
+	if (bench.publishCtx == NULL || bench.publishCtx->err || bench.subscribeCtx == NULL || bench.subscribeCtx->err) {
+		fprintf(stderr, "could not connect to redis at %s:%d\n", bench.redisHost, bench.redisPort);
+		return 1;
+	}
+	bench.subscribeCtx->data = &bench;
+
+	redisLibeventAttach(bench.publishCtx, bench.eventBase);
+	redisLibeventAttach(bench.subscribeCtx, bench.eventBase);
+	redisAsyncSetConnectCallback(bench.subscribeCtx, cbOnConnectSubscribeContext);
+
+	// expires the requests and sends them in rate mode
+	{
+		struct timeval interval;
+		interval.tv_sec = 0;
+		interval.tv_usec = 1000;
+
+		event_set(&bench.evTick, 0, EV_PERSIST, cbOnTick, &bench);
+		event_base_set(bench.eventBase, &bench.evTick);
+		evtimer_add(&bench.evTick, &interval);
+	}
+
+	event_base_dispatch(bench.eventBase);
+
+	benchReport(&bench);
+
+	redisAsyncFree(bench.publishCtx);
+	redisAsyncFree(bench.subscribeCtx);
+	event_base_free(bench.eventBase);
+	free(bench.requests);
+
+	return 0;
+}
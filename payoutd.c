@@ -2,14 +2,34 @@
  *  \brief Main source file for the payoutd daemon.
  *
  *  In a nutshell:
- *  - we are single threaded
- *  - libevent is used to trigger 2 periodic events ("poll event" and "check quit") which poll the hardware and check if we should quit
- *  - main() function supports arguments -h (redis hostname), -p (redis port), -d (serial device name) and -?
+ *  - we are single threaded, unless -t is used: then a dedicated hardware thread owns the serial port (see hwThreadStart())
+ *  - libevent is used to trigger periodic events ("poll event" per device and "check quit") which poll the hardware and check if we should quit
+ *  - each device is polled fast while it is busy and backs off to a slow idle rate otherwise (see pollAdapt())
+ *  - main() function supports arguments -h (redis hostname), -p (redis port), -d (serial device name), -a (async transport), -t (hardware thread),
+ *    -g/-G (frame gap of the hopper/validator in ms), -P (fast,idle,backoff poll rates), -q (queue size per device), -m (metrics interval in s, 0 disables),
+ *    -s (redis streams transport, max. requests per read), -j (transaction journal file), -S (state file for warm starts),
+ *    -F (ssp frame trace file), -T (topic prefix), -E (one event message per poll), -B (MessagePack events on <device>-event.bin) and -?
+ *  - with -E/-B the events of a poll cycle are collected and published as one message (see eventsEnd())
+ *  - messages are logged with logMessage(): rate limited per call site, formatted into a lock-free ring and
+ *    written by a log thread (see logWrite()), the level can be changed with the "set-log-level" command
+ *  - with -a both devices are initialized at once by tasks (see taskDeviceStartup()), with -S the configuration
+ *    is only sent to a device if it changed since the last start (see deviceConfigure())
+ *  - one payoutd drives one cash unit (one serial bus), several units on a host are run as one payoutd each
+ *    with its own -d and -T (see struct m_topics)
+ *  - with -j every money moving operation and credit is appended to a memory mapped journal (see journalAppend()),
+ *    operations left open by a crash are reported with an "interrupted" event on startup (see journalRecover())
+ *  - with -F every ssp frame is recorded in a memory mapped ring by libitlssp (see SSPTraceOpen()), payouttrace analyzes it
+ *  - requests are queued per device and processed by priority, a full queue is answered with "busy" (see queuePush())
+ *  - instead of waiting a fixed time before each request or poll only the gap between two frames to the same device is enforced (see pacingWait())
+ *  - with -a the serial port is registered on the event base and command handlers and polls are run as
+ *    cooperative tasks (see taskSpawn()) which are suspended while the hardware takes its time to answer
  *  - libevent calls cbOnPollEvent() for the "poll" event
  *  - libevent calls cbOnCheckQuitEvent() for the "check quit" event
  *  - redis is used in conjunction with libevent
  *  - if a message is detected in 'validator-request' or 'hopper-request' the cbOnRequestMessage() is called
- *  - the cbOnRequestMessage() checks if the command is known and if its known dispatches the call to a handle<Cmd> function
+ *  - with -s the requests are read in batches from the streams of the same name as member of a consumer group instead,
+ *    entries are acknowledged once answered and events/responses are written with XADD (see cbOnStreamMessages())
+ *  - processRequest() looks up the command in the commandHandlers table and if its known dispatches the call to a handle<Cmd> function
  *  - a command handler interprets the provided JSON message, issues commands to the money hardware and publishes a JSON response
  *  - the naming convention used most of the time is like: the JSON command is 'configure-bezel' so the handler function is called handleConfigureBezel()
  *  - handleConfigureBezel() itself calls mc_ssp_configure_bezel() which sends the SSP command to the hardware
@@ -24,20 +44,33 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <ucontext.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <time.h>
 
 // lowlevel library provided by the cash hardware vendor
 // innovative technologies (http://innovative-technology.com).
 // ssp manual available at http://innovative-technology.com/images/pdocuments/manuals/SSP_Manual.pdf
 #include "libitlssp/ssp_commands.h"
 
+// layout of the transaction journal, shared with the payoutjournal reader
+#include "payoutjournal.h"
+
 // json library
 #include <jansson.h>
 
@@ -52,17 +85,396 @@
 // libuuid is used to generate msgIds for the responses
 #include <uuid/uuid.h>
 
-// https://sites.google.com/site/rickcreamer/Home/cc/c-implementation-of-stringbuffer-functionality
-#include "StringBuffer.h"
-#include "StringBuffer.c"
-
 /** \brief redis context used for publishing messages */
 redisAsyncContext *redisPublishCtx = NULL;
 
 /** \brief redis context used for subscribing to topics */
 redisAsyncContext *redisSubscribeCtx = NULL;
 
+/** \brief redis context used for reading the request streams, NULL unless started with -s */
+redisAsyncContext *redisStreamCtx = NULL;
+
+/** \brief the hardware thread, NULL unless started with -t */
+struct m_hwthread *hwThread = NULL;
+
+/** \brief Number of messages of the hardware thread dropped because the publication ring was full or memory ran out */
+atomic_ulong droppedPublications;
+
+/** \brief !=0 only on the hardware thread itself */
+_Thread_local int onHardwareThread = 0;
+
+/**
+ * \brief Collects the PUBLISH commands as ready made RESP frames until they are flushed
+ * with publishFlush(), all memory is reused.
+ */
+struct m_publisher {
+	/** \brief The RESP frames, back to back */
+	char *buffer;
+	/** \brief Number of bytes used in buffer */
+	size_t length;
+	/** \brief Number of bytes allocated for buffer */
+	size_t capacity;
+	/** \brief Length of each frame in buffer */
+	size_t *frames;
+	/** \brief Number of frames in buffer */
+	unsigned int frameCount;
+	/** \brief Number of frame lengths allocated for frames */
+	unsigned int frameCapacity;
+	/** \brief Buffer for formatting a single message */
+	char *scratch;
+	/** \brief Number of bytes allocated for scratch */
+	size_t scratchCapacity;
+	/** \brief If !=0 a flush is already scheduled on the event base */
+	int flushScheduled;
+	/** \brief The event base for scheduling flushes */
+	struct event_base *eventBase;
+	/** \brief Approximate maximum length of the streams written with XADD, 0 to use PUBLISH instead */
+	long streamMaxLen;
+};
+
+/** \brief The publisher, only used on the redis thread */
+struct m_publisher publisher;
+
+/** \brief Size of a topic name including the prefix set with -T */
+#define TOPIC_SIZE 96
+
+/**
+ * \brief Names of the topics (and streams with -s) we use, all start with the prefix set with -T.
+ * \details The prefix allows to run one payoutd per cash unit against the same redis, ex.
+ * "kiosk1." for "kiosk1.hopper-request" and so on.
+ */
+struct m_topics {
+	/** \brief "payout-event" */
+	char payoutEvent[TOPIC_SIZE];
+	/** \brief "payout-metrics" */
+	char payoutMetrics[TOPIC_SIZE];
+	/** \brief "metacash" */
+	char metacash[TOPIC_SIZE];
+	/** \brief "hopper-request" */
+	char hopperRequest[TOPIC_SIZE];
+	/** \brief "hopper-response" */
+	char hopperResponse[TOPIC_SIZE];
+	/** \brief "hopper-event" */
+	char hopperEvent[TOPIC_SIZE];
+	/** \brief "hopper-event.bin" */
+	char hopperEventBin[TOPIC_SIZE];
+	/** \brief "validator-request" */
+	char validatorRequest[TOPIC_SIZE];
+	/** \brief "validator-response" */
+	char validatorResponse[TOPIC_SIZE];
+	/** \brief "validator-event" */
+	char validatorEvent[TOPIC_SIZE];
+	/** \brief "validator-event.bin" */
+	char validatorEventBin[TOPIC_SIZE];
+};
+
+/** \brief The topics, set up by topicsInit() */
+struct m_topics topics;
+
+/** \brief Interval in ms in which the journal is written to disk */
+#define JOURNAL_COMMIT_INTERVAL 100
+/** \brief Number of uncommitted records which trigger writing the journal to disk right away */
+#define JOURNAL_COMMIT_RECORDS 32
+
+/**
+ * \brief State of the memory mapped transaction journal (only used with -j), see payoutjournal.h.
+ * \details Records are appended to the mapping by whichever thread handles the money, they
+ * are written to disk with msync() in groups: every JOURNAL_COMMIT_INTERVAL ms, once
+ * JOURNAL_COMMIT_RECORDS are waiting and right away for the start of an operation.
+ */
+struct m_journal {
+	/** \brief The journal file, NULL if the journal is disabled */
+	char *path;
+	/** \brief The open journal file */
+	int fd;
+	/** \brief The mapping of the whole journal file */
+	void *map;
+	/** \brief Size of the journal file and the mapping */
+	size_t size;
+	/** \brief The record slots in the mapping */
+	struct m_journalRecord *records;
+	/** \brief Index of the next free record slot */
+	uint64_t next;
+	/** \brief Records before this index are on disk */
+	uint64_t committed;
+	/** \brief Sequence of the last record */
+	uint64_t sequence;
+	/** \brief Operations per device which have been started but not finished according to the journal, kept up to date by every append */
+	struct m_journalRecord open[2];
+	/** \brief Protects everything above, the records are appended by the redis and the hardware thread */
+	pthread_mutex_t lock;
+	/** \brief event struct for the periodic commit */
+	struct event evCommit;
+};
+
+/** \brief The journal, disabled unless started with -j */
+struct m_journal journal = { .path = NULL, .fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER };
+
 struct m_metacash;
+struct m_task;
+struct m_commandHandler;
+
+/**
+ * \brief Simple FIFO of tasks waiting for something.
+ */
+struct m_waitqueue {
+	/** \brief First task in the queue (next one to wake up) */
+	struct m_task *head;
+	/** \brief Last task in the queue */
+	struct m_task *tail;
+};
+
+/**
+ * \brief Lock which can be held by a single task. Used for the serial bus and
+ * for each device. Ownership is handed over to the waiting tasks in FIFO order.
+ */
+struct m_lock {
+	/** \brief The task currently holding the lock, NULL if the lock is free */
+	struct m_task *owner;
+	/** \brief Tasks waiting for the lock */
+	struct m_waitqueue waiting;
+};
+
+/**
+ * \brief Structure which describes a cooperative task (a command handler or a poll)
+ * running on its own stack. Only used with the async transport: a task is suspended
+ * while its SSP command is on the wire and resumed by libevent when the response
+ * (or a timeout) arrived.
+ */
+struct m_task {
+	/** \brief Saved execution context of the task */
+	ucontext_t context;
+	/** \brief Stack memory of the task */
+	char *stack;
+	/** \brief The function executed by the task */
+	void (*fn) (struct m_task *task);
+	/** \brief Argument for the function */
+	void *data;
+	/** \brief Called with data once the task is gone (may be NULL) */
+	void (*disposeFn) (void *data);
+	/** \brief The metacash struct, provides the event base */
+	struct m_metacash *metacash;
+	/** \brief If !=0 the function has returned */
+	int finished;
+	/** \brief Next task in a m_waitqueue */
+	struct m_task *nextWaiting;
+	/** \brief Next task in the list of all tasks */
+	struct m_task *nextTask;
+	/** \brief The command the task is currently processing (if any), owned by the task */
+	struct m_command *command;
+	/** \brief The sub-command of a "batch" the task is currently processing (if any), never freed by the task */
+	struct m_command *subCommand;
+};
+
+/** \brief Priority class of commands which move money (processed first) */
+#define PRIORITY_MONEY 0
+/** \brief Priority class of commands which change the configuration of a device */
+#define PRIORITY_CONTROL 1
+/** \brief Priority class of commands which only query a device (processed last) */
+#define PRIORITY_DIAGNOSTICS 2
+/** \brief Number of priority classes */
+#define PRIORITY_COUNT 3
+
+/**
+ * \brief Bounded queue of the commands waiting for a device, one FIFO per priority class.
+ */
+struct m_queue {
+	/** \brief Oldest command of each priority class */
+	struct m_command *head[PRIORITY_COUNT];
+	/** \brief Newest command of each priority class */
+	struct m_command *tail[PRIORITY_COUNT];
+	/** \brief Number of commands in the queue */
+	unsigned int length;
+	/** \brief Maximum number of commands in the queue (override with -q) */
+	unsigned int capacity;
+	/** \brief Moving average of the time in ms it takes to process a command, only written by the thread owning the queue */
+	atomic_long serviceTime;
+	/** \brief Copy of length for the busy hint, which is also given by the redis thread while the hardware thread owns the queue */
+	atomic_uint depth;
+	/** \brief If !=0 a worker is processing the queue */
+	int workerActive;
+};
+
+/** \brief Default capacity of the command queue of a device */
+#define QUEUE_CAPACITY 16
+/** \brief Largest capacity accepted by -q */
+#define QUEUE_CAPACITY_MAX 4096
+
+/** \brief Maximum number of counters a GET ALL LEVELS response can carry (9 bytes each) */
+#define MAX_LEVELS 28
+/** \brief Interval in ms in which the level cache of an idle device is compared with the hardware */
+#define LEVEL_CHECK_INTERVAL 60000
+
+/**
+ * \brief The level of a single denomination as reported by GET ALL LEVELS.
+ */
+struct m_level {
+	/** \brief Value of the denomination in cents */
+	long value;
+	/** \brief Number of coins or notes of the denomination stored */
+	long level;
+	/** \brief Country code of the denomination */
+	char cc[4];
+};
+
+/**
+ * \brief Local copy of the denomination levels of a device.
+ * \details The poll events which change the levels only tell the totals, so instead of
+ * guessing the denominations the cache is marked stale by them and read again once
+ * the device is idle (see levelsAfterPoll()).
+ */
+struct m_levelCache {
+	/** \brief If !=0 the levels have been read from the device */
+	int valid;
+	/** \brief If !=0 an event or command changed the levels since they have been read */
+	int stale;
+	/** \brief Number of entries in level */
+	unsigned int count;
+	/** \brief The levels per denomination */
+	struct m_level level[MAX_LEVELS];
+	/** \brief Monotonic time in ms the levels have been read the last time */
+	long long lastCheck;
+};
+
+/** \brief Largest amount the solver plans, in units of the greatest common divisor of the denominations */
+#define SOLVER_MAX_STATES 4096
+/** \brief Maximum number of denominations the solver plans with (the levels of both devices) */
+#define SOLVER_MAX_DENOMINATIONS (2 * MAX_LEVELS)
+
+/** \brief solverPlan(): the amount can be paid, see m_solver.denomination[].count */
+#define SOLVER_OK 0
+/** \brief solverPlan(): the denominations are worth less than the amount */
+#define SOLVER_NOT_ENOUGH 1
+/** \brief solverPlan(): the amount can't be made of the denominations */
+#define SOLVER_NO_EXACT 2
+/** \brief solverPlan(): the amount is too large to be planned (SOLVER_MAX_STATES) */
+#define SOLVER_TOO_LARGE 3
+
+/**
+ * \brief A denomination the solver may use.
+ */
+struct m_solverDenomination {
+	/** \brief The device which stores the denomination */
+	struct m_device *device;
+	/** \brief Value in cents */
+	long value;
+	/** \brief Number of coins or notes available */
+	long available;
+	/** \brief Number of coins or notes planned by solverPlan() */
+	long count;
+};
+
+/**
+ * \brief Plans a payout from the cached levels with as few coins and notes as possible.
+ * \details Bounded change making: one pass per denomination over all partial amounts, the number
+ * taken per denomination is kept so the plan can be read back afterwards.
+ */
+struct m_solver {
+	/** \brief Number of entries in denomination */
+	unsigned int count;
+	/** \brief The denominations added with solverAdd() */
+	struct m_solverDenomination denomination[SOLVER_MAX_DENOMINATIONS];
+	/** \brief Fewest pieces per partial amount with the denominations so far, UINT_MAX if impossible */
+	unsigned int best[SOLVER_MAX_STATES];
+	/** \brief best[] of the current pass */
+	unsigned int next[SOLVER_MAX_STATES];
+	/** \brief Indices of the sliding window minimum */
+	unsigned int window[SOLVER_MAX_STATES];
+	/** \brief Number of pieces of each denomination taken per partial amount */
+	unsigned short take[SOLVER_MAX_DENOMINATIONS][SOLVER_MAX_STATES];
+};
+
+/** \brief The solver of the thread which talks to the hardware, see handlePayout() and handlePlanPayout() */
+static struct m_solver planSolver;
+
+/** \brief Number of buckets of a m_histogram */
+#define HISTOGRAM_BUCKETS 12
+
+/**
+ * \brief Latency histogram with fixed buckets (see histogramBounds) in ms.
+ */
+struct m_histogram {
+	/** \brief Number of recorded values */
+	unsigned long count;
+	/** \brief Sum of the recorded values */
+	unsigned long long sum;
+	/** \brief Largest recorded value */
+	unsigned long max;
+	/** \brief Number of values per bucket */
+	unsigned long bucket[HISTOGRAM_BUCKETS];
+};
+
+/**
+ * \brief Counters of one SSP command (the command byte) sent to a device.
+ */
+struct m_sspStats {
+	/** \brief Number of commands sent */
+	unsigned long sent;
+	/** \brief Number of retransmissions */
+	unsigned long retries;
+	/** \brief Number of commands without a reply */
+	unsigned long timeouts;
+	/** \brief Number of replies with a wrong checksum (or commands which could not be compiled) */
+	unsigned long packetErrors;
+	/** \brief Number of encrypted replies with a wrong packet counter */
+	unsigned long counterErrors;
+	/** \brief Number of commands which could not be written to the port */
+	unsigned long portErrors;
+	/** \brief Time from sending the command until the reply arrived */
+	struct m_histogram latency;
+};
+
+/**
+ * \brief Static information about a device which is read once and answered from memory.
+ */
+struct m_deviceInfo {
+	/** \brief If !=0 the information below has been read from the device */
+	int valid;
+	/** \brief Full firmware version as reported by the device */
+	char firmwareVersion[100];
+	/** \brief Full dataset version as reported by the device */
+	char datasetVersion[100];
+};
+
+/**
+ * \brief The configuration last applied to a device, kept in the state file (-S) so that
+ * a warm restart doesn't send it again (see deviceConfigure()).
+ */
+struct m_configState {
+	/** \brief If !=0 the configuration below has been applied successfully */
+	int valid;
+	/** \brief deviceConfigHash() of the applied configuration */
+	unsigned long long hash;
+	/** \brief Full firmware version of the device at that time */
+	char firmwareVersion[100];
+	/** \brief Full dataset version of the device at that time */
+	char datasetVersion[100];
+};
+
+/** \brief Time in ms after which an operation without a finishing event is given up */
+#define OPERATION_TIMEOUT 300000
+
+/**
+ * \brief A payout, float or empty accepted by the device which hasn't finished yet.
+ * \details Its progress and end as reported by the polls are published to the response
+ * topic with the correlId of the request which started it (see operationAfterPoll()).
+ */
+struct m_operation {
+	/** \brief If !=0 the operation is in flight */
+	int active;
+	/** \brief The command which started the operation, ex. "do-payout" */
+	char command[32];
+	/** \brief The msgId of the request which started the operation */
+	char correlId[128];
+	/** \brief The topic to which the progress is published */
+	char *responseTopic;
+	/** \brief The requested amount in cents, 0 for empty and smart-empty */
+	long requested;
+	/** \brief Monotonic time in ms the operation has been accepted */
+	long long started;
+	/** \brief Amount of the last progress message, -1 if none has been published */
+	long progress;
+};
 
 /**
  * \brief Structure which describes an actual physical ITL device
@@ -82,6 +494,234 @@ struct m_device {
 	SSP6_SETUP_REQUEST_DATA sspSetupReq;
 	/** \brief Callback function which is used to inspect and publish events reported by this device */
 	void (*eventHandlerFn) (struct m_device *device, struct m_metacash *metacash, SSP_POLL_DATA6 *poll);
+	/** \brief Adds the device specific settings to the configuration hash (see deviceConfigHash()) */
+	unsigned long long (*configHashFn) (struct m_device *device, unsigned long long hash);
+	/** \brief Sends the settings which the device keeps across a restart of payoutd, may be skipped on a warm start */
+	SSP_RESPONSE_ENUM (*configureFn) (struct m_device *device);
+	/** \brief Sends the settings which are needed after every start, NULL if there are none */
+	SSP_RESPONSE_ENUM (*enableFn) (struct m_device *device);
+	/** \brief Serializes the tasks using this device (async transport only) */
+	struct m_lock lock;
+	/** \brief If !=0 a poll task for this device is already scheduled (async transport only) */
+	int pollPending;
+	/** \brief If !=0 the configuration has been skipped on a warm start and the first poll has to show
+	 * that the device has not been reset (power cycle) meanwhile, the queue waits until then (see deviceVerifyPoll()) */
+	int verifyPending;
+	/** \brief Number of failed polls since the warm start, after VERIFY_POLL_FAILURES the skip counts as failed */
+	int verifyFailures;
+	/** \brief If !=0 the warm start couldn't be confirmed and the configuration is sent with the next successful poll */
+	int reconfigurePending;
+	/** \brief Minimum gap in ms between the response to a frame and the next frame sent to this device */
+	long frameGap;
+	/** \brief Monotonic time in ms at which the last frame exchange with this device has finished */
+	long long lastFrame;
+	/** \brief The metacash struct this device belongs to */
+	struct m_metacash *metacash;
+	/** \brief event struct for the polling of this device */
+	struct event evPoll;
+	/** \brief Current poll interval in ms, adapted after every poll (see pollAdapt()) */
+	long pollInterval;
+	/** \brief Monotonic time in ms of the next poll (hardware thread only) */
+	long long nextPoll;
+	/** \brief If !=0 the device has been enabled, cleared by "disable", a reset or a "disabled" event */
+	int enabled;
+	/** \brief If !=0 an operation (payout, float, empty) we started is not finished yet */
+	int operationPending;
+	/** \brief The operation in flight, its progress is published to the requester */
+	struct m_operation operation;
+	/** \brief The commands waiting for this device */
+	struct m_queue queue;
+	/** \brief Cached static information, invalidated when the device resets */
+	struct m_deviceInfo info;
+	/** \brief Cached denomination levels */
+	struct m_levelCache levels;
+	/** \brief The configuration last applied to the device */
+	struct m_configState config;
+	/** \brief Counters per SSP command byte */
+	struct m_sspStats sspStats[256];
+};
+
+/**
+ * \brief State of the event driven SSP transport which is used instead of the busy
+ * waiting SSPSendCommand() if enabled with -a.
+ */
+struct m_transport {
+	/** \brief The serial port, registered on the event base */
+	SSP_PORT port;
+	/** \brief event struct for the data received on the serial port */
+	struct event evRead;
+	/** \brief event struct for the reply timeout of the command in flight */
+	struct event evTimeout;
+	/** \brief Only one command can be on the wire at a time, the owner of this lock sends it */
+	struct m_lock bus;
+	/** \brief The command in flight, NULL if we are not waiting for a response */
+	SSP_COMMAND *cmd;
+	/** \brief Packet state for the command in flight */
+	SSP_TX_RX_PACKET packet;
+	/** \brief Remaining transmissions for the command in flight */
+	unsigned char retry;
+	/** \brief Result of SSPCompleteCommand() for the command in flight */
+	int result;
+	/** \brief If !=0 the port hung up, evRead has been removed and every command fails with PORT_ERROR */
+	int hungUp;
+};
+
+/**
+ * \brief Bounded lock-free ring of pointers with exactly one producer and one consumer thread.
+ */
+struct m_ring {
+	/** \brief Storage for the items, the number of slots is a power of 2 */
+	void **slots;
+	/** \brief Number of slots - 1 */
+	unsigned int mask;
+	/** \brief Index of the next item to consume, only written by the consumer */
+	atomic_uint head;
+	/** \brief Index of the next free slot, only written by the producer */
+	atomic_uint tail;
+};
+
+/** \brief Number of messages the log ring can hold (a power of 2) */
+#define LOG_RING_SIZE 1024
+/** \brief Maximum length of a logged message, longer ones are truncated */
+#define LOG_LINE_SIZE 256
+/** \brief Number of messages per call site and LOG_SITE_WINDOW, further ones are only counted */
+#define LOG_SITE_BURST 32
+/** \brief Length of the rate limiting window of a call site in ms */
+#define LOG_SITE_WINDOW 1000
+
+/**
+ * \brief Rate limit state of a logMessage() call site.
+ */
+struct m_logSite {
+	/** \brief Start of the current window (monotonic ms) */
+	atomic_llong windowStart;
+	/** \brief Number of messages in the current window */
+	atomic_uint count;
+	/** \brief Number of messages suppressed since the last one written, reported with the next one */
+	atomic_uint suppressed;
+};
+
+/**
+ * \brief A formatted message in the log ring.
+ */
+struct m_logEntry {
+	/** \brief Position + 1 once the entry is filled, position + LOG_RING_SIZE once it's free again */
+	atomic_size_t sequence;
+	/** \brief The syslog priority */
+	int priority;
+	/** \brief The message */
+	char text[LOG_LINE_SIZE];
+};
+
+/**
+ * \brief Bounded lock-free ring of log messages with any number of producers and the log thread as consumer.
+ * \details syslog() (and with -e the write to stderr) happens on the log thread, the threads which
+ * log only format the message into a slot.
+ */
+struct m_log {
+	/** \brief The slots */
+	struct m_logEntry entries[LOG_RING_SIZE];
+	/** \brief Position of the next slot to fill, claimed by the producers */
+	atomic_size_t head;
+	/** \brief Position of the next slot to write, only used by the log thread */
+	size_t tail;
+	/** \brief Messages with a priority above are discarded (LOG_UPTO), see "set-log-level" */
+	atomic_int level;
+	/** \brief Number of messages dropped because the ring was full, reported by the log thread */
+	atomic_uint dropped;
+	/** \brief Number of messages dropped since the start because the ring was full */
+	atomic_ulong droppedTotal;
+	/** \brief Number of messages suppressed since the start by the rate limit of their call site */
+	atomic_ulong suppressedTotal;
+	/** \brief If !=0 the log thread is waiting for the wakeFd */
+	atomic_int sleeping;
+	/** \brief If !=0 the log thread is running, otherwise the messages are written right away */
+	atomic_int running;
+	/** \brief Set to tell the log thread to exit once the ring is empty */
+	atomic_int stop;
+	/** \brief eventfd used to wakeup the log thread */
+	int wakeFd;
+	/** \brief The log thread itself */
+	pthread_t thread;
+};
+
+/**
+ * \brief Logs the message like syslog(), rate limited per call site and written by the log thread.
+ */
+#define logMessage(priority, ...) \
+	do { \
+		static struct m_logSite logSite; \
+		logWrite(&logSite, (priority), __VA_ARGS__); \
+	} while (0)
+
+/**
+ * \brief A message which should be published by the redis thread.
+ */
+struct m_publication {
+	/** \brief The topic to which the message should be published */
+	char *topic;
+	/** \brief The message itself (the entry id if ack is set) */
+	char *message;
+	/** \brief Length of the message, it may contain zero bytes (binary event encoding) */
+	size_t length;
+	/** \brief If !=0 the entry message of the stream topic should be acknowledged instead */
+	int ack;
+};
+
+/**
+ * \brief State of the dedicated hardware thread (only used with -t).
+ * \details The hardware thread owns the serial port, it runs the polling
+ * and all commands. Parsed commands are handed over via the commands ring, everything
+ * the hardware thread wants to publish comes back via the publications ring.
+ */
+struct m_hwthread {
+	/** \brief The hardware thread itself */
+	pthread_t thread;
+	/** \brief If !=0 the hardware thread has been started */
+	int running;
+	/** \brief Set by the redis thread to tell the hardware thread to exit */
+	atomic_int stop;
+	/** \brief Set by the metrics timer of the redis thread, the hardware thread owns the metrics and publishes them */
+	atomic_int metricsDue;
+	/** \brief struct m_command items, redis thread -> hardware thread */
+	struct m_ring commands;
+	/** \brief struct m_publication items, hardware thread -> redis thread */
+	struct m_ring publications;
+	/** \brief eventfd used to wakeup the hardware thread */
+	int commandFd;
+	/** \brief eventfd used to wakeup the event loop of the redis thread */
+	int publicationFd;
+	/** \brief event struct for the publicationFd */
+	struct event evPublications;
+};
+
+/** \brief Number of request streams, see requestStreams */
+#define STREAM_COUNT 2
+/** \brief Name of the consumer group used for the request streams */
+#define STREAM_GROUP "payoutd"
+/** \brief Time in ms a XREADGROUP waits for new requests */
+#define STREAM_BLOCK 1000
+/** \brief Approximate maximum length of the event and response streams */
+#define STREAM_MAXLEN 10000
+/** \brief Time in ms to wait before reading again if the queues are full */
+#define STREAM_BACKOFF 50
+
+/**
+ * \brief State of the Redis Streams transport (only used with -s).
+ * \details The requests are read from the streams "hopper-request" and "validator-request" as
+ * member of the consumer group STREAM_GROUP, an entry is acknowledged once its command
+ * is done (see freeCommand()). Entries which were delivered but not acknowledged before
+ * a restart are read again first.
+ */
+struct m_streams {
+	/** \brief Maximum number of entries read per stream with a single XREADGROUP (set with -s), 0 if disabled */
+	unsigned int maxCount;
+	/** \brief Name of this consumer in the group (the hostname, so pending entries survive a restart) */
+	char consumer[64];
+	/** \brief Id to read from per stream: the last pending entry seen or ">" once all pending entries are read */
+	char nextId[STREAM_COUNT][48];
+	/** \brief event struct for reading again after the queues have been full */
+	struct event evBackoff;
 };
 
 /**
@@ -95,57 +735,412 @@ struct m_metacash {
 	int deviceAvailable;
 	/** \brief The name of the device we should use to connect to the ITL hardware */
 	char *serialDevice;
+	/** \brief The file of the transaction journal, NULL to disable the journal (default, enable with -j) */
+	char *journalFile;
+	/** \brief The file the SSP frames are recorded in, NULL to disable the trace (default, enable with -F) */
+	char *traceFile;
+	/** \brief The file in which the applied configuration is kept, NULL to always configure (default, enable with -S) */
+	char *stateFile;
+	/** \brief Number of devices which are still initialized by a task (async transport only) */
+	int startupPending;
 	/** \brief Should the hardware accept coins at all (default off for now) */
 	int acceptCoins;
 	/** \brief Should the syslog messages also be written to stderr (default no, enable with -e) */
 	int logSyslogStderr;
+	/** \brief Use the event driven SSP transport (default no, enable with -a) */
+	int asyncTransport;
+	/** \brief Use a dedicated hardware thread (default no, enable with -t) */
+	int hardwareThread;
+	/** \brief Poll interval in ms while a device is busy (override with -P) */
+	long pollFast;
+	/** \brief Poll interval in ms while a device is idle (override with -P) */
+	long pollIdle;
+	/** \brief Factor by which the poll interval of an idle device grows after each poll (override with -P) */
+	int pollBackoff;
+	/** \brief Maximum number of commands waiting per device (override with -q) */
+	unsigned int queueCapacity;
+	/** \brief Interval in ms in which the metrics are published to "payout-metrics", 0 to disable (override with -m) */
+	long metricsInterval;
+	/** \brief Monotonic time in ms at which the daemon has been started */
+	long long started;
 
 	/** \brief The port of the redis server to which we connect */
 	int redisPort;
 	/** \brief The hostname of the redis server to which we connect */
 	char *redisHost;
+	/** \brief Prefix of all topics, empty by default (override with -T) */
+	char *topicPrefix;
 
 	/** \brief base struct for libevent */
 	struct event_base *eventBase;
-	/** \brief event struct for the periodic polling of the devices */
-	struct event evPoll;
 	/** \brief event struct for the periodic check for quitting */
 	struct event evCheckQuit;
+	/** \brief event struct for the periodic publishing of the metrics */
+	struct event evMetrics;
 
 	/** \brief struct for the smart-hopper device */
 	struct m_device hopper;
 	/** \brief struct for the smart-payout device */
 	struct m_device validator;
+
+	/** \brief state of the event driven SSP transport (only used with -a) */
+	struct m_transport transport;
+	/** \brief state of the hardware thread (only used with -t) */
+	struct m_hwthread hwThread;
+	/** \brief state of the Redis Streams transport (only used with -s) */
+	struct m_streams streams;
+};
+
+/** \brief Size of the stack buffers used with struct m_json for responses */
+#define JSON_BUFFER_SIZE 4096
+/** \brief Size of the stack buffers used with struct m_json for the metrics */
+#define METRICS_BUFFER_SIZE 32768
+
+/**
+ * \brief A minimal JSON writer which appends to a caller provided (usually stack) buffer.
+ * \details Nothing is allocated, if the buffer is too small overflow is set and everything
+ * which did not fit anymore is dropped. The buffer is always zero terminated.
+ */
+struct m_json {
+	/** \brief The buffer to write to */
+	char *buffer;
+	/** \brief Size of the buffer */
+	size_t capacity;
+	/** \brief Number of bytes written so far (without the terminating zero) */
+	size_t length;
+	/** \brief If !=0 something did not fit into the buffer */
+	int overflow;
+};
+
+/**
+ * \brief A MessagePack writer which appends to a caller provided buffer, see struct m_json.
+ */
+struct m_msgpack {
+	/** \brief The buffer to write to */
+	unsigned char *buffer;
+	/** \brief Size of the buffer */
+	size_t capacity;
+	/** \brief Number of bytes written so far */
+	size_t length;
+	/** \brief If !=0 something did not fit into the buffer */
+	int overflow;
+};
+
+/** \brief Size of the buffer for the events of one poll cycle */
+#define EVENTS_BUFFER_SIZE 16384
+
+/**
+ * \brief Collects the events of one device during a poll cycle (see eventsBegin()).
+ */
+struct m_eventBatch {
+	/** \brief The JSON topic of the events */
+	const char *topic;
+	/** \brief The topic of the MessagePack encoded poll messages */
+	const char *binTopic;
+	/** \brief If !=0 a poll cycle is running and the events are collected */
+	int active;
+	/** \brief Sequence number of the last poll message */
+	unsigned long long seq;
+	/** \brief Monotonic time in ms at which the poll cycle started */
+	long long time;
+	/** \brief Number of events collected so far */
+	unsigned int count;
+	/** \brief The collected events, separated by commas */
+	struct m_json json;
+	/** \brief Storage for json */
+	char buffer[EVENTS_BUFFER_SIZE];
+};
+
+/**
+ * \brief State of the per poll event messages (-E) and of their binary encoding (-B).
+ */
+struct m_pollEvents {
+	/** \brief If !=0 the events of a poll cycle are published as one message instead of one by one */
+	int perPoll;
+	/** \brief If !=0 the poll messages are also published MessagePack encoded to the *-event.bin topics */
+	int binary;
+	/** \brief The events of the hopper */
+	struct m_eventBatch hopper;
+	/** \brief The events of the validator */
+	struct m_eventBatch validator;
 };
 
+/** \brief The event batches, only used by the thread which polls the devices */
+struct m_pollEvents pollEvents;
+
 /**
  * \brief Structure which describes an actual command which we
  * received in one of our request topics.
  */
+/** \brief Size of the arena in m_request for the strings of a request */
+#define REQUEST_ARENA_SIZE 256
+
+/** \brief Bit of m_request.present for "msgId" */
+#define REQUEST_MSGID 0x001
+/** \brief Bit of m_request.present for "cmd" */
+#define REQUEST_CMD 0x002
+/** \brief Bit of m_request.present for "channels" */
+#define REQUEST_CHANNELS 0x004
+/** \brief Bit of m_request.present for "amount" */
+#define REQUEST_AMOUNT 0x008
+/** \brief Bit of m_request.present for "level" */
+#define REQUEST_LEVEL 0x010
+/** \brief Bit of m_request.present for "r" */
+#define REQUEST_R 0x020
+/** \brief Bit of m_request.present for "g" */
+#define REQUEST_G 0x040
+/** \brief Bit of m_request.present for "b" */
+#define REQUEST_B 0x080
+/** \brief Bit of m_request.present for "type" */
+#define REQUEST_TYPE 0x100
+/** \brief Bit of m_request.present for "refresh":true */
+#define REQUEST_REFRESH 0x200
+/** \brief Bit of m_request.present for "logLevel" */
+#define REQUEST_LOG_LEVEL 0x400
+
+/**
+ * \brief The properties of a request the command handlers know about.
+ * \details Filled by requestParse() for flat requests, the strings point into the arena then.
+ * Otherwise it's filled from the jansson tree by requestFromJson() and the strings point into it.
+ */
+struct m_request {
+	/** \brief Bitmask (REQUEST_*) of the properties which are present with the expected type */
+	unsigned int present;
+	/** \brief "msgId" */
+	const char *msgId;
+	/** \brief "cmd" */
+	const char *cmd;
+	/** \brief "channels", ex. "1,2,3" */
+	const char *channels;
+	/** \brief "logLevel" of "set-log-level", ex. "debug" */
+	const char *logLevel;
+	/** \brief "amount" in cents */
+	long long amount;
+	/** \brief "level" */
+	long long level;
+	/** \brief "r" of "configure-bezel" */
+	long long r;
+	/** \brief "g" of "configure-bezel" */
+	long long g;
+	/** \brief "b" of "configure-bezel" */
+	long long b;
+	/** \brief "type" of "configure-bezel" */
+	long long type;
+	/** \brief Number of bytes of the arena in use */
+	size_t used;
+	/** \brief Storage for the unescaped strings */
+	char arena[REQUEST_ARENA_SIZE];
+};
+
 struct m_command {
-	/** \brief The complete received message parsed as JSON */
+	/** \brief The complete received message parsed as JSON, NULL if requestParse() could handle it */
 	json_t *jsonMessage;
+	/** \brief The known properties of the message */
+	struct m_request request;
 	/** \brief The command from the message */
 	char *command;
 	/** \brief The correlId to use in the response (this is the msgId from the message which contained the command) */
 	char *correlId;
 	/** \brief The msgId for the response */
 	char *msgId;
+	/** \brief Storage for the generated msgId, ex. "1b4e28ba-2fa1-11d2-883f-0016d3cca427" + "\0" */
+	char msgIdBuffer[37];
 	/** \brief The topic to which the response should be published */
 	char *responseTopic;
 	/** \brief The device to which the command should be issued */
 	struct m_device *device;
+	/** \brief The entry in the commandHandlers table for the command, NULL if it's unknown */
+	const struct m_commandHandler *handler;
+	/** \brief Next command in the same priority class of the m_queue */
+	struct m_command *next;
+	/** \brief If !=0 the command went through the m_queue of the device */
+	int queued;
+	/** \brief Monotonic time in ms at which the command was queued */
+	long long enqueued;
+	/** \brief Number of commands which were already waiting when the command was queued */
+	unsigned int queueDepth;
+	/** \brief Time in ms the command has been waiting in the queue */
+	long long queueWait;
+	/** \brief Monotonic time in ms at which the command has been received from redis */
+	long long received;
+	/** \brief The stream the command has been read from, NULL if it has been received via pub/sub */
+	const char *stream;
+	/** \brief Id of the stream entry, acknowledged by freeCommand() */
+	char streamId[48];
+	/** \brief If !=0 the entry was delivered before but never acknowledged (ex. payoutd restarted) */
+	int redelivered;
+	/** \brief If not NULL the replies are written to it instead of being published (sub-commands of a "batch") */
+	struct m_json *capture;
+};
+
+/** \brief Bit for the hopper in m_commandHandler.allowedDevices */
+#define DEVICE_HOPPER 0x01
+/** \brief Bit for the validator in m_commandHandler.allowedDevices */
+#define DEVICE_VALIDATOR 0x02
+/** \brief All devices in m_commandHandler.allowedDevices */
+#define DEVICE_ALL (DEVICE_HOPPER | DEVICE_VALIDATOR)
+
+/**
+ * \brief Structure which describes a JSON command we know how to handle.
+ */
+struct m_commandHandler {
+	/** \brief The name of the command, ex. "do-payout" */
+	const char *name;
+	/** \brief The handle<Cmd> function for the command */
+	void (*fn) (struct m_command *cmd);
+	/** \brief If !=0 the command can only be processed if we have actual hardware */
+	int needsHardware;
+	/** \brief Bitmask of the devices (DEVICE_*) to which the command may be issued */
+	int allowedDevices;
+	/** \brief Priority class (PRIORITY_*) of the command */
+	int priority;
 };
 
+// task* : cooperative tasks used by the async transport
+struct m_task *taskSpawn(struct m_metacash *metacash, void (*fn) (struct m_task *task), void *data,
+		void (*disposeFn) (void *data));
+void taskResume(struct m_task *task);
+void taskYield();
+void taskWakeup(struct m_task *task);
+void taskSleep(long ms);
+void taskLock(struct m_lock *lock);
+void taskUnlock(struct m_lock *lock);
+void taskCleanup();
+
+// transport* : event driven ssp transport
+void transportSetup(struct m_metacash *metacash);
+int transportSendCommand(const SSP_PORT port, SSP_COMMAND *cmd, void *userdata);
+void cbOnTransportRead(int fd, short event, void *privdata);
+void cbOnTransportTimeout(int fd, short event, void *privdata);
+
+// log* : asynchronous logging
+void logWrite(struct m_logSite *site, int priority, const char *format, ...) __attribute__ ((format (printf, 3, 4)));
+void logStart();
+void logStop();
+const char *logLevelName(int level);
+
+// ring* : single producer / single consumer rings
+int ringInit(struct m_ring *ring, unsigned int size);
+void ringFree(struct m_ring *ring);
+int ringPush(struct m_ring *ring, void *item);
+void *ringPop(struct m_ring *ring);
+
+// hwThread* : dedicated hardware thread
+void hwThreadStart(struct m_metacash *metacash);
+void hwThreadStop(struct m_metacash *metacash);
+int hwThreadSubmit(struct m_metacash *metacash, struct m_command *cmd);
+void hwThreadPublish(const char *topic, char *message, size_t length, int ack);
+void publishMessage(const char *topic, char *message);
+
+// publish* : pipelined publishing of pre-formatted RESP frames
+void publishV(const char *topic, const char *tail, const char *format, va_list args);
+void publishFlush();
+void publishRaw(const char *topic, const char *message, size_t length);
+void publishWithTail(const char *topic, const char *message, size_t length, const char *tail);
+void publishAck(const char *stream, const char *id);
+
+// stream* : redis streams transport
+void streamRead(struct m_metacash *metacash);
+void cbOnStreamMessages(redisAsyncContext *c, void *r, void *privdata);
+void processRequest(struct m_metacash *m, const char *topic, const char *message, const char *streamId,
+		int redelivered);
+
+// request* : request parsing
+int requestParse(struct m_request *request, const char *message);
+void requestFromJson(struct m_request *request, json_t *json);
+
+// dispatch* : command handler table
+const struct m_commandHandler *findCommandHandler(const char *command);
+void dispatchCommand(struct m_metacash *m, struct m_command *cmd);
+struct m_command *currentCommand();
+void setCurrentCommand(struct m_command *cmd);
+void setCurrentSubCommand(struct m_command *sub);
+
+// operation* : progress and completion of payouts, floats and empties
+void operationStart(struct m_command *cmd, long requested);
+void operationAfterPoll(struct m_device *device, SSP_POLL_DATA6 *poll);
+void operationCheckTimeout(struct m_device *device);
+
+// idempotency* : answering retried requests (same msgId) from a cache
+int idempotencyAnswer(struct m_command *cmd);
+void idempotencyBegin(struct m_command *cmd);
+void idempotencyRecordV(struct m_command *cmd, const char *format, va_list args);
+void idempotencyRecord(struct m_command *cmd, const char *reply, size_t length);
+void idempotencyFinish(struct m_command *cmd);
+
+// journal* : memory mapped transaction journal
+int journalOpen(const char *path);
+void journalClose();
+void journalCommit();
+void journalAppend(unsigned char type, struct m_device *device, long long amount, long long requested,
+		long long total, const char *cc, const char *correlId, int sync);
+void journalOperation(struct m_command *cmd, unsigned char type, long long amount);
+void journalOperationResult(struct m_command *cmd, SSP_RESPONSE_ENUM resp);
+void journalAfterPoll(struct m_device *device, SSP_POLL_DATA6 *poll);
+void journalRecover(struct m_metacash *metacash);
+void cbOnJournalCommit(int fd, short event, void *privdata);
+
+// metrics* : latency histograms and counters
+void histogramAdd(struct m_histogram *histogram, long value);
+void metricsRecordSsp(struct m_device *device, unsigned char command, SSP_COMMAND *cmd, long latency);
+void metricsPublish(struct m_metacash *metacash);
+void cbOnMetrics(int fd, short event, void *privdata);
+void metricsWrite(struct m_json *json, struct m_metacash *metacash);
+
+// queue* : bounded per device command queues
+int queuePush(struct m_device *device, struct m_command *cmd);
+struct m_command *queuePop(struct m_device *device);
+void queueReplyBusy(struct m_command *cmd);
+void queueProcessOne(struct m_metacash *m, struct m_command *cmd);
+void queueClear(struct m_device *device);
+const char *replyTail();
+struct m_json *replyCapture();
+void freeCommand(void *data);
+void dropCommand(struct m_command *cmd);
+
+// json* : allocation free JSON writer
+void jsonBytes(struct m_json *json, const char *bytes, size_t length);
+void jsonFormatV(struct m_json *json, const char *format, va_list args);
+
+// msgpack* : MessagePack encoding of the JSON we write
+int msgpackFromJson(struct m_msgpack *mp, const char **json);
+
+// events* : per poll event messages (-E) and their binary encoding (-B)
+void eventsInit();
+struct m_eventBatch *eventsOf(struct m_device *device);
+void eventsBegin(struct m_eventBatch *batch);
+void eventsEnd(struct m_eventBatch *batch);
+void eventsAdd(struct m_eventBatch *batch, const char *message, size_t length);
+void eventsPublishV(struct m_eventBatch *batch, const char *format, va_list args);
+
 // mcSsp* : ssp helper functions
 int mcSspOpenSerialDevice(struct m_metacash *metacash);
 void mcSspCloseSerialDevice(struct m_metacash *metacash);
 void mcSspSetupCommand(SSP_COMMAND *sspC, int deviceId);
-void mcSspInitializeDevice(SSP_COMMAND *sspC, unsigned long long key, struct m_device *device);
+int mcSspInitializeDevice(SSP_COMMAND *sspC, unsigned long long key, struct m_device *device);
 void mcSspPollDevice(struct m_device *device, struct m_metacash *metacash);
 
+// device* : startup and configuration of the devices
+void deviceStartup(struct m_device *device);
+void deviceConfigure(struct m_device *device, int force);
+void deviceAfterReset(struct m_device *device);
+void deviceVerifyPoll(struct m_device *device, int ok);
+unsigned long long deviceConfigHash(struct m_device *device);
+unsigned long long configHashBytes(unsigned long long hash, const void *data, size_t length);
+void taskDeviceStartup(struct m_task *task);
+unsigned long long hopperConfigHash(struct m_device *device, unsigned long long hash);
+SSP_RESPONSE_ENUM hopperConfigure(struct m_device *device);
+unsigned long long validatorConfigHash(struct m_device *device, unsigned long long hash);
+SSP_RESPONSE_ENUM validatorConfigure(struct m_device *device);
+SSP_RESPONSE_ENUM validatorEnable(struct m_device *device);
+void stateLoad(struct m_metacash *metacash);
+void stateSave(struct m_metacash *metacash);
+
 // mc_ssp_* : ssp magic values and functions (each of these relate directly to a command specified in the ssp protocol)
 
+/** \brief Number of failed polls after which a warm start counts as not confirmed, see deviceVerifyPoll() */
+#define VERIFY_POLL_FAILURES 3
+
 /** \brief Magic Constant for the "GET FIRMWARE VERSION" command ID as specified in SSP */
 #define SSP_CMD_GET_FIRMWARE_VERSION 0x20
 /** \brief Magic Constant for the "GET DATASET VERSION" command ID as specified in SSP */
@@ -171,19 +1166,29 @@ void mcSspPollDevice(struct m_device *device, struct m_metacash *metacash);
 
 SSP_RESPONSE_ENUM mc_ssp_empty(SSP_COMMAND *sspC);
 SSP_RESPONSE_ENUM mc_ssp_smart_empty(SSP_COMMAND *sspC);
-SSP_RESPONSE_ENUM mc_ssp_cashbox_payout_operation_data(SSP_COMMAND *sspC, char **json);
+SSP_RESPONSE_ENUM mc_ssp_cashbox_payout_operation_data(SSP_COMMAND *sspC, struct m_json *json);
 SSP_RESPONSE_ENUM mc_ssp_configure_bezel(SSP_COMMAND *sspC, unsigned char r, unsigned char g,
 		unsigned char b, unsigned char volatileOption, unsigned char bezelTypeOption);
 SSP_RESPONSE_ENUM mc_ssp_display_on(SSP_COMMAND *sspC);
 SSP_RESPONSE_ENUM mc_ssp_display_off(SSP_COMMAND *sspC);
 SSP_RESPONSE_ENUM mc_ssp_last_reject_note(SSP_COMMAND *sspC, unsigned char *reason);
 SSP_RESPONSE_ENUM mc_ssp_set_refill_mode(SSP_COMMAND *sspC);
-SSP_RESPONSE_ENUM mc_ssp_get_all_levels(SSP_COMMAND *sspC, char **json);
+SSP_RESPONSE_ENUM mc_ssp_get_all_levels(SSP_COMMAND *sspC, struct m_level *levels, unsigned int *count);
 SSP_RESPONSE_ENUM mc_ssp_set_denomination_level(SSP_COMMAND *sspC, int amount, int level, const char *cc);
 SSP_RESPONSE_ENUM mc_ssp_float(SSP_COMMAND *sspC, const int value, const char *cc, const char option);
 SSP_RESPONSE_ENUM mc_ssp_channel_security_data(SSP_COMMAND *sspC);
 SSP_RESPONSE_ENUM mc_ssp_get_firmware_version(SSP_COMMAND *sspC, char *firmwareVersion);
 SSP_RESPONSE_ENUM mc_ssp_get_dataset_version(SSP_COMMAND *sspC, char *datasetVersion);
+SSP_RESPONSE_ENUM mcSspReadDeviceInfo(struct m_device *device);
+SSP_RESPONSE_ENUM levelsSync(struct m_device *device, int check);
+void levelsAfterPoll(struct m_device *device, SSP_POLL_DATA6 *poll);
+long long levelsTotal(struct m_device *device);
+
+// solver* : change making from the level caches
+void solverInit(struct m_solver *solver);
+int solverAdd(struct m_solver *solver, struct m_device *device);
+int solverPlan(struct m_solver *solver, long amount);
+void jsonPlan(struct m_json *json, struct m_solver *solver, struct m_device *device);
 
 /** \brief Magic Constant for the "route to cashbox" option as specified in SSP */
 const char SSP_OPTION_ROUTE_CASHBOX = 0x01;
@@ -205,1743 +1210,6759 @@ static const unsigned long long DEFAULT_KEY = 0x123456701234567LL;
 
 // metacash
 int parseCmdLine(int argc, char *argv[], struct m_metacash *metacash);
+int topicsInit(const char *prefix);
 void setup(struct m_metacash *metacash);
+void setupFinished(struct m_metacash *metacash);
 void hopperEventHandler(struct m_device *device, struct m_metacash *metacash, SSP_POLL_DATA6 *poll);
 void validatorEventHandler(struct m_device *device, struct m_metacash *metacash, SSP_POLL_DATA6 *poll);
+void die(char *reason, int rc);
 
 static const char *CURRENCY = "EUR";
 
 /**
- * \brief Set by the signalHandler function and checked in cbCheckQuit.
+ * \brief Set by the signalHandler function (or the quit command, on the hardware thread with -t)
+ * and checked in cbCheckQuit.
  */
-int receivedSignal = 0;
+atomic_int receivedSignal = 0;
 
 /**
  * \brief Signal handler
  */
 void signalHandler(int signal) {
-	receivedSignal = signal;
+	atomic_store(&receivedSignal, signal);
 }
 
-/**
- * \brief Waits for 300ms each time called.
- * \details Details only to get graph.
- * \callergraph
- */
-void hardwareWaitTime() {
-	struct timespec ts;
-	ts.tv_sec = 0;
-	ts.tv_nsec = 300000000;
-	nanosleep(&ts, NULL);
-}
+/** \brief Size of the stack of each task (a SSP_POLL_DATA6 alone needs ~6kb) */
+#define TASK_STACK_SIZE (256 * 1024)
 
 /**
- * \brief Connect to redis and return a new redisAsyncContext.
+ * \brief The task which is currently running, NULL if we are running on the main stack.
  */
-redisAsyncContext* connectRedis(struct m_metacash *metacash) {
-	redisAsyncContext *conn = redisAsyncConnect(metacash->redisHost,
-			metacash->redisPort);
-
-	if (conn == NULL || conn->err) {
-		if (conn) {
-			syslog(LOG_ERR,  "fatal: Connection error: %s\n", conn->errstr);
-		} else {
-			syslog(LOG_ERR,
-					"fatal: Connection error: can't allocate redis context\n");
-		}
-	} else {
-		// reference the metcash struct in data for use in connect/disconnect callback
-		conn->data = metacash;
-	}
-
-	return conn;
-}
+struct m_task *currentTask = NULL;
 
 /**
- * \brief Callback function for libEvent timer triggered "Poll" event.
- * \details Details only to get graph.
- * \callgraph
+ * \brief List of all tasks which have been spawned and did not finish yet.
  */
-void cbOnPollEvent(int fd, short event, void *privdata) {
-	struct m_metacash *metacash = privdata;
-	if (metacash->deviceAvailable == 0) {
-		// return immediately if we have no actual hardware to poll
-		return;
-	}
-
-	mcSspPollDevice(&metacash->hopper, metacash);
-	mcSspPollDevice(&metacash->validator, metacash);
-}
+struct m_task *allTasks = NULL;
 
 /**
- * \brief Callback function for libEvent timer triggered "CheckQuit" event.
+ * \brief The context of the main stack, tasks switch back to it if they yield or finish.
  */
-void cbOnCheckQuitEvent(int fd, short event, void *privdata) {
-	if (receivedSignal != 0) {
-		syslog(LOG_NOTICE, "received signal or quit cmd. going to exit event loop.");
-
-		struct m_metacash *metacash = privdata;
-		event_base_loopexit(metacash->eventBase, NULL);
-		receivedSignal = 0;
-	}
-}
+ucontext_t schedulerContext;
 
 /**
- * \brief Callback function triggered by an incoming message in the "metacash" topic.
+ * \brief Returns the current time of the monotonic clock in ms.
  */
-void cbOnMetacashMessage(redisAsyncContext *c, void *r, void *privdata) {
-	// empty for now
+long long clockMonotonicMs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
+/** \brief The log ring, see logWrite() */
+struct m_log logRing = { .level = LOG_INFO };
+
+/** \brief Names of the syslog levels, indexed by LOG_EMERG .. LOG_DEBUG */
+static const char *logLevelNames[] = { "emerg", "alert", "crit", "err", "warning", "notice", "info", "debug" };
+
 /**
- * \brief Test if cmd.command equals command
+ * \brief Returns the name of the syslog level, ex. "info".
  */
-int isCommand(struct m_command *cmd, const char *command) {
-	return ! strcmp(cmd->command, command);
+const char *logLevelName(int level) {
+	return level >= 0 && level < (int) (sizeof(logLevelNames) / sizeof(logLevelNames[0])) ? logLevelNames[level] : "?";
 }
 
 /**
- * \brief Helper function to publish a message to the "payout-event" topic.
+ * \brief Formats the message into the next free slot of the log ring.
+ * \details Called by logMessage(). Only LOG_SITE_BURST messages per call site and second are
+ * accepted, the number of the suppressed ones is appended to the next message of the call site.
+ * Messages are dropped (and counted) while the ring is full, a thread never waits for the log thread.
  */
-int publishPayoutEvent(char *format, ...) {
-	va_list varags;
-	va_start(varags, format);
+void logWrite(struct m_logSite *site, int priority, const char *format, ...) {
+	if (LOG_PRI(priority) > atomic_load_explicit(&logRing.level, memory_order_relaxed)) {
+		return;
+	}
+
+	long long now = clockMonotonicMs();
+	long long windowStart = atomic_load(&site->windowStart);
+	if (now - windowStart >= LOG_SITE_WINDOW && atomic_compare_exchange_strong(&site->windowStart, &windowStart, now)) {
+		atomic_store(&site->count, 0);
+	}
+	if (atomic_fetch_add(&site->count, 1) >= LOG_SITE_BURST) {
+		atomic_fetch_add(&site->suppressed, 1);
+		atomic_fetch_add(&logRing.suppressedTotal, 1);
+		return;
+	}
 
-	char *reply = NULL;
-	vasprintf(&reply, format, varags);
+	va_list varargs;
+	unsigned int suppressed;
+
+	if (! atomic_load(&logRing.running)) {
+		// before logStart() and after logStop()
+		char buffer[LOG_LINE_SIZE];
+		va_start(varargs, format);
+		vsnprintf(buffer, sizeof(buffer), format, varargs);
+		va_end(varargs);
+		if ((suppressed = atomic_exchange(&site->suppressed, 0)) != 0) {
+			buffer[strcspn(buffer, "\n")] = '\0';
+			syslog(priority, "%s (%u similar messages suppressed)", buffer, suppressed);
+		} else {
+			syslog(priority, "%s", buffer);
+		}
+		return;
+	}
 
-	va_end(varags);
+	// claim a slot, see struct m_logEntry
+	struct m_logEntry *entry;
+	size_t position = atomic_load_explicit(&logRing.head, memory_order_relaxed);
+	for (;;) {
+		entry = &logRing.entries[position & (LOG_RING_SIZE - 1)];
+		size_t sequence = atomic_load_explicit(&entry->sequence, memory_order_acquire);
+		if (sequence == position) {
+			if (atomic_compare_exchange_weak_explicit(&logRing.head, &position, position + 1,
+					memory_order_relaxed, memory_order_relaxed)) {
+				break;
+			}
+		} else if (sequence < position) {
+			// the log thread is behind
+			atomic_fetch_add(&logRing.dropped, 1);
+			atomic_fetch_add(&logRing.droppedTotal, 1);
+			return;
+		} else {
+			position = atomic_load_explicit(&logRing.head, memory_order_relaxed);
+		}
+	}
 
-	redisAsyncCommand(redisPublishCtx, NULL, NULL, "PUBLISH %s %s", "payout-event", reply);
+	// only now, a dropped message leaves the count to the next one of the call site
+	suppressed = atomic_exchange(&site->suppressed, 0);
 
-	free(reply);
+	va_start(varargs, format);
+	int length = vsnprintf(entry->text, sizeof(entry->text), format, varargs);
+	va_end(varargs);
 
-	return 0;
+	if (length < 0) {
+		length = 0;
+		entry->text[0] = '\0';
+	} else if ((size_t) length >= sizeof(entry->text)) {
+		length = sizeof(entry->text) - 1;
+	}
+	if (suppressed) {
+		while (length > 0 && entry->text[length - 1] == '\n') {
+			length--;
+		}
+		snprintf(entry->text + length, sizeof(entry->text) - length, " (%u similar messages suppressed)", suppressed);
+	}
+	entry->priority = priority;
+
+	atomic_store_explicit(&entry->sequence, position + 1, memory_order_release);
+
+	// pairs with the fence in logThreadMain() before it looks at the ring one last time
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load(&logRing.sleeping) && atomic_exchange(&logRing.sleeping, 0)) {
+		uint64_t one = 1;
+		if (write(logRing.wakeFd, &one, sizeof(one)) != sizeof(one)) {
+			// the log thread looks at the ring at least once per second anyway
+		}
+	}
 }
 
 /**
- * \brief Helper function to publish a message to the "hopper-event" topic.
+ * \brief Writes the next message of the log ring, returns 0 if the ring is empty. Log thread only.
  */
-int publishHopperEvent(char *format, ...) {
-	va_list varags;
-	va_start(varags, format);
+int logWriteNext() {
+	struct m_logEntry *entry = &logRing.entries[logRing.tail & (LOG_RING_SIZE - 1)];
 
-	char *reply = NULL;
-	vasprintf(&reply, format, varags);
-
-	va_end(varags);
-
-	redisAsyncCommand(redisPublishCtx, NULL, NULL, "PUBLISH %s %s", "hopper-event", reply);
+	if (atomic_load_explicit(&entry->sequence, memory_order_acquire) != logRing.tail + 1) {
+		return 0;
+	}
 
-	free(reply);
+	syslog(entry->priority, "%s", entry->text);
 
-	return 0;
+	atomic_store_explicit(&entry->sequence, logRing.tail + LOG_RING_SIZE, memory_order_release);
+	logRing.tail++;
+	return 1;
 }
 
 /**
- * \brief Helper function to publish a message to the "validator-event" topic.
+ * \brief Main function of the log thread, writes the messages of the log ring with syslog().
  */
-int publishValidatorEvent(char *format, ...) {
-	va_list varags;
-	va_start(varags, format);
+void *logThreadMain(void *data) {
+	for (;;) {
+		while (logWriteNext()) {
+		}
 
-	char *reply = NULL;
-	vasprintf(&reply, format, varags);
+		unsigned int dropped = atomic_exchange(&logRing.dropped, 0);
+		if (dropped) {
+			syslog(LOG_WARNING, "%u log messages dropped, the log ring was full", dropped);
+		}
 
-	va_end(varags);
+		if (atomic_load(&logRing.stop)) {
+			break;
+		}
 
-	redisAsyncCommand(redisPublishCtx, NULL, NULL, "PUBLISH %s %s", "validator-event", reply);
+		atomic_store(&logRing.sleeping, 1);
+		atomic_thread_fence(memory_order_seq_cst);
 
-	free(reply);
+		struct m_logEntry *entry = &logRing.entries[logRing.tail & (LOG_RING_SIZE - 1)];
+		if (atomic_load_explicit(&entry->sequence, memory_order_acquire) != logRing.tail + 1) {
+			struct pollfd pfd;
+			pfd.fd = logRing.wakeFd;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
 
-	return 0;
-}
+			if (poll(&pfd, 1, 1000) > 0 && (pfd.revents & POLLIN)) {
+				uint64_t count;
+				if (read(logRing.wakeFd, &count, sizeof(count)) != sizeof(count)) {
+					// woken up anyway
+				}
+			}
+		}
+
+		atomic_store(&logRing.sleeping, 0);
+	}
+
+	return NULL;
+}
 
 /**
- * \brief Helper function to publish a message to the given topic.
- * \details Details only to get graph.
- * \callergraph
+ * \brief Starts the log thread, from now on logMessage() only hands the messages over to it.
+ * \details If the thread can't be started the messages are written right away as before.
  */
-int replyWith(char *topic, char *format, ...) {
-	va_list varags;
-	va_start(varags, format);
+void logStart() {
+	for (size_t i = 0; i < LOG_RING_SIZE; i++) {
+		atomic_init(&logRing.entries[i].sequence, i);
+	}
+	atomic_init(&logRing.head, 0);
+	logRing.tail = 0;
+	atomic_init(&logRing.stop, 0);
+	atomic_init(&logRing.sleeping, 0);
+
+	logRing.wakeFd = eventfd(0, EFD_NONBLOCK);
+	if (logRing.wakeFd < 0) {
+		logMessage(LOG_WARNING, "logStart: could not create eventfd, logging synchronously\n");
+		return;
+	}
 
-	char *reply = NULL;
-	vasprintf(&reply, format, varags);
+	// set before the thread is created, it must see the initialized ring
+	atomic_store(&logRing.running, 1);
+	if (pthread_create(&logRing.thread, NULL, logThreadMain, NULL) != 0) {
+		atomic_store(&logRing.running, 0);
+		close(logRing.wakeFd);
+		logMessage(LOG_WARNING, "logStart: could not create the log thread, logging synchronously\n");
+	}
+}
 
-	va_end(varags);
+/**
+ * \brief Writes what is left in the log ring and stops the log thread, logMessage() writes right away again.
+ */
+void logStop() {
+	if (! atomic_exchange(&logRing.running, 0)) {
+		return;
+	}
 
-	redisAsyncCommand(redisPublishCtx, NULL, NULL, "PUBLISH %s %s", topic, reply);
+	atomic_store(&logRing.stop, 1);
 
-	free(reply);
+	uint64_t one = 1;
+	if (write(logRing.wakeFd, &one, sizeof(one)) != sizeof(one)) {
+		// the log thread looks at the ring at least once per second anyway
+	}
 
-	return 0;
+	pthread_join(logRing.thread, NULL);
+	close(logRing.wakeFd);
 }
 
 /**
- * \brief Helper function to publish a reply to a message which was missing a
- * mandatory property (or the property was of the wrong type).
- * \details Details only to get graph.
- * \callergraph
+ * \brief Returns the default frame gap in ms for the given type of device.
+ * \details The devices need a short break between finishing a response and
+ * receiving the next frame, override with -g (hopper) and -G (validator).
  */
-int replyWithPropertyError(struct m_command *cmd, char *name) {
-	char *msgId = "unknown";
-	if(cmd->msgId) {
-		msgId = cmd->msgId;
+long defaultFrameGap(int deviceId) {
+	switch (deviceId) {
+	case 0x10: // SMART Hopper
+		return 50;
+	case 0x00: // NV200
+		return 20;
+	default:
+		return 50;
 	}
+}
 
-	char *correlId = "unknown";
-	if(cmd->correlId) {
-		correlId = cmd->correlId;
+/**
+ * \brief Finds the device for the given SSP address, returns NULL if we don't know that address.
+ */
+struct m_device *deviceByAddress(struct m_metacash *metacash, unsigned char address) {
+	if (metacash->hopper.sspC.SSPAddress == address) {
+		return &metacash->hopper;
 	}
-
-	return replyWith(cmd->responseTopic,
-			"{\"msgId\":\"%s\",\"correlId\":\"%s\",\"error\":\"Property '%s' missing or of wrong type\"}",
-			msgId,
-			correlId,
-			name);
+	if (metacash->validator.sspC.SSPAddress == address) {
+		return &metacash->validator;
+	}
+	return NULL;
 }
 
 /**
- * \brief Helper function to publish a reply to a message which contains a human readable
- * version of the SSP response.
- * \details Details only to get graph.
+ * \brief Waits until the frame gap of the device has elapsed since the last frame.
+ * \details If called from a task only the task is suspended, the event loop keeps running.
+ * If the device has been idle long enough this returns immediately.
  * \callergraph
  */
-int replyWithSspResponse(struct m_command *cmd, SSP_RESPONSE_ENUM response) {
-	if(response == SSP_RESPONSE_OK) {
-		return replyWith(cmd->responseTopic, "{\"msgId\":\"%s\",\"correlId\":\"%s\",\"result\":\"ok\"}",
-				cmd->msgId,
-				cmd->correlId);
-	} else {
-		char *errorMsg;
+void pacingWait(struct m_device *device) {
+	long long remaining = device->lastFrame + device->frameGap - clockMonotonicMs();
+	if (remaining <= 0) {
+		return;
+	}
 
-		switch(response) {
-			case SSP_RESPONSE_UNKNOWN_COMMAND:
-				errorMsg = "unknown command";
-				break;
-			case SSP_RESPONSE_INCORRECT_PARAMETERS:
-				errorMsg = "incorrect parameters";
-				break;
-			case SSP_RESPONSE_INVALID_PARAMETER:
-				errorMsg = "invalid parameter";
-				break;
-			case SSP_RESPONSE_COMMAND_NOT_PROCESSED:
-				errorMsg = "command not processed";
-				break;
-			case SSP_RESPONSE_SOFTWARE_ERROR:
-				errorMsg = "software error";
-				break;
-			case SSP_RESPONSE_CHECKSUM_ERROR:
-				errorMsg = "checksum error";
-				break;
-			case SSP_RESPONSE_FAILURE:
-				errorMsg = "failure";
-				break;
-			case SSP_RESPONSE_HEADER_FAILURE:
-				errorMsg = "header failure";
-				break;
-			case SSP_RESPONSE_KEY_NOT_SET:
-				errorMsg = "key not set";
-				break;
-			case SSP_RESPONSE_TIMEOUT:
-				errorMsg = "timeout";
-				break;
-			default:
-				errorMsg = "unknown";
-		}
+	SSPTraceWait(device->sspC.SSPAddress, remaining * 1000000ULL);
 
-		return replyWith(cmd->responseTopic, "{\"msgId\":\"%s\",\"correlId\":\"%s\",\"sspError\":\"%s\"}",
-				cmd->msgId,
-				cmd->correlId,
-				errorMsg);
+	if (currentTask != NULL) {
+		taskSleep(remaining);
+		return;
 	}
+
+	struct timespec ts;
+	ts.tv_sec = remaining / 1000;
+	ts.tv_nsec = (remaining % 1000) * 1000000;
+	nanosleep(&ts, NULL);
 }
 
 /**
- * \brief Handles the JSON "quit" command.
+ * \brief Entry point of every task, runs the task function on the stack of the task.
  */
-void handleQuit(struct m_command *cmd) {
-	receivedSignal = 1;
-	replyWithSspResponse(cmd, SSP_RESPONSE_OK); // :D
+void taskMain() {
+	struct m_task *task = currentTask;
+	task->fn(task);
+	task->finished = 1;
+	// returning switches back to schedulerContext (uc_link)
 }
 
 /**
- * \brief Handles the JSON "empty" command.
+ * \brief Frees a task and removes it from the list of all tasks.
  */
-void handleEmpty(struct m_command *cmd) {
-	replyWithSspResponse(cmd, mc_ssp_empty(&cmd->device->sspC));
+void taskFree(struct m_task *task) {
+	for (struct m_task **t = &allTasks; *t != NULL; t = &(*t)->nextTask) {
+		if (*t == task) {
+			*t = task->nextTask;
+			break;
+		}
+	}
+
+	if (task->disposeFn) {
+		task->disposeFn(task->data);
+	}
+	free(task->stack);
+	free(task);
 }
 
 /**
- * \brief Handles the JSON "smart-empty" command.
+ * \brief Creates a new task which runs fn(task) as soon as the event loop gets to it.
+ * \details The disposeFn (if any) is called with data after the task has finished.
  */
-void handleSmartEmpty(struct m_command *cmd) {
-	replyWithSspResponse(cmd, mc_ssp_smart_empty(&cmd->device->sspC));
+struct m_task *taskSpawn(struct m_metacash *metacash, void (*fn) (struct m_task *task), void *data,
+		void (*disposeFn) (void *data)) {
+	struct m_task *task = calloc(1, sizeof(struct m_task));
+	task->stack = malloc(TASK_STACK_SIZE);
+	if (task->stack == NULL) {
+		die("taskSpawn: could not allocate stack", 1);
+		// never reached, already exited
+	}
+
+	task->fn = fn;
+	task->data = data;
+	task->disposeFn = disposeFn;
+	task->metacash = metacash;
+
+	getcontext(&task->context);
+	task->context.uc_stack.ss_sp = task->stack;
+	task->context.uc_stack.ss_size = TASK_STACK_SIZE;
+	task->context.uc_link = &schedulerContext;
+	makecontext(&task->context, taskMain, 0);
+
+	task->nextTask = allTasks;
+	allTasks = task;
+
+	taskWakeup(task);
+
+	return task;
 }
 
 /**
- * \brief Handles the JSON "do-payout" and "test-payout" commands.
+ * \brief Switches from the main stack to the task until it yields or finishes.
+ * \details Must only be called from the main stack (i.e. a libevent callback).
  */
-void handlePayout(struct m_command *cmd) {
-	int payoutOption = 0;
+void taskResume(struct m_task *task) {
+	currentTask = task;
+	swapcontext(&schedulerContext, &task->context);
+	currentTask = NULL;
 
-	if (isCommand(cmd, "do-payout")) {
-		payoutOption = SSP6_OPTION_BYTE_DO;
-	} else {
-		payoutOption = SSP6_OPTION_BYTE_TEST;
+	if (task->finished) {
+		taskFree(task);
 	}
+}
 
-	json_t *jAmount = json_object_get(cmd->jsonMessage, "amount");
-	if(! json_is_integer(jAmount)) {
-		replyWithPropertyError(cmd, "amount");
-		return;
-	}
+/**
+ * \brief Suspends the current task, someone has to resume (or wakeup) it later on.
+ */
+void taskYield() {
+	swapcontext(&currentTask->context, &schedulerContext);
+}
 
-	int amount = json_integer_value(jAmount);
+/**
+ * \brief Callback function for libEvent, resumes the task provided in privdata.
+ */
+void cbOnTaskWakeup(int fd, short event, void *privdata) {
+	taskResume(privdata);
+}
 
-	SSP_RESPONSE_ENUM resp = ssp6_payout(&cmd->device->sspC, amount, CURRENCY,
-			payoutOption);
+/**
+ * \brief Resumes the task in the next iteration of the event loop. Safe to call from a task.
+ */
+void taskWakeup(struct m_task *task) {
+	struct timeval now = { 0, 0 };
+	event_base_once(task->metacash->eventBase, -1, EV_TIMEOUT, cbOnTaskWakeup, task, &now);
+}
 
-	if (resp == SSP_RESPONSE_COMMAND_NOT_PROCESSED) {
-		char *error = NULL;
-		switch (cmd->device->sspC.ResponseData[1]) {
-		case 0x01:
-			error = "not enough value in smart payout";
-			break;
-		case 0x02:
-			error = "can't pay exact amount";
-			break;
-		case 0x03:
-			error = "smart payout busy";
-			break;
-		case 0x04:
-			error = "smart payout disabled";
-			break;
-		default:
-			error = "unknown";
-			break;
-		}
+/**
+ * \brief Suspends the current task for the given amount of milliseconds.
+ */
+void taskSleep(long ms) {
+	struct timeval interval;
+	interval.tv_sec = ms / 1000;
+	interval.tv_usec = (ms % 1000) * 1000;
 
-		replyWith(cmd->responseTopic, "{\"correlId\":\"%s\",\"error\":\"%s\"}", cmd->correlId, error);
-	} else {
-		replyWithSspResponse(cmd, resp);
-	}
+	event_base_once(currentTask->metacash->eventBase, -1, EV_TIMEOUT, cbOnTaskWakeup, currentTask, &interval);
+	taskYield();
 }
 
 /**
- * \brief Handles the JSON "do-float" and "test-float" commands.
+ * \brief Acquires the lock for the current task, suspends the task until the lock is available.
  */
-void handleFloat(struct m_command *cmd) {
-	// basically a copy of do/test-payout ...
-	int payoutOption = 0;
-
-	if (isCommand(cmd, "do-float")) {
-		payoutOption = SSP6_OPTION_BYTE_DO;
-	} else {
-		payoutOption = SSP6_OPTION_BYTE_TEST;
+void taskLock(struct m_lock *lock) {
+	if (lock->owner == NULL) {
+		lock->owner = currentTask;
+		return;
 	}
 
-	json_t *jAmount = json_object_get(cmd->jsonMessage, "amount");
-	if(! json_is_integer(jAmount)) {
-		replyWithPropertyError(cmd, "amount");
-		return;
+	currentTask->nextWaiting = NULL;
+	if (lock->waiting.tail) {
+		lock->waiting.tail->nextWaiting = currentTask;
+	} else {
+		lock->waiting.head = currentTask;
 	}
+	lock->waiting.tail = currentTask;
 
-	int amount = json_integer_value(jAmount);
+	// taskUnlock() hands over the lock before waking us up
+	taskYield();
+}
 
-	SSP_RESPONSE_ENUM resp = mc_ssp_float(&cmd->device->sspC, amount, CURRENCY,
-			payoutOption);
+/**
+ * \brief Releases the lock and hands it over to the next waiting task (if any).
+ */
+void taskUnlock(struct m_lock *lock) {
+	struct m_task *next = lock->waiting.head;
 
-	if (resp == SSP_RESPONSE_COMMAND_NOT_PROCESSED) {
-		char *error = NULL;
-		switch (cmd->device->sspC.ResponseData[1]) {
-		case 0x01:
-			error = "not enough value in smart payout";
-			break;
-		case 0x02:
-			error = "can't pay exact amount";
-			break;
-		case 0x03:
-			error = "smart payout busy";
-			break;
-		case 0x04:
-			error = "smart payout disabled";
-			break;
-		default:
-			error = "unknown";
-			break;
+	if (next) {
+		lock->waiting.head = next->nextWaiting;
+		if (lock->waiting.head == NULL) {
+			lock->waiting.tail = NULL;
 		}
-		replyWith(cmd->responseTopic, "{\"correlId\":\"%s\",\"error\":\"%s\"}",
-				cmd->correlId, error);
-	} else {
-		replyWithSspResponse(cmd, resp);
+		next->nextWaiting = NULL;
+		taskWakeup(next);
 	}
+
+	lock->owner = next;
 }
 
 /**
- * \brief Print inhibits debug output.
+ * \brief Frees all tasks which did not finish (e.g. because we are exiting).
  */
-void dbgDisplayInhibits(unsigned char inhibits) {
-	syslog(LOG_DEBUG, "dbgDisplayInhibits: inhibits are: 0=%d 1=%d 2=%d 3=%d 4=%d 5=%d 6=%d 7=%d\n",
-			(inhibits >> 0) & 1,
-			(inhibits >> 1) & 1,
-			(inhibits >> 2) & 1,
-			(inhibits >> 3) & 1,
-			(inhibits >> 4) & 1,
-			(inhibits >> 5) & 1,
-			(inhibits >> 6) & 1,
-			(inhibits >> 7) & 1);
+void taskCleanup() {
+	while (allTasks) {
+		if (allTasks->command) {
+			dropCommand(allTasks->command);
+		}
+		taskFree(allTasks);
+	}
 }
 
 /**
- * \brief Handles the JSON "enable-channels" command.
+ * \brief Registers the serial port on the event base and installs transportSendCommand() as the
+ * send hook in the ssp library.
  */
-void handleEnableChannels(struct m_command *cmd) {
-	json_t *jChannels = json_object_get(cmd->jsonMessage, "channels");
-	if(! json_is_string(jChannels)) {
-		replyWithPropertyError(cmd, "channels");
-		return;
-	}
+void transportSetup(struct m_metacash *metacash) {
+	struct m_transport *transport = &metacash->transport;
 
-	char *channels = (char *) json_string_value(jChannels);
+	transport->port = get_ssp_port();
+	transport->cmd = NULL;
+	transport->hungUp = 0;
 
-	// this will be updated and written back to the device state
-	// if the update succeeds
-	unsigned char currentChannelInhibits = cmd->device->channelInhibits;
-	unsigned char highChannels = 0xFF; // actually not in use
+	event_set(&transport->evRead, transport->port, EV_READ | EV_PERSIST, cbOnTransportRead, metacash);
+	event_base_set(metacash->eventBase, &transport->evRead);
+	event_add(&transport->evRead, NULL);
 
-	// 8 channels for now, set the bit to 1 for each requested channel
-	if(strstr(channels, "1") != NULL) {
-		currentChannelInhibits |= 1 << 0;
-	}
-	if(strstr(channels, "2") != NULL) {
-		currentChannelInhibits |= 1 << 1;
-	}
-	if(strstr(channels, "3") != NULL) {
-		currentChannelInhibits |= 1 << 2;
-	}
-	if(strstr(channels, "4") != NULL) {
-		currentChannelInhibits |= 1 << 3;
-	}
-	if(strstr(channels, "5") != NULL) {
-		currentChannelInhibits |= 1 << 4;
-	}
-	if(strstr(channels, "6") != NULL) {
-		currentChannelInhibits |= 1 << 5;
-	}
-	if(strstr(channels, "7") != NULL) {
-		currentChannelInhibits |= 1 << 6;
-	}
-	if(strstr(channels, "8") != NULL) {
-		currentChannelInhibits |= 1 << 7;
-	}
+	evtimer_set(&transport->evTimeout, cbOnTransportTimeout, metacash);
+	event_base_set(metacash->eventBase, &transport->evTimeout);
 
-	SSP_RESPONSE_ENUM resp = ssp6_set_inhibits(&cmd->device->sspC, currentChannelInhibits, highChannels);
+	logMessage(LOG_NOTICE, "using the async transport\n");
+}
 
-	if(resp == SSP_RESPONSE_OK) {
-		// okay, update the channelInhibits in the device structure with the new state
-		cmd->device->channelInhibits = currentChannelInhibits;
+/**
+ * \brief (Re)starts the reply timeout of the command in flight.
+ */
+void transportArmTimeout(struct m_transport *transport) {
+	struct timeval timeout;
+	timeout.tv_sec = transport->cmd->Timeout / 1000;
+	timeout.tv_usec = (transport->cmd->Timeout % 1000) * 1000;
 
-		if(0) {
-			syslog(LOG_DEBUG, "enable-channels:\n");
-			dbgDisplayInhibits(currentChannelInhibits);
-		}
-	}
+	evtimer_add(&transport->evTimeout, &timeout);
+}
 
-	replyWithSspResponse(cmd, resp);
+/**
+ * \brief Finishes the command in flight and resumes the task which is waiting for it.
+ */
+void transportComplete(struct m_transport *transport) {
+	evtimer_del(&transport->evTimeout);
+
+	transport->result = SSPCompleteCommand(transport->cmd, &transport->packet);
+	transport->cmd = NULL;
+
+	taskResume(transport->bus.owner);
 }
 
 /**
- * \brief Handles the JSON "disable-channels" command.
+ * \brief Callback function for libEvent triggered by data on the serial port.
  */
-void handleDisableChannels(struct m_command *cmd) {
-	json_t *jChannels = json_object_get(cmd->jsonMessage, "channels");
-	if(! json_is_string(jChannels)) {
-		replyWithPropertyError(cmd, "channels");
+void cbOnTransportRead(int fd, short event, void *privdata) {
+	struct m_metacash *metacash = privdata;
+	struct m_transport *transport = &metacash->transport;
+	unsigned char buffer[255];
+
+	ssize_t n = read(fd, buffer, sizeof(buffer));
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		return;
+	}
+	if (n <= 0) {
+		// a hung up tty (ex. the usb adapter has been pulled) stays readable, without removing
+		// the event we would be called again in every iteration of the event loop
+		logMessage(LOG_ERR, "cbOnTransportRead: serial port hung up: %s\n", n == 0 ? "end of file" : strerror(errno));
+		event_del(&transport->evRead);
+		transport->hungUp = 1;
+
+		if (transport->cmd) {
+			transport->cmd->ResponseStatus = PORT_ERROR;
+			transportComplete(transport);
+		}
 		return;
 	}
 
-	char *channels = (char *) json_string_value(jChannels);
+	if (transport->cmd == NULL) {
+		// nobody is waiting for this data (e.g. a late response for a command which timed out)
+		return;
+	}
 
-	// this will be updated and written back to the device state
-	// if the update succeeds
-	unsigned char currentChannelInhibits = cmd->device->channelInhibits;
-	unsigned char highChannels = 0xFF; // actually not in use
+	for (ssize_t i = 0; i < n && !transport->packet.NewResponse; i++) {
+		SSPDataIn(buffer[i], &transport->packet);
+	}
 
-	// 8 channels for now, set the bit to 0 for each requested channel
-	if(strstr(channels, "1") != NULL) {
-		currentChannelInhibits &= ~(1 << 0);
+	if (transport->packet.NewResponse) {
+		transportComplete(transport);
 	}
-	if(strstr(channels, "2") != NULL) {
-		currentChannelInhibits &= ~(1 << 1);
+}
+
+/**
+ * \brief Callback function for libEvent triggered if the reply timeout of the command in flight expired.
+ */
+void cbOnTransportTimeout(int fd, short event, void *privdata) {
+	struct m_metacash *metacash = privdata;
+	struct m_transport *transport = &metacash->transport;
+
+	if (transport->cmd == NULL) {
+		return;
 	}
-	if(strstr(channels, "3") != NULL) {
-		currentChannelInhibits &= ~(1 << 2);
+
+	transport->retry--;
+	if (transport->retry > 0) {
+		// counted before, so the retransmission is recorded with its number in the frame trace
+		transport->cmd->RetryCount++;
+		if (SSPTransmitPacket(transport->port, transport->cmd, &transport->packet)) {
+			transportArmTimeout(transport);
+			return;
+		}
+		// PORT_ERROR is already set in ResponseStatus
+	} else {
+		transport->cmd->ResponseStatus = SSP_CMD_TIMEOUT;
 	}
-	if(strstr(channels, "4") != NULL) {
-		currentChannelInhibits &= ~(1 << 3);
+
+	transportComplete(transport);
+}
+
+/**
+ * \brief Sends the command with the async transport and suspends the current task until
+ * the response arrived, the event loop keeps running meanwhile.
+ */
+int transportSendCommandAsync(struct m_transport *transport, const SSP_PORT port, SSP_COMMAND *cmd) {
+	taskLock(&transport->bus);
+
+	if (transport->hungUp) {
+		// nothing would ever be received, see cbOnTransportRead()
+		cmd->ResponseStatus = PORT_ERROR;
+		taskUnlock(&transport->bus);
+		return 0;
 	}
-	if(strstr(channels, "5") != NULL) {
-		currentChannelInhibits &= ~(1 << 4);
+
+	if (! SSPStartCommand(port, cmd, &transport->packet)) {
+		taskUnlock(&transport->bus);
+		return 0;
 	}
-	if(strstr(channels, "6") != NULL) {
-		currentChannelInhibits &= ~(1 << 5);
+
+	transport->cmd = cmd;
+	transport->retry = cmd->RetryLevel;
+	transportArmTimeout(transport);
+
+	// resumed by transportComplete()
+	taskYield();
+
+	int result = transport->result;
+
+	taskUnlock(&transport->bus);
+
+	return result;
+}
+
+/**
+ * \brief Send hook used by the ssp library for every frame. Enforces the frame gap of the
+ * device and sends the command via the async transport if called from a task.
+ * \details During the startup (before the event loop is running) or without -a we are
+ * not in a task and fall back to the blocking variant.
+ */
+int transportSendCommand(const SSP_PORT port, SSP_COMMAND *cmd, void *userdata) {
+	struct m_metacash *metacash = userdata;
+	struct m_device *device = deviceByAddress(metacash, cmd->SSPAddress);
+	int result;
+
+	if (device) {
+		pacingWait(device);
 	}
-	if(strstr(channels, "7") != NULL) {
-		currentChannelInhibits &= ~(1 << 6);
+
+	// the command data is replaced by the encrypted packet while sending
+	unsigned char command = cmd->CommandData[0];
+	long long start = clockMonotonicMs();
+
+	if (currentTask == NULL) {
+		result = SSPSendCommandBlocking(port, cmd);
+	} else {
+		result = transportSendCommandAsync(&metacash->transport, port, cmd);
 	}
-	if(strstr(channels, "8") != NULL) {
-		currentChannelInhibits &= ~(1 << 7);
+
+	if (device) {
+		device->lastFrame = clockMonotonicMs();
+		metricsRecordSsp(device, command, cmd, device->lastFrame - start);
 	}
 
-	SSP_RESPONSE_ENUM resp = ssp6_set_inhibits(&cmd->device->sspC, currentChannelInhibits, highChannels);
+	return result;
+}
 
-	if(resp == SSP_RESPONSE_OK) {
-		// okay, update the channelInhibits in the device structure with the new state
-		cmd->device->channelInhibits = currentChannelInhibits;
+/**
+ * \brief Connect to redis and return a new redisAsyncContext.
+ */
+redisAsyncContext* connectRedis(struct m_metacash *metacash) {
+	redisAsyncContext *conn = redisAsyncConnect(metacash->redisHost,
+			metacash->redisPort);
 
-		if(0) {
-			syslog(LOG_DEBUG, "disable-channels:\n");
-			dbgDisplayInhibits(currentChannelInhibits);
+	if (conn == NULL || conn->err) {
+		if (conn) {
+			logMessage(LOG_ERR,  "fatal: Connection error: %s\n", conn->errstr);
+		} else {
+			logMessage(LOG_ERR,
+					"fatal: Connection error: can't allocate redis context\n");
 		}
+	} else {
+		// reference the metcash struct in data for use in connect/disconnect callback
+		conn->data = metacash;
 	}
 
-	replyWithSspResponse(cmd, resp);
+	return conn;
 }
 
 /**
- * \brief Handles the JSON "inhibit-channels" command.
+ * \brief Test if the event reports that the device is in the middle of something.
  */
-void handleInhibitChannels(struct m_command *cmd) {
-	json_t *jChannels = json_object_get(cmd->jsonMessage, "channels");
-	if(! json_is_string(jChannels)) {
-		replyWithPropertyError(cmd, "channels");
-		return;
+int isInFlightEvent(unsigned char event) {
+	switch (event) {
+	case SSP_POLL_READ:
+	case SSP_POLL_REJECTING:
+	case SSP_POLL_STACKING:
+	case SSP_POLL_DISPENSING:
+	case SSP_POLL_FLOATING:
+	case SSP_POLL_EMPTYING:
+	case SSP_POLL_SMART_EMPTYING:
+		return 1;
+	default:
+		return 0;
 	}
+}
 
-	char *channels = (char *) json_string_value(jChannels);
-
-	unsigned char lowChannels = 0xFF;
-	unsigned char highChannels = 0xFF;
-
-	// 8 channels for now
-	if(strstr(channels, "1") != NULL) {
-		lowChannels &= ~(1 << 0);
-	}
-	if(strstr(channels, "2") != NULL) {
-		lowChannels &= ~(1 << 1);
-	}
-	if(strstr(channels, "3") != NULL) {
-		lowChannels &= ~(1 << 2);
+/**
+ * \brief Test if the event reports the end of an operation started with pollOperationStarted().
+ */
+int isOperationFinishedEvent(unsigned char event) {
+	switch (event) {
+	case SSP_POLL_DISPENSED:
+	case SSP_POLL_FLOATED:
+	case SSP_POLL_EMPTY:
+	case SSP_POLL_SMART_EMPTIED:
+	case SSP_POLL_INCOMPLETE_PAYOUT:
+	case SSP_POLL_INCOMPLETE_FLOAT:
+	case SSP_POLL_TIMEOUT:
+	case SSP_POLL_JAMMED:
+	case SSP_POLL_RESET:
+		return 1;
+	default:
+		return 0;
 	}
-	if(strstr(channels, "4") != NULL) {
-		lowChannels &= ~(1 << 3);
+}
+
+/**
+ * \brief Adapts the poll interval of the device to the events it reported (poll is NULL if the poll failed).
+ * \details While the device reports in-flight states or an operation is pending we poll with
+ * the fast rate, otherwise the interval grows by the backoff factor up to the idle rate.
+ */
+void pollAdapt(struct m_device *device, SSP_POLL_DATA6 *poll) {
+	struct m_metacash *metacash = device->metacash;
+	int busy = 0;
+
+	if (poll) {
+		for (unsigned int i = 0; i < poll->event_count; ++i) {
+			if (isInFlightEvent(poll->events[i].event)) {
+				busy = 1;
+			}
+			if (isOperationFinishedEvent(poll->events[i].event)) {
+				device->operationPending = 0;
+			}
+		}
 	}
-	if(strstr(channels, "5") != NULL) {
-		lowChannels &= ~(1 << 4);
+
+	if (busy || device->operationPending) {
+		device->pollInterval = metacash->pollFast;
+	} else {
+		device->pollInterval *= metacash->pollBackoff;
+		if (device->pollInterval > metacash->pollIdle) {
+			device->pollInterval = metacash->pollIdle;
+		}
 	}
-	if(strstr(channels, "6") != NULL) {
-		lowChannels &= ~(1 << 5);
+}
+
+/**
+ * \brief Schedules the next poll of the device after its current poll interval.
+ */
+void pollSchedule(struct m_device *device) {
+	struct timeval interval;
+	interval.tv_sec = device->pollInterval / 1000;
+	interval.tv_usec = (device->pollInterval % 1000) * 1000;
+
+	evtimer_add(&device->evPoll, &interval);
+}
+
+/**
+ * \brief Switches the device to the fast poll rate because we just started an operation on it.
+ */
+void pollOperationStarted(struct m_device *device) {
+	device->operationPending = 1;
+	device->pollInterval = device->metacash->pollFast;
+
+	if (onHardwareThread) {
+		device->nextPoll = clockMonotonicMs() + device->pollInterval;
+	} else if (! device->pollPending) {
+		// re-adding the pending timer moves it up
+		pollSchedule(device);
 	}
-	if(strstr(channels, "7") != NULL) {
-		lowChannels &= ~(1 << 6);
+}
+
+/**
+ * \brief Task function which polls a single device with the async transport.
+ */
+void taskPollDevice(struct m_task *task) {
+	struct m_device *device = task->data;
+
+	taskLock(&device->lock);
+	mcSspPollDevice(device, task->metacash);
+	taskUnlock(&device->lock);
+
+	device->pollPending = 0;
+	pollSchedule(device);
+}
+
+/**
+ * \brief Spawns a task polling the device unless the previous poll is still pending.
+ */
+void spawnPollDevice(struct m_device *device, struct m_metacash *metacash) {
+	if (device->pollPending) {
+		return;
 	}
-	if(strstr(channels, "8") != NULL) {
-		lowChannels &= ~(1 << 7);
+
+	device->pollPending = 1;
+	taskSpawn(metacash, taskPollDevice, device, NULL);
+}
+
+/**
+ * \brief Callback function for libEvent timer triggered "Poll" event of a device.
+ * \details Details only to get graph.
+ * \callgraph
+ */
+void cbOnPollEvent(int fd, short event, void *privdata) {
+	struct m_device *device = privdata;
+	struct m_metacash *metacash = device->metacash;
+
+	if (metacash->asyncTransport) {
+		// the task schedules the next poll once it is done
+		spawnPollDevice(device, metacash);
+		return;
 	}
 
-	replyWithSspResponse(cmd, ssp6_set_inhibits(&cmd->device->sspC, lowChannels, highChannels));
+	mcSspPollDevice(device, metacash);
+	pollSchedule(device);
 }
 
 /**
- * \brief Handles the JSON "enable" command.
+ * \brief Callback function for libEvent timer triggered "CheckQuit" event.
  */
-void handleEnable(struct m_command *cmd) {
-	replyWithSspResponse(cmd, ssp6_enable(&cmd->device->sspC));
+void cbOnCheckQuitEvent(int fd, short event, void *privdata) {
+	if (atomic_exchange(&receivedSignal, 0) != 0) {
+		logMessage(LOG_NOTICE, "received signal or quit cmd. going to exit event loop.");
+
+		struct m_metacash *metacash = privdata;
+		event_base_loopexit(metacash->eventBase, NULL);
+	}
 }
 
 /**
- * \brief Handles the JSON "disable" command.
+ * \brief Callback function triggered by an incoming message in the "metacash" topic.
  */
-void handleDisable(struct m_command *cmd) {
-	replyWithSspResponse(cmd, ssp6_disable(&cmd->device->sspC));
+void cbOnMetacashMessage(redisAsyncContext *c, void *r, void *privdata) {
+	// empty for now
 }
 
 /**
- * \brief Handles the JSON "set-denomination-levels" command.
+ * \brief Test if cmd.command equals command
  */
-void handleSetDenominationLevels(struct m_command *cmd) {
-	json_t *jLevel = json_object_get(cmd->jsonMessage, "level");
-	if(! json_is_integer(jLevel)) {
-		replyWithPropertyError(cmd, "level");
+int isCommand(struct m_command *cmd, const char *command) {
+	return ! strcmp(cmd->command, command);
+}
+
+/**
+ * \brief Grows the buffer to hold at least size bytes, the contents are kept.
+ */
+void publishGrow(char **buffer, size_t *capacity, size_t size) {
+	if (size <= *capacity) {
 		return;
 	}
 
-	json_t *jAmount = json_object_get(cmd->jsonMessage, "amount");
-	if(! json_is_integer(jAmount)) {
-		replyWithPropertyError(cmd, "amount");
-		return;
+	size_t newCapacity = *capacity ? *capacity : 1024;
+	while (newCapacity < size) {
+		newCapacity *= 2;
 	}
 
-	int level = json_integer_value(jLevel);
-	int amount = json_integer_value(jAmount);
+	char *newBuffer = realloc(*buffer, newCapacity);
+	if (newBuffer == NULL) {
+		die("publishGrow: out of memory", 1);
+	}
+	*buffer = newBuffer;
+	*capacity = newCapacity;
+}
 
-	if(level > 0) {
-		/* Quote from the spec -.-
-		 *
-		 * A command to increment the level of coins of a denomination stored in the hopper.
-		 * The command is formatted with the command byte first, amount of coins to *add*
-		 * as a 2-byte little endian, the value of coin as 2-byte little endian and
-		 * (if using protocol version 6) the country code of the coin as 3 byte ASCII. The level of coins for a
-		 * denomination can be set to zero by sending a zero level for that value.
-		 *
-		 * In a nutshell: This command behaves only with a level of 0 as expected (setting the absolute value),
-		 * otherwise it works like the not existing "increment denomination level" command.
-		 */
+/**
+ * \brief Records the length of the frame which has just been appended to the buffer of the publisher.
+ */
+void publishCommitFrame(size_t frameLength) {
+	publisher.length += frameLength;
+
+	if (publisher.frameCount == publisher.frameCapacity) {
+		unsigned int capacity = publisher.frameCapacity ? publisher.frameCapacity * 2 : 32;
+		size_t *frames = realloc(publisher.frames, capacity * sizeof(size_t));
+		if (frames == NULL) {
+			die("publishCommitFrame: out of memory", 1);
+		}
+		publisher.frames = frames;
+		publisher.frameCapacity = capacity;
+	}
+	publisher.frames[publisher.frameCount++] = frameLength;
+}
 
-		// ignore the result for now. we could not do much anyway now.
-		mc_ssp_set_denomination_level(&cmd->device->sspC, amount, 0, CURRENCY);
+/**
+ * \brief Appends a PUBLISH command for the message followed by tail (may be NULL) as a RESP frame to the publisher.
+ * \details With -s a "XADD <topic> MAXLEN ~ <n> * message <message>" command is appended instead.
+ */
+void publishAppendFrame(const char *topic, const char *message, size_t messageLength, const char *tail) {
+	size_t topicLength = strlen(topic);
+	size_t tailLength = tail ? strlen(tail) : 0;
+	char header[64];
+	char middle[96];
+	int headerLength;
+	int middleLength;
+
+	if (publisher.streamMaxLen > 0) {
+		char maxLen[24];
+		int maxLenLength = snprintf(maxLen, sizeof(maxLen), "%ld", publisher.streamMaxLen);
+		headerLength = snprintf(header, sizeof(header), "*8\r\n$4\r\nXADD\r\n$%zu\r\n", topicLength);
+		middleLength = snprintf(middle, sizeof(middle),
+				"\r\n$6\r\nMAXLEN\r\n$1\r\n~\r\n$%d\r\n%s\r\n$1\r\n*\r\n$7\r\nmessage\r\n$%zu\r\n",
+				maxLenLength, maxLen, messageLength + tailLength);
+	} else {
+		headerLength = snprintf(header, sizeof(header), "*3\r\n$7\r\nPUBLISH\r\n$%zu\r\n", topicLength);
+		middleLength = snprintf(middle, sizeof(middle), "\r\n$%zu\r\n", messageLength + tailLength);
 	}
 
-	replyWithSspResponse(cmd, mc_ssp_set_denomination_level(&cmd->device->sspC, amount, level, CURRENCY));
+	size_t frameLength = headerLength + topicLength + middleLength + messageLength + tailLength + 2;
+	publishGrow(&publisher.buffer, &publisher.capacity, publisher.length + frameLength);
+
+	char *p = publisher.buffer + publisher.length;
+	memcpy(p, header, headerLength);
+	p += headerLength;
+	memcpy(p, topic, topicLength);
+	p += topicLength;
+	memcpy(p, middle, middleLength);
+	p += middleLength;
+	memcpy(p, message, messageLength);
+	p += messageLength;
+	memcpy(p, tail, tailLength);
+	p += tailLength;
+	memcpy(p, "\r\n", 2);
+
+	publishCommitFrame(frameLength);
 }
 
 /**
- * \brief Handles the JSON "get-all-levels" command.
+ * \brief Appends a "XACK <stream> STREAM_GROUP <id>" command as a RESP frame to the publisher.
  */
-void handleGetAllLevels(struct m_command *cmd) {
-	char *json = NULL;
+void publishAppendAck(const char *stream, const char *id) {
+	size_t streamLength = strlen(stream);
+	size_t idLength = strlen(id);
+	size_t frameLength = 64 + streamLength + idLength;
+
+	publishGrow(&publisher.buffer, &publisher.capacity, publisher.length + frameLength);
+
+	int length = snprintf(publisher.buffer + publisher.length, frameLength,
+			"*4\r\n$4\r\nXACK\r\n$%zu\r\n%s\r\n$%zu\r\n%s\r\n$%zu\r\n%s\r\n",
+			streamLength, stream, strlen(STREAM_GROUP), STREAM_GROUP, idLength, id);
+	if (length < 0 || (size_t) length >= frameLength) {
+		logMessage(LOG_ERR, "publishAppendAck: could not format XACK for stream='%s' id='%s'\n", stream, id);
+		return;
+	}
 
-	SSP_RESPONSE_ENUM resp = mc_ssp_get_all_levels(&cmd->device->sspC, &json);
+	publishCommitFrame(length);
+}
 
-	if(resp == SSP_RESPONSE_OK) {
-		replyWith(cmd->responseTopic, "{\"correlId\":\"%s\",\"levels\":[%s]}", cmd->correlId, json);
-	} else {
-		replyWithSspResponse(cmd, resp);
+/**
+ * \brief Hands all collected frames over to hiredis which writes them out with a single write.
+ * \details Called at the end of each request and poll cycle, everything else is
+ * flushed by the next iteration of the event loop.
+ */
+void publishFlush() {
+	size_t offset = 0;
+
+	for (unsigned int i = 0; i < publisher.frameCount; i++) {
+		// one call per frame: hiredis expects one reply callback per command
+		redisAsyncFormattedCommand(redisPublishCtx, NULL, NULL, publisher.buffer + offset, publisher.frames[i]);
+		offset += publisher.frames[i];
 	}
 
-	free(json);
+	publisher.length = 0;
+	publisher.frameCount = 0;
 }
 
 /**
- * \brief Handles the JSON "cashbox-payout-operation-data" command.
+ * \brief Callback function for libEvent, flushes the publisher.
  */
-void handleCashboxPayoutOperationData(struct m_command *cmd) {
-	char *json = NULL;
+void cbOnPublishFlush(int fd, short event, void *privdata) {
+	publisher.flushScheduled = 0;
+	publishFlush();
+}
 
-	SSP_RESPONSE_ENUM resp = mc_ssp_cashbox_payout_operation_data(&cmd->device->sspC, &json);
+/**
+ * \brief Makes sure nothing gets stuck if no explicit publishFlush() follows.
+ */
+void publishScheduleFlush() {
+	if (! publisher.flushScheduled && publisher.eventBase) {
+		struct timeval now = { 0, 0 };
+		publisher.flushScheduled = 1;
+		event_base_once(publisher.eventBase, -1, EV_TIMEOUT, cbOnPublishFlush, NULL, &now);
+	}
+}
 
-	if(resp == SSP_RESPONSE_OK) {
-		replyWith(cmd->responseTopic, "{\"correlId\":\"%s\",\"levels\":[%s]}", cmd->correlId, json);
+/**
+ * \brief Formats the message and publishes it to the topic.
+ * \details On the redis thread the message goes straight into the publisher, it is
+ * sent with the next publishFlush(). See publishWithTail() for tail (may be NULL).
+ */
+void publishV(const char *topic, const char *tail, const char *format, va_list args) {
+	if (onHardwareThread) {
+		char *message = NULL;
+		if (vasprintf(&message, format, args) < 0) {
+			return;
+		}
+		if (tail) {
+			publishWithTail(topic, message, strlen(message), tail);
+			free(message);
+		} else {
+			publishMessage(topic, message);
+		}
+		return;
+	}
+
+	va_list copy;
+	va_copy(copy, args);
+	int length = vsnprintf(publisher.scratch, publisher.scratchCapacity, format, args);
+	if (length >= 0 && (size_t) length >= publisher.scratchCapacity) {
+		publishGrow(&publisher.scratch, &publisher.scratchCapacity, length + 1);
+		length = vsnprintf(publisher.scratch, publisher.scratchCapacity, format, copy);
+	}
+	va_end(copy);
+
+	if (length < 0) {
+		logMessage(LOG_ERR, "publishV: could not format message for topic='%s'\n", topic);
+		return;
+	}
+
+	publishWithTail(topic, publisher.scratch, length, tail);
+}
+
+/**
+ * \brief Publishes the already formatted message to the topic.
+ * \details If tail is not NULL it replaces the closing brace of the message, this is
+ * used to add properties to a JSON object without formatting it again.
+ */
+void publishWithTail(const char *topic, const char *message, size_t length, const char *tail) {
+	if (tail && length > 0 && message[length - 1] == '}') {
+		length--;
 	} else {
-		replyWithSspResponse(cmd, resp);
+		tail = NULL;
+	}
+
+	if (onHardwareThread) {
+		size_t tailLength = tail ? strlen(tail) : 0;
+		char *copy = malloc(length + tailLength + 1);
+		if (copy == NULL) {
+			atomic_fetch_add(&droppedPublications, 1);
+			return;
+		}
+		memcpy(copy, message, length);
+		if (tail) {
+			memcpy(copy + length, tail, tailLength);
+		}
+		copy[length + tailLength] = '\0';
+		hwThreadPublish(topic, copy, length + tailLength, 0);
+		return;
 	}
 
-	free(json);
+	publishAppendFrame(topic, message, length, tail);
+	publishScheduleFlush();
 }
 
+/**
+ * \brief Publishes the already formatted message to the topic.
+ */
+void publishRaw(const char *topic, const char *message, size_t length) {
+	publishWithTail(topic, message, length, NULL);
+}
 
 /**
- * \brief Handles the JSON "get-firmware-version" command.
+ * \brief Hands the message (or the entry id to acknowledge) over to the redis thread, called on the hardware thread.
+ * \details Takes ownership of message. Like the log ring the hardware thread never waits for the redis
+ * thread: while the ring is full (or memory ran out) the message is dropped and counted.
  */
-void handleGetFirmwareVersion(struct m_command *cmd) {
-	char firmwareVersion[100] = { 0 };
+void hwThreadPublish(const char *topic, char *message, size_t length, int ack) {
+	struct m_publication *publication = message ? malloc(sizeof(struct m_publication)) : NULL;
+	char *copy = publication ? strdup(topic) : NULL;
+
+	if (copy == NULL) {
+		free(publication);
+		free(message);
+		atomic_fetch_add(&droppedPublications, 1);
+		logMessage(LOG_ERR, "hwThreadPublish: out of memory, message for topic='%s' dropped\n", topic);
+		return;
+	}
 
-	SSP_RESPONSE_ENUM resp = mc_ssp_get_firmware_version(&cmd->device->sspC, &firmwareVersion[0]);
+	publication->topic = copy;
+	publication->message = message;
+	publication->length = length;
+	publication->ack = ack;
+
+	if (! ringPush(&hwThread->publications, publication)) {
+		// the redis thread is lagging behind, the polls must go on regardless
+		free(publication->topic);
+		free(publication->message);
+		free(publication);
+		atomic_fetch_add(&droppedPublications, 1);
+		logMessage(LOG_ERR, "hwThreadPublish: publication ring full, message for topic='%s' dropped\n", topic);
+	}
 
-	if(resp == SSP_RESPONSE_OK) {
-		replyWith(cmd->responseTopic, "{\"correlId\":\"%s\",\"version\":\"%s\"}", cmd->correlId, firmwareVersion);
-	} else {
-		replyWithSspResponse(cmd, resp);
+	uint64_t one = 1;
+	if (write(hwThread->publicationFd, &one, sizeof(one)) != sizeof(one)) {
+		logMessage(LOG_ERR, "hwThreadPublish: could not wakeup the redis thread\n");
 	}
 }
 
 /**
- * \brief Handles the JSON "get-dataset-version" command.
+ * \brief Publishes the message to the topic and frees the message afterwards.
+ * \details On the hardware thread the message is handed over to the redis thread
+ * because the redis contexts must only be used there.
  */
-void handleGetDatasetVersion(struct m_command *cmd) {
-	char datasetVersion[100] = { 0 };
+void publishMessage(const char *topic, char *message) {
+	if (onHardwareThread) {
+		hwThreadPublish(topic, message, strlen(message), 0);
+		return;
+	}
 
-	SSP_RESPONSE_ENUM resp = mc_ssp_get_dataset_version(&cmd->device->sspC, &datasetVersion[0]);
+	publishAppendFrame(topic, message, strlen(message), NULL);
 
-	if(resp == SSP_RESPONSE_OK) {
-		replyWith(cmd->responseTopic, "{\"correlId\":\"%s\",\"version\":\"%s\"}",
-				cmd->correlId, datasetVersion);
-	} else {
-		replyWithSspResponse(cmd, resp);
+	free(message);
+}
+
+/**
+ * \brief Acknowledges the entry id of the stream (only used with -s).
+ * \details The XACK is pipelined with the responses, so it is sent right after the
+ * response of the command.
+ */
+void publishAck(const char *stream, const char *id) {
+	if (onHardwareThread) {
+		hwThreadPublish(stream, strdup(id), strlen(id), 1);
+		return;
 	}
+
+	publishAppendAck(stream, id);
+	publishScheduleFlush();
 }
 
 /**
- * \brief Handles the JSON "last-reject-note" command.
+ * \brief Helper function to publish a message to the "payout-event" topic.
  */
-void handleLastRejectNote(struct m_command *cmd) {
-	unsigned char reasonCode;
+int publishPayoutEvent(char *format, ...) {
+	va_list varags;
+	va_start(varags, format);
 
-	SSP_RESPONSE_ENUM resp = mc_ssp_last_reject_note(&cmd->device->sspC, &reasonCode);
+	publishV(topics.payoutEvent, NULL, format, varags);
 
-	if (resp == SSP_RESPONSE_OK) {
-		char *reason = NULL;
+	va_end(varags);
 
-		switch (reasonCode) {
-		case 0x00: // Note accepted
-			reason = "note accepted";
-			break;
-		case 0x01: // Note length incorrect
-			reason = "note length incorrect";
-			break;
-		case 0x02: // Average fail
-			reason = "internal validation failure: average fail";
-			break;
-		case 0x03: // Coastline fail
-			reason = "internal validation failure: coastline fail";
-			break;
-		case 0x04: // Graph fail
-			reason = "internal validation failure: graph fail";
-			break;
-		case 0x05: // Buried fail
-			reason = "internal validation failure: buried fail";
-			break;
-		case 0x06: // Channel inhibited
-			reason = "channel inhibited";
-			break;
-		case 0x07: // Second note inserted
-			reason = "second note inserted";
-			break;
-		case 0x08: // Reject by host
-			reason = "reject by host";
-			break;
-		case 0x09: // Note recognised in more than one channel
-			reason = "note recognised in more than one channel";
-			break;
-		case 0x0A: // Reject reason 10
-			reason = "rear sensor error";
-			break;
-		case 0x0B: // Note too long
-			reason = "note too long";
-			break;
-		case 0x0C: // Disabled by host
-			reason = "disabled by host";
-			break;
-		case 0x0D: // Mechanism slow/stalled
-			reason = "mechanism slow/stalled";
-			break;
-		case 0x0E: // Strimming attempt detected
-			reason = "strimming attempt detected";
-			break;
-		case 0x0F: // Fraud channel reject
-			reason = "fraud channel reject";
-			break;
-		case 0x10: // No notes inserted
-			reason = "no notes inserted";
-			break;
-		case 0x11: // Peak detect fail
-			reason = "peak detect fail";
-			break;
-		case 0x12: // Twisted note detected
-			reason = "twisted note detected";
-			break;
-		case 0x13: // Escrow time-out
-			reason = "escrow time-out";
-			break;
-		case 0x14: // Bar code scan fail
-			reason = "bar code scan fail";
-			break;
-		case 0x15: // Rear sensor 2 fail
-			reason = "rear sensor 2 fail";
-			break;
-		case 0x16: // Slot fail 1
-			reason = "slot fail 1";
-			break;
-		case 0x17: // Slot fail 2
-			reason = "slot fail 2";
-			break;
-		case 0x18: // Lens over-sample
-			reason = "lens over-sample";
-			break;
-		case 0x19: // Width detect fail
-			reason = "width detect fail";
-			break;
-		case 0x1A: // Short note detected
-			reason = "short note detected";
-			break;
-		case 0x1B: // Note payout
-			reason = "note payout";
-			break;
-		case 0x1C: // Unable to stack note
-			reason = "unable to stack note";
-			break;
-		default: // not defined in API doc
-			reason = "undefined in API";
-			break;
-		}
-
-		replyWith(cmd->responseTopic,
-				"{\"correlId\":\"%s\",\"reason\":\"%s\",\"code\":%ld}",
-				cmd->correlId, reason, reasonCode);
-	} else {
-		replyWithSspResponse(cmd, resp);
-	}
+	return 0;
 }
 
 /**
- * \brief Handles the JSON "channel-security" command.
+ * \brief Helper function to publish a message to the "hopper-event" topic.
  */
-void handleChannelSecurityData(struct m_command *cmd) {
-	mc_ssp_channel_security_data(&cmd->device->sspC);
+int publishHopperEvent(char *format, ...) {
+	va_list varags;
+	va_start(varags, format);
+
+	eventsPublishV(&pollEvents.hopper, format, varags);
+
+	va_end(varags);
+
+	return 0;
 }
 
 /**
- * \brief Handles the JSON "test" command
+ * \brief Helper function to publish a message to the "validator-event" topic.
  */
-void handleTest(struct m_command *cmd) {
-	replyWithSspResponse(cmd, SSP_RESPONSE_OK);
+int publishValidatorEvent(char *format, ...) {
+	va_list varags;
+	va_start(varags, format);
+
+	eventsPublishV(&pollEvents.validator, format, varags);
+
+	va_end(varags);
+
+	return 0;
 }
 
 /**
- * \brief Handles the JSON "configure-bezel" command.
+ * \brief Helper function to publish a message to the given topic.
+ * \details The queue statistics of the command which is processed right now are added (see replyTail()).
+ * \callergraph
  */
-void handleConfigureBezel(struct m_command *cmd) {
-	json_t *jR = json_object_get(cmd->jsonMessage, "r");
-	if(! json_is_integer(jR)) {
-		replyWithPropertyError(cmd, "r");
-		return;
-	}
-	unsigned char r = json_integer_value(jR);
+int replyWith(char *topic, char *format, ...) {
+	va_list varags;
+	va_start(varags, format);
 
-	json_t *jG = json_object_get(cmd->jsonMessage, "g");
-	if(! json_is_integer(jG)) {
-		replyWithPropertyError(cmd, "g");
-		return;
-	}
-	unsigned char g = json_integer_value(jG);
+	struct m_json *capture = replyCapture();
+	if (capture) {
+		jsonFormatV(capture, format, varags);
+	} else {
+		va_list copy;
+		va_copy(copy, varags);
+		idempotencyRecordV(currentCommand(), format, copy);
+		va_end(copy);
 
-	json_t *jB = json_object_get(cmd->jsonMessage, "b");
-	if(! json_is_integer(jB)) {
-		replyWithPropertyError(cmd, "b");
-		return;
+		publishV(topic, replyTail(), format, varags);
 	}
-	unsigned char b = json_integer_value(jB);
 
-	json_t *jType = json_object_get(cmd->jsonMessage, "type");
-	if(! json_is_integer(jType)) {
-		replyWithPropertyError(cmd, "type");
-		return;
-	}
-	unsigned char type = json_integer_value(jType);
+	va_end(varags);
 
-	replyWithSspResponse(cmd,
-			mc_ssp_configure_bezel(&cmd->device->sspC, r, g, b, SSP_OPTION_NON_VOLATILE, type));
+	return 0;
 }
 
 /**
- * \brief Callback function triggered by an incoming message in either
- * the "hopper-request" or "validator-request" topic.
- * \details Details only to get graph.
- * \callgraph
+ * \brief Starts writing JSON into the buffer.
  */
-void cbOnRequestMessage(redisAsyncContext *c, void *r, void *privdata) {
-	if (r == NULL) {
+void jsonInit(struct m_json *json, char *buffer, size_t capacity) {
+	json->buffer = buffer;
+	json->capacity = capacity;
+	json->length = 0;
+	json->overflow = 0;
+	json->buffer[0] = '\0';
+}
+
+/**
+ * \brief Appends length bytes as they are.
+ */
+void jsonBytes(struct m_json *json, const char *bytes, size_t length) {
+	if (json->overflow || json->length + length >= json->capacity) {
+		json->overflow = 1;
 		return;
 	}
 
-	hardwareWaitTime();
-
-	struct m_metacash *m = c->data;
-	redisReply *reply = r;
+	memcpy(json->buffer + json->length, bytes, length);
+	json->length += length;
+	json->buffer[json->length] = '\0';
+}
 
-	// example from http://stackoverflow.com/questions/16213676/hiredis-waiting-for-message
-	if (reply->type == REDIS_REPLY_ARRAY && reply->elements == 3) {
-		if (strcmp(reply->element[0]->str, "subscribe") != 0) {
-			char *topic = reply->element[1]->str;
-			struct m_command cmd;
-
-			cmd.msgId = NULL;
-			cmd.correlId = NULL;
-			cmd.command = NULL;
-
-			// decide to which topic the response should be sent to
-			if (strcmp(topic, "validator-request") == 0) {
-				cmd.device = &m->validator;
-				cmd.responseTopic = "validator-response";
-			} else if (strcmp(topic, "hopper-request") == 0) {
-				cmd.device = &m->hopper;
-				cmd.responseTopic = "hopper-response";
-			} else {
-				syslog(LOG_ERR, "cbOnRequestMessage subscribed for a topic we don't have a response topic\n");
-				return;
-			}
+/**
+ * \brief Appends the formatted string as it is (it must already be valid JSON).
+ */
+void jsonFormatV(struct m_json *json, const char *format, va_list args) {
+	if (json->overflow) {
+		return;
+	}
 
-			// generate a new 'msgId' for the response itself
-			uuid_t uuid;
-			uuid_generate_time_safe(uuid);
-			char msgId[37] = { 0 }; // ex. "1b4e28ba-2fa1-11d2-883f-0016d3cca427" + "\0"
-			uuid_unparse_lower(uuid, msgId);
-			cmd.msgId = (char *) &msgId; // points to a local variable. only valid until this block is exited!
-
-			char *message = reply->element[2]->str;
-
-			// try to parse the message as json
-			json_error_t error;
-			cmd.jsonMessage = json_loads(message, 0, &error);
-
-			if(! cmd.jsonMessage) {
-				syslog(LOG_WARNING, "unable to process message: could not parse json. reason: %s, line: %d",
-						error.text, error.line);
-				replyWith(cmd.responseTopic,
-						"{\"error\":\"could not parse json\",\"reason\":\"%s\",\"line\":%d}",
-						error.text, error.line);
-				// no need to json_decref(cmd.jsonMessage) here
-				return;
-			}
+	size_t available = json->capacity - json->length;
+	int length = vsnprintf(json->buffer + json->length, available, format, args);
+	if (length < 0 || (size_t) length >= available) {
+		json->overflow = 1;
+		json->buffer[json->length] = '\0';
+		return;
+	}
+	json->length += length;
+}
 
-			// extract the 'msgId' property (used as the 'correlId' in a response)
-			// this will be the 'correlId' used in replies.
-			json_t *jMsgId = json_object_get(cmd.jsonMessage, "msgId");
-			if(! json_is_string(jMsgId)) {
-				syslog(LOG_WARNING, "unable to process message: property 'msgId' missing or invalid");
-				replyWithPropertyError(&cmd, "msgId");
-				json_decref(cmd.jsonMessage);
-				return;
-			} else {
-				cmd.correlId = (char *) json_string_value(jMsgId); // cast for now
-			}
+/**
+ * \brief Appends the string as it is (it must already be valid JSON).
+ */
+void jsonRaw(struct m_json *json, const char *raw) {
+	jsonBytes(json, raw, strlen(raw));
+}
 
-			// extract the 'cmd' property
-			json_t *jCmd = json_object_get(cmd.jsonMessage, "cmd");
-			if(! json_is_string(jCmd)) {
-				syslog(LOG_WARNING, "unable to process message: property 'cmd' missing or invalid");
-				replyWithPropertyError(&cmd, "cmd");
-				json_decref(cmd.jsonMessage);
-				return;
-			} else {
-				cmd.command = (char *) json_string_value(jCmd); // cast for now
-			}
+/**
+ * \brief Appends the number.
+ */
+void jsonInt(struct m_json *json, long value) {
+	char digits[24];
+	char *p = digits + sizeof(digits);
+	unsigned long v = value < 0 ? - (unsigned long) value : (unsigned long) value;
+
+	do {
+		*--p = '0' + (v % 10);
+		v /= 10;
+	} while (v);
+
+	if (value < 0) {
+		*--p = '-';
+	}
 
-			// proper json structure, properties cmd and msgId have been verified here.
-			// also we know which device is used and where we should send our response to.
-			// finally try to dispatch the message to the appropriate command handler
-			// function if any. in case we don't know that command we respond with a
-			// generic error response.
+	jsonBytes(json, p, digits + sizeof(digits) - p);
+}
 
-			syslog(LOG_INFO, "processing cmd='%s' from msgId='%s' in topic='%s' for device='%s'\n",
-					cmd.command, cmd.correlId, topic, cmd.device->name);
+/**
+ * \brief Appends the string as a quoted and escaped JSON string.
+ */
+void jsonString(struct m_json *json, const char *string) {
+	static const char hex[] = "0123456789abcdef";
 
-			if(isCommand(&cmd, "quit")) {
-				handleQuit(&cmd);
-			} else if(isCommand(&cmd, "test")) {
-				handleTest(&cmd);
-			} else {
-				// commands in here need the actual hardware
+	jsonBytes(json, "\"", 1);
 
-				if(! m->deviceAvailable) {
-					// TODO: an unknown command without the actual hardware will also receive this response :-/
-					syslog(LOG_WARNING, "rejecting cmd='%s' from msgId='%s', hardware unavailable!\n", cmd.command, cmd.correlId);
-					replyWith(cmd.responseTopic, "{\"correlId\":\"%s\",\"error\":\"hardware unavailable\"}", cmd.correlId);
-				} else {
-					if(isCommand(&cmd, "configure-bezel")) {
-						handleConfigureBezel(&cmd);
-					} else if(isCommand(&cmd, "empty")) {
-						handleEmpty(&cmd);
-					} else if (isCommand(&cmd, "smart-empty")) {
-						handleSmartEmpty(&cmd);
-					} else if (isCommand(&cmd, "cashbox-payout-operation-data")) {
-						handleCashboxPayoutOperationData(&cmd);
-					} else if (isCommand(&cmd, "enable")) {
-						handleEnable(&cmd);
-					} else if (isCommand(&cmd, "disable")) {
-						handleDisable(&cmd);
-					} else if(isCommand(&cmd, "enable-channels")) {
-						handleEnableChannels(&cmd);
-					} else if(isCommand(&cmd, "disable-channels")) {
-						handleDisableChannels(&cmd);
-					} else if(isCommand(&cmd, "inhibit-channels")) {
-						handleInhibitChannels(&cmd);
-					} else if (isCommand(&cmd, "test-float") || isCommand(&cmd, "do-float")) {
-						handleFloat(&cmd);
-					} else if (isCommand(&cmd, "test-payout") || isCommand(&cmd, "do-payout")) {
-						handlePayout(&cmd);
-					} else if (isCommand(&cmd, "get-firmware-version")) {
-						handleGetFirmwareVersion(&cmd);
-					} else if (isCommand(&cmd, "get-dataset-version")) {
-						handleGetDatasetVersion(&cmd);
-					} else if (isCommand(&cmd, "channel-security-data")) {
-						handleChannelSecurityData(&cmd);
-					} else if (isCommand(&cmd, "get-all-levels")) {
-						handleGetAllLevels(&cmd);
-					} else if (isCommand(&cmd, "set-denomination-level")) {
-						handleSetDenominationLevels(&cmd);
-					} else if (isCommand(&cmd, "last-reject-note")) {
-						handleLastRejectNote(&cmd);
-					} else {
-						syslog(LOG_WARNING, "unable to process message: no handler for cmd='%s' found", cmd.command);
-						replyWith(cmd.responseTopic, "{\"correlId\":\"%s\",\"error\":\"unknown command\",\"cmd\":\"%s\"}",
-								cmd.correlId, cmd.command);
-					}
-				}
-			}
+	const char *start = string;
+	for (const char *p = string; *p; p++) {
+		unsigned char c = *p;
+		if (c != '"' && c != '\\' && c >= 0x20) {
+			continue;
+		}
 
-			// this will also free the other json objects associated with it
-			json_decref(cmd.jsonMessage);
+		jsonBytes(json, start, p - start);
+		if (c == '"' || c == '\\') {
+			char escaped[2] = { '\\', c };
+			jsonBytes(json, escaped, 2);
+		} else {
+			char escaped[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf] };
+			jsonBytes(json, escaped, 6);
 		}
+		start = p + 1;
 	}
+	jsonRaw(json, start);
+
+	jsonBytes(json, "\"", 1);
 }
 
 /**
- * \brief Callback function triggered by the redis client on connecting with
- * the "publish" context.
+ * \brief Appends a {"value":..,"level":..,"cc":".."} object as used for the levels.
  */
-void cbOnConnectPublishContext(const redisAsyncContext *c, int status) {
-	if (status != REDIS_OK) {
-		syslog(LOG_ERR, "cbOnConnectPublishContext: redis error: %s\n", c->errstr);
-		return;
-	}
-	syslog(LOG_INFO, "cbOnConnectPublishContext: connected to redis\n");
+void jsonLevel(struct m_json *json, long value, long level, const char *cc) {
+	jsonRaw(json, "{\"value\":");
+	jsonInt(json, value);
+	jsonRaw(json, ",\"level\":");
+	jsonInt(json, level);
+	jsonRaw(json, ",\"cc\":");
+	jsonString(json, cc);
+	jsonRaw(json, "}");
 }
 
 /**
- * \brief Callback function triggered by the redis client on disconnecting with
- * the "publish" context.
+ * \brief Starts a reply to the command, the JSON is {"correlId":"..." afterwards.
  */
-void cbOnDisconnectPublishContext(const redisAsyncContext *c, int status) {
-	if (status != REDIS_OK) {
-		syslog(LOG_ERR, "cbOnDisconnectPublishContext: redis error: %s\n", c->errstr);
-		return;
-	}
-	syslog(LOG_INFO, "cbOnDisconnectPublishContext: disconnected from redis\n");
+void jsonReplyStart(struct m_json *json, char *buffer, size_t capacity, struct m_command *cmd) {
+	jsonInit(json, buffer, capacity);
+	jsonRaw(json, "{\"correlId\":");
+	jsonString(json, cmd->correlId);
 }
 
 /**
- * \brief Callback function triggered by the redis client on connecting with
- * the "subscribe" context.
+ * \brief Appends length bytes as they are.
  */
-void cbOnConnectSubscribeContext(const redisAsyncContext *c, int status) {
-	if (status != REDIS_OK) {
-		syslog(LOG_ERR, "cbOnConnectSubscribeContext - redis error: %s\n", c->errstr);
+void msgpackBytes(struct m_msgpack *mp, const void *bytes, size_t length) {
+	if (mp->overflow || mp->length + length > mp->capacity) {
+		mp->overflow = 1;
 		return;
 	}
-	syslog(LOG_INFO, "cbOnConnectSubscribeContext - connected to redis\n");
 
-	redisAsyncContext *cNotConst = (redisAsyncContext*) c; // get rids of discarding qualifier \"const\" warning
+	memcpy(mp->buffer + mp->length, bytes, length);
+	mp->length += length;
+}
 
-	// subscribe the topics in redis from which we want to receive messages
-	redisAsyncCommand(cNotConst, cbOnMetacashMessage, NULL, "SUBSCRIBE metacash");
+/**
+ * \brief Appends the type byte followed by the value as a big endian number of size bytes.
+ */
+void msgpackTyped(struct m_msgpack *mp, unsigned char type, unsigned long long value, int size) {
+	unsigned char bytes[9];
+
+	bytes[0] = type;
+	for (int i = 0; i < size; i++) {
+		bytes[size - i] = value >> (8 * i);
+	}
 
-	// n.b: the same callback function handles both topics
-	redisAsyncCommand(cNotConst, cbOnRequestMessage, NULL, "SUBSCRIBE validator-request");
-	redisAsyncCommand(cNotConst, cbOnRequestMessage, NULL, "SUBSCRIBE hopper-request");
+	msgpackBytes(mp, bytes, size + 1);
 }
 
 /**
- * \brief Callback function triggered by the redis client on disconnecting with
- * the "subscribe" context.
+ * \brief Appends the integer in its shortest form.
  */
-void cbOnDisconnectSubscribeContext(const redisAsyncContext *c, int status) {
-	if (status != REDIS_OK) {
-		syslog(LOG_INFO, "cbOnDisconnectSubscribeContext - redis error: %s\n", c->errstr);
+void msgpackInt(struct m_msgpack *mp, long long value) {
+	if (value >= 0) {
+		if (value < 0x80) {
+			unsigned char fixint = value;
+			msgpackBytes(mp, &fixint, 1);
+		} else if (value <= 0xff) {
+			msgpackTyped(mp, 0xcc, value, 1);
+		} else if (value <= 0xffff) {
+			msgpackTyped(mp, 0xcd, value, 2);
+		} else if (value <= 0xffffffffLL) {
+			msgpackTyped(mp, 0xce, value, 4);
+		} else {
+			msgpackTyped(mp, 0xcf, value, 8);
+		}
+	} else {
+		if (value >= -32) {
+			unsigned char fixint = (unsigned char) value;
+			msgpackBytes(mp, &fixint, 1);
+		} else if (value >= -128) {
+			msgpackTyped(mp, 0xd0, value, 1);
+		} else if (value >= -32768) {
+			msgpackTyped(mp, 0xd1, value, 2);
+		} else if (value >= -2147483648LL) {
+			msgpackTyped(mp, 0xd2, value, 4);
+		} else {
+			msgpackTyped(mp, 0xd3, value, 8);
+		}
+	}
+}
+
+/**
+ * \brief Replaces the 5 bytes reserved at start by the shortest header of a map (fix 0x80)
+ * or array (fix 0x90) with count entries.
+ */
+void msgpackFinishContainer(struct m_msgpack *mp, size_t start, unsigned char fix, unsigned char type16,
+		unsigned long count) {
+	unsigned char header[5];
+	int size;
+
+	if (mp->overflow) {
 		return;
 	}
-	syslog(LOG_INFO, "cbOnDisconnectSubscribeContext - disconnected from redis\n");
+
+	if (count < 16) {
+		header[0] = fix | count;
+		size = 1;
+	} else if (count <= 0xffff) {
+		header[0] = type16;
+		header[1] = count >> 8;
+		header[2] = count;
+		size = 3;
+	} else {
+		header[0] = type16 + 1; // map32 / array32
+		header[1] = count >> 24;
+		header[2] = count >> 16;
+		header[3] = count >> 8;
+		header[4] = count;
+		size = 5;
+	}
+
+	memmove(mp->buffer + start + size, mp->buffer + start + 5, mp->length - start - 5);
+	memcpy(mp->buffer + start, header, size);
+	mp->length -= 5 - size;
 }
 
 /**
- * \brief This function never returns, it displays the reason argument and return code
- * in the syslog and exits immediately.
+ * \brief Parses the 4 hex digits of a \u escape, returns !=0 if they are malformed.
  */
-void die(char *reason, int rc) {
-	syslog(LOG_EMERG, "fatal error occured: %s, rc=%d", reason, rc);
-	syslog(LOG_EMERG, "exiting NOW");
-	exit(rc);
+int jsonHex4(const char *p, unsigned long *value) {
+	*value = 0;
+	for (int i = 0; i < 4; i++) {
+		if (! isxdigit((unsigned char) p[i])) {
+			return 1;
+		}
+		*value = *value * 16 + (isdigit((unsigned char) p[i]) ? p[i] - '0' : (tolower((unsigned char) p[i]) - 'a' + 10));
+	}
+	return 0;
 }
 
 /**
- * \brief Supports arguments -h (redis hostname), -p (redis port), -d (serial device name) and -?.
- * \details Warning: both "calls" to hopperEventHandler() and validatorEventHandler() in the callgraph are false positives!
- * \callgraph
+ * \brief Decodes the JSON string at *json (behind the opening quote) to out as UTF-8, returns
+ * the number of bytes or -1 if it is malformed. With out NULL only the length is determined.
+ * \details *json is moved behind the closing quote.
  */
-int main(int argc, char *argv[]) {
-	// setup logging via syslog
-	setlogmask(LOG_UPTO(LOG_INFO));
-	openlog("payoutd", LOG_CONS | LOG_PID | LOG_NDELAY, LOG_LOCAL1);
-	syslog(LOG_NOTICE, "Program started by User %d", getuid());
+long jsonUnescape(const char **json, unsigned char *out) {
+	const char *p = *json;
+	long length = 0;
 
-	// register interrupt handler for signals
-	signal(SIGTERM, signalHandler);
-	signal(SIGINT, signalHandler);
+	while (*p != '"') {
+		unsigned long c = (unsigned char) *p++;
 
-	struct m_metacash metacash;
-	metacash.deviceAvailable = 0;
-	metacash.quit = 0;
-	metacash.logSyslogStderr = 0; // default, override using -e
-	metacash.acceptCoins = 0; // default, override using -c
+		if (c == '\0') {
+			return -1;
+		}
 
-	metacash.serialDevice = "/dev/ttyACM0";	// default, override with -d argument
-	metacash.redisHost = "127.0.0.1";	// default, override with -h argument
-	metacash.redisPort = 6379;			// default, override with -p argument
+		if (c != '\\') {
+			// already UTF-8
+			if (out) {
+				out[length] = c;
+			}
+			length++;
+			continue;
+		}
 
-	metacash.hopper.id = 0x10; // 0X10 -> Smart Hopper ("Münzer")
-	metacash.hopper.name = "Mr. Coin";
-	metacash.hopper.key = DEFAULT_KEY;
-	metacash.hopper.eventHandlerFn = hopperEventHandler;
-
-	metacash.validator.id = 0x00; // 0x00 -> Smart Payout NV200 ("Scheiner")
-	metacash.validator.name = "Ms. Note";
-	metacash.validator.key = DEFAULT_KEY;
-	metacash.validator.eventHandlerFn = validatorEventHandler;
+		switch (*p++) {
+		case '"': c = '"'; break;
+		case '\\': c = '\\'; break;
+		case '/': c = '/'; break;
+		case 'b': c = '\b'; break;
+		case 'f': c = '\f'; break;
+		case 'n': c = '\n'; break;
+		case 'r': c = '\r'; break;
+		case 't': c = '\t'; break;
+		case 'u':
+			if (jsonHex4(p, &c)) {
+				return -1;
+			}
+			p += 4;
+			if (c >= 0xd800 && c < 0xdc00 && p[0] == '\\' && p[1] == 'u') {
+				unsigned long low;
+				if (! jsonHex4(p + 2, &low) && low >= 0xdc00 && low < 0xe000) {
+					c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+					p += 6;
+				}
+			}
+			break;
+		default:
+			return -1;
+		}
 
-	// parse the command line arguments
-	if (parseCmdLine(argc, argv, &metacash)) {
-		die("invalid command line", 1);
-		// never reached, already exited
+		unsigned char utf8[4];
+		int n;
+		if (c < 0x80) {
+			utf8[0] = c;
+			n = 1;
+		} else if (c < 0x800) {
+			utf8[0] = 0xc0 | (c >> 6);
+			utf8[1] = 0x80 | (c & 0x3f);
+			n = 2;
+		} else if (c < 0x10000) {
+			utf8[0] = 0xe0 | (c >> 12);
+			utf8[1] = 0x80 | ((c >> 6) & 0x3f);
+			utf8[2] = 0x80 | (c & 0x3f);
+			n = 3;
+		} else {
+			utf8[0] = 0xf0 | (c >> 18);
+			utf8[1] = 0x80 | ((c >> 12) & 0x3f);
+			utf8[2] = 0x80 | ((c >> 6) & 0x3f);
+			utf8[3] = 0x80 | (c & 0x3f);
+			n = 4;
+		}
+		if (out) {
+			memcpy(out + length, utf8, n);
+		}
+		length += n;
 	}
 
-	if(metacash.logSyslogStderr) {
-		closelog();
-		// also writeout syslog messages to stderr (intended for development purposes, you
-		// can enable this with the -e argument)
-		openlog("payoutd", LOG_PERROR | LOG_PID | LOG_NDELAY, LOG_LOCAL1);
+	*json = p + 1;
+	return length;
+}
+
+/**
+ * \brief Skips the whitespace.
+ */
+const char *jsonSkipSpace(const char *p) {
+	while (isspace((unsigned char) *p)) {
+		p++;
 	}
+	return p;
+}
 
-	syslog(LOG_NOTICE, "using redis at %s:%d and hardware device %s",
-			metacash.redisHost, metacash.redisPort, metacash.serialDevice);
+/**
+ * \brief Appends the JSON value at *json MessagePack encoded, returns !=0 if the JSON is malformed.
+ * \details *json is moved behind the value. Integers are written in their shortest form, containers
+ * get a placeholder header which is shrunk once the number of entries is known.
+ */
+int msgpackFromJson(struct m_msgpack *mp, const char **json) {
+	const char *p = jsonSkipSpace(*json);
 
-	// open the serial device
-	if (mcSspOpenSerialDevice(&metacash) == 0) {
-		metacash.deviceAvailable = 1;
+	if (*p == '{' || *p == '[') {
+		int object = *p == '{';
+		char close = object ? '}' : ']';
+		size_t start = mp->length;
+		unsigned long count = 0;
+
+		msgpackBytes(mp, "\0\0\0\0\0", 5); // replaced by the header, see msgpackFinishContainer()
+		p = jsonSkipSpace(p + 1);
+
+		if (*p == close) {
+			p++;
+		} else {
+			for (;;) {
+				if (object) {
+					p = jsonSkipSpace(p);
+					if (*p != '"' || msgpackFromJson(mp, &p)) {
+						return 1;
+					}
+					p = jsonSkipSpace(p);
+					if (*p++ != ':') {
+						return 1;
+					}
+				}
+				if (msgpackFromJson(mp, &p)) {
+					return 1;
+				}
+				count++;
+
+				p = jsonSkipSpace(p);
+				if (*p == ',') {
+					p++;
+				} else if (*p == close) {
+					p++;
+					break;
+				} else {
+					return 1;
+				}
+			}
+		}
+
+		msgpackFinishContainer(mp, start, object ? 0x80 : 0x90, object ? 0xde : 0xdc, count);
+	} else if (*p == '"') {
+		const char *q = ++p;
+		long length = jsonUnescape(&q, NULL);
+		if (length < 0) {
+			return 1;
+		}
+
+		if (length < 32) {
+			unsigned char fixstr = 0xa0 | length;
+			msgpackBytes(mp, &fixstr, 1);
+		} else if (length <= 0xff) {
+			msgpackTyped(mp, 0xd9, length, 1);
+		} else if (length <= 0xffff) {
+			msgpackTyped(mp, 0xda, length, 2);
+		} else {
+			msgpackTyped(mp, 0xdb, length, 4);
+		}
+
+		if (mp->overflow || mp->length + length > mp->capacity) {
+			mp->overflow = 1;
+			p = q;
+		} else {
+			mp->length += jsonUnescape(&p, mp->buffer + mp->length);
+		}
+	} else if (strncmp(p, "true", 4) == 0) {
+		msgpackBytes(mp, "\xc3", 1);
+		p += 4;
+	} else if (strncmp(p, "false", 5) == 0) {
+		msgpackBytes(mp, "\xc2", 1);
+		p += 5;
+	} else if (strncmp(p, "null", 4) == 0) {
+		msgpackBytes(mp, "\xc0", 1);
+		p += 4;
+	} else if (*p == '-' || isdigit((unsigned char) *p)) {
+		char *end;
+		long long value = strtoll(p, &end, 10);
+
+		if (end == p) {
+			return 1;
+		}
+		if (*end == '.' || *end == 'e' || *end == 'E') {
+			double d = strtod(p, &end);
+			unsigned long long bits;
+			memcpy(&bits, &d, sizeof(bits));
+			msgpackTyped(mp, 0xcb, bits, 8); // float 64
+		} else {
+			msgpackInt(mp, value);
+		}
+		p = end;
 	} else {
-		syslog(LOG_ALERT, "cash hardware unavailable");
+		return 1;
 	}
 
-	// setup the ssp commands, configure and initialize the hardware
-	setup(&metacash);
+	*json = p;
+	return 0;
+}
 
-	syslog(LOG_NOTICE, "open for business :D");
+/**
+ * \brief Sets up the topics of the event batches (after topicsInit()).
+ */
+void eventsInit() {
+	pollEvents.hopper.topic = topics.hopperEvent;
+	pollEvents.hopper.binTopic = topics.hopperEventBin;
+	pollEvents.validator.topic = topics.validatorEvent;
+	pollEvents.validator.binTopic = topics.validatorEventBin;
+}
 
-	publishPayoutEvent("{ \"event\":\"started\" }");
+/**
+ * \brief Returns the event batch of the device.
+ */
+struct m_eventBatch *eventsOf(struct m_device *device) {
+	return device == &device->metacash->hopper ? &pollEvents.hopper : &pollEvents.validator;
+}
 
-	event_base_dispatch(metacash.eventBase); // blocking until exited via api-call
+/**
+ * \brief Starts collecting the events of a poll cycle, see eventsEnd().
+ */
+void eventsBegin(struct m_eventBatch *batch) {
+	if (! pollEvents.perPoll && ! pollEvents.binary) {
+		return;
+	}
 
-	publishPayoutEvent("{ \"event\":\"exiting\" }");
+	batch->active = 1;
+	batch->count = 0;
+	batch->time = clockMonotonicMs();
+	jsonInit(&batch->json, batch->buffer, sizeof(batch->buffer));
+}
 
-	syslog(LOG_NOTICE, "shutting down");
+/**
+ * \brief Publishes the events collected since eventsBegin() as one message.
+ * \details The message is {"seq":<n>,"time":<monotonic ms>,"events":[...]}, with -E it goes to the
+ * event topic and with -B MessagePack encoded to the .bin topic. Nothing is published without events.
+ */
+void eventsEnd(struct m_eventBatch *batch) {
+	if (! batch->active) {
+		return;
+	}
+	batch->active = 0;
 
-	if (metacash.deviceAvailable) {
-		mcSspCloseSerialDevice(&metacash);
+	if (batch->count == 0) {
+		return;
 	}
 
-	// cleanup stuff before exiting.
+	char buffer[EVENTS_BUFFER_SIZE + 96];
+	struct m_json json;
 
-	// redis
-	redisAsyncFree(redisPublishCtx);
-	redisAsyncFree(redisSubscribeCtx);
+	batch->seq++;
 
-	// libevent
-	event_base_free(metacash.eventBase);
+	jsonInit(&json, buffer, sizeof(buffer));
+	jsonRaw(&json, "{\"seq\":");
+	jsonInt(&json, (long) batch->seq);
+	jsonRaw(&json, ",\"time\":");
+	jsonInt(&json, (long) batch->time);
+	jsonRaw(&json, ",\"events\":[");
+	jsonBytes(&json, batch->json.buffer, batch->json.length);
+	jsonRaw(&json, "]}");
 
-	// syslog
-	syslog(LOG_NOTICE, "exiting NOW");
-	closelog();
+	if (pollEvents.perPoll) {
+		publishRaw(batch->topic, json.buffer, json.length);
+	}
 
-	return 0;
+	if (pollEvents.binary) {
+		// never larger than the JSON
+		unsigned char binary[EVENTS_BUFFER_SIZE + 96];
+		struct m_msgpack mp = { binary, sizeof(binary), 0, 0 };
+		const char *p = json.buffer;
+
+		if (msgpackFromJson(&mp, &p) || mp.overflow) {
+			logMessage(LOG_ERR, "eventsEnd: could not encode the events for topic='%s'\n", batch->binTopic);
+		} else {
+			publishRaw(batch->binTopic, (const char *) binary, mp.length);
+		}
+	}
 }
 
 /**
- * \brief Parse the command line arguments.
+ * \brief Publishes the event (a JSON object), during a poll cycle it is collected in the batch.
+ * \details An event outside of a poll cycle (ex. "levels-changed" after a request) is a batch of its own.
  */
-int parseCmdLine(int argc, char *argv[], struct m_metacash *metacash) {
-	opterr = 0;
+void eventsAdd(struct m_eventBatch *batch, const char *message, size_t length) {
+	if (! pollEvents.perPoll) {
+		// the JSON events are still published one by one, only the .bin topic gets batches
+		publishRaw(batch->topic, message, length);
+		if (! pollEvents.binary) {
+			return;
+		}
+	}
 
-	int c;
-	while ((c = getopt(argc, argv, "ech:p:d:")) != -1) {
-		switch (c) {
-		case 'h':
-			metacash->redisHost = optarg;
-			break;
-		case 'p':
-			metacash->redisPort = atoi(optarg);
-			break;
-		case 'd':
-			metacash->serialDevice = optarg;
-			break;
-		case 'c':
-			metacash->acceptCoins = 1;
-			break;
-		case 'e':
-			metacash->logSyslogStderr = 1;
-			break;
-		case '?':
-			if (optopt == 'h' || optopt == 'p' || optopt == 'd') {
-				fprintf(stderr, "Option -%c requires an argument.\n", optopt);
-				syslog(LOG_ERR, "Option -%c requires an argument.\n", optopt);
-			} else if (isprint(optopt)) {
-				fprintf(stderr, "Unknown option '-%c'.\n", optopt);
-				syslog(LOG_ERR, "Unknown option '-%c'.\n", optopt);
-			} else {
-				fprintf(stderr, "Unknown option character 'x%x'.\n", optopt);
-				syslog(LOG_ERR, "Unknown option character 'x%x'.\n", optopt);
-			}
-			return 1;
-		default:
-			fprintf(stderr, "Unknown argument: %c", c);
-			syslog(LOG_ERR, "Unknown argument: %c", c);
-			return 1;
+	int single = ! batch->active;
+	if (single) {
+		eventsBegin(batch);
+	}
+
+	size_t mark = batch->json.length;
+	if (batch->count > 0) {
+		jsonRaw(&batch->json, ",");
+	}
+	jsonBytes(&batch->json, message, length);
+
+	if (batch->json.overflow) {
+		// the batch is full, publish it and continue with a new one
+		batch->json.overflow = 0;
+		batch->json.length = mark;
+		batch->json.buffer[mark] = '\0';
+		eventsEnd(batch);
+		eventsBegin(batch);
+		jsonBytes(&batch->json, message, length);
+	}
+
+	if (batch->json.overflow) {
+		logMessage(LOG_ERR, "eventsAdd: event for topic='%s' too large\n", batch->topic);
+		jsonInit(&batch->json, batch->buffer, sizeof(batch->buffer));
+	} else {
+		batch->count++;
+	}
+
+	if (single) {
+		eventsEnd(batch);
+	}
+}
+
+/**
+ * \brief Formats the event and publishes it with eventsAdd().
+ */
+void eventsPublishV(struct m_eventBatch *batch, const char *format, va_list args) {
+	if (! pollEvents.perPoll && ! pollEvents.binary) {
+		publishV(batch->topic, NULL, format, args);
+		return;
+	}
+
+	char buffer[JSON_BUFFER_SIZE];
+	int length = vsnprintf(buffer, sizeof(buffer), format, args);
+	if (length < 0 || (size_t) length >= sizeof(buffer)) {
+		logMessage(LOG_ERR, "eventsPublishV: could not format event for topic='%s'\n", batch->topic);
+		return;
+	}
+
+	eventsAdd(batch, buffer, length);
+}
+
+/**
+ * \brief Publishes the JSON written with the m_json writer to the topic without formatting it again.
+ * \details A response which didn't fit into the buffer is replaced by an error, the client gets
+ * an answer instead of waiting for its timeout.
+ */
+int replyWithJson(char *topic, struct m_json *json) {
+	if (json->overflow) {
+		struct m_command *cmd = currentCommand();
+
+		logMessage(LOG_ERR, "replyWithJson: response for topic='%s' too large\n", topic);
+		if (cmd) {
+			replyWith(topic, "{\"correlId\":\"%s\",\"error\":\"response too large\"}", cmd->correlId);
 		}
+		return 1;
+	}
+
+	struct m_json *capture = replyCapture();
+	if (capture) {
+		jsonBytes(capture, json->buffer, json->length);
+		return 0;
 	}
 
+	idempotencyRecord(currentCommand(), json->buffer, json->length);
+	publishWithTail(topic, json->buffer, json->length, replyTail());
 	return 0;
 }
 
 /**
- * \brief Callback function used for inspecting and publishing events reported by the Hopper hardware.
+ * \brief Helper function to publish a reply to a message which was missing a
+ * mandatory property (or the property was of the wrong type).
+ * \details Details only to get graph.
+ * \callergraph
  */
-void hopperEventHandler(struct m_device *device,
-		struct m_metacash *metacash, SSP_POLL_DATA6 *poll) {
-	for (unsigned char i = 0; i < poll->event_count; ++i) {
-		switch (poll->events[i].event) {
-		case SSP_POLL_RESET:
-			publishHopperEvent("{\"event\":\"unit reset\"}");
-			// Make sure we are using ssp version 6
-			if (ssp6_host_protocol(&device->sspC, 0x06) != SSP_RESPONSE_OK) {
-				die("hopperEventHandler: SSP Host Protocol Failed", 3);
-				// never reached, already exited
-			}
-			break;
-		case SSP_POLL_READ:
-			// the \"read\" event contains 1 data value, which if >0 means a note has been validated and is in escrow
-			if (poll->events[i].data1 > 0) {
-				publishHopperEvent("{\"event\":\"read\",\"channel\":%ld}", poll->events[i].data1);
-			} else {
-				// this is reported more than once for a single note
-				publishHopperEvent("{\"event\":\"reading\"}");
-			}
-			break;
-		case SSP_POLL_TIMEOUT:
-			publishHopperEvent("{\"event\":\"timeout\",\"amount\":%ld,\"cc\":\"%s\"}", poll->events[i].data1, poll->events[i].cc);
-			break;
-		case SSP_POLL_DISPENSING:
-			publishHopperEvent("{\"event\":\"dispensing\",\"amount\":%ld}", poll->events[i].data1);
-			break;
-		case SSP_POLL_DISPENSED:
-			publishHopperEvent("{\"event\":\"dispensed\",\"amount\":%ld}", poll->events[i].data1);
-			break;
-		case SSP_POLL_FLOATING:
-			publishHopperEvent("{\"event\":\"floating\",\"amount\":%ld,\"cc\":\"%s\"}", poll->events[i].data1, poll->events[i].cc);
-			break;
-		case SSP_POLL_FLOATED:
-			publishHopperEvent("{\"event\":\"floated\",\"amount\":%ld,\"cc\":\"%s\"}", poll->events[i].data1, poll->events[i].cc);
-			break;
-		case SSP_POLL_CASHBOX_PAID:
-			publishHopperEvent("{\"event\":\"cashbox paid\",\"amount\":%ld,\"cc\":\"%s\"}", poll->events[i].data1, poll->events[i].cc);
-			break;
-		case SSP_POLL_JAMMED:
-			publishHopperEvent("{\"event\":\"jammed\"}");
-			break;
-		case SSP_POLL_FRAUD_ATTEMPT:
-			publishHopperEvent("{\"event\":\"fraud attempt\"}");
-			break;
-		case SSP_POLL_COIN_CREDIT:
-			publishHopperEvent("{\"event\":\"coin credit\",\"amount\":%ld,\"cc\":\"%s\"}", poll->events[i].data1, poll->events[i].cc);
-			break;
-		case SSP_POLL_EMPTY:
-			publishHopperEvent("{\"event\":\"empty\"}");
-			break;
-		case SSP_POLL_EMPTYING:
-			publishHopperEvent("{\"event\":\"emptying\"}");
-			break;
-		case SSP_POLL_SMART_EMPTYING:
-			publishHopperEvent("{\"event\":\"smart emptying\",\"amount\":%ld,\"cc\":\"%s\"}", poll->events[i].data1, poll->events[i].cc);
-			break;
-		case SSP_POLL_SMART_EMPTIED:
-			publishHopperEvent("{\"event\":\"smart emptied\",\"amount\":%ld,\"cc\":\"%s\"}", poll->events[i].data1, poll->events[i].cc);
-			break;
-		case SSP_POLL_CREDIT:
-			// The note which was in escrow has been accepted
-			publishHopperEvent("{\"event\":\"credit\",\"channel\":%ld,\"cc\":\"%s\"}", poll->events[i].data1, poll->events[i].cc);
-			break;
-		case SSP_POLL_INCOMPLETE_PAYOUT:
-			// the validator shutdown during a payout, this event is reporting that some value remains to payout
-			publishHopperEvent(
-					"{\"event\":\"incomplete payout\",\"dispensed\":%ld,\"requested\":%ld,\"cc\":\"%s\"}",
-					poll->events[i].data1, poll->events[i].data2,
-					poll->events[i].cc);
-			break;
-		case SSP_POLL_INCOMPLETE_FLOAT:
-			// the validator shutdown during a float, this event is reporting that some value remains to float
-			publishHopperEvent(
-					"{\"event\":\"incomplete float\",\"dispensed\":%ld,\"requested\":%ld,\"cc\":\"%s\"}",
-					poll->events[i].data1, poll->events[i].data2,
-					poll->events[i].cc);
-			break;
-		case SSP_POLL_DISABLED:
-			// The unit has been disabled
-			publishHopperEvent("{\"event\":\"disabled\"}");
-			break;
-		case SSP_POLL_CALIBRATION_FAIL:
-			// the hopper calibration has failed. An extra byte is available with an error code.
-			switch (poll->events[i].data1) {
-			case NO_FAILUE:
-				publishHopperEvent("{\"event\":\"calibration fail\",\"error\":\"no error\"}");
-				break;
-			case SENSOR_FLAP:
-				publishHopperEvent("{\"event\":\"calibration fail\",\"error\":\"sensor flap\"}");
+int replyWithPropertyError(struct m_command *cmd, char *name) {
+	char *msgId = "unknown";
+	if(cmd->msgId) {
+		msgId = cmd->msgId;
+	}
+
+	char *correlId = "unknown";
+	if(cmd->correlId) {
+		correlId = cmd->correlId;
+	}
+
+	return replyWith(cmd->responseTopic,
+			"{\"msgId\":\"%s\",\"correlId\":\"%s\",\"error\":\"Property '%s' missing or of wrong type\"}",
+			msgId,
+			correlId,
+			name);
+}
+
+/**
+ * \brief Helper function to publish a reply to a message which contains a human readable
+ * version of the SSP response.
+ * \details Details only to get graph.
+ * \callergraph
+ */
+int replyWithSspResponse(struct m_command *cmd, SSP_RESPONSE_ENUM response) {
+	char buffer[JSON_BUFFER_SIZE];
+	struct m_json json;
+
+	jsonInit(&json, buffer, sizeof(buffer));
+	jsonRaw(&json, "{\"msgId\":");
+	jsonString(&json, cmd->msgId);
+	jsonRaw(&json, ",\"correlId\":");
+	jsonString(&json, cmd->correlId);
+
+	if(response == SSP_RESPONSE_OK) {
+		jsonRaw(&json, ",\"result\":\"ok\"}");
+	} else {
+		char *errorMsg;
+
+		switch(response) {
+			case SSP_RESPONSE_UNKNOWN_COMMAND:
+				errorMsg = "unknown command";
 				break;
-			case SENSOR_EXIT:
-				publishHopperEvent("{\"event\":\"calibration fail\",\"error\":\"sensor exit\"}");
+			case SSP_RESPONSE_INCORRECT_PARAMETERS:
+				errorMsg = "incorrect parameters";
 				break;
-			case SENSOR_COIL1:
-				publishHopperEvent("{\"event\":\"calibration fail\",\"error\":\"sensor coil 1\"}");
+			case SSP_RESPONSE_INVALID_PARAMETER:
+				errorMsg = "invalid parameter";
 				break;
-			case SENSOR_COIL2:
-				publishHopperEvent("{\"event\":\"calibration fail\",\"error\":\"sensor coil 2\"}");
+			case SSP_RESPONSE_COMMAND_NOT_PROCESSED:
+				errorMsg = "command not processed";
 				break;
-			case NOT_INITIALISED:
-				publishHopperEvent("{\"event\":\"calibration fail\",\"error\":\"not initialized\"}");
+			case SSP_RESPONSE_SOFTWARE_ERROR:
+				errorMsg = "software error";
 				break;
-			case CHECKSUM_ERROR:
-				publishHopperEvent("{\"event\":\"calibration fail\",\"error\":\"checksum error\"}");
+			case SSP_RESPONSE_CHECKSUM_ERROR:
+				errorMsg = "checksum error";
 				break;
-			case COMMAND_RECAL:
-				publishHopperEvent("{\"event\":\"recalibrating\"}");
-				ssp6_run_calibration(&device->sspC);
+			case SSP_RESPONSE_FAILURE:
+				errorMsg = "failure";
 				break;
-			}
-			break;
-		default:
-			// fallback only. in case we got a message which is not handled above.
-			// if you can see this have a look in the SSP reference manual what
-			// the message is about.
-			publishHopperEvent("{\"event\":\"unknown\",\"id\":\"0x%02X\"}", poll->events[i].event);
-			break;
+			case SSP_RESPONSE_HEADER_FAILURE:
+				errorMsg = "header failure";
+				break;
+			case SSP_RESPONSE_KEY_NOT_SET:
+				errorMsg = "key not set";
+				break;
+			case SSP_RESPONSE_TIMEOUT:
+				errorMsg = "timeout";
+				break;
+			default:
+				errorMsg = "unknown";
+		}
+
+		jsonRaw(&json, ",\"sspError\":");
+		jsonString(&json, errorMsg);
+		jsonRaw(&json, "}");
+	}
+
+	return replyWithJson(cmd->responseTopic, &json);
+}
+
+/**
+ * \brief Publishes a message about the operation in flight on the device to the response topic
+ * of the request which started it, with final!=0 the operation is over.
+ * \details key is "progress" (value is the state reported by the device), "result" or "error".
+ */
+void operationPublish(struct m_device *device, const char *key, const char *value, long amount, int final) {
+	struct m_operation *operation = &device->operation;
+	char buffer[JSON_BUFFER_SIZE];
+	struct m_json json;
+
+	char msgId[37];
+	uuid_t uuid;
+	uuid_generate_time_safe(uuid);
+	uuid_unparse_lower(uuid, msgId);
+
+	jsonInit(&json, buffer, sizeof(buffer));
+	jsonRaw(&json, "{\"msgId\":");
+	jsonString(&json, msgId);
+	jsonRaw(&json, ",\"correlId\":");
+	jsonString(&json, operation->correlId);
+	jsonRaw(&json, ",\"cmd\":");
+	jsonString(&json, operation->command);
+	jsonRaw(&json, ",\"");
+	jsonRaw(&json, key);
+	jsonRaw(&json, "\":");
+	jsonString(&json, value);
+	jsonRaw(&json, ",\"amount\":");
+	jsonInt(&json, amount);
+	if (operation->requested) {
+		jsonRaw(&json, ",\"requested\":");
+		jsonInt(&json, operation->requested);
+	}
+	if (final) {
+		jsonRaw(&json, ",\"duration\":");
+		jsonInt(&json, clockMonotonicMs() - operation->started);
+		long long total = levelsTotal(device);
+		if (total >= 0) {
+			jsonRaw(&json, ",\"total\":");
+			jsonInt(&json, total);
 		}
+		operation->active = 0;
+	}
+	jsonRaw(&json, "}");
+
+	// not a reply to the command processed right now (ex. "superseded" while the next payout
+	// starts): no queue statistics, no capture and not remembered for retries of that command
+	if (json.overflow) {
+		logMessage(LOG_ERR, "operationPublish: message for topic='%s' too large\n", operation->responseTopic);
+		return;
 	}
+	publishWithTail(operation->responseTopic, json.buffer, json.length, NULL);
 }
 
 /**
- * \brief Callback function used for inspecting and publishing events reported by the Validator hardware.
+ * \brief Registers the operation the command just started on its device and switches to the fast poll rate.
  */
-void validatorEventHandler(struct m_device *device,
-		struct m_metacash *metacash, SSP_POLL_DATA6 *poll) {
-	for (unsigned char i = 0; i < poll->event_count; ++i) {
+void operationStart(struct m_command *cmd, long requested) {
+	struct m_operation *operation = &cmd->device->operation;
+
+	if (operation->active) {
+		// the device accepted a new one, so the old one is over without us noticing
+		operationPublish(cmd->device, "error", "superseded", 0, 1);
+	}
+
+	operation->active = 1;
+	snprintf(operation->command, sizeof(operation->command), "%s", cmd->command);
+	snprintf(operation->correlId, sizeof(operation->correlId), "%s", cmd->correlId);
+	operation->responseTopic = cmd->responseTopic;
+	operation->requested = requested;
+	operation->started = clockMonotonicMs();
+	operation->progress = -1;
+
+	pollOperationStarted(cmd->device);
+}
+
+/**
+ * \brief Publishes the progress and the end of the operation in flight as reported by the poll.
+ * \details A progress message is only published when the amount changed. The operation ends with
+ * "result":"completed" or an "error" ("incomplete", "timeout", "jammed", "reset"), or after
+ * OPERATION_TIMEOUT ms without any of them.
+ */
+void operationAfterPoll(struct m_device *device, SSP_POLL_DATA6 *poll) {
+	struct m_operation *operation = &device->operation;
+
+	if (! operation->active) {
+		return;
+	}
+
+	for (unsigned int i = 0; i < poll->event_count; ++i) {
+		long data1 = poll->events[i].data1;
+		const char *progress = NULL;
+
 		switch (poll->events[i].event) {
-		case SSP_POLL_RESET:
-			publishValidatorEvent("{\"event\":\"unit reset\"}");
-			// Make sure we are using ssp version 6
-			if (ssp6_host_protocol(&device->sspC, 0x06) != SSP_RESPONSE_OK) {
-				die("validatorEventHandler: SSP Host Protocol Failed", 3);
-				// never reached, already exited
-			}
-			break;
-		case SSP_POLL_READ:
-			// the \"read\" event contains 1 data value, which if >0 means a note has been validated and is in escrow
-			if (poll->events[i].data1 > 0) {
-				// The note which was in escrow has been accepted
-				unsigned long amount =
-						device->sspSetupReq.ChannelData[poll->events[i].data1 - 1].value
-								* 100;
-				publishValidatorEvent("{\"event\":\"read\",\"amount\":%ld,\"channel\":%ld}",
-						amount, poll->events[i].data1);
-			} else {
-				publishValidatorEvent("{\"event\":\"reading\"}");
-			}
+		case SSP_POLL_DISPENSING:
+			progress = "dispensing";
 			break;
-		case SSP_POLL_EMPTY:
-			publishValidatorEvent("{\"event\":\"empty\"}");
+		case SSP_POLL_FLOATING:
+			progress = "floating";
 			break;
 		case SSP_POLL_EMPTYING:
-			publishValidatorEvent("{\"event\":\"emptying\"}");
+			progress = "emptying";
 			break;
 		case SSP_POLL_SMART_EMPTYING:
-			publishValidatorEvent("{\"event\":\"smart emptying\"}");
+			progress = "smart emptying";
 			break;
+		case SSP_POLL_DISPENSED:
+		case SSP_POLL_FLOATED:
+		case SSP_POLL_EMPTY:
+		case SSP_POLL_SMART_EMPTIED:
+			operationPublish(device, "result", "completed", data1, 1);
+			return;
+		case SSP_POLL_INCOMPLETE_PAYOUT:
+		case SSP_POLL_INCOMPLETE_FLOAT:
+			operation->requested = poll->events[i].data2;
+			operationPublish(device, "error", "incomplete", data1, 1);
+			return;
 		case SSP_POLL_TIMEOUT:
-			publishValidatorEvent("{\"event\":\"timeout\",\"amount\":%ld,\"cc\":\"%s\"}", poll->events[i].data1, poll->events[i].cc);
+			operationPublish(device, "error", "timeout", data1, 1);
+			return;
+		case SSP_POLL_JAMMED:
+			operationPublish(device, "error", "jammed", 0, 1);
+			return;
+		case SSP_POLL_RESET:
+			operationPublish(device, "error", "reset", 0, 1);
+			return;
+		default:
 			break;
-		case SSP_POLL_CREDIT:
-			// The note which was in escrow has been accepted
-		{
-			unsigned long amount =
-					device->sspSetupReq.ChannelData[poll->events[i].data1 - 1].value
-							* 100;
-			publishValidatorEvent("{\"event\":\"credit\",\"amount\":%ld,\"channel\":%ld}",
-					amount, poll->events[i].data1);
 		}
+
+		if (progress && (data1 != operation->progress || operation->progress < 0)) {
+			operation->progress = data1;
+			operationPublish(device, "progress", progress, data1, 0);
+		}
+	}
+
+	operationCheckTimeout(device);
+}
+
+/**
+ * \brief Gives up the operation in flight with "error":"lost" once it took more than OPERATION_TIMEOUT ms.
+ * \details Called after every poll, also after the failed ones: a device which stopped answering
+ * never reports the end of the operation.
+ */
+void operationCheckTimeout(struct m_device *device) {
+	struct m_operation *operation = &device->operation;
+
+	if (operation->active && clockMonotonicMs() - operation->started > OPERATION_TIMEOUT) {
+		logMessage(LOG_WARNING, "operation cmd='%s' of msgId='%s' on device='%s' never finished\n",
+				operation->command, operation->correlId, device->name);
+		operationPublish(device, "error", "lost", operation->progress > 0 ? operation->progress : 0, 1);
+	}
+}
+
+/**
+ * \brief Handles the JSON "quit" command.
+ */
+void handleQuit(struct m_command *cmd) {
+	atomic_store(&receivedSignal, 1);
+	replyWithSspResponse(cmd, SSP_RESPONSE_OK); // :D
+}
+
+/**
+ * \brief Handles the JSON "empty" command.
+ */
+void handleEmpty(struct m_command *cmd) {
+	journalOperation(cmd, JOURNAL_EMPTY, 0);
+	SSP_RESPONSE_ENUM resp = mc_ssp_empty(&cmd->device->sspC);
+	journalOperationResult(cmd, resp);
+	if (resp == SSP_RESPONSE_OK) {
+		operationStart(cmd, 0);
+	}
+	replyWithSspResponse(cmd, resp);
+}
+
+/**
+ * \brief Handles the JSON "smart-empty" command.
+ */
+void handleSmartEmpty(struct m_command *cmd) {
+	journalOperation(cmd, JOURNAL_SMART_EMPTY, 0);
+	SSP_RESPONSE_ENUM resp = mc_ssp_smart_empty(&cmd->device->sspC);
+	journalOperationResult(cmd, resp);
+	if (resp == SSP_RESPONSE_OK) {
+		operationStart(cmd, 0);
+	}
+	replyWithSspResponse(cmd, resp);
+}
+
+/**
+ * \brief Answers "test-payout" from the level cache, returns 0 if the hardware has to be asked.
+ * \details The hardware is asked while an operation is pending, with "refresh":true, if the cache
+ * is not up to date or the amount is too large to be planned. A disabled device wouldn't pay out,
+ * that is answered like the hardware does.
+ */
+int payoutTestFromCache(struct m_command *cmd, int amount) {
+	char buffer[JSON_BUFFER_SIZE];
+	struct m_json json;
+
+	if (cmd->device->operationPending || (cmd->request.present & REQUEST_REFRESH)) {
+		return 0;
+	}
+
+	if (! cmd->device->enabled) {
+		replyWith(cmd->responseTopic, "{\"correlId\":\"%s\",\"error\":\"smart payout disabled\",\"cached\":true}",
+				cmd->correlId);
+		return 1;
+	}
+
+	solverInit(&planSolver);
+	if (solverAdd(&planSolver, cmd->device)) {
+		return 0;
+	}
+
+	char *error = NULL;
+	switch (solverPlan(&planSolver, amount)) {
+	case SOLVER_OK:
+		break;
+	case SOLVER_NOT_ENOUGH:
+		error = "not enough value in smart payout";
+		break;
+	case SOLVER_NO_EXACT:
+		error = "can't pay exact amount";
+		break;
+	default:
+		return 0;
+	}
+
+	if (error) {
+		replyWith(cmd->responseTopic, "{\"correlId\":\"%s\",\"error\":\"%s\",\"cached\":true}", cmd->correlId, error);
+		return 1;
+	}
+
+	jsonReplyStart(&json, buffer, sizeof(buffer), cmd);
+	jsonRaw(&json, ",\"result\":\"ok\",\"cached\":true,\"plan\":");
+	jsonPlan(&json, &planSolver, NULL);
+	jsonRaw(&json, "}");
+
+	replyWithJson(cmd->responseTopic, &json);
+	return 1;
+}
+
+/**
+ * \brief Handles the JSON "do-payout" and "test-payout" commands.
+ * \details "test-payout" is answered from the level cache if possible, see payoutTestFromCache().
+ */
+void handlePayout(struct m_command *cmd) {
+	int payoutOption = 0;
+
+	if (isCommand(cmd, "do-payout")) {
+		payoutOption = SSP6_OPTION_BYTE_DO;
+	} else {
+		payoutOption = SSP6_OPTION_BYTE_TEST;
+	}
+
+	if(! (cmd->request.present & REQUEST_AMOUNT)) {
+		replyWithPropertyError(cmd, "amount");
+		return;
+	}
+
+	int amount = cmd->request.amount;
+
+	if (payoutOption == SSP6_OPTION_BYTE_TEST && payoutTestFromCache(cmd, amount)) {
+		return;
+	}
+
+	if (payoutOption == SSP6_OPTION_BYTE_DO) {
+		journalOperation(cmd, JOURNAL_PAYOUT, amount);
+	}
+
+	SSP_RESPONSE_ENUM resp = ssp6_payout(&cmd->device->sspC, amount, CURRENCY,
+			payoutOption);
+
+	if (payoutOption == SSP6_OPTION_BYTE_DO) {
+		journalOperationResult(cmd, resp);
+	}
+
+	if (resp == SSP_RESPONSE_COMMAND_NOT_PROCESSED) {
+		char *error = NULL;
+		switch (cmd->device->sspC.ResponseData[1]) {
+		case 0x01:
+			error = "not enough value in smart payout";
 			break;
-		case SSP_POLL_INCOMPLETE_PAYOUT:
-			// the validator shutdown during a payout, this event is reporting that some value remains to payout
-			publishValidatorEvent(
-					"{\"event\":\"incomplete payout\",\"dispensed\":%ld,\"requested\":%ld,\"cc\":\"%s\"}",
-					poll->events[i].data1, poll->events[i].data2,
-					poll->events[i].cc);
+		case 0x02:
+			error = "can't pay exact amount";
 			break;
-		case SSP_POLL_INCOMPLETE_FLOAT:
-			// the validator shutdown during a float, this event is reporting that some value remains to float
-			publishValidatorEvent(
-					"{\"event\":\"incomplete float\",\"dispensed\":%ld,\"requested\":%ld,\"cc\":\"%s\"}",
-					poll->events[i].data1, poll->events[i].data2,
-					poll->events[i].cc);
-			break;
-		case SSP_POLL_REJECTING:
-			publishValidatorEvent("{\"event\":\"rejecting\"}");
-			break;
-		case SSP_POLL_REJECTED:
-			// The note was rejected
-			publishValidatorEvent("{\"event\":\"rejected\"}");
-			break;
-		case SSP_POLL_STACKING:
-			publishValidatorEvent("{\"event\":\"stacking\"}");
-			break;
-		case SSP_POLL_STORED:
-			// The note has been stored in the payout unit
-			publishValidatorEvent("{\"event\":\"stored\"}");
-			break;
-		case SSP_POLL_STACKED:
-			// The note has been stacked in the cashbox
-			publishValidatorEvent("{\"event\":\"stacked\"}");
-			break;
-		case SSP_POLL_SAFE_JAM:
-			publishValidatorEvent("{\"event\":\"safe jam\"}");
-			break;
-		case SSP_POLL_UNSAFE_JAM:
-			publishValidatorEvent("{\"event\":\"unsafe jam\"}");
+		case 0x03:
+			error = "smart payout busy";
 			break;
-		case SSP_POLL_DISABLED:
-			// The validator has been disabled
-			publishValidatorEvent("{\"event\":\"disabled\"}");
+		case 0x04:
+			error = "smart payout disabled";
 			break;
-		case SSP_POLL_FRAUD_ATTEMPT:
-			// The validator has detected a fraud attempt
-			publishValidatorEvent(
-					"{\"event\":\"fraud attempt\",\"dispensed\":%ld}",
-					poll->events[i].data1);
+		default:
+			error = "unknown";
 			break;
-		case SSP_POLL_STACKER_FULL:
-			// The cashbox is full
-			publishValidatorEvent("{\"event\":\"stacker full\"}");
+		}
+
+		replyWith(cmd->responseTopic, "{\"correlId\":\"%s\",\"error\":\"%s\"}", cmd->correlId, error);
+	} else {
+		if (resp == SSP_RESPONSE_OK && payoutOption == SSP6_OPTION_BYTE_DO) {
+			operationStart(cmd, amount);
+		}
+		replyWithSspResponse(cmd, resp);
+	}
+}
+
+/**
+ * \brief Handles the JSON "plan-payout" command.
+ * \details Plans "amount" with the cached levels of both devices, split between them where that
+ * needs fewer coins and notes. Nothing is paid. The levels of the device of the request topic are
+ * read if they are not up to date, the other device is left out ("skipped") if its cache isn't.
+ */
+void handlePlanPayout(struct m_command *cmd) {
+	char buffer[JSON_BUFFER_SIZE];
+	struct m_json json;
+
+	if(! (cmd->request.present & REQUEST_AMOUNT)) {
+		replyWithPropertyError(cmd, "amount");
+		return;
+	}
+
+	struct m_metacash *metacash = cmd->device->metacash;
+	struct m_device *devices[] = { &metacash->hopper, &metacash->validator };
+	const char *names[] = { "hopper", "validator" };
+	int skipped[2];
+
+	struct m_levelCache *levels = &cmd->device->levels;
+	if (metacash->deviceAvailable && ! cmd->device->operationPending && (! levels->valid || levels->stale)) {
+		levelsSync(cmd->device, 0);
+	}
+
+	solverInit(&planSolver);
+	for (unsigned int i = 0; i < 2; i++) {
+		skipped[i] = solverAdd(&planSolver, devices[i]);
+	}
+
+	int result = solverPlan(&planSolver, cmd->request.amount);
+
+	jsonReplyStart(&json, buffer, sizeof(buffer), cmd);
+	switch (result) {
+	case SOLVER_OK:
+		jsonRaw(&json, ",\"result\":\"ok\"");
+		break;
+	case SOLVER_NOT_ENOUGH:
+		jsonRaw(&json, ",\"error\":\"not enough value\"");
+		break;
+	case SOLVER_NO_EXACT:
+		jsonRaw(&json, ",\"error\":\"can't pay exact amount\"");
+		break;
+	default:
+		jsonRaw(&json, ",\"error\":\"amount too large to plan\"");
+		break;
+	}
+	jsonRaw(&json, ",\"amount\":");
+	jsonInt(&json, cmd->request.amount);
+
+	if (result == SOLVER_OK) {
+		jsonRaw(&json, ",\"devices\":[");
+		int first = 1;
+		for (unsigned int i = 0; i < 2; i++) {
+			long amount = 0;
+			for (unsigned int j = 0; j < planSolver.count; j++) {
+				if (planSolver.denomination[j].device == devices[i]) {
+					amount += planSolver.denomination[j].value * planSolver.denomination[j].count;
+				}
+			}
+			if (amount == 0) {
+				continue;
+			}
+			jsonRaw(&json, first ? "{\"device\":" : ",{\"device\":");
+			jsonString(&json, names[i]);
+			jsonRaw(&json, ",\"amount\":");
+			jsonInt(&json, amount);
+			jsonRaw(&json, ",\"plan\":");
+			jsonPlan(&json, &planSolver, devices[i]);
+			jsonRaw(&json, "}");
+			first = 0;
+		}
+		jsonRaw(&json, "]");
+	}
+
+	if (skipped[0] || skipped[1]) {
+		jsonRaw(&json, ",\"skipped\":[");
+		jsonString(&json, names[skipped[0] ? 0 : 1]);
+		if (skipped[0] && skipped[1]) {
+			jsonRaw(&json, ",");
+			jsonString(&json, names[1]);
+		}
+		jsonRaw(&json, "]");
+	}
+	jsonRaw(&json, "}");
+
+	replyWithJson(cmd->responseTopic, &json);
+}
+
+/**
+ * \brief Handles the JSON "do-float" and "test-float" commands.
+ */
+void handleFloat(struct m_command *cmd) {
+	// basically a copy of do/test-payout ...
+	int payoutOption = 0;
+
+	if (isCommand(cmd, "do-float")) {
+		payoutOption = SSP6_OPTION_BYTE_DO;
+	} else {
+		payoutOption = SSP6_OPTION_BYTE_TEST;
+	}
+
+	if(! (cmd->request.present & REQUEST_AMOUNT)) {
+		replyWithPropertyError(cmd, "amount");
+		return;
+	}
+
+	int amount = cmd->request.amount;
+
+	if (payoutOption == SSP6_OPTION_BYTE_DO) {
+		journalOperation(cmd, JOURNAL_FLOAT, amount);
+	}
+
+	SSP_RESPONSE_ENUM resp = mc_ssp_float(&cmd->device->sspC, amount, CURRENCY,
+			payoutOption);
+
+	if (payoutOption == SSP6_OPTION_BYTE_DO) {
+		journalOperationResult(cmd, resp);
+	}
+
+	if (resp == SSP_RESPONSE_COMMAND_NOT_PROCESSED) {
+		char *error = NULL;
+		switch (cmd->device->sspC.ResponseData[1]) {
+		case 0x01:
+			error = "not enough value in smart payout";
 			break;
-		case SSP_POLL_CASH_BOX_REMOVED:
-			// The cashbox has been removed
-			publishValidatorEvent("{\"event\":\"cashbox removed\"}");
+		case 0x02:
+			error = "can't pay exact amount";
 			break;
-		case SSP_POLL_CASH_BOX_REPLACED:
-			// The cashbox has been replaced
-			publishValidatorEvent("{\"event\":\"cashbox replaced\"}");
+		case 0x03:
+			error = "smart payout busy";
 			break;
-		case SSP_POLL_CLEARED_FROM_FRONT:
-			// A note was in the notepath at startup and has been cleared from the front of the validator
-			publishValidatorEvent("{\"event\":\"cleared from front\"}");
+		case 0x04:
+			error = "smart payout disabled";
 			break;
-		case SSP_POLL_CLEARED_INTO_CASHBOX:
-			// A note was in the notepath at startup and has been cleared into the cashbox
-			publishValidatorEvent("{\"event\":\"cleared into cashbox\"}");
+		default:
+			error = "unknown";
 			break;
-		case SSP_POLL_CALIBRATION_FAIL:
-			// the hopper calibration has failed. An extra byte is available with an error code.
-			switch (poll->events[i].data1) {
-			case NO_FAILUE:
-				publishValidatorEvent("{\"event\":\"calibration fail\",\"error\":\"no error\"}");
-				break;
-			case SENSOR_FLAP:
-				publishValidatorEvent("{\"event\":\"calibration fail\",\"error\":\"sensor flap\"}");
-				break;
-			case SENSOR_EXIT:
-				publishValidatorEvent("{\"event\":\"calibration fail\",\"error\":\"sensor exit\"}");
-				break;
-			case SENSOR_COIL1:
-				publishValidatorEvent("{\"event\":\"calibration fail\",\"error\":\"sensor coil 1\"}");
-				break;
-			case SENSOR_COIL2:
-				publishValidatorEvent("{\"event\":\"calibration fail\",\"error\":\"sensor coil 2\"}");
-				break;
-			case NOT_INITIALISED:
-				publishValidatorEvent("{\"event\":\"calibration fail\",\"error\":\"not initialized\"}");
-				break;
-			case CHECKSUM_ERROR:
-				publishValidatorEvent("{\"event\":\"calibration fail\",\"error\":\"checksum error\"}");
-				break;
-			case COMMAND_RECAL:
-				publishValidatorEvent("{\"event\":\"recalibrating\"}");
-				ssp6_run_calibration(&device->sspC);
-				break;
+		}
+		replyWith(cmd->responseTopic, "{\"correlId\":\"%s\",\"error\":\"%s\"}",
+				cmd->correlId, error);
+	} else {
+		if (resp == SSP_RESPONSE_OK && payoutOption == SSP6_OPTION_BYTE_DO) {
+			operationStart(cmd, amount);
+		}
+		replyWithSspResponse(cmd, resp);
+	}
+}
+
+/**
+ * \brief Print inhibits debug output.
+ */
+void dbgDisplayInhibits(unsigned char inhibits) {
+	logMessage(LOG_DEBUG, "dbgDisplayInhibits: inhibits are: 0=%d 1=%d 2=%d 3=%d 4=%d 5=%d 6=%d 7=%d\n",
+			(inhibits >> 0) & 1,
+			(inhibits >> 1) & 1,
+			(inhibits >> 2) & 1,
+			(inhibits >> 3) & 1,
+			(inhibits >> 4) & 1,
+			(inhibits >> 5) & 1,
+			(inhibits >> 6) & 1,
+			(inhibits >> 7) & 1);
+}
+
+/**
+ * \brief Returns the bits of the channels in a "channels" property, ex. "1,3" is 0x05.
+ */
+unsigned char channelBits(const char *channels) {
+	unsigned char bits = 0;
+
+	// 8 channels for now, a digit anywhere in the string selects the channel
+	for (int i = 0; i < 8; i++) {
+		if (strchr(channels, '1' + i) != NULL) {
+			bits |= 1 << i;
+		}
+	}
+
+	return bits;
+}
+
+/**
+ * \brief Handles the JSON "enable-channels" command.
+ */
+void handleEnableChannels(struct m_command *cmd) {
+	if(! (cmd->request.present & REQUEST_CHANNELS)) {
+		replyWithPropertyError(cmd, "channels");
+		return;
+	}
+
+	const char *channels = cmd->request.channels;
+
+	// this will be updated and written back to the device state
+	// if the update succeeds
+	unsigned char currentChannelInhibits = cmd->device->channelInhibits;
+	unsigned char highChannels = 0xFF; // actually not in use
+
+	// 8 channels for now, set the bit to 1 for each requested channel
+	currentChannelInhibits |= channelBits(channels);
+
+	SSP_RESPONSE_ENUM resp = ssp6_set_inhibits(&cmd->device->sspC, currentChannelInhibits, highChannels);
+
+	if(resp == SSP_RESPONSE_OK) {
+		// okay, update the channelInhibits in the device structure with the new state
+		cmd->device->channelInhibits = currentChannelInhibits;
+
+		if(0) {
+			logMessage(LOG_DEBUG, "enable-channels:\n");
+			dbgDisplayInhibits(currentChannelInhibits);
+		}
+	}
+
+	replyWithSspResponse(cmd, resp);
+}
+
+/**
+ * \brief Handles the JSON "disable-channels" command.
+ */
+void handleDisableChannels(struct m_command *cmd) {
+	if(! (cmd->request.present & REQUEST_CHANNELS)) {
+		replyWithPropertyError(cmd, "channels");
+		return;
+	}
+
+	const char *channels = cmd->request.channels;
+
+	// this will be updated and written back to the device state
+	// if the update succeeds
+	unsigned char currentChannelInhibits = cmd->device->channelInhibits;
+	unsigned char highChannels = 0xFF; // actually not in use
+
+	// 8 channels for now, set the bit to 0 for each requested channel
+	currentChannelInhibits &= ~channelBits(channels);
+
+	SSP_RESPONSE_ENUM resp = ssp6_set_inhibits(&cmd->device->sspC, currentChannelInhibits, highChannels);
+
+	if(resp == SSP_RESPONSE_OK) {
+		// okay, update the channelInhibits in the device structure with the new state
+		cmd->device->channelInhibits = currentChannelInhibits;
+
+		if(0) {
+			logMessage(LOG_DEBUG, "disable-channels:\n");
+			dbgDisplayInhibits(currentChannelInhibits);
+		}
+	}
+
+	replyWithSspResponse(cmd, resp);
+}
+
+/**
+ * \brief Handles the JSON "inhibit-channels" command.
+ */
+void handleInhibitChannels(struct m_command *cmd) {
+	if(! (cmd->request.present & REQUEST_CHANNELS)) {
+		replyWithPropertyError(cmd, "channels");
+		return;
+	}
+
+	const char *channels = cmd->request.channels;
+
+	unsigned char lowChannels = 0xFF;
+	unsigned char highChannels = 0xFF;
+
+	// 8 channels for now
+	lowChannels &= ~channelBits(channels);
+
+	replyWithSspResponse(cmd, ssp6_set_inhibits(&cmd->device->sspC, lowChannels, highChannels));
+}
+
+/**
+ * \brief Handles the JSON "enable" command.
+ */
+void handleEnable(struct m_command *cmd) {
+	SSP_RESPONSE_ENUM resp = ssp6_enable(&cmd->device->sspC);
+	if (resp == SSP_RESPONSE_OK) {
+		cmd->device->enabled = 1;
+	}
+	replyWithSspResponse(cmd, resp);
+}
+
+/**
+ * \brief Handles the JSON "disable" command.
+ */
+void handleDisable(struct m_command *cmd) {
+	SSP_RESPONSE_ENUM resp = ssp6_disable(&cmd->device->sspC);
+	if (resp == SSP_RESPONSE_OK) {
+		cmd->device->enabled = 0;
+	}
+	replyWithSspResponse(cmd, resp);
+}
+
+/**
+ * \brief Handles the JSON "set-denomination-levels" command.
+ */
+void handleSetDenominationLevels(struct m_command *cmd) {
+	if(! (cmd->request.present & REQUEST_LEVEL)) {
+		replyWithPropertyError(cmd, "level");
+		return;
+	}
+
+	if(! (cmd->request.present & REQUEST_AMOUNT)) {
+		replyWithPropertyError(cmd, "amount");
+		return;
+	}
+
+	int level = cmd->request.level;
+	int amount = cmd->request.amount;
+
+	if(level > 0) {
+		/* Quote from the spec -.-
+		 *
+		 * A command to increment the level of coins of a denomination stored in the hopper.
+		 * The command is formatted with the command byte first, amount of coins to *add*
+		 * as a 2-byte little endian, the value of coin as 2-byte little endian and
+		 * (if using protocol version 6) the country code of the coin as 3 byte ASCII. The level of coins for a
+		 * denomination can be set to zero by sending a zero level for that value.
+		 *
+		 * In a nutshell: This command behaves only with a level of 0 as expected (setting the absolute value),
+		 * otherwise it works like the not existing "increment denomination level" command.
+		 */
+
+		// ignore the result for now. we could not do much anyway now.
+		mc_ssp_set_denomination_level(&cmd->device->sspC, amount, 0, CURRENCY);
+	}
+
+	cmd->device->levels.stale = 1;
+
+	replyWithSspResponse(cmd, mc_ssp_set_denomination_level(&cmd->device->sspC, amount, level, CURRENCY));
+}
+
+/**
+ * \brief Handles the JSON "get-all-levels" command.
+ * \details Answered from the level cache unless it is stale or "refresh":true is given.
+ */
+void handleGetAllLevels(struct m_command *cmd) {
+	char buffer[JSON_BUFFER_SIZE];
+	struct m_json json;
+
+	struct m_levelCache *levels = &cmd->device->levels;
+
+	SSP_RESPONSE_ENUM resp = SSP_RESPONSE_OK;
+	if (! levels->valid || levels->stale || (cmd->request.present & REQUEST_REFRESH)) {
+		resp = levelsSync(cmd->device, 0);
+	}
+
+	if(resp == SSP_RESPONSE_OK) {
+		jsonReplyStart(&json, buffer, sizeof(buffer), cmd);
+		jsonRaw(&json, ",\"levels\":[");
+		for (unsigned int i = 0; i < levels->count; i++) {
+			if (i > 0) {
+				jsonRaw(&json, ","); // json array seperator
+			}
+			jsonLevel(&json, levels->level[i].value, levels->level[i].level, levels->level[i].cc);
+		}
+		jsonRaw(&json, "]}");
+		replyWithJson(cmd->responseTopic, &json);
+	} else {
+		replyWithSspResponse(cmd, resp);
+	}
+}
+
+/**
+ * \brief Handles the JSON "cashbox-payout-operation-data" command.
+ */
+void handleCashboxPayoutOperationData(struct m_command *cmd) {
+	char buffer[JSON_BUFFER_SIZE];
+	struct m_json json;
+
+	jsonReplyStart(&json, buffer, sizeof(buffer), cmd);
+	jsonRaw(&json, ",\"levels\":[");
+
+	SSP_RESPONSE_ENUM resp = mc_ssp_cashbox_payout_operation_data(&cmd->device->sspC, &json);
+
+	if(resp == SSP_RESPONSE_OK) {
+		jsonRaw(&json, "]}");
+		replyWithJson(cmd->responseTopic, &json);
+	} else {
+		replyWithSspResponse(cmd, resp);
+	}
+}
+
+
+/**
+ * \brief Makes sure the cached device info of the command's device is valid, reads it from
+ * the device if it isn't or the client asked for it with "refresh":true.
+ */
+SSP_RESPONSE_ENUM deviceInfoFor(struct m_command *cmd) {
+	struct m_device *device = cmd->device;
+
+	if (device->info.valid && ! (cmd->request.present & REQUEST_REFRESH)) {
+		return SSP_RESPONSE_OK;
+	}
+
+	return mcSspReadDeviceInfo(device);
+}
+
+/**
+ * \brief Handles the JSON "get-firmware-version" command.
+ * \details Answered from the device info cache unless "refresh":true is given.
+ */
+void handleGetFirmwareVersion(struct m_command *cmd) {
+	SSP_RESPONSE_ENUM resp = deviceInfoFor(cmd);
+
+	if(resp == SSP_RESPONSE_OK) {
+		replyWith(cmd->responseTopic, "{\"correlId\":\"%s\",\"version\":\"%s\"}",
+				cmd->correlId, cmd->device->info.firmwareVersion);
+	} else {
+		replyWithSspResponse(cmd, resp);
+	}
+}
+
+/**
+ * \brief Handles the JSON "get-dataset-version" command.
+ * \details Answered from the device info cache unless "refresh":true is given.
+ */
+void handleGetDatasetVersion(struct m_command *cmd) {
+	SSP_RESPONSE_ENUM resp = deviceInfoFor(cmd);
+
+	if(resp == SSP_RESPONSE_OK) {
+		replyWith(cmd->responseTopic, "{\"correlId\":\"%s\",\"version\":\"%s\"}",
+				cmd->correlId, cmd->device->info.datasetVersion);
+	} else {
+		replyWithSspResponse(cmd, resp);
+	}
+}
+
+/**
+ * \brief Handles the JSON "last-reject-note" command.
+ */
+void handleLastRejectNote(struct m_command *cmd) {
+	unsigned char reasonCode;
+
+	SSP_RESPONSE_ENUM resp = mc_ssp_last_reject_note(&cmd->device->sspC, &reasonCode);
+
+	if (resp == SSP_RESPONSE_OK) {
+		char *reason = NULL;
+
+		switch (reasonCode) {
+		case 0x00: // Note accepted
+			reason = "note accepted";
+			break;
+		case 0x01: // Note length incorrect
+			reason = "note length incorrect";
+			break;
+		case 0x02: // Average fail
+			reason = "internal validation failure: average fail";
+			break;
+		case 0x03: // Coastline fail
+			reason = "internal validation failure: coastline fail";
+			break;
+		case 0x04: // Graph fail
+			reason = "internal validation failure: graph fail";
+			break;
+		case 0x05: // Buried fail
+			reason = "internal validation failure: buried fail";
+			break;
+		case 0x06: // Channel inhibited
+			reason = "channel inhibited";
+			break;
+		case 0x07: // Second note inserted
+			reason = "second note inserted";
+			break;
+		case 0x08: // Reject by host
+			reason = "reject by host";
+			break;
+		case 0x09: // Note recognised in more than one channel
+			reason = "note recognised in more than one channel";
+			break;
+		case 0x0A: // Reject reason 10
+			reason = "rear sensor error";
+			break;
+		case 0x0B: // Note too long
+			reason = "note too long";
+			break;
+		case 0x0C: // Disabled by host
+			reason = "disabled by host";
+			break;
+		case 0x0D: // Mechanism slow/stalled
+			reason = "mechanism slow/stalled";
+			break;
+		case 0x0E: // Strimming attempt detected
+			reason = "strimming attempt detected";
+			break;
+		case 0x0F: // Fraud channel reject
+			reason = "fraud channel reject";
+			break;
+		case 0x10: // No notes inserted
+			reason = "no notes inserted";
+			break;
+		case 0x11: // Peak detect fail
+			reason = "peak detect fail";
+			break;
+		case 0x12: // Twisted note detected
+			reason = "twisted note detected";
+			break;
+		case 0x13: // Escrow time-out
+			reason = "escrow time-out";
+			break;
+		case 0x14: // Bar code scan fail
+			reason = "bar code scan fail";
+			break;
+		case 0x15: // Rear sensor 2 fail
+			reason = "rear sensor 2 fail";
+			break;
+		case 0x16: // Slot fail 1
+			reason = "slot fail 1";
+			break;
+		case 0x17: // Slot fail 2
+			reason = "slot fail 2";
+			break;
+		case 0x18: // Lens over-sample
+			reason = "lens over-sample";
+			break;
+		case 0x19: // Width detect fail
+			reason = "width detect fail";
+			break;
+		case 0x1A: // Short note detected
+			reason = "short note detected";
+			break;
+		case 0x1B: // Note payout
+			reason = "note payout";
+			break;
+		case 0x1C: // Unable to stack note
+			reason = "unable to stack note";
+			break;
+		default: // not defined in API doc
+			reason = "undefined in API";
+			break;
+		}
+
+		replyWith(cmd->responseTopic,
+				"{\"correlId\":\"%s\",\"reason\":\"%s\",\"code\":%ld}",
+				cmd->correlId, reason, reasonCode);
+	} else {
+		replyWithSspResponse(cmd, resp);
+	}
+}
+
+/**
+ * \brief Handles the JSON "channel-security" command.
+ */
+void handleChannelSecurityData(struct m_command *cmd) {
+	mc_ssp_channel_security_data(&cmd->device->sspC);
+}
+
+/**
+ * \brief Handles the JSON "stats" command, replies with the same metrics as published to "payout-metrics".
+ */
+void handleStats(struct m_command *cmd) {
+	char buffer[METRICS_BUFFER_SIZE];
+	struct m_json json;
+
+	jsonReplyStart(&json, buffer, sizeof(buffer), cmd);
+	jsonRaw(&json, ",");
+	metricsWrite(&json, cmd->device->metacash);
+	jsonRaw(&json, "}");
+
+	replyWithJson(cmd->responseTopic, &json);
+}
+
+/**
+ * \brief Handles the JSON "set-log-level" command.
+ * \details "logLevel" is the name of a syslog level ("debug", "info", "notice", "warning", "err", ...),
+ * messages with a lower priority are discarded from now on.
+ */
+void handleSetLogLevel(struct m_command *cmd) {
+	int level = -1;
+
+	if (cmd->request.present & REQUEST_LOG_LEVEL) {
+		for (int i = LOG_EMERG; i <= LOG_DEBUG; i++) {
+			if (! strcmp(cmd->request.logLevel, logLevelName(i))) {
+				level = i;
+			}
+		}
+	}
+
+	if (level < 0) {
+		replyWithPropertyError(cmd, "logLevel");
+		return;
+	}
+
+	int previous = atomic_exchange(&logRing.level, level);
+	logMessage(LOG_NOTICE, "log level changed from '%s' to '%s' by msgId='%s'\n", logLevelName(previous),
+			logLevelName(level), cmd->correlId);
+
+	replyWith(cmd->responseTopic, "{\"correlId\":\"%s\",\"result\":\"ok\",\"logLevel\":\"%s\",\"previous\":\"%s\"}",
+			cmd->correlId, logLevelName(level), logLevelName(previous));
+}
+
+/**
+ * \brief Handles the JSON "test" command
+ */
+void handleTest(struct m_command *cmd) {
+	replyWithSspResponse(cmd, SSP_RESPONSE_OK);
+}
+
+/**
+ * \brief Handles the JSON "configure-bezel" command.
+ */
+void handleConfigureBezel(struct m_command *cmd) {
+	if(! (cmd->request.present & REQUEST_R)) {
+		replyWithPropertyError(cmd, "r");
+		return;
+	}
+	unsigned char r = cmd->request.r;
+
+	if(! (cmd->request.present & REQUEST_G)) {
+		replyWithPropertyError(cmd, "g");
+		return;
+	}
+	unsigned char g = cmd->request.g;
+
+	if(! (cmd->request.present & REQUEST_B)) {
+		replyWithPropertyError(cmd, "b");
+		return;
+	}
+	unsigned char b = cmd->request.b;
+
+	if(! (cmd->request.present & REQUEST_TYPE)) {
+		replyWithPropertyError(cmd, "type");
+		return;
+	}
+	unsigned char type = cmd->request.type;
+
+	replyWithSspResponse(cmd,
+			mc_ssp_configure_bezel(&cmd->device->sspC, r, g, b, SSP_OPTION_NON_VOLATILE, type));
+}
+
+/** \brief Maximum number of commands in a "batch" request */
+#define BATCH_MAX_COMMANDS 64
+/** \brief Size of the stack buffer for the reply of a "batch" request */
+#define BATCH_BUFFER_SIZE 32768
+
+/**
+ * \brief Prepares sub as the sub-command jItem of the "batch" command cmd, its replies go to json.
+ */
+void batchInitCommand(struct m_command *sub, struct m_command *cmd, json_t *jItem, struct m_json *json) {
+	memset(sub, 0, sizeof(*sub));
+	sub->jsonMessage = jItem;
+	requestFromJson(&sub->request, jItem);
+	sub->command = (char *) sub->request.cmd;
+	sub->correlId = cmd->correlId;
+	sub->msgId = cmd->msgId;
+	sub->responseTopic = cmd->responseTopic;
+	sub->device = cmd->device;
+	sub->received = cmd->received;
+	sub->capture = json;
+}
+
+/**
+ * \brief Returns !=0 if the captured reply reports an error.
+ */
+int batchReplyFailed(const char *reply, size_t length) {
+	json_t *jReply = json_loadb(reply, length, 0, NULL);
+	int failed = jReply == NULL || json_object_get(jReply, "error") != NULL
+			|| json_object_get(jReply, "sspError") != NULL;
+	json_decref(jReply);
+	return failed;
+}
+
+/**
+ * \brief Returns !=0 if the item is a channel command which can be merged with its neighbours.
+ */
+int batchIsChannelItem(json_t *jItem) {
+	const char *command = json_string_value(json_object_get(jItem, "cmd"));
+	if (command == NULL || ! json_is_string(json_object_get(jItem, "channels"))) {
+		return 0;
+	}
+	return ! strcmp(command, "enable-channels") || ! strcmp(command, "disable-channels")
+			|| ! strcmp(command, "inhibit-channels");
+}
+
+/**
+ * \brief Runs the channel commands from index first on with a single SSP SET INHIBITS,
+ * returns the index of the first item not merged.
+ * \details The inhibits end up like the commands had been sent one after the other:
+ * the device gets the mask of the last one and channelInhibits is updated like each
+ * handle*Channels() would have done. All merged items share the SSP response.
+ */
+size_t batchRunChannels(struct m_command *cmd, json_t *jCmds, size_t first, struct m_json *json, int *failed) {
+	struct m_device *device = cmd->device;
+	unsigned char state = device->channelInhibits;
+	unsigned char inhibits = state;
+	size_t end = first;
+
+	for (; end < json_array_size(jCmds) && batchIsChannelItem(json_array_get(jCmds, end)); end++) {
+		json_t *jItem = json_array_get(jCmds, end);
+		const char *command = json_string_value(json_object_get(jItem, "cmd"));
+		unsigned char bits = channelBits(json_string_value(json_object_get(jItem, "channels")));
+
+		if (! strcmp(command, "enable-channels")) {
+			state |= bits;
+			inhibits = state;
+		} else if (! strcmp(command, "disable-channels")) {
+			state &= ~bits;
+			inhibits = state;
+		} else {
+			// inhibit-channels doesn't touch channelInhibits
+			inhibits = 0xFF & ~bits;
+		}
+	}
+
+	SSP_RESPONSE_ENUM resp = ssp6_set_inhibits(&device->sspC, inhibits, 0xFF);
+	if (resp == SSP_RESPONSE_OK) {
+		device->channelInhibits = state;
+	}
+
+	for (size_t i = first; i < end; i++) {
+		struct m_command sub;
+		batchInitCommand(&sub, cmd, json_array_get(jCmds, i), json);
+
+		jsonRaw(json, i > 0 ? ",{\"cmd\":" : "{\"cmd\":");
+		jsonString(json, sub.command);
+		jsonRaw(json, ",\"merged\":true,\"reply\":");
+		setCurrentSubCommand(&sub);
+		replyWithSspResponse(&sub, resp);
+		setCurrentSubCommand(NULL);
+		jsonRaw(json, "}");
+	}
+
+	*failed = resp != SSP_RESPONSE_OK;
+	return end;
+}
+
+/**
+ * \brief Runs a single item of the "batch" command, returns !=0 if it failed.
+ */
+int batchRunCommand(struct m_command *cmd, json_t *jItem, size_t index, struct m_json *json) {
+	struct m_command sub;
+
+	jsonRaw(json, index > 0 ? ",{\"cmd\":" : "{\"cmd\":");
+
+	if (! json_is_object(jItem) || ! json_is_string(json_object_get(jItem, "cmd"))) {
+		jsonRaw(json, "null,\"reply\":{\"error\":\"Property 'cmd' missing or of wrong type\"}}");
+		return 1;
+	}
+
+	batchInitCommand(&sub, cmd, jItem, json);
+	sub.handler = findCommandHandler(sub.command);
+
+	jsonString(json, sub.command);
+	jsonRaw(json, ",\"reply\":");
+
+	if (sub.handler && (sub.handler->fn == cmd->handler->fn || sub.handler->priority == PRIORITY_MONEY)) {
+		// no nesting, and money is only moved by requests of its own (see the journal and the streams)
+		jsonRaw(json, "{\"error\":\"not allowed in batch\"}}");
+		return 1;
+	}
+
+	size_t offset = json->length;
+
+	setCurrentSubCommand(&sub);
+	dispatchCommand(cmd->device->metacash, &sub);
+	setCurrentSubCommand(NULL);
+
+	int failed = 0;
+	if (json->length == offset) {
+		// the command has no reply
+		jsonRaw(json, "null");
+	} else {
+		failed = batchReplyFailed(json->buffer + offset, json->length - offset);
+	}
+	jsonRaw(json, "}");
+
+	return failed;
+}
+
+/**
+ * \brief Handles the JSON "batch" command.
+ * \details The commands in "cmds" are run one after the other without other requests
+ * of the device in between, consecutive channel commands are merged into one SSP call.
+ * With "stopOnError":true the remaining commands are skipped after the first failed one.
+ */
+void handleBatch(struct m_command *cmd) {
+	char buffer[BATCH_BUFFER_SIZE];
+	struct m_json json;
+
+	json_t *jCmds = json_object_get(cmd->jsonMessage, "cmds");
+	if(! json_is_array(jCmds)) {
+		replyWithPropertyError(cmd, "cmds");
+		return;
+	}
+
+	size_t count = json_array_size(jCmds);
+	if (count > BATCH_MAX_COMMANDS) {
+		replyWith(cmd->responseTopic, "{\"correlId\":\"%s\",\"error\":\"too many commands\",\"max\":%d}",
+				cmd->correlId, BATCH_MAX_COMMANDS);
+		return;
+	}
+
+	int stopOnError = json_is_true(json_object_get(cmd->jsonMessage, "stopOnError"));
+	int available = cmd->device->metacash->deviceAvailable;
+	unsigned int failed = 0;
+	size_t done = 0;
+
+	jsonReplyStart(&json, buffer, sizeof(buffer), cmd);
+	jsonRaw(&json, ",\"results\":[");
+
+	while (done < count && ! (stopOnError && failed)) {
+		json_t *jItem = json_array_get(jCmds, done);
+
+		if (available && batchIsChannelItem(jItem)) {
+			int channelsFailed;
+			size_t end = batchRunChannels(cmd, jCmds, done, &json, &channelsFailed);
+			failed += channelsFailed ? end - done : 0;
+			done = end;
+		} else {
+			failed += batchRunCommand(cmd, jItem, done, &json);
+			done++;
+		}
+	}
+
+	jsonRaw(&json, "],\"count\":");
+	jsonInt(&json, count);
+	jsonRaw(&json, ",\"completed\":");
+	jsonInt(&json, done);
+	jsonRaw(&json, ",\"failed\":");
+	jsonInt(&json, failed);
+	jsonRaw(&json, failed ? ",\"error\":\"command failed\"}" : ",\"result\":\"ok\"}");
+
+	if (json.overflow) {
+		logMessage(LOG_ERR, "handleBatch: reply for msgId='%s' too large\n", cmd->correlId);
+		replyWith(cmd->responseTopic, "{\"correlId\":\"%s\",\"error\":\"reply too large\",\"completed\":%zu}",
+				cmd->correlId, done);
+		return;
+	}
+
+	replyWithJson(cmd->responseTopic, &json);
+}
+
+/**
+ * \brief All known JSON commands, looked up with findCommandHandler().
+ * \details Must be sorted by name (checked by checkCommandHandlers() on startup).
+ */
+static const struct m_commandHandler commandHandlers[] = {
+	{ "batch", handleBatch, 0, DEVICE_ALL, PRIORITY_CONTROL },
+	{ "cashbox-payout-operation-data", handleCashboxPayoutOperationData, 1, DEVICE_ALL, PRIORITY_DIAGNOSTICS },
+	{ "channel-security-data", handleChannelSecurityData, 1, DEVICE_VALIDATOR, PRIORITY_DIAGNOSTICS },
+	{ "configure-bezel", handleConfigureBezel, 1, DEVICE_ALL, PRIORITY_CONTROL },
+	{ "disable", handleDisable, 1, DEVICE_ALL, PRIORITY_CONTROL },
+	{ "disable-channels", handleDisableChannels, 1, DEVICE_VALIDATOR, PRIORITY_CONTROL },
+	{ "do-float", handleFloat, 1, DEVICE_ALL, PRIORITY_MONEY },
+	{ "do-payout", handlePayout, 1, DEVICE_ALL, PRIORITY_MONEY },
+	{ "empty", handleEmpty, 1, DEVICE_ALL, PRIORITY_MONEY },
+	{ "enable", handleEnable, 1, DEVICE_ALL, PRIORITY_CONTROL },
+	{ "enable-channels", handleEnableChannels, 1, DEVICE_VALIDATOR, PRIORITY_CONTROL },
+	{ "get-all-levels", handleGetAllLevels, 1, DEVICE_ALL, PRIORITY_DIAGNOSTICS },
+	{ "get-dataset-version", handleGetDatasetVersion, 1, DEVICE_ALL, PRIORITY_DIAGNOSTICS },
+	{ "get-firmware-version", handleGetFirmwareVersion, 1, DEVICE_ALL, PRIORITY_DIAGNOSTICS },
+	{ "inhibit-channels", handleInhibitChannels, 1, DEVICE_VALIDATOR, PRIORITY_CONTROL },
+	{ "last-reject-note", handleLastRejectNote, 1, DEVICE_VALIDATOR, PRIORITY_DIAGNOSTICS },
+	{ "plan-payout", handlePlanPayout, 0, DEVICE_ALL, PRIORITY_DIAGNOSTICS },
+	{ "quit", handleQuit, 0, DEVICE_ALL, PRIORITY_CONTROL },
+	{ "set-denomination-level", handleSetDenominationLevels, 1, DEVICE_ALL, PRIORITY_CONTROL },
+	{ "set-log-level", handleSetLogLevel, 0, DEVICE_ALL, PRIORITY_CONTROL },
+	{ "smart-empty", handleSmartEmpty, 1, DEVICE_ALL, PRIORITY_MONEY },
+	{ "stats", handleStats, 0, DEVICE_ALL, PRIORITY_DIAGNOSTICS },
+	{ "test", handleTest, 0, DEVICE_ALL, PRIORITY_DIAGNOSTICS },
+	{ "test-float", handleFloat, 1, DEVICE_ALL, PRIORITY_MONEY },
+	{ "test-payout", handlePayout, 1, DEVICE_ALL, PRIORITY_MONEY },
+};
+
+/** \brief Number of entries in commandHandlers */
+#define COMMAND_HANDLER_COUNT (sizeof(commandHandlers) / sizeof(commandHandlers[0]))
+
+/**
+ * \brief Compares a command name with an entry in commandHandlers (for bsearch).
+ */
+int compareCommandHandler(const void *key, const void *entry) {
+	return strcmp(key, ((const struct m_commandHandler *) entry)->name);
+}
+
+/**
+ * \brief Looks up the command in the commandHandlers table, returns NULL if it's unknown.
+ */
+const struct m_commandHandler *findCommandHandler(const char *command) {
+	return bsearch(command, commandHandlers, COMMAND_HANDLER_COUNT, sizeof(struct m_commandHandler),
+			compareCommandHandler);
+}
+
+/**
+ * \brief Verifies that the commandHandlers table is sorted, otherwise the lookup would fail.
+ */
+void checkCommandHandlers() {
+	for (unsigned int i = 1; i < COMMAND_HANDLER_COUNT; i++) {
+		if (strcmp(commandHandlers[i - 1].name, commandHandlers[i].name) >= 0) {
+			logMessage(LOG_EMERG, "commandHandlers not sorted at '%s'", commandHandlers[i].name);
+			die("commandHandlers table not sorted", 1);
+		}
+	}
+}
+
+/**
+ * \brief Returns the DEVICE_* bit of the device.
+ */
+int deviceMask(struct m_metacash *m, struct m_device *device) {
+	if (device == &m->hopper) {
+		return DEVICE_HOPPER;
+	}
+	if (device == &m->validator) {
+		return DEVICE_VALIDATOR;
+	}
+	return 0;
+}
+
+/**
+ * \brief Frees a command created by processRequest(), a command read from a stream is acknowledged.
+ */
+void freeCommand(void *data) {
+	struct m_command *cmd = data;
+	if (cmd->stream) {
+		// the command is done (and answered), the entry can be removed from the pending list
+		publishAck(cmd->stream, cmd->streamId);
+	}
+	if (cmd->jsonMessage) {
+		// this will also free the other json objects associated with it
+		json_decref(cmd->jsonMessage);
+	}
+	free(cmd);
+}
+
+/**
+ * \brief Frees a command which has not been processed (e.g. because we are exiting).
+ * \details The stream entry is not acknowledged, so it is read again after the restart.
+ */
+void dropCommand(struct m_command *cmd) {
+	cmd->stream = NULL;
+	freeCommand(cmd);
+}
+
+/**
+ * \brief Dispatches the command to the appropriate command handler function if any. In case
+ * we don't know that command we respond with a generic error response.
+ * \callgraph
+ */
+void dispatchCommand(struct m_metacash *m, struct m_command *cmd) {
+	const struct m_commandHandler *handler = cmd->handler;
+
+	if (handler == NULL) {
+		logMessage(LOG_WARNING, "unable to process message: no handler for cmd='%s' found", cmd->command);
+		replyWith(cmd->responseTopic, "{\"correlId\":\"%s\",\"error\":\"unknown command\",\"cmd\":\"%s\"}",
+				cmd->correlId, cmd->command);
+		return;
+	}
+
+	if (! (handler->allowedDevices & deviceMask(m, cmd->device))) {
+		logMessage(LOG_WARNING, "rejecting cmd='%s' from msgId='%s', not supported by device='%s'\n",
+				cmd->command, cmd->correlId, cmd->device->name);
+		replyWith(cmd->responseTopic, "{\"correlId\":\"%s\",\"error\":\"command not supported by device\",\"cmd\":\"%s\"}",
+				cmd->correlId, cmd->command);
+		return;
+	}
+
+	if (handler->needsHardware && ! m->deviceAvailable) {
+		logMessage(LOG_WARNING, "rejecting cmd='%s' from msgId='%s', hardware unavailable!\n", cmd->command, cmd->correlId);
+		replyWith(cmd->responseTopic, "{\"correlId\":\"%s\",\"error\":\"hardware unavailable\"}", cmd->correlId);
+		return;
+	}
+
+	handler->fn(cmd);
+
+	if (! onHardwareThread) {
+		// everything published while processing the command goes out in one write
+		publishFlush();
+	}
+}
+
+/**
+ * \brief End to end latency (received from redis until the reply has been published) per
+ * command handler, the last entry is for unknown commands.
+ */
+struct m_histogram requestLatency[COMMAND_HANDLER_COUNT + 1];
+
+/**
+ * \brief Number of requests answered with "busy".
+ */
+atomic_ulong busyReplies;
+
+/**
+ * \brief The command processed on this thread right now (if not processed by a task).
+ */
+_Thread_local struct m_command *threadCommand = NULL;
+
+/**
+ * \brief The sub-command of a "batch" processed on this thread right now (if not processed by a task).
+ */
+_Thread_local struct m_command *threadSubCommand = NULL;
+
+/**
+ * \brief Returns the command which is processed right now (the sub-command while a "batch"
+ * runs one), NULL if none.
+ */
+struct m_command *currentCommand() {
+	struct m_command *sub = currentTask ? currentTask->subCommand : threadSubCommand;
+	if (sub) {
+		return sub;
+	}
+	return currentTask ? currentTask->command : threadCommand;
+}
+
+/**
+ * \brief Sets the command which is processed right now.
+ */
+void setCurrentCommand(struct m_command *cmd) {
+	if (currentTask) {
+		currentTask->command = cmd;
+	} else {
+		threadCommand = cmd;
+	}
+}
+
+/**
+ * \brief Sets the sub-command of a "batch" which is processed right now, NULL once it is done.
+ * \details The sub-command lives on the stack of the batch handler and borrows the JSON of the
+ * batch request, so it is kept apart from the command which is dropped by taskCleanup().
+ */
+void setCurrentSubCommand(struct m_command *sub) {
+	if (currentTask) {
+		currentTask->subCommand = sub;
+	} else {
+		threadSubCommand = sub;
+	}
+}
+
+/**
+ * \brief Returns the JSON properties with the queue statistics of the current command which
+ * close a reply (see publishWithTail()), NULL if there is no queued command.
+ */
+const char *replyTail() {
+	static _Thread_local char tail[96];
+
+	struct m_command *cmd = currentCommand();
+	if (cmd == NULL || ! cmd->queued) {
+		return NULL;
+	}
+
+	snprintf(tail, sizeof(tail), ",\"queueDepth\":%u,\"queueWait\":%lld}", cmd->queueDepth, cmd->queueWait);
+	return tail;
+}
+
+/**
+ * \brief Returns the JSON writer which collects the replies of the current command, NULL if
+ * they are published as usual.
+ */
+struct m_json *replyCapture() {
+	struct m_command *cmd = currentCommand();
+	return cmd ? cmd->capture : NULL;
+}
+
+/**
+ * \brief Adds the command to the queue of its device, returns 0 if the queue is full.
+ */
+int queuePush(struct m_device *device, struct m_command *cmd) {
+	struct m_queue *queue = &device->queue;
+
+	if (queue->length >= queue->capacity) {
+		return 0;
+	}
+
+	int priority = cmd->handler ? cmd->handler->priority : PRIORITY_DIAGNOSTICS;
+
+	cmd->next = NULL;
+	if (queue->tail[priority]) {
+		queue->tail[priority]->next = cmd;
+	} else {
+		queue->head[priority] = cmd;
+	}
+	queue->tail[priority] = cmd;
+
+	cmd->queued = 1;
+	cmd->enqueued = clockMonotonicMs();
+	cmd->queueDepth = queue->length;
+	queue->length++;
+	atomic_store(&queue->depth, queue->length);
+
+	return 1;
+}
+
+/**
+ * \brief Removes the oldest command of the highest priority class from the queue, NULL if it's empty.
+ */
+struct m_command *queuePop(struct m_device *device) {
+	struct m_queue *queue = &device->queue;
+
+	for (int priority = 0; priority < PRIORITY_COUNT; priority++) {
+		struct m_command *cmd = queue->head[priority];
+		if (cmd == NULL) {
+			continue;
+		}
+
+		queue->head[priority] = cmd->next;
+		if (queue->head[priority] == NULL) {
+			queue->tail[priority] = NULL;
+		}
+		cmd->next = NULL;
+		queue->length--;
+		atomic_store(&queue->depth, queue->length);
+
+		cmd->queueWait = clockMonotonicMs() - cmd->enqueued;
+		return cmd;
+	}
+
+	return NULL;
+}
+
+/**
+ * \brief Tells the client that the queue of the device is full and when it should try again.
+ * \details Called by the thread owning the queue or, with -t, by the redis thread if the command
+ * ring is full, so only the atomic copies of the queue statistics are read.
+ */
+void queueReplyBusy(struct m_command *cmd) {
+	struct m_queue *queue = &cmd->device->queue;
+	unsigned int depth = atomic_load(&queue->depth);
+	long retryAfter = (depth + 1) * atomic_load(&queue->serviceTime);
+
+	atomic_fetch_add(&busyReplies, 1);
+
+	logMessage(LOG_WARNING, "rejecting cmd='%s' from msgId='%s', queue of device='%s' full!\n",
+			cmd->command, cmd->correlId, cmd->device->name);
+	replyWith(cmd->responseTopic, "{\"correlId\":\"%s\",\"error\":\"busy\",\"retryAfter\":%ld,\"queueDepth\":%u}",
+			cmd->correlId, retryAfter, depth);
+}
+
+/**
+ * \brief Processes and frees a command taken from the queue of its device.
+ */
+void queueProcessOne(struct m_metacash *m, struct m_command *cmd) {
+	struct m_queue *queue = &cmd->device->queue;
+	long long start = clockMonotonicMs();
+
+	setCurrentCommand(cmd);
+	dispatchCommand(m, cmd);
+	setCurrentCommand(NULL);
+	idempotencyFinish(cmd);
+
+	long long now = clockMonotonicMs();
+	atomic_store(&queue->serviceTime, (3 * atomic_load(&queue->serviceTime) + (now - start)) / 4);
+
+	histogramAdd(&requestLatency[cmd->handler ? cmd->handler - commandHandlers : COMMAND_HANDLER_COUNT],
+			now - cmd->received);
+
+	freeCommand(cmd);
+}
+
+/** \brief Number of slots of the idempotency cache, a power of 2 */
+#define IDEMPOTENCY_SLOTS 256
+/** \brief Number of slots (starting at the hash of the msgId) looked at for a msgId */
+#define IDEMPOTENCY_PROBES 8
+/** \brief Time in ms a finished request is remembered after it has been answered or asked for the last time */
+#define IDEMPOTENCY_TTL 600000
+/** \brief Size of the longest msgId which is remembered + 1 */
+#define IDEMPOTENCY_KEY_SIZE 64
+/** \brief Size of the longest reply which is remembered */
+#define IDEMPOTENCY_REPLY_SIZE 384
+
+/** \brief The slot of the m_idempotency cache has never been used */
+#define IDEMPOTENCY_FREE 0
+/** \brief The request is queued or processed right now */
+#define IDEMPOTENCY_IN_FLIGHT 1
+/** \brief The request has been answered */
+#define IDEMPOTENCY_DONE 2
+
+/**
+ * \brief A request remembered by its msgId.
+ */
+struct m_idempotencyEntry {
+	/** \brief IDEMPOTENCY_FREE, IDEMPOTENCY_IN_FLIGHT or IDEMPOTENCY_DONE */
+	int state;
+	/** \brief Hash of device and msgId */
+	unsigned long long hash;
+	/** \brief The device the request was sent to */
+	struct m_device *device;
+	/** \brief The msgId of the request */
+	char msgId[IDEMPOTENCY_KEY_SIZE];
+	/** \brief The command which is processed for the request, NULL once it is done */
+	struct m_command *owner;
+	/** \brief Priority class (PRIORITY_*) of the command */
+	int priority;
+	/** \brief Monotonic time in ms the entry has been answered or asked for the last time */
+	long long lastUsed;
+	/** \brief If !=0 the first reply to the request has been seen (but may not have fit into reply) */
+	int replied;
+	/** \brief Length of the reply, 0 if it has not been stored */
+	size_t length;
+	/** \brief The first reply to the request without the queue statistics */
+	char reply[IDEMPOTENCY_REPLY_SIZE];
+};
+
+/**
+ * \brief Open addressing hash table of the recent requests so a retried request (same msgId)
+ * is answered again instead of being executed twice.
+ * \details Only used by the thread which queues the commands, so there is no lock.
+ */
+struct m_idempotency {
+	/** \brief The slots, linear probing over IDEMPOTENCY_PROBES slots */
+	struct m_idempotencyEntry slots[IDEMPOTENCY_SLOTS];
+	/** \brief Number of retried requests answered with the remembered reply */
+	unsigned long hits;
+	/** \brief Number of requests which had not been seen before */
+	unsigned long misses;
+	/** \brief Number of retried requests answered with "in progress" */
+	unsigned long inFlight;
+	/** \brief Number of remembered requests replaced before IDEMPOTENCY_TTL */
+	unsigned long evicted;
+};
+
+static struct m_idempotency idempotency;
+
+/**
+ * \brief Hash of the device and msgId of the command.
+ */
+unsigned long long idempotencyHash(struct m_command *cmd) {
+	unsigned long long hash = configHashBytes(14695981039346656037ULL, &cmd->device->id, sizeof(cmd->device->id));
+	return configHashBytes(hash, cmd->correlId, strlen(cmd->correlId));
+}
+
+/**
+ * \brief Returns !=0 if the slot holds nothing worth keeping: never used or done and expired.
+ */
+int idempotencyUnused(struct m_idempotencyEntry *entry, long long now) {
+	return entry->state == IDEMPOTENCY_FREE
+			|| (entry->state == IDEMPOTENCY_DONE && now - entry->lastUsed > IDEMPOTENCY_TTL);
+}
+
+/**
+ * \brief Returns the entry for the msgId of the command, NULL if the request has not been seen
+ * (recently) or the msgId is too long to be remembered.
+ */
+struct m_idempotencyEntry *idempotencyFind(struct m_command *cmd, unsigned long long hash, long long now) {
+	if (strlen(cmd->correlId) >= IDEMPOTENCY_KEY_SIZE) {
+		return NULL;
+	}
+
+	for (unsigned int i = 0; i < IDEMPOTENCY_PROBES; i++) {
+		struct m_idempotencyEntry *entry = &idempotency.slots[(hash + i) & (IDEMPOTENCY_SLOTS - 1)];
+		if (entry->state == IDEMPOTENCY_FREE) {
+			// slots are never freed again, nothing was placed behind this one
+			return NULL;
+		}
+		if (entry->hash == hash && entry->device == cmd->device && strcmp(entry->msgId, cmd->correlId) == 0) {
+			return idempotencyUnused(entry, now) ? NULL : entry;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * \brief Answers a request whose msgId has been seen before instead of queueing it again,
+ * returns !=0 if the command has been answered and must not be processed.
+ * \details A finished request is answered with its first reply and "duplicate":true, a
+ * request which is still queued or processed with an "in progress" error. A money request
+ * whose reply was too large to be remembered is answered with a "duplicate" error, any other
+ * request is processed again.
+ */
+int idempotencyAnswer(struct m_command *cmd) {
+	long long now = clockMonotonicMs();
+	struct m_idempotencyEntry *entry = idempotencyFind(cmd, idempotencyHash(cmd), now);
+
+	if (entry == NULL) {
+		idempotency.misses++;
+		return 0;
+	}
+
+	if (entry->state == IDEMPOTENCY_IN_FLIGHT) {
+		logMessage(LOG_WARNING, "cmd='%s' from msgId='%s' is still in progress\n", cmd->command, cmd->correlId);
+		idempotency.inFlight++;
+		replyWith(cmd->responseTopic, "{\"correlId\":\"%s\",\"error\":\"in progress\",\"cmd\":\"%s\"}",
+				cmd->correlId, cmd->command);
+		return 1;
+	}
+
+	if (entry->length) {
+		logMessage(LOG_INFO, "answering cmd='%s' from msgId='%s' again\n", cmd->command, cmd->correlId);
+		idempotency.hits++;
+		entry->lastUsed = now;
+		publishWithTail(cmd->responseTopic, entry->reply, entry->length, ",\"duplicate\":true}");
+		return 1;
+	}
+
+	if (entry->priority == PRIORITY_MONEY) {
+		logMessage(LOG_WARNING, "not repeating cmd='%s' from msgId='%s'\n", cmd->command, cmd->correlId);
+		idempotency.hits++;
+		entry->lastUsed = now;
+		replyWith(cmd->responseTopic, "{\"correlId\":\"%s\",\"error\":\"duplicate\",\"cmd\":\"%s\"}",
+				cmd->correlId, cmd->command);
+		return 1;
+	}
+
+	idempotency.misses++;
+	return 0;
+}
+
+/**
+ * \brief Remembers the queued command as in flight, called after idempotencyAnswer() returned 0
+ * and the command has been queued. The msgId is not remembered if all slots it can go to are
+ * in flight.
+ */
+void idempotencyBegin(struct m_command *cmd) {
+	long long now = clockMonotonicMs();
+	unsigned long long hash = idempotencyHash(cmd);
+	struct m_idempotencyEntry *entry = idempotencyFind(cmd, hash, now);
+
+	if (entry == NULL && strlen(cmd->correlId) < IDEMPOTENCY_KEY_SIZE) {
+		// the first unused slot, otherwise the least recently used finished one
+		for (unsigned int i = 0; i < IDEMPOTENCY_PROBES; i++) {
+			struct m_idempotencyEntry *slot = &idempotency.slots[(hash + i) & (IDEMPOTENCY_SLOTS - 1)];
+			if (idempotencyUnused(slot, now)) {
+				entry = slot;
+				break;
+			}
+			if (slot->state == IDEMPOTENCY_DONE && (entry == NULL || slot->lastUsed < entry->lastUsed)) {
+				entry = slot;
+			}
+		}
+		if (entry && ! idempotencyUnused(entry, now)) {
+			idempotency.evicted++;
+		}
+	}
+
+	if (entry == NULL || entry->state == IDEMPOTENCY_IN_FLIGHT) {
+		return;
+	}
+
+	entry->state = IDEMPOTENCY_IN_FLIGHT;
+	entry->hash = hash;
+	entry->device = cmd->device;
+	snprintf(entry->msgId, sizeof(entry->msgId), "%s", cmd->correlId);
+	entry->owner = cmd;
+	entry->priority = cmd->handler ? cmd->handler->priority : PRIORITY_DIAGNOSTICS;
+	entry->lastUsed = now;
+	entry->replied = 0;
+	entry->length = 0;
+}
+
+/**
+ * \brief Returns the in flight entry of the command, NULL if it is not remembered.
+ */
+struct m_idempotencyEntry *idempotencyOf(struct m_command *cmd) {
+	if (cmd == NULL || cmd->capture || cmd->correlId == NULL) {
+		return NULL;
+	}
+
+	struct m_idempotencyEntry *entry = idempotencyFind(cmd, idempotencyHash(cmd), clockMonotonicMs());
+	return entry && entry->owner == cmd ? entry : NULL;
+}
+
+/**
+ * \brief Returns !=0 if the reply is addressed to the command (carries its correlId).
+ * \details Other messages can be published while the command is processed, ex. the
+ * "superseded" message of the previous operation of the device.
+ */
+int idempotencyOwnReply(struct m_command *cmd, const char *reply, size_t length) {
+	char needle[IDEMPOTENCY_KEY_SIZE + 16];
+	int n = snprintf(needle, sizeof(needle), "\"correlId\":\"%s\"", cmd->correlId);
+	return n > 0 && (size_t) n < sizeof(needle) && memmem(reply, length, needle, n) != NULL;
+}
+
+/**
+ * \brief Remembers the first reply to the command published while it is processed.
+ */
+void idempotencyRecordV(struct m_command *cmd, const char *format, va_list args) {
+	struct m_idempotencyEntry *entry = idempotencyOf(cmd);
+	if (entry == NULL || entry->replied) {
+		return;
+	}
+
+	char reply[IDEMPOTENCY_REPLY_SIZE];
+	int length = vsnprintf(reply, sizeof(reply), format, args);
+	if (length <= 0) {
+		return;
+	}
+	size_t written = (size_t) length < sizeof(reply) ? (size_t) length : sizeof(reply) - 1;
+	if (! idempotencyOwnReply(cmd, reply, written)) {
+		return;
+	}
+
+	entry->replied = 1;
+	if ((size_t) length < sizeof(entry->reply)) {
+		memcpy(entry->reply, reply, length);
+		entry->length = length;
+	}
+}
+
+/**
+ * \brief Remembers the first reply to the command written with the m_json writer while it is processed.
+ */
+void idempotencyRecord(struct m_command *cmd, const char *reply, size_t length) {
+	struct m_idempotencyEntry *entry = idempotencyOf(cmd);
+	if (entry == NULL || entry->replied || ! idempotencyOwnReply(cmd, reply, length)) {
+		return;
+	}
+
+	entry->replied = 1;
+	if (length < sizeof(entry->reply)) {
+		memcpy(entry->reply, reply, length);
+		entry->length = length;
+	}
+}
+
+/**
+ * \brief Marks the request of the command as done, called before it is freed.
+ */
+void idempotencyFinish(struct m_command *cmd) {
+	struct m_idempotencyEntry *entry = idempotencyOf(cmd);
+	if (entry == NULL) {
+		return;
+	}
+
+	entry->state = IDEMPOTENCY_DONE;
+	entry->owner = NULL;
+	entry->lastUsed = clockMonotonicMs();
+}
+
+/**
+ * \brief Appends the counters of the idempotency cache as JSON object.
+ */
+void jsonIdempotency(struct m_json *json) {
+	jsonRaw(json, "{\"hits\":");
+	jsonInt(json, idempotency.hits);
+	jsonRaw(json, ",\"misses\":");
+	jsonInt(json, idempotency.misses);
+	jsonRaw(json, ",\"inProgress\":");
+	jsonInt(json, idempotency.inFlight);
+	jsonRaw(json, ",\"evicted\":");
+	jsonInt(json, idempotency.evicted);
+	jsonRaw(json, "}");
+}
+
+/**
+ * \brief Upper bounds (exclusive) in ms of the buckets of a m_histogram, the last bucket has none.
+ */
+static const long histogramBounds[HISTOGRAM_BUCKETS - 1] = { 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000 };
+
+/**
+ * \brief Records a value in ms in the histogram.
+ */
+void histogramAdd(struct m_histogram *histogram, long value) {
+	unsigned int i = 0;
+	while (i < HISTOGRAM_BUCKETS - 1 && value >= histogramBounds[i]) {
+		i++;
+	}
+
+	histogram->bucket[i]++;
+	histogram->count++;
+	histogram->sum += value;
+	if ((unsigned long) value > histogram->max) {
+		histogram->max = value;
+	}
+}
+
+/**
+ * \brief Records the outcome of an SSP command sent to the device.
+ */
+void metricsRecordSsp(struct m_device *device, unsigned char command, SSP_COMMAND *cmd, long latency) {
+	struct m_sspStats *stats = &device->sspStats[command];
+
+	stats->sent++;
+	stats->retries += cmd->RetryCount;
+
+	switch (cmd->ResponseStatus) {
+	case SSP_REPLY_OK:
+		histogramAdd(&stats->latency, latency);
+		break;
+	case SSP_CMD_TIMEOUT:
+		stats->timeouts++;
+		break;
+	case SSP_PACKET_ERROR:
+		if (cmd->PacketError == SSP_PACKET_ERROR_COUNTER) {
+			stats->counterErrors++;
+		} else {
+			stats->packetErrors++;
+		}
+		break;
+	case PORT_ERROR:
+		stats->portErrors++;
+		break;
+	}
+}
+
+/**
+ * \brief Appends {"count":..,"avg":..,"max":..,"buckets":[..]} for the histogram.
+ */
+void jsonHistogram(struct m_json *json, const struct m_histogram *histogram) {
+	jsonRaw(json, "{\"count\":");
+	jsonInt(json, histogram->count);
+	jsonRaw(json, ",\"avg\":");
+	jsonInt(json, histogram->count ? (long) (histogram->sum / histogram->count) : 0);
+	jsonRaw(json, ",\"max\":");
+	jsonInt(json, histogram->max);
+	jsonRaw(json, ",\"buckets\":[");
+	for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		if (i > 0) {
+			jsonRaw(json, ",");
+		}
+		jsonInt(json, histogram->bucket[i]);
+	}
+	jsonRaw(json, "]}");
+}
+
+/**
+ * \brief Appends the SSP counters of the device as "<name>":[{"cmd":"0x07",...},...].
+ */
+void jsonDeviceMetrics(struct m_json *json, const struct m_device *device) {
+	static const char hex[] = "0123456789ABCDEF";
+	int first = 1;
+
+	jsonString(json, device->name);
+	jsonRaw(json, ":[");
+	for (unsigned int command = 0; command < 256; command++) {
+		const struct m_sspStats *stats = &device->sspStats[command];
+		if (stats->sent == 0) {
+			continue;
+		}
+
+		char name[5] = { '0', 'x', hex[command >> 4], hex[command & 0xf], '\0' };
+
+		jsonRaw(json, first ? "{\"cmd\":" : ",{\"cmd\":");
+		jsonString(json, name);
+		jsonRaw(json, ",\"sent\":");
+		jsonInt(json, stats->sent);
+		jsonRaw(json, ",\"retries\":");
+		jsonInt(json, stats->retries);
+		jsonRaw(json, ",\"timeouts\":");
+		jsonInt(json, stats->timeouts);
+		jsonRaw(json, ",\"packetErrors\":");
+		jsonInt(json, stats->packetErrors);
+		jsonRaw(json, ",\"counterErrors\":");
+		jsonInt(json, stats->counterErrors);
+		jsonRaw(json, ",\"portErrors\":");
+		jsonInt(json, stats->portErrors);
+		jsonRaw(json, ",\"latency\":");
+		jsonHistogram(json, &stats->latency);
+		jsonRaw(json, "}");
+		first = 0;
+	}
+	jsonRaw(json, "]");
+}
+
+/**
+ * \brief Appends the metrics as JSON properties ("uptime", "busy", "log", "idempotency",
+ * "devices" and "requests").
+ * \details Must be called on the thread which talks to the hardware, the counters are not locked.
+ */
+void metricsWrite(struct m_json *json, struct m_metacash *metacash) {
+	jsonRaw(json, "\"uptime\":");
+	jsonInt(json, (clockMonotonicMs() - metacash->started) / 1000);
+	jsonRaw(json, ",\"busy\":");
+	jsonInt(json, atomic_load(&busyReplies));
+	jsonRaw(json, ",\"droppedPublications\":");
+	jsonInt(json, atomic_load(&droppedPublications));
+	jsonRaw(json, ",\"log\":{\"level\":");
+	jsonString(json, logLevelName(atomic_load(&logRing.level)));
+	jsonRaw(json, ",\"dropped\":");
+	jsonInt(json, atomic_load(&logRing.droppedTotal));
+	jsonRaw(json, ",\"suppressed\":");
+	jsonInt(json, atomic_load(&logRing.suppressedTotal));
+	jsonRaw(json, "}");
+	jsonRaw(json, ",\"idempotency\":");
+	jsonIdempotency(json);
+
+	jsonRaw(json, ",\"devices\":{");
+	jsonDeviceMetrics(json, &metacash->hopper);
+	jsonRaw(json, ",");
+	jsonDeviceMetrics(json, &metacash->validator);
+	jsonRaw(json, "}");
+
+	jsonRaw(json, ",\"requests\":[");
+	int first = 1;
+	for (unsigned int i = 0; i <= COMMAND_HANDLER_COUNT; i++) {
+		if (requestLatency[i].count == 0) {
+			continue;
+		}
+		jsonRaw(json, first ? "{\"cmd\":" : ",{\"cmd\":");
+		jsonString(json, i < COMMAND_HANDLER_COUNT ? commandHandlers[i].name : "unknown");
+		jsonRaw(json, ",\"latency\":");
+		jsonHistogram(json, &requestLatency[i]);
+		jsonRaw(json, "}");
+		first = 0;
+	}
+	jsonRaw(json, "]");
+}
+
+/**
+ * \brief Publishes the metrics to "payout-metrics", called by the thread which owns the hardware.
+ */
+void metricsPublish(struct m_metacash *metacash) {
+	char buffer[METRICS_BUFFER_SIZE];
+	struct m_json json;
+
+	jsonInit(&json, buffer, sizeof(buffer));
+	jsonRaw(&json, "{\"event\":\"metrics\",");
+	metricsWrite(&json, metacash);
+	jsonRaw(&json, "}");
+
+	if (json.overflow) {
+		logMessage(LOG_ERR, "metricsPublish: metrics too large\n");
+		return;
+	}
+	publishRaw(topics.payoutMetrics, json.buffer, json.length);
+}
+
+/**
+ * \brief Callback function for libEvent, the periodic publishing of the metrics.
+ * \details Independent of the polls, so the metrics keep coming while a device does not answer.
+ * With -t the counters belong to the hardware thread, which is woken up to publish them.
+ */
+void cbOnMetrics(int fd, short event, void *privdata) {
+	struct m_metacash *metacash = privdata;
+
+	if (metacash->hwThread.running) {
+		atomic_store(&metacash->hwThread.metricsDue, 1);
+
+		uint64_t one = 1;
+		if (write(metacash->hwThread.commandFd, &one, sizeof(one)) != sizeof(one)) {
+			logMessage(LOG_WARNING, "cbOnMetrics: could not wakeup the hardware thread\n");
+		}
+		return;
+	}
+
+	metricsPublish(metacash);
+	publishFlush();
+}
+
+/**
+ * \brief Frees all commands waiting in the queue of the device.
+ */
+void queueClear(struct m_device *device) {
+	struct m_command *cmd;
+	while ((cmd = queuePop(device)) != NULL) {
+		dropCommand(cmd);
+	}
+}
+
+/**
+ * \brief Task function which processes the queue of a device with the async transport.
+ * \details The device lock keeps the commands and the polls of the device apart, polls
+ * and commands of the other device are interleaved on the bus by the transport.
+ */
+void taskQueueWorker(struct m_task *task) {
+	struct m_device *device = task->data;
+	struct m_command *cmd;
+
+	while ((cmd = queuePop(device)) != NULL) {
+		taskLock(&device->lock);
+		queueProcessOne(task->metacash, cmd);
+		taskUnlock(&device->lock);
+	}
+
+	device->queue.workerActive = 0;
+}
+
+/**
+ * \brief Callback function for libEvent, processes one command of the queue of the device in privdata.
+ * \details Only one command per iteration of the event loop, so commands arriving meanwhile
+ * are queued (and prioritized) before the next one is taken.
+ */
+void cbOnQueueWorker(int fd, short event, void *privdata) {
+	struct m_device *device = privdata;
+	struct m_command *cmd = queuePop(device);
+
+	if (cmd) {
+		queueProcessOne(device->metacash, cmd);
+	}
+
+	if (device->queue.length > 0) {
+		struct timeval now = { 0, 0 };
+		event_base_once(device->metacash->eventBase, -1, EV_TIMEOUT, cbOnQueueWorker, device, &now);
+	} else {
+		device->queue.workerActive = 0;
+	}
+}
+
+/**
+ * \brief Makes sure a worker processes the queue of the device.
+ */
+void queueKick(struct m_metacash *m, struct m_device *device) {
+	if (device->queue.workerActive || m->startupPending || device->verifyPending) {
+		// a worker is running already, or the startup isn't done yet (setupFinished() or
+		// deviceVerifyPoll() kick the queue then)
+		return;
+	}
+
+	device->queue.workerActive = 1;
+	if (m->asyncTransport) {
+		taskSpawn(m, taskQueueWorker, device, NULL);
+	} else {
+		struct timeval now = { 0, 0 };
+		event_base_once(m->eventBase, -1, EV_TIMEOUT, cbOnQueueWorker, device, &now);
+	}
+}
+
+/**
+ * \brief Initializes the ring with size slots (must be a power of 2).
+ */
+int ringInit(struct m_ring *ring, unsigned int size) {
+	ring->slots = calloc(size, sizeof(void *));
+	if (ring->slots == NULL) {
+		return 1;
+	}
+	ring->mask = size - 1;
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	return 0;
+}
+
+/**
+ * \brief Frees the slots of the ring (not the items).
+ */
+void ringFree(struct m_ring *ring) {
+	free(ring->slots);
+	ring->slots = NULL;
+}
+
+/**
+ * \brief Adds the item to the ring, returns 0 if the ring is full. Producer only.
+ */
+int ringPush(struct m_ring *ring, void *item) {
+	unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+	if (tail - head > ring->mask) {
+		return 0;
+	}
+
+	ring->slots[tail & ring->mask] = item;
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+	return 1;
+}
+
+/**
+ * \brief Removes the oldest item from the ring, returns NULL if the ring is empty. Consumer only.
+ */
+void *ringPop(struct m_ring *ring) {
+	unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+	if (head == tail) {
+		return NULL;
+	}
+
+	void *item = ring->slots[head & ring->mask];
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+	return item;
+}
+
+/** \brief Number of slots in each of the rings of the hardware thread */
+#define HWTHREAD_RING_SIZE 64
+
+/**
+ * \brief Main function of the hardware thread, polls each device according to its poll interval
+ * and processes the commands handed over by the redis thread in between.
+ */
+void *hwThreadMain(void *data) {
+	struct m_metacash *metacash = data;
+	struct m_hwthread *hw = &metacash->hwThread;
+
+	onHardwareThread = 1;
+
+	metacash->hopper.nextPoll = clockMonotonicMs();
+	metacash->validator.nextPoll = metacash->hopper.nextPoll;
+
+	while (! atomic_load(&hw->stop)) {
+		struct m_command *cmd;
+		while ((cmd = ringPop(&hw->commands)) != NULL) {
+			if (idempotencyAnswer(cmd)) {
+				freeCommand(cmd);
+			} else if (queuePush(cmd->device, cmd)) {
+				idempotencyBegin(cmd);
+			} else {
+				queueReplyBusy(cmd);
+				freeCommand(cmd);
+			}
+		}
+
+		if (atomic_exchange(&hw->metricsDue, 0)) {
+			metricsPublish(metacash);
+		}
+
+		// one command per device, then look again for new (maybe more important) ones and due polls.
+		// the commands of a device wait while its warm start hasn't been confirmed (see deviceVerifyPoll()).
+		int processed = 0;
+		if (! metacash->hopper.verifyPending && (cmd = queuePop(&metacash->hopper)) != NULL) {
+			queueProcessOne(metacash, cmd);
+			processed = 1;
+		}
+		if (! metacash->validator.verifyPending && (cmd = queuePop(&metacash->validator)) != NULL) {
+			queueProcessOne(metacash, cmd);
+			processed = 1;
+		}
+
+		long long now = clockMonotonicMs();
+		if (now >= metacash->hopper.nextPoll) {
+			mcSspPollDevice(&metacash->hopper, metacash);
+			metacash->hopper.nextPoll = clockMonotonicMs() + metacash->hopper.pollInterval;
+			continue;
+		}
+		if (now >= metacash->validator.nextPoll) {
+			mcSspPollDevice(&metacash->validator, metacash);
+			metacash->validator.nextPoll = clockMonotonicMs() + metacash->validator.pollInterval;
+			continue;
+		}
+
+		if (processed) {
+			continue;
+		}
+
+		long long nextPoll = metacash->hopper.nextPoll;
+		if (metacash->validator.nextPoll < nextPoll) {
+			nextPoll = metacash->validator.nextPoll;
+		}
+
+		// sleep until the next poll is due or the redis thread submits a command
+		struct pollfd pfd;
+		pfd.fd = hw->commandFd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+
+		if (poll(&pfd, 1, (int) (nextPoll - now)) > 0 && (pfd.revents & POLLIN)) {
+			uint64_t count;
+			if (read(hw->commandFd, &count, sizeof(count)) != sizeof(count)) {
+				logMessage(LOG_WARNING, "hwThreadMain: could not read the eventfd\n");
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * \brief Publishes everything the hardware thread has handed over.
+ */
+void hwThreadDrainPublications(struct m_hwthread *hw) {
+	struct m_publication *publication;
+	while ((publication = ringPop(&hw->publications)) != NULL) {
+		if (publication->ack) {
+			publishAppendAck(publication->topic, publication->message);
+		} else {
+			publishAppendFrame(publication->topic, publication->message, publication->length, NULL);
+		}
+		free(publication->topic);
+		free(publication->message);
+		free(publication);
+	}
+
+	publishFlush();
+}
+
+/**
+ * \brief Callback function for libEvent triggered by the hardware thread via the publicationFd.
+ */
+void cbOnPublications(int fd, short event, void *privdata) {
+	struct m_hwthread *hw = privdata;
+
+	uint64_t count;
+	if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+		return;
+	}
+
+	hwThreadDrainPublications(hw);
+}
+
+/**
+ * \brief Starts the hardware thread, from now on the serial port must only be used by it.
+ */
+void hwThreadStart(struct m_metacash *metacash) {
+	struct m_hwthread *hw = &metacash->hwThread;
+
+	if (ringInit(&hw->commands, HWTHREAD_RING_SIZE) || ringInit(&hw->publications, HWTHREAD_RING_SIZE)) {
+		die("hwThreadStart: could not allocate rings", 1);
+	}
+
+	hw->commandFd = eventfd(0, EFD_NONBLOCK);
+	hw->publicationFd = eventfd(0, EFD_NONBLOCK);
+	if (hw->commandFd < 0 || hw->publicationFd < 0) {
+		die("hwThreadStart: could not create eventfd", 1);
+	}
+
+	event_set(&hw->evPublications, hw->publicationFd, EV_READ | EV_PERSIST, cbOnPublications, hw);
+	event_base_set(metacash->eventBase, &hw->evPublications);
+	event_add(&hw->evPublications, NULL);
+
+	atomic_init(&hw->stop, 0);
+	hwThread = hw;
+
+	if (pthread_create(&hw->thread, NULL, hwThreadMain, metacash) != 0) {
+		die("hwThreadStart: could not create the hardware thread", 1);
+	}
+	hw->running = 1;
+
+	logMessage(LOG_NOTICE, "using a dedicated hardware thread\n");
+}
+
+/**
+ * \brief Stops the hardware thread and publishes whatever it has left behind.
+ */
+void hwThreadStop(struct m_metacash *metacash) {
+	struct m_hwthread *hw = &metacash->hwThread;
+
+	if (! hw->running) {
+		return;
+	}
+
+	atomic_store(&hw->stop, 1);
+
+	uint64_t one = 1;
+	if (write(hw->commandFd, &one, sizeof(one)) != sizeof(one)) {
+		logMessage(LOG_WARNING, "hwThreadStop: could not wakeup the hardware thread\n");
+	}
+
+	pthread_join(hw->thread, NULL);
+	hw->running = 0;
+
+	event_del(&hw->evPublications);
+	hwThreadDrainPublications(hw);
+
+	// commands which have not been processed yet are simply dropped
+	struct m_command *cmd;
+	while ((cmd = ringPop(&hw->commands)) != NULL) {
+		dropCommand(cmd);
+	}
+
+	ringFree(&hw->commands);
+	ringFree(&hw->publications);
+	close(hw->commandFd);
+	close(hw->publicationFd);
+	hwThread = NULL;
+}
+
+/**
+ * \brief Hands the command over to the hardware thread, returns 0 if it's queue is full.
+ */
+int hwThreadSubmit(struct m_metacash *metacash, struct m_command *cmd) {
+	struct m_hwthread *hw = &metacash->hwThread;
+
+	if (! ringPush(&hw->commands, cmd)) {
+		return 0;
+	}
+
+	uint64_t one = 1;
+	if (write(hw->commandFd, &one, sizeof(one)) != sizeof(one)) {
+		logMessage(LOG_WARNING, "hwThreadSubmit: could not wakeup the hardware thread\n");
+	}
+	return 1;
+}
+
+/**
+ * \brief Callback function triggered by an incoming message in either
+ * the "hopper-request" or "validator-request" topic.
+ * \details Details only to get graph.
+ * \callgraph
+ */
+void cbOnRequestMessage(redisAsyncContext *c, void *r, void *privdata) {
+	if (r == NULL) {
+		return;
+	}
+
+	struct m_metacash *m = c->data;
+	redisReply *reply = r;
+
+	// example from http://stackoverflow.com/questions/16213676/hiredis-waiting-for-message
+	if (reply->type == REDIS_REPLY_ARRAY && reply->elements == 3) {
+		if (strcmp(reply->element[0]->str, "subscribe") != 0) {
+			processRequest(m, reply->element[1]->str, reply->element[2]->str, NULL, 0);
+		}
+	}
+}
+
+/** \brief Type of a m_requestProperty: a string */
+#define REQUEST_STRING 1
+/** \brief Type of a m_requestProperty: an integer */
+#define REQUEST_INTEGER 2
+/** \brief Type of a m_requestProperty: present if it's true */
+#define REQUEST_TRUE 3
+
+/**
+ * \brief Describes where a known property of a request is stored in m_request.
+ */
+struct m_requestProperty {
+	/** \brief Name of the property */
+	const char *name;
+	/** \brief Bit (REQUEST_*) in m_request.present */
+	unsigned int bit;
+	/** \brief REQUEST_STRING, REQUEST_INTEGER or REQUEST_TRUE */
+	int type;
+	/** \brief Offset of the value in m_request */
+	size_t offset;
+};
+
+/** \brief The properties of a request the command handlers use */
+static const struct m_requestProperty requestProperties[] = {
+	{ "msgId", REQUEST_MSGID, REQUEST_STRING, offsetof(struct m_request, msgId) },
+	{ "cmd", REQUEST_CMD, REQUEST_STRING, offsetof(struct m_request, cmd) },
+	{ "channels", REQUEST_CHANNELS, REQUEST_STRING, offsetof(struct m_request, channels) },
+	{ "amount", REQUEST_AMOUNT, REQUEST_INTEGER, offsetof(struct m_request, amount) },
+	{ "level", REQUEST_LEVEL, REQUEST_INTEGER, offsetof(struct m_request, level) },
+	{ "r", REQUEST_R, REQUEST_INTEGER, offsetof(struct m_request, r) },
+	{ "g", REQUEST_G, REQUEST_INTEGER, offsetof(struct m_request, g) },
+	{ "b", REQUEST_B, REQUEST_INTEGER, offsetof(struct m_request, b) },
+	{ "type", REQUEST_TYPE, REQUEST_INTEGER, offsetof(struct m_request, type) },
+	{ "refresh", REQUEST_REFRESH, REQUEST_TRUE, 0 },
+	{ "logLevel", REQUEST_LOG_LEVEL, REQUEST_STRING, offsetof(struct m_request, logLevel) },
+};
+
+/**
+ * \brief Returns the known property with the name of length bytes, NULL if it's unknown.
+ */
+const struct m_requestProperty *requestProperty(const char *name, size_t length) {
+	for (unsigned int i = 0; i < sizeof(requestProperties) / sizeof(requestProperties[0]); i++) {
+		if (strlen(requestProperties[i].name) == length && ! memcmp(requestProperties[i].name, name, length)) {
+			return &requestProperties[i];
+		}
+	}
+	return NULL;
+}
+
+/**
+ * \brief Reads the JSON string at *json (behind the opening quote), with string not NULL it's
+ * unescaped to the arena. Returns !=0 if the string is left to jansson: the arena is full or it
+ * has to be validated (control characters, non ASCII characters, \u escapes).
+ */
+int requestString(struct m_request *request, const char **json, const char **string) {
+	const char *p = *json;
+
+	for (const char *q = p; *q != '"'; q++) {
+		if ((unsigned char) *q < 0x20 || (unsigned char) *q >= 0x80) {
+			return 1;
+		}
+		if (*q == '\\') {
+			if (q[1] == 'u' || q[1] == '\0') {
+				return 1;
+			}
+			q++;
+		}
+	}
+
+	const char *end = p;
+	long length = jsonUnescape(&end, NULL);
+	if (length < 0) {
+		return 1;
+	}
+
+	if (string) {
+		if (request->used + length + 1 > sizeof(request->arena)) {
+			return 1;
+		}
+		char *copy = request->arena + request->used;
+		jsonUnescape(&p, (unsigned char *) copy);
+		copy[length] = '\0';
+		request->used += length + 1;
+		*string = copy;
+	}
+
+	*json = end;
+	return 0;
+}
+
+/**
+ * \brief Parses a flat request object into request without allocating, returns !=0 if the
+ * message has to be parsed by jansson (nested values, reals, unusual strings or malformed JSON).
+ * \details Other properties are skipped, a known property with an unexpected type is treated
+ * as missing (like the json_is_*() checks of the handlers did). The last of duplicates wins.
+ */
+int requestParse(struct m_request *request, const char *message) {
+	const char *p = jsonSkipSpace(message);
+
+	request->present = 0;
+	request->used = 0;
+
+	if (*p++ != '{') {
+		return 1;
+	}
+
+	p = jsonSkipSpace(p);
+	if (*p == '}') {
+		p++;
+	} else {
+		for (;;) {
+			if (*p++ != '"') {
+				return 1;
+			}
+			const char *name = p;
+			while (*p != '"') {
+				if (*p == '\\' || (unsigned char) *p < 0x20 || (unsigned char) *p >= 0x80) {
+					return 1;
+				}
+				p++;
+			}
+			const struct m_requestProperty *property = requestProperty(name, p - name);
+			void *value = property ? (char *) request + property->offset : NULL;
+
+			p = jsonSkipSpace(p + 1);
+			if (*p++ != ':') {
+				return 1;
+			}
+			p = jsonSkipSpace(p);
+
+			if (property) {
+				request->present &= ~property->bit;
+			}
+
+			if (*p == '"') {
+				p++;
+				int known = property && property->type == REQUEST_STRING;
+				if (requestString(request, &p, known ? (const char **) value : NULL)) {
+					return 1;
+				}
+				if (known) {
+					request->present |= property->bit;
+				}
+			} else if (*p == '-' || isdigit((unsigned char) *p)) {
+				// only what jansson reads as an integer, reals and leading zeros are left to it
+				const char *digits = *p == '-' ? p + 1 : p;
+				if (! isdigit((unsigned char) *digits) || (digits[0] == '0' && isdigit((unsigned char) digits[1]))) {
+					return 1;
+				}
+				char *end;
+				errno = 0;
+				long long integer = strtoll(p, &end, 10);
+				if (errno == ERANGE || *end == '.' || *end == 'e' || *end == 'E') {
+					return 1;
+				}
+				if (property && property->type == REQUEST_INTEGER) {
+					*(long long *) value = integer;
+					request->present |= property->bit;
+				}
+				p = end;
+			} else if (strncmp(p, "true", 4) == 0) {
+				if (property && property->type == REQUEST_TRUE) {
+					request->present |= property->bit;
+				}
+				p += 4;
+			} else if (strncmp(p, "false", 5) == 0) {
+				p += 5;
+			} else if (strncmp(p, "null", 4) == 0) {
+				p += 4;
+			} else {
+				return 1;
+			}
+
+			p = jsonSkipSpace(p);
+			if (*p == ',') {
+				p = jsonSkipSpace(p + 1);
+			} else if (*p == '}') {
+				p++;
+				break;
+			} else {
+				return 1;
+			}
+		}
+	}
+
+	return *jsonSkipSpace(p) != '\0';
+}
+
+/**
+ * \brief Fills request with the known properties of the JSON object, the strings point into it.
+ */
+void requestFromJson(struct m_request *request, json_t *json) {
+	request->present = 0;
+	request->used = 0;
+
+	for (unsigned int i = 0; i < sizeof(requestProperties) / sizeof(requestProperties[0]); i++) {
+		const struct m_requestProperty *property = &requestProperties[i];
+		json_t *jValue = json_object_get(json, property->name);
+		void *value = (char *) request + property->offset;
+
+		if (property->type == REQUEST_STRING && json_is_string(jValue)) {
+			*(const char **) value = json_string_value(jValue);
+		} else if (property->type == REQUEST_INTEGER && json_is_integer(jValue)) {
+			*(long long *) value = json_integer_value(jValue);
+		} else if (! (property->type == REQUEST_TRUE && json_is_true(jValue))) {
+			continue;
+		}
+		request->present |= property->bit;
+	}
+}
+
+/**
+ * \brief Parses the message received in the request topic and queues the command for its device.
+ * \details streamId is the id of the stream entry if the message has been read from
+ * the stream of the topic (-s), NULL for pub/sub. redelivered is !=0 if the entry has
+ * been delivered before already.
+ */
+void processRequest(struct m_metacash *m, const char *topic, const char *message, const char *streamId,
+		int redelivered) {
+	struct m_command *cmd = calloc(1, sizeof(struct m_command));
+
+	cmd->received = clockMonotonicMs();
+	cmd->msgId = NULL;
+	cmd->correlId = NULL;
+	cmd->command = NULL;
+
+	// decide to which topic the response should be sent to
+	if (strcmp(topic, topics.validatorRequest) == 0) {
+		cmd->device = &m->validator;
+		cmd->responseTopic = topics.validatorResponse;
+		cmd->stream = topics.validatorRequest;
+	} else if (strcmp(topic, topics.hopperRequest) == 0) {
+		cmd->device = &m->hopper;
+		cmd->responseTopic = topics.hopperResponse;
+		cmd->stream = topics.hopperRequest;
+	} else {
+		logMessage(LOG_ERR, "processRequest: received a message in a topic we don't have a response topic for\n");
+		free(cmd);
+		return;
+	}
+
+	if (streamId) {
+		snprintf(cmd->streamId, sizeof(cmd->streamId), "%s", streamId);
+		cmd->redelivered = redelivered;
+	} else {
+		cmd->stream = NULL;
+	}
+
+	// generate a new 'msgId' for the response itself
+	uuid_t uuid;
+	uuid_generate_time_safe(uuid);
+	uuid_unparse_lower(uuid, cmd->msgIdBuffer);
+	cmd->msgId = cmd->msgIdBuffer;
+
+	// almost every request is a flat object, those are parsed into cmd->request without
+	// allocating. anything else (ex. "batch") goes through jansson.
+	if (requestParse(&cmd->request, message)) {
+		json_error_t error;
+		cmd->jsonMessage = json_loads(message, 0, &error);
+
+		if(! cmd->jsonMessage) {
+			logMessage(LOG_WARNING, "unable to process message: could not parse json. reason: %s, line: %d",
+					error.text, error.line);
+			replyWith(cmd->responseTopic,
+					"{\"error\":\"could not parse json\",\"reason\":\"%s\",\"line\":%d}",
+					error.text, error.line);
+			freeCommand(cmd);
+			return;
+		}
+
+		requestFromJson(&cmd->request, cmd->jsonMessage);
+	}
+
+	// the 'msgId' property will be the 'correlId' used in replies.
+	if(! (cmd->request.present & REQUEST_MSGID)) {
+		logMessage(LOG_WARNING, "unable to process message: property 'msgId' missing or invalid");
+		replyWithPropertyError(cmd, "msgId");
+		freeCommand(cmd);
+		return;
+	} else {
+		cmd->correlId = (char *) cmd->request.msgId; // cast for now
+	}
+
+	// the 'cmd' property
+	if(! (cmd->request.present & REQUEST_CMD)) {
+		logMessage(LOG_WARNING, "unable to process message: property 'cmd' missing or invalid");
+		replyWithPropertyError(cmd, "cmd");
+		freeCommand(cmd);
+		return;
+	} else {
+		cmd->command = (char *) cmd->request.cmd; // cast for now
+	}
+
+	// proper json structure, properties cmd and msgId have been verified here.
+	// also we know which device is used and where we should send our response to.
+	// finally try to dispatch the message to the appropriate command handler.
+
+	logMessage(LOG_INFO, "processing cmd='%s' from msgId='%s' in topic='%s' for device='%s'\n",
+			cmd->command, cmd->correlId, topic, cmd->device->name);
+
+	cmd->handler = findCommandHandler(cmd->command);
+
+	if (cmd->redelivered && cmd->handler && cmd->handler->priority == PRIORITY_MONEY) {
+		// we don't know how far the command got before the restart, moving the money
+		// again could pay out twice. the client has to check and decide.
+		logMessage(LOG_WARNING, "not repeating cmd='%s' from msgId='%s' delivered before the restart\n",
+				cmd->command, cmd->correlId);
+		replyWith(cmd->responseTopic, "{\"correlId\":\"%s\",\"error\":\"interrupted\",\"cmd\":\"%s\"}",
+				cmd->correlId, cmd->command);
+		freeCommand(cmd);
+		return;
+	}
+
+	if (m->hwThread.running) {
+		// the hardware thread queues the command and frees it once it has been processed
+		if (! hwThreadSubmit(m, cmd)) {
+			queueReplyBusy(cmd);
+			freeCommand(cmd);
+		}
+	} else if (idempotencyAnswer(cmd)) {
+		freeCommand(cmd);
+	} else if (queuePush(cmd->device, cmd)) {
+		// the worker frees the command once it has been processed
+		idempotencyBegin(cmd);
+		queueKick(m, cmd->device);
+	} else {
+		queueReplyBusy(cmd);
+		freeCommand(cmd);
+	}
+}
+
+/** \brief The request streams, in the order used for m_streams.nextId */
+static const char *requestStreams[STREAM_COUNT] = { topics.hopperRequest, topics.validatorRequest };
+
+/**
+ * \brief Number of entries to read per stream, limited by the free space in the queues.
+ * \details Whatever gets read is ours until it's acknowledged, so rather than answering
+ * "busy" the entries stay in the stream until the queues have room for them.
+ */
+unsigned int streamFetchCount(struct m_metacash *m) {
+	unsigned int count = m->streams.maxCount;
+
+	// with -t the queues belong to the hardware thread, its ring has plenty of room
+	if (! m->hwThread.running) {
+		struct m_queue *queues[] = { &m->hopper.queue, &m->validator.queue };
+		for (unsigned int i = 0; i < sizeof(queues) / sizeof(queues[0]); i++) {
+			unsigned int free = queues[i]->length < queues[i]->capacity ? queues[i]->capacity - queues[i]->length : 0;
+			if (free < count) {
+				count = free;
+			}
+		}
+	}
+
+	return count;
+}
+
+/**
+ * \brief Callback function for libEvent, reads the request streams again after the queues have been full.
+ */
+void cbOnStreamBackoff(int fd, short event, void *privdata) {
+	streamRead(privdata);
+}
+
+/**
+ * \brief Reads the next batch of requests with XREADGROUP, cbOnStreamMessages() is called with the result.
+ * \details Pending entries are read without blocking until there are none left, then
+ * we wait up to STREAM_BLOCK ms for new entries.
+ */
+void streamRead(struct m_metacash *metacash) {
+	struct m_streams *streams = &metacash->streams;
+
+	unsigned int count = streamFetchCount(metacash);
+	if (count == 0) {
+		struct timeval backoff = { 0, STREAM_BACKOFF * 1000 };
+		evtimer_add(&streams->evBackoff, &backoff);
+		return;
+	}
+
+	redisAsyncCommand(redisStreamCtx, cbOnStreamMessages, NULL,
+			"XREADGROUP GROUP %s %s COUNT %u BLOCK %d STREAMS %s %s %s %s", STREAM_GROUP, streams->consumer,
+			count, STREAM_BLOCK, requestStreams[0], requestStreams[1], streams->nextId[0], streams->nextId[1]);
+}
+
+/**
+ * \brief Callback function triggered by the reply to XREADGROUP, processes the batch and reads the next one.
+ * \details The reply is an array of [stream, [[id, [field, value, ...]], ...]], the request
+ * itself is the value of the field "message".
+ */
+void cbOnStreamMessages(redisAsyncContext *c, void *r, void *privdata) {
+	if (r == NULL) {
+		// disconnected or exiting
+		return;
+	}
+
+	struct m_metacash *m = c->data;
+	struct m_streams *streams = &m->streams;
+	redisReply *reply = r;
+
+	if (reply->type == REDIS_REPLY_ERROR) {
+		logMessage(LOG_ERR, "cbOnStreamMessages: redis error: %s\n", reply->str);
+		struct timeval backoff = { 1, 0 };
+		evtimer_add(&streams->evBackoff, &backoff);
+		return;
+	}
+
+	// nil: nothing arrived within STREAM_BLOCK ms
+	for (size_t i = 0; reply->type == REDIS_REPLY_ARRAY && i < reply->elements; i++) {
+		redisReply *stream = reply->element[i];
+		if (stream->type != REDIS_REPLY_ARRAY || stream->elements != 2
+				|| stream->element[1]->type != REDIS_REPLY_ARRAY) {
+			continue;
+		}
+
+		const char *name = stream->element[0]->str;
+		redisReply *entries = stream->element[1];
+
+		int index = strcmp(name, requestStreams[0]) == 0 ? 0 : 1;
+		int pending = strcmp(streams->nextId[index], ">") != 0;
+
+		for (size_t j = 0; j < entries->elements; j++) {
+			redisReply *entry = entries->element[j];
+			if (entry->type != REDIS_REPLY_ARRAY || entry->elements != 2) {
+				continue;
+			}
+
+			const char *id = entry->element[0]->str;
+			redisReply *fields = entry->element[1];
+			const char *message = NULL;
+
+			for (size_t k = 0; fields->type == REDIS_REPLY_ARRAY && k + 1 < fields->elements; k += 2) {
+				if (strcmp(fields->element[k]->str, "message") == 0) {
+					message = fields->element[k + 1]->str;
+				}
+			}
+
+			if (pending) {
+				snprintf(streams->nextId[index], sizeof(streams->nextId[index]), "%s", id);
+			}
+
+			if (message) {
+				processRequest(m, name, message, id, pending);
+			} else {
+				// trimmed away while pending or not written by a client of ours
+				logMessage(LOG_WARNING, "cbOnStreamMessages: ignoring entry id='%s' in stream='%s' without message\n",
+						id, name);
+				publishAppendAck(requestStreams[index], id);
+			}
+		}
+
+		if (pending && entries->elements == 0) {
+			// all entries delivered before the restart are done, continue with the new ones
+			strcpy(streams->nextId[index], ">");
+		}
+	}
+
+	publishFlush();
+
+	streamRead(m);
+}
+
+/**
+ * \brief Callback function triggered by the reply to XGROUP CREATE.
+ */
+void cbOnStreamGroupCreated(redisAsyncContext *c, void *r, void *privdata) {
+	redisReply *reply = r;
+
+	// BUSYGROUP: the group exists already, that's the normal case
+	if (reply && reply->type == REDIS_REPLY_ERROR && strncmp(reply->str, "BUSYGROUP", 9) != 0) {
+		logMessage(LOG_ERR, "cbOnStreamGroupCreated: redis error: %s\n", reply->str);
+	}
+}
+
+/**
+ * \brief Callback function triggered by the redis client on connecting with
+ * the "stream" context.
+ */
+void cbOnConnectStreamContext(const redisAsyncContext *c, int status) {
+	if (status != REDIS_OK) {
+		logMessage(LOG_ERR, "cbOnConnectStreamContext - redis error: %s\n", c->errstr);
+		return;
+	}
+	logMessage(LOG_INFO, "cbOnConnectStreamContext - connected to redis\n");
+
+	redisAsyncContext *cNotConst = (redisAsyncContext*) c; // get rids of discarding qualifier \"const\" warning
+	struct m_metacash *m = c->data;
+
+	// a new group only gets the requests from now on, MKSTREAM creates the stream if required
+	for (unsigned int i = 0; i < STREAM_COUNT; i++) {
+		redisAsyncCommand(cNotConst, cbOnStreamGroupCreated, NULL, "XGROUP CREATE %s %s $ MKSTREAM",
+				requestStreams[i], STREAM_GROUP);
+		strcpy(m->streams.nextId[i], "0");
+	}
+
+	streamRead(m);
+}
+
+/**
+ * \brief Callback function triggered by the redis client on disconnecting with
+ * the "stream" context.
+ */
+void cbOnDisconnectStreamContext(const redisAsyncContext *c, int status) {
+	if (status != REDIS_OK) {
+		logMessage(LOG_INFO, "cbOnDisconnectStreamContext - redis error: %s\n", c->errstr);
+		return;
+	}
+	logMessage(LOG_INFO, "cbOnDisconnectStreamContext - disconnected from redis\n");
+}
+
+/**
+ * \brief Callback function triggered by the redis client on connecting with
+ * the "publish" context.
+ */
+void cbOnConnectPublishContext(const redisAsyncContext *c, int status) {
+	if (status != REDIS_OK) {
+		logMessage(LOG_ERR, "cbOnConnectPublishContext: redis error: %s\n", c->errstr);
+		return;
+	}
+	logMessage(LOG_INFO, "cbOnConnectPublishContext: connected to redis\n");
+}
+
+/**
+ * \brief Callback function triggered by the redis client on disconnecting with
+ * the "publish" context.
+ */
+void cbOnDisconnectPublishContext(const redisAsyncContext *c, int status) {
+	if (status != REDIS_OK) {
+		logMessage(LOG_ERR, "cbOnDisconnectPublishContext: redis error: %s\n", c->errstr);
+		return;
+	}
+	logMessage(LOG_INFO, "cbOnDisconnectPublishContext: disconnected from redis\n");
+}
+
+/**
+ * \brief Callback function triggered by the redis client on connecting with
+ * the "subscribe" context.
+ */
+void cbOnConnectSubscribeContext(const redisAsyncContext *c, int status) {
+	if (status != REDIS_OK) {
+		logMessage(LOG_ERR, "cbOnConnectSubscribeContext - redis error: %s\n", c->errstr);
+		return;
+	}
+	logMessage(LOG_INFO, "cbOnConnectSubscribeContext - connected to redis\n");
+
+	redisAsyncContext *cNotConst = (redisAsyncContext*) c; // get rids of discarding qualifier \"const\" warning
+
+	// subscribe the topics in redis from which we want to receive messages
+	redisAsyncCommand(cNotConst, cbOnMetacashMessage, NULL, "SUBSCRIBE %s", topics.metacash);
+
+	// with -s the requests are read from the streams instead (see cbOnConnectStreamContext())
+	struct m_metacash *m = c->data;
+	if (m->streams.maxCount == 0) {
+		// n.b: the same callback function handles both topics
+		redisAsyncCommand(cNotConst, cbOnRequestMessage, NULL, "SUBSCRIBE %s", topics.validatorRequest);
+		redisAsyncCommand(cNotConst, cbOnRequestMessage, NULL, "SUBSCRIBE %s", topics.hopperRequest);
+	}
+}
+
+/**
+ * \brief Callback function triggered by the redis client on disconnecting with
+ * the "subscribe" context.
+ */
+void cbOnDisconnectSubscribeContext(const redisAsyncContext *c, int status) {
+	if (status != REDIS_OK) {
+		logMessage(LOG_INFO, "cbOnDisconnectSubscribeContext - redis error: %s\n", c->errstr);
+		return;
+	}
+	logMessage(LOG_INFO, "cbOnDisconnectSubscribeContext - disconnected from redis\n");
+}
+
+/**
+ * \brief This function never returns, it displays the reason argument and return code
+ * in the syslog and exits immediately.
+ */
+void die(char *reason, int rc) {
+	logMessage(LOG_EMERG, "fatal error occured: %s, rc=%d", reason, rc);
+	logMessage(LOG_EMERG, "exiting NOW");
+	logStop();
+	exit(rc);
+}
+
+/**
+ * \brief Supports arguments -h (redis hostname), -p (redis port), -d (serial device name) and -?.
+ * \details Warning: both "calls" to hopperEventHandler() and validatorEventHandler() in the callgraph are false positives!
+ * \callgraph
+ */
+int main(int argc, char *argv[]) {
+	// setup logging via syslog, the level is checked by logWrite() (see "set-log-level")
+	setlogmask(LOG_UPTO(LOG_DEBUG));
+	openlog("payoutd", LOG_CONS | LOG_PID | LOG_NDELAY, LOG_LOCAL1);
+	logMessage(LOG_NOTICE, "Program started by User %d", getuid());
+
+	// register interrupt handler for signals
+	signal(SIGTERM, signalHandler);
+	signal(SIGINT, signalHandler);
+
+	struct m_metacash metacash = { 0 };
+	metacash.deviceAvailable = 0;
+	metacash.quit = 0;
+	metacash.logSyslogStderr = 0; // default, override using -e
+	metacash.acceptCoins = 0; // default, override using -c
+	metacash.asyncTransport = 0; // default, override using -a
+	metacash.hardwareThread = 0; // default, override using -t
+	metacash.pollFast = 200; // default, override using -P
+	metacash.pollIdle = 1000; // default, override using -P
+	metacash.pollBackoff = 2; // default, override using -P
+	metacash.queueCapacity = QUEUE_CAPACITY; // default, override using -q
+	metacash.metricsInterval = 60000; // default, override using -m
+	metacash.streams.maxCount = 0; // default pub/sub, override using -s
+	metacash.started = clockMonotonicMs();
+
+	metacash.serialDevice = "/dev/ttyACM0";	// default, override with -d argument
+	metacash.journalFile = NULL;		// default no journal, enable with -j argument
+	metacash.traceFile = NULL;			// default no frame trace, enable with -F argument
+	metacash.stateFile = NULL;			// default always configure, enable warm starts with -S argument
+	metacash.redisHost = "127.0.0.1";	// default, override with -h argument
+	metacash.redisPort = 6379;			// default, override with -p argument
+	metacash.topicPrefix = "";			// default, override with -T argument
+
+	metacash.hopper.id = 0x10; // 0X10 -> Smart Hopper ("Münzer")
+	metacash.hopper.name = "Mr. Coin";
+	metacash.hopper.key = DEFAULT_KEY;
+	metacash.hopper.eventHandlerFn = hopperEventHandler;
+	metacash.hopper.configHashFn = hopperConfigHash;
+	metacash.hopper.configureFn = hopperConfigure;
+	metacash.hopper.enableFn = NULL;
+	metacash.hopper.frameGap = defaultFrameGap(metacash.hopper.id); // override with -g
+	metacash.hopper.metacash = &metacash;
+
+	metacash.validator.id = 0x00; // 0x00 -> Smart Payout NV200 ("Scheiner")
+	metacash.validator.name = "Ms. Note";
+	metacash.validator.key = DEFAULT_KEY;
+	metacash.validator.eventHandlerFn = validatorEventHandler;
+	metacash.validator.configHashFn = validatorConfigHash;
+	metacash.validator.configureFn = validatorConfigure;
+	metacash.validator.enableFn = validatorEnable;
+	metacash.validator.frameGap = defaultFrameGap(metacash.validator.id); // override with -G
+	metacash.validator.metacash = &metacash;
+
+	// parse the command line arguments
+	if (parseCmdLine(argc, argv, &metacash)) {
+		die("invalid command line", 1);
+		// never reached, already exited
+	}
+
+	if (topicsInit(metacash.topicPrefix)) {
+		die("topic prefix too long", 1);
+		// never reached, already exited
+	}
+	eventsInit();
+
+	if(metacash.logSyslogStderr) {
+		closelog();
+		// also writeout syslog messages to stderr (intended for development purposes, you
+		// can enable this with the -e argument)
+		openlog("payoutd", LOG_PERROR | LOG_PID | LOG_NDELAY, LOG_LOCAL1);
+	}
+
+	// from now on syslog() (and the write to stderr with -e) is done by the log thread
+	logStart();
+
+	metacash.hopper.pollInterval = metacash.pollIdle;
+	metacash.validator.pollInterval = metacash.pollIdle;
+
+	metacash.hopper.queue.capacity = metacash.queueCapacity;
+	metacash.hopper.queue.serviceTime = 100; // initial guess for the retryAfter hint
+	metacash.validator.queue.capacity = metacash.queueCapacity;
+	metacash.validator.queue.serviceTime = 100;
+
+	if (metacash.asyncTransport && metacash.hardwareThread) {
+		logMessage(LOG_WARNING, "-a and -t can't be combined, using the hardware thread");
+		metacash.asyncTransport = 0;
+	}
+
+	logMessage(LOG_NOTICE, "using redis at %s:%d, topic prefix '%s' and hardware device %s",
+			metacash.redisHost, metacash.redisPort, metacash.topicPrefix, metacash.serialDevice);
+
+	// open the journal before anything can move money
+	if (metacash.journalFile && journalOpen(metacash.journalFile)) {
+		die("could not open the journal", 1);
+		// never reached, already exited
+	}
+
+	// the trace has to be open before the first frame (sync) is sent
+	if (metacash.traceFile) {
+		if (SSPTraceOpen(metacash.traceFile, 0)) {
+			logMessage(LOG_NOTICE, "recording the ssp frames in '%s'", metacash.traceFile);
+		} else {
+			logMessage(LOG_ERR, "could not open the frame trace '%s': %s", metacash.traceFile, strerror(errno));
+		}
+	}
+
+	// open the serial device
+	if (mcSspOpenSerialDevice(&metacash) == 0) {
+		metacash.deviceAvailable = 1;
+	} else {
+		logMessage(LOG_ALERT, "cash hardware unavailable");
+	}
+
+	// setup the ssp commands, configure and initialize the hardware. with -a the devices
+	// are initialized by tasks, we are open for business once they are done (see setupFinished()).
+	setup(&metacash);
+
+	event_base_dispatch(metacash.eventBase); // blocking until exited via api-call
+
+	publishPayoutEvent("{ \"event\":\"exiting\" }");
+	publishFlush();
+
+	// tasks still waiting for the hardware are simply dropped
+	taskCleanup();
+
+	if (metacash.metricsInterval > 0) {
+		event_del(&metacash.evMetrics);
+	}
+	hwThreadStop(&metacash);
+	SSPKeyPoolStop();
+
+	if (journal.path) {
+		event_del(&journal.evCommit);
+		journalClose();
+	}
+	SSPTraceClose();
+
+	// requests still waiting for the hardware are dropped as well
+	queueClear(&metacash.hopper);
+	queueClear(&metacash.validator);
+
+	logMessage(LOG_NOTICE, "shutting down");
+
+	if (metacash.deviceAvailable) {
+		mcSspCloseSerialDevice(&metacash);
+	}
+
+	// cleanup stuff before exiting.
+
+	// redis
+	redisAsyncFree(redisPublishCtx);
+	redisAsyncFree(redisSubscribeCtx);
+	if (redisStreamCtx) {
+		event_del(&metacash.streams.evBackoff);
+		redisAsyncFree(redisStreamCtx);
+	}
+
+	free(publisher.buffer);
+	free(publisher.frames);
+	free(publisher.scratch);
+
+	// libevent
+	event_base_free(metacash.eventBase);
+
+	// syslog
+	logMessage(LOG_NOTICE, "exiting NOW");
+	logStop();
+	closelog();
+
+	return 0;
+}
+
+/**
+ * \brief Sets up the names in topics with the prefix, returns !=0 if the prefix is too long.
+ */
+int topicsInit(const char *prefix) {
+	struct {
+		char *topic;
+		const char *name;
+	} names[] = {
+		{ topics.payoutEvent, "payout-event" },
+		{ topics.payoutMetrics, "payout-metrics" },
+		{ topics.metacash, "metacash" },
+		{ topics.hopperRequest, "hopper-request" },
+		{ topics.hopperResponse, "hopper-response" },
+		{ topics.hopperEvent, "hopper-event" },
+		{ topics.hopperEventBin, "hopper-event.bin" },
+		{ topics.validatorRequest, "validator-request" },
+		{ topics.validatorResponse, "validator-response" },
+		{ topics.validatorEvent, "validator-event" },
+		{ topics.validatorEventBin, "validator-event.bin" },
+	};
+
+	for (unsigned int i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		if (snprintf(names[i].topic, TOPIC_SIZE, "%s%s", prefix, names[i].name) >= TOPIC_SIZE) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * \brief Parse the command line arguments.
+ */
+int parseCmdLine(int argc, char *argv[], struct m_metacash *metacash) {
+	opterr = 0;
+
+	int c;
+	while ((c = getopt(argc, argv, "atecEBh:p:d:j:F:g:G:P:q:m:s:S:T:")) != -1) {
+		switch (c) {
+		case 'h':
+			metacash->redisHost = optarg;
+			break;
+		case 'p':
+			metacash->redisPort = atoi(optarg);
+			break;
+		case 'd':
+			metacash->serialDevice = optarg;
+			break;
+		case 'j':
+			metacash->journalFile = optarg;
+			break;
+		case 'F':
+			metacash->traceFile = optarg;
+			break;
+		case 'S':
+			metacash->stateFile = optarg;
+			break;
+		case 'T':
+			metacash->topicPrefix = optarg;
+			break;
+		case 'c':
+			metacash->acceptCoins = 1;
+			break;
+		case 'e':
+			metacash->logSyslogStderr = 1;
+			break;
+		case 'a':
+			metacash->asyncTransport = 1;
+			break;
+		case 'E':
+			pollEvents.perPoll = 1;
+			break;
+		case 'B':
+			pollEvents.binary = 1;
+			break;
+		case 't':
+			metacash->hardwareThread = 1;
+			break;
+		case 'g':
+			metacash->hopper.frameGap = atol(optarg);
+			break;
+		case 'G':
+			metacash->validator.frameGap = atol(optarg);
+			break;
+		case 'm':
+			metacash->metricsInterval = atol(optarg) * 1000;
+			break;
+		case 'q': {
+			char *end = NULL;
+			errno = 0;
+			long capacity = strtol(optarg, &end, 10);
+			if (errno != 0 || end == optarg || *end != '\0' || capacity < 1 || capacity > QUEUE_CAPACITY_MAX) {
+				fprintf(stderr, "Option -q requires a number from 1 to %d.\n", QUEUE_CAPACITY_MAX);
+				logMessage(LOG_ERR, "Option -q requires a number from 1 to %d.\n", QUEUE_CAPACITY_MAX);
+				return 1;
+			}
+			metacash->queueCapacity = (unsigned int) capacity;
+			break;
+		}
+		case 's':
+			if (atoi(optarg) < 1) {
+				fprintf(stderr, "Option -s requires a positive number.\n");
+				logMessage(LOG_ERR, "Option -s requires a positive number.\n");
+				return 1;
+			}
+			metacash->streams.maxCount = atoi(optarg);
+			break;
+		case 'P':
+			// <fast>,<idle>,<backoff> ex. "200,1000,2"
+			if (sscanf(optarg, "%ld,%ld,%d", &metacash->pollFast, &metacash->pollIdle,
+					&metacash->pollBackoff) != 3 || metacash->pollFast <= 0
+					|| metacash->pollIdle < metacash->pollFast || metacash->pollBackoff < 1) {
+				fprintf(stderr, "Option -P requires <fast>,<idle>,<backoff>.\n");
+				logMessage(LOG_ERR, "Option -P requires <fast>,<idle>,<backoff>.\n");
+				return 1;
+			}
+			break;
+		case '?':
+			if (optopt == 'h' || optopt == 'p' || optopt == 'd' || optopt == 'j' || optopt == 'F' || optopt == 'g' || optopt == 'G'
+					|| optopt == 'P' || optopt == 'q' || optopt == 'm' || optopt == 's' || optopt == 'S'
+					|| optopt == 'T') {
+				fprintf(stderr, "Option -%c requires an argument.\n", optopt);
+				logMessage(LOG_ERR, "Option -%c requires an argument.\n", optopt);
+			} else if (isprint(optopt)) {
+				fprintf(stderr, "Unknown option '-%c'.\n", optopt);
+				logMessage(LOG_ERR, "Unknown option '-%c'.\n", optopt);
+			} else {
+				fprintf(stderr, "Unknown option character 'x%x'.\n", optopt);
+				logMessage(LOG_ERR, "Unknown option character 'x%x'.\n", optopt);
+			}
+			return 1;
+		default:
+			fprintf(stderr, "Unknown argument: %c", c);
+			logMessage(LOG_ERR, "Unknown argument: %c", c);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * \brief Callback function used for inspecting and publishing events reported by the Hopper hardware.
+ */
+void hopperEventHandler(struct m_device *device,
+		struct m_metacash *metacash, SSP_POLL_DATA6 *poll) {
+	for (unsigned char i = 0; i < poll->event_count; ++i) {
+		switch (poll->events[i].event) {
+		case SSP_POLL_RESET:
+			publishHopperEvent("{\"event\":\"unit reset\"}");
+			// Make sure we are using ssp version 6
+			if (ssp6_host_protocol(&device->sspC, 0x06) != SSP_RESPONSE_OK) {
+				die("hopperEventHandler: SSP Host Protocol Failed", 3);
+				// never reached, already exited
+			}
+			// the firmware may have been updated and the configuration may be lost
+			deviceAfterReset(device);
+			break;
+		case SSP_POLL_READ:
+			// the \"read\" event contains 1 data value, which if >0 means a note has been validated and is in escrow
+			if (poll->events[i].data1 > 0) {
+				publishHopperEvent("{\"event\":\"read\",\"channel\":%ld}", poll->events[i].data1);
+			} else {
+				// this is reported more than once for a single note
+				publishHopperEvent("{\"event\":\"reading\"}");
+			}
+			break;
+		case SSP_POLL_TIMEOUT:
+			publishHopperEvent("{\"event\":\"timeout\",\"amount\":%ld,\"cc\":\"%s\"}", poll->events[i].data1, poll->events[i].cc);
+			break;
+		case SSP_POLL_DISPENSING:
+			publishHopperEvent("{\"event\":\"dispensing\",\"amount\":%ld}", poll->events[i].data1);
+			break;
+		case SSP_POLL_DISPENSED:
+			publishHopperEvent("{\"event\":\"dispensed\",\"amount\":%ld}", poll->events[i].data1);
+			break;
+		case SSP_POLL_FLOATING:
+			publishHopperEvent("{\"event\":\"floating\",\"amount\":%ld,\"cc\":\"%s\"}", poll->events[i].data1, poll->events[i].cc);
+			break;
+		case SSP_POLL_FLOATED:
+			publishHopperEvent("{\"event\":\"floated\",\"amount\":%ld,\"cc\":\"%s\"}", poll->events[i].data1, poll->events[i].cc);
+			break;
+		case SSP_POLL_CASHBOX_PAID:
+			publishHopperEvent("{\"event\":\"cashbox paid\",\"amount\":%ld,\"cc\":\"%s\"}", poll->events[i].data1, poll->events[i].cc);
+			break;
+		case SSP_POLL_JAMMED:
+			publishHopperEvent("{\"event\":\"jammed\"}");
+			break;
+		case SSP_POLL_FRAUD_ATTEMPT:
+			publishHopperEvent("{\"event\":\"fraud attempt\"}");
+			break;
+		case SSP_POLL_COIN_CREDIT:
+			publishHopperEvent("{\"event\":\"coin credit\",\"amount\":%ld,\"cc\":\"%s\"}", poll->events[i].data1, poll->events[i].cc);
+			break;
+		case SSP_POLL_EMPTY:
+			publishHopperEvent("{\"event\":\"empty\"}");
+			break;
+		case SSP_POLL_EMPTYING:
+			publishHopperEvent("{\"event\":\"emptying\"}");
+			break;
+		case SSP_POLL_SMART_EMPTYING:
+			publishHopperEvent("{\"event\":\"smart emptying\",\"amount\":%ld,\"cc\":\"%s\"}", poll->events[i].data1, poll->events[i].cc);
+			break;
+		case SSP_POLL_SMART_EMPTIED:
+			publishHopperEvent("{\"event\":\"smart emptied\",\"amount\":%ld,\"cc\":\"%s\"}", poll->events[i].data1, poll->events[i].cc);
+			break;
+		case SSP_POLL_CREDIT:
+			// The note which was in escrow has been accepted
+			publishHopperEvent("{\"event\":\"credit\",\"channel\":%ld,\"cc\":\"%s\"}", poll->events[i].data1, poll->events[i].cc);
+			break;
+		case SSP_POLL_INCOMPLETE_PAYOUT:
+			// the validator shutdown during a payout, this event is reporting that some value remains to payout
+			publishHopperEvent(
+					"{\"event\":\"incomplete payout\",\"dispensed\":%ld,\"requested\":%ld,\"cc\":\"%s\"}",
+					poll->events[i].data1, poll->events[i].data2,
+					poll->events[i].cc);
+			break;
+		case SSP_POLL_INCOMPLETE_FLOAT:
+			// the validator shutdown during a float, this event is reporting that some value remains to float
+			publishHopperEvent(
+					"{\"event\":\"incomplete float\",\"dispensed\":%ld,\"requested\":%ld,\"cc\":\"%s\"}",
+					poll->events[i].data1, poll->events[i].data2,
+					poll->events[i].cc);
+			break;
+		case SSP_POLL_DISABLED:
+			// The unit has been disabled
+			device->enabled = 0;
+			publishHopperEvent("{\"event\":\"disabled\"}");
+			break;
+		case SSP_POLL_CALIBRATION_FAIL:
+			// the hopper calibration has failed. An extra byte is available with an error code.
+			switch (poll->events[i].data1) {
+			case NO_FAILUE:
+				publishHopperEvent("{\"event\":\"calibration fail\",\"error\":\"no error\"}");
+				break;
+			case SENSOR_FLAP:
+				publishHopperEvent("{\"event\":\"calibration fail\",\"error\":\"sensor flap\"}");
+				break;
+			case SENSOR_EXIT:
+				publishHopperEvent("{\"event\":\"calibration fail\",\"error\":\"sensor exit\"}");
+				break;
+			case SENSOR_COIL1:
+				publishHopperEvent("{\"event\":\"calibration fail\",\"error\":\"sensor coil 1\"}");
+				break;
+			case SENSOR_COIL2:
+				publishHopperEvent("{\"event\":\"calibration fail\",\"error\":\"sensor coil 2\"}");
+				break;
+			case NOT_INITIALISED:
+				publishHopperEvent("{\"event\":\"calibration fail\",\"error\":\"not initialized\"}");
+				break;
+			case CHECKSUM_ERROR:
+				publishHopperEvent("{\"event\":\"calibration fail\",\"error\":\"checksum error\"}");
+				break;
+			case COMMAND_RECAL:
+				publishHopperEvent("{\"event\":\"recalibrating\"}");
+				ssp6_run_calibration(&device->sspC);
+				break;
+			}
+			break;
+		default:
+			// fallback only. in case we got a message which is not handled above.
+			// if you can see this have a look in the SSP reference manual what
+			// the message is about.
+			publishHopperEvent("{\"event\":\"unknown\",\"id\":\"0x%02X\"}", poll->events[i].event);
+			break;
+		}
+	}
+}
+
+/**
+ * \brief Callback function used for inspecting and publishing events reported by the Validator hardware.
+ */
+void validatorEventHandler(struct m_device *device,
+		struct m_metacash *metacash, SSP_POLL_DATA6 *poll) {
+	for (unsigned char i = 0; i < poll->event_count; ++i) {
+		switch (poll->events[i].event) {
+		case SSP_POLL_RESET:
+			publishValidatorEvent("{\"event\":\"unit reset\"}");
+			// Make sure we are using ssp version 6
+			if (ssp6_host_protocol(&device->sspC, 0x06) != SSP_RESPONSE_OK) {
+				die("validatorEventHandler: SSP Host Protocol Failed", 3);
+				// never reached, already exited
+			}
+			// the firmware may have been updated and the configuration may be lost
+			deviceAfterReset(device);
+			break;
+		case SSP_POLL_READ:
+			// the \"read\" event contains 1 data value, which if >0 means a note has been validated and is in escrow
+			if (poll->events[i].data1 > 0) {
+				// The note which was in escrow has been accepted
+				unsigned long amount =
+						device->sspSetupReq.ChannelData[poll->events[i].data1 - 1].value
+								* 100;
+				publishValidatorEvent("{\"event\":\"read\",\"amount\":%ld,\"channel\":%ld}",
+						amount, poll->events[i].data1);
+			} else {
+				publishValidatorEvent("{\"event\":\"reading\"}");
+			}
+			break;
+		case SSP_POLL_EMPTY:
+			publishValidatorEvent("{\"event\":\"empty\"}");
+			break;
+		case SSP_POLL_EMPTYING:
+			publishValidatorEvent("{\"event\":\"emptying\"}");
+			break;
+		case SSP_POLL_SMART_EMPTYING:
+			publishValidatorEvent("{\"event\":\"smart emptying\"}");
+			break;
+		case SSP_POLL_TIMEOUT:
+			publishValidatorEvent("{\"event\":\"timeout\",\"amount\":%ld,\"cc\":\"%s\"}", poll->events[i].data1, poll->events[i].cc);
+			break;
+		case SSP_POLL_CREDIT:
+			// The note which was in escrow has been accepted
+		{
+			unsigned long amount =
+					device->sspSetupReq.ChannelData[poll->events[i].data1 - 1].value
+							* 100;
+			publishValidatorEvent("{\"event\":\"credit\",\"amount\":%ld,\"channel\":%ld}",
+					amount, poll->events[i].data1);
+		}
+			break;
+		case SSP_POLL_INCOMPLETE_PAYOUT:
+			// the validator shutdown during a payout, this event is reporting that some value remains to payout
+			publishValidatorEvent(
+					"{\"event\":\"incomplete payout\",\"dispensed\":%ld,\"requested\":%ld,\"cc\":\"%s\"}",
+					poll->events[i].data1, poll->events[i].data2,
+					poll->events[i].cc);
+			break;
+		case SSP_POLL_INCOMPLETE_FLOAT:
+			// the validator shutdown during a float, this event is reporting that some value remains to float
+			publishValidatorEvent(
+					"{\"event\":\"incomplete float\",\"dispensed\":%ld,\"requested\":%ld,\"cc\":\"%s\"}",
+					poll->events[i].data1, poll->events[i].data2,
+					poll->events[i].cc);
+			break;
+		case SSP_POLL_REJECTING:
+			publishValidatorEvent("{\"event\":\"rejecting\"}");
+			break;
+		case SSP_POLL_REJECTED:
+			// The note was rejected
+			publishValidatorEvent("{\"event\":\"rejected\"}");
+			break;
+		case SSP_POLL_STACKING:
+			publishValidatorEvent("{\"event\":\"stacking\"}");
+			break;
+		case SSP_POLL_STORED:
+			// The note has been stored in the payout unit
+			publishValidatorEvent("{\"event\":\"stored\"}");
+			break;
+		case SSP_POLL_STACKED:
+			// The note has been stacked in the cashbox
+			publishValidatorEvent("{\"event\":\"stacked\"}");
+			break;
+		case SSP_POLL_SAFE_JAM:
+			publishValidatorEvent("{\"event\":\"safe jam\"}");
+			break;
+		case SSP_POLL_UNSAFE_JAM:
+			publishValidatorEvent("{\"event\":\"unsafe jam\"}");
+			break;
+		case SSP_POLL_DISABLED:
+			// The validator has been disabled
+			device->enabled = 0;
+			publishValidatorEvent("{\"event\":\"disabled\"}");
+			break;
+		case SSP_POLL_FRAUD_ATTEMPT:
+			// The validator has detected a fraud attempt
+			publishValidatorEvent(
+					"{\"event\":\"fraud attempt\",\"dispensed\":%ld}",
+					poll->events[i].data1);
+			break;
+		case SSP_POLL_STACKER_FULL:
+			// The cashbox is full
+			publishValidatorEvent("{\"event\":\"stacker full\"}");
+			break;
+		case SSP_POLL_CASH_BOX_REMOVED:
+			// The cashbox has been removed
+			publishValidatorEvent("{\"event\":\"cashbox removed\"}");
+			break;
+		case SSP_POLL_CASH_BOX_REPLACED:
+			// The cashbox has been replaced
+			publishValidatorEvent("{\"event\":\"cashbox replaced\"}");
+			break;
+		case SSP_POLL_CLEARED_FROM_FRONT:
+			// A note was in the notepath at startup and has been cleared from the front of the validator
+			publishValidatorEvent("{\"event\":\"cleared from front\"}");
+			break;
+		case SSP_POLL_CLEARED_INTO_CASHBOX:
+			// A note was in the notepath at startup and has been cleared into the cashbox
+			publishValidatorEvent("{\"event\":\"cleared into cashbox\"}");
+			break;
+		case SSP_POLL_CALIBRATION_FAIL:
+			// the hopper calibration has failed. An extra byte is available with an error code.
+			switch (poll->events[i].data1) {
+			case NO_FAILUE:
+				publishValidatorEvent("{\"event\":\"calibration fail\",\"error\":\"no error\"}");
+				break;
+			case SENSOR_FLAP:
+				publishValidatorEvent("{\"event\":\"calibration fail\",\"error\":\"sensor flap\"}");
+				break;
+			case SENSOR_EXIT:
+				publishValidatorEvent("{\"event\":\"calibration fail\",\"error\":\"sensor exit\"}");
+				break;
+			case SENSOR_COIL1:
+				publishValidatorEvent("{\"event\":\"calibration fail\",\"error\":\"sensor coil 1\"}");
+				break;
+			case SENSOR_COIL2:
+				publishValidatorEvent("{\"event\":\"calibration fail\",\"error\":\"sensor coil 2\"}");
+				break;
+			case NOT_INITIALISED:
+				publishValidatorEvent("{\"event\":\"calibration fail\",\"error\":\"not initialized\"}");
+				break;
+			case CHECKSUM_ERROR:
+				publishValidatorEvent("{\"event\":\"calibration fail\",\"error\":\"checksum error\"}");
+				break;
+			case COMMAND_RECAL:
+				publishValidatorEvent("{\"event\":\"recalibrating\"}");
+				ssp6_run_calibration(&device->sspC);
+				break;
+			}
+			break;
+		default:
+			// fallback only. in case we got a message which is not handled above.
+			// if you can see this have a look in the SSP reference manual what
+			// the message is about.
+			publishValidatorEvent("{\"event\":\"unknown\",\"id\":\"0x%02X\"}", poll->events[i].event);
+			break;
+		}
+	}
+}
+
+/**
+ * \brief Initializes and configures redis, libevent and the hardware.
+ */
+void setup(struct m_metacash *metacash) {
+	checkCommandHandlers();
+
+	// initialize libEvent
+	metacash->eventBase = event_base_new();
+	publisher.eventBase = metacash->eventBase;
+
+	// connect to redis
+	redisPublishCtx = connectRedis(metacash); // establish connection for publishing
+	redisSubscribeCtx = connectRedis(metacash); // establich connection for subscribing
+
+	// setup redis
+	if (redisPublishCtx && redisSubscribeCtx) {
+		redisLibeventAttach(redisPublishCtx, metacash->eventBase);
+		redisAsyncSetConnectCallback(redisPublishCtx, cbOnConnectPublishContext);
+		redisAsyncSetDisconnectCallback(redisPublishCtx, cbOnDisconnectPublishContext);
+
+		redisLibeventAttach(redisSubscribeCtx, metacash->eventBase);
+		redisAsyncSetConnectCallback(redisSubscribeCtx, cbOnConnectSubscribeContext);
+		redisAsyncSetDisconnectCallback(redisSubscribeCtx, cbOnDisconnectSubscribeContext);
+	} else {
+		die("could not establish connection to redis", 1);
+		// never reached, already exited
+	}
+
+	// setup the streams transport, XREADGROUP blocks so it needs a connection of its own
+	if (metacash->streams.maxCount > 0) {
+		publisher.streamMaxLen = STREAM_MAXLEN;
+
+		if (gethostname(metacash->streams.consumer, sizeof(metacash->streams.consumer)) != 0) {
+			strcpy(metacash->streams.consumer, "payoutd");
+		}
+		metacash->streams.consumer[sizeof(metacash->streams.consumer) - 1] = '\0';
+
+		evtimer_set(&metacash->streams.evBackoff, cbOnStreamBackoff, metacash);
+		event_base_set(metacash->eventBase, &metacash->streams.evBackoff);
+
+		redisStreamCtx = connectRedis(metacash);
+		if (! redisStreamCtx) {
+			die("could not establish connection to redis", 1);
+			// never reached, already exited
+		}
+		redisLibeventAttach(redisStreamCtx, metacash->eventBase);
+		redisAsyncSetConnectCallback(redisStreamCtx, cbOnConnectStreamContext);
+		redisAsyncSetDisconnectCallback(redisStreamCtx, cbOnDisconnectStreamContext);
+
+		logMessage(LOG_NOTICE, "reading requests from streams as consumer '%s' of group '%s'",
+				metacash->streams.consumer, STREAM_GROUP);
+	}
+
+	// setup libevent triggered check if we should quit (every 500ms more or less)
+	{
+		struct timeval interval;
+		interval.tv_sec = 0;
+		interval.tv_usec = 500000;
+
+		event_set(&metacash->evCheckQuit, 0, EV_PERSIST, cbOnCheckQuitEvent, metacash); // provide metacash in privdata
+		event_base_set(metacash->eventBase, &metacash->evCheckQuit);
+		evtimer_add(&metacash->evCheckQuit, &interval);
+	}
+
+	// setup the periodic metrics
+	if (metacash->metricsInterval > 0) {
+		struct timeval interval = { metacash->metricsInterval / 1000, (metacash->metricsInterval % 1000) * 1000 };
+
+		event_set(&metacash->evMetrics, 0, EV_PERSIST, cbOnMetrics, metacash);
+		event_base_set(metacash->eventBase, &metacash->evMetrics);
+		evtimer_add(&metacash->evMetrics, &interval);
+	}
+
+	// setup the group commit of the journal
+	if (journal.path) {
+		struct timeval interval = { 0, JOURNAL_COMMIT_INTERVAL * 1000 };
+
+		event_set(&journal.evCommit, 0, EV_PERSIST, cbOnJournalCommit, NULL);
+		event_base_set(metacash->eventBase, &journal.evCommit);
+		evtimer_add(&journal.evCommit, &interval);
+	}
+
+	// try to initialize the hardware only if we successfully have opened the device
+	if (metacash->deviceAvailable) {
+		// every frame is sent via transportSendCommand() which takes care of the pacing
+		SSPSetSendHook(transportSendCommand, metacash);
+
+		// prepare the device structures
+		mcSspSetupCommand(&metacash->validator.sspC, metacash->validator.id);
+		mcSspSetupCommand(&metacash->hopper.sspC, metacash->hopper.id);
+
+		// what has been applied to the devices before the restart
+		stateLoad(metacash);
+
+		// precompute the key material for the encryption (and renegotiations after a power glitch) in the background
+		SSPKeyPoolStart(2);
+
+		if (metacash->asyncTransport) {
+			// from now on all ssp commands issued from within tasks no longer block the event loop
+			transportSetup(metacash);
+
+			// both devices are initialized at once, their frames are interleaved on the bus.
+			// the last task to finish calls setupFinished().
+			metacash->startupPending = 2;
+			taskSpawn(metacash, taskDeviceStartup, &metacash->validator, NULL);
+			taskSpawn(metacash, taskDeviceStartup, &metacash->hopper, NULL);
+			return;
+		}
+
+		deviceStartup(&metacash->validator);
+		deviceStartup(&metacash->hopper);
+	}
+
+	setupFinished(metacash);
+}
+
+/**
+ * \brief Finishes the startup once the devices have been initialized: the journal is
+ * recovered, the polling starts and the requests received meanwhile are processed.
+ * \details If the configuration of a device has been skipped (warm start) the requests for
+ * that device wait until its first poll has shown that it hasn't been reset meanwhile, see
+ * deviceVerifyPoll().
+ */
+void setupFinished(struct m_metacash *metacash) {
+	if (metacash->deviceAvailable) {
+		// the level caches are fresh now, compare them with what the journal left open
+		journalRecover(metacash);
+
+		logMessage(LOG_INFO, "setup finished successfully after %lld ms\n", clockMonotonicMs() - metacash->started);
+
+		if (metacash->hopper.verifyPending || metacash->validator.verifyPending) {
+			logMessage(LOG_NOTICE, "requests for the warm started devices wait for their first poll\n");
+		}
+
+		// from now on all ssp commands are issued by the hardware thread
+		if (metacash->hardwareThread) {
+			hwThreadStart(metacash);
+		}
+	}
+
+	// setup libevent triggered polling of the hardware (unless there is nothing to poll or the
+	// hardware thread polls on it's own). each device reschedules its own timer after polling.
+	if (metacash->deviceAvailable && ! metacash->hwThread.running) {
+		struct m_device *devices[] = { &metacash->hopper, &metacash->validator };
+
+		for (unsigned int i = 0; i < sizeof(devices) / sizeof(devices[0]); i++) {
+			evtimer_set(&devices[i]->evPoll, cbOnPollEvent, devices[i]); // provide the device in privdata
+			event_base_set(metacash->eventBase, &devices[i]->evPoll);
+			pollSchedule(devices[i]);
+		}
+	}
+
+	logMessage(LOG_NOTICE, "open for business :D");
+
+	publishPayoutEvent("{ \"event\":\"started\" }");
+
+	// requests received while the devices were initialized have only been queued
+	if (! metacash->hwThread.running) {
+		struct m_device *devices[] = { &metacash->hopper, &metacash->validator };
+
+		for (unsigned int i = 0; i < sizeof(devices) / sizeof(devices[0]); i++) {
+			if (devices[i]->queue.length > 0) {
+				queueKick(metacash, devices[i]);
+			}
+		}
+	}
+}
+
+/**
+ * \brief Opens the serial device.
+ */
+int mcSspOpenSerialDevice(struct m_metacash *metacash) {
+	// open the serial device
+	logMessage(LOG_INFO, "opening serial device: %s\n", metacash->serialDevice);
+
+	{
+		struct stat buffer;
+		int fildes = open(metacash->serialDevice, O_RDWR);
+		if (fildes <= 0) {
+			logMessage(LOG_ERR, "opening device %s failed: %s\n", metacash->serialDevice, strerror(errno));
+			return 1;
+		}
+
+		fstat(fildes, &buffer); // TODO: error handling
+
+		close(fildes);
+
+		switch (buffer.st_mode & S_IFMT) {
+		case S_IFCHR:
+			break;
+		default:
+			logMessage(LOG_ERR, "file %s is not a device\n", metacash->serialDevice);
+			return 1;
+		}
+	}
+
+	if (open_ssp_port(metacash->serialDevice) == 0) {
+		logMessage(LOG_ERR, "could not open serial device %s\n",
+				metacash->serialDevice);
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * \brief Closes the serial device.
+ */
+void mcSspCloseSerialDevice(struct m_metacash *metacash) {
+	close_ssp_port();
+}
+
+/**
+ * \brief Issues a poll command to the hardware and dispatches the response to the event handler function of the device.
+ */
+void mcSspPollDevice(struct m_device *device, struct m_metacash *metacash) {
+	SSP_POLL_DATA6 poll;
+
+	// poll the unit
+	SSP_RESPONSE_ENUM resp;
+	if ((resp = ssp6_poll(&device->sspC, &poll)) != SSP_RESPONSE_OK) {
+		pollAdapt(device, NULL);
+		operationCheckTimeout(device);
+		deviceVerifyPoll(device, 0);
+
+		if (resp == SSP_RESPONSE_TIMEOUT) {
+			// If the poll timed out, then give up
+			logMessage(LOG_WARNING, "SSP Poll Timeout\n");
+			return;
+		} else {
+			if (resp == SSP_RESPONSE_KEY_NOT_SET) {
+				// The unit has responded with key not set, so we should try to negotiate one. With key
+				// material from the pool this only costs the round trips, which with the async transport
+				// don't block the event loop either (the poll task is suspended meanwhile).
+				logMessage(LOG_NOTICE, "renegotiating the encryption of device='%s' (%d key sets ready)\n",
+						device->name, SSPKeyPoolAvailable());
+				if (ssp6_setup_encryption(&device->sspC, device->key)
+						!= SSP_RESPONSE_OK) {
+					logMessage(LOG_ERR, "Encryption Failed\n");
+				} else {
+					logMessage(LOG_INFO, "Encryption Setup\n");
+				}
+			} else {
+				logMessage(LOG_ERR, "SSP Poll Error: 0x%x\n", resp);
+			}
+		}
+	} else {
+		pollAdapt(device, &poll);
+
+		// everything the poll leads to goes into one message with -E
+		eventsBegin(eventsOf(device));
+
+		if (poll.event_count > 0) {
+			logMessage(LOG_INFO, "parsing poll response from \"%s\" now (%d events)\n",
+					device->name, poll.event_count);
+			device->eventHandlerFn(device, metacash, &poll);
+		} else {
+			//printf("polling \"%s\" returned no events\n", device->name);
+		}
+
+		journalAfterPoll(device, &poll);
+		levelsAfterPoll(device, &poll);
+		// after the levels, the completion carries the new total
+		operationAfterPoll(device, &poll);
+
+		// a reset would have been handled (and the configuration sent again) by the event handler
+		deviceVerifyPoll(device, 1);
+
+		eventsEnd(eventsOf(device));
+
+		if (! onHardwareThread) {
+			// all events of this poll go out in one write
+			publishFlush();
+		}
+	}
+}
+
+/**
+ * \brief Initializes an ITL hardware device via SSP, returns !=0 if that failed.
+ */
+int mcSspInitializeDevice(SSP_COMMAND *sspC, unsigned long long key,
+		struct m_device *device) {
+	SSP6_SETUP_REQUEST_DATA *sspSetupReq = &device->sspSetupReq;
+	logMessage(LOG_NOTICE, "initializing device (id=0x%02X, '%s')\n", sspC->SSPAddress, device->name);
+
+	//check device is present
+	if (ssp6_sync(sspC) != SSP_RESPONSE_OK) {
+		logMessage(LOG_ERR, "No device found\n");
+		return 1;
+	}
+	logMessage(LOG_INFO, "device found\n");
+
+	//try to setup encryption using the default key
+	if (ssp6_setup_encryption(sspC, key) != SSP_RESPONSE_OK) {
+		logMessage(LOG_ERR, "Encryption failed\n");
+		return 1;
+	}
+	logMessage(LOG_INFO, "encryption setup\n");
+
+	// Make sure we are using ssp version 6
+	if (ssp6_host_protocol(sspC, 0x06) != SSP_RESPONSE_OK) {
+		logMessage(LOG_ERR, "Host Protocol Failed\n");
+		return 1;
+	}
+	logMessage(LOG_INFO, "host protocol verified\n");
+
+	// Collect some information about the device
+	if (ssp6_setup_request(sspC, sspSetupReq) != SSP_RESPONSE_OK) {
+		logMessage(LOG_ERR, "Setup Request Failed\n");
+		return 1;
+	}
+
+	logMessage(LOG_INFO, "channels:\n");
+	for (unsigned int i = 0; i < sspSetupReq->NumberOfChannels; i++) {
+		logMessage(LOG_INFO, "channel %d: %d %s\n", i + 1, sspSetupReq->ChannelData[i].value,
+				sspSetupReq->ChannelData[i].cc);
+	}
+
+	if (mcSspReadDeviceInfo(device) == SSP_RESPONSE_OK) {
+		logMessage(LOG_INFO, "full firmware version: %s\n", device->info.firmwareVersion);
+		logMessage(LOG_INFO, "full dataset version : %s\n", device->info.datasetVersion);
+	}
+
+	// seed the level cache, devices without payout simply keep an invalid one
+	levelsSync(device, 0);
+
+	//enable the device
+	if (ssp6_enable(sspC) != SSP_RESPONSE_OK) {
+		logMessage(LOG_ERR, "Enable Failed\n");
+		return 1;
+	}
+	device->enabled = 1;
+
+	logMessage(LOG_NOTICE, "device has been successfully initialized (id=0x%02X, '%s')\n", sspC->SSPAddress, device->name);
+	return 0;
+}
+
+/**
+ * \brief Reads the static information of the device into its device info cache.
+ */
+SSP_RESPONSE_ENUM mcSspReadDeviceInfo(struct m_device *device) {
+	struct m_deviceInfo *info = &device->info;
+
+	info->valid = 0;
+
+	SSP_RESPONSE_ENUM resp = mc_ssp_get_firmware_version(&device->sspC, info->firmwareVersion);
+	if (resp != SSP_RESPONSE_OK) {
+		return resp;
+	}
+
+	resp = mc_ssp_get_dataset_version(&device->sspC, info->datasetVersion);
+	if (resp != SSP_RESPONSE_OK) {
+		return resp;
+	}
+
+	info->valid = 1;
+	return SSP_RESPONSE_OK;
+}
+
+/**
+ * \brief Routing of the banknotes in the validator (amounts are in cent), notes which are
+ * not routed to the cashbox are stored for payouts.
+ */
+static const struct {
+	/** \brief Value of the banknote in cent */
+	long value;
+	/** \brief If !=0 the note goes to the cashbox */
+	int cashbox;
+} validatorRoutes[] = {
+	{ 500, 1 }, // 5 euro
+	{ 1000, 1 }, // 10 euro
+	{ 2000, 1 }, // 20 euro
+	{ 5000, 0 }, // 50 euro
+	{ 10000, 0 }, // 100 euro
+	{ 20000, 0 }, // 200 euro
+	{ 50000, 0 }, // 500 euro
+};
+
+/**
+ * \brief Continues the FNV-1a hash with the bytes.
+ */
+unsigned long long configHashBytes(unsigned long long hash, const void *data, size_t length) {
+	const unsigned char *p = data;
+
+	for (size_t i = 0; i < length; i++) {
+		hash ^= p[i];
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+/**
+ * \brief Hash of what deviceConfigure() would send to the device: the channels reported by the
+ * setup request and the device specific settings.
+ */
+unsigned long long deviceConfigHash(struct m_device *device) {
+	SSP6_SETUP_REQUEST_DATA *sspSetupReq = &device->sspSetupReq;
+	unsigned long long hash = 14695981039346656037ULL;
+
+	hash = configHashBytes(hash, &device->id, sizeof(device->id));
+	for (unsigned int i = 0; i < sspSetupReq->NumberOfChannels; i++) {
+		hash = configHashBytes(hash, &sspSetupReq->ChannelData[i].value, sizeof(sspSetupReq->ChannelData[i].value));
+		hash = configHashBytes(hash, sspSetupReq->ChannelData[i].cc, strlen(sspSetupReq->ChannelData[i].cc));
+	}
+
+	return device->configHashFn(device, hash);
+}
+
+/**
+ * \brief Sends the configuration to the device unless the state file says it already has it.
+ * \details The configuration is skipped if its hash and the firmware and dataset versions
+ * are the same as when it was applied the last time. A device which loses it (power cycle)
+ * reports a reset with its first poll, deviceAfterReset() sends it again then.
+ */
+void deviceConfigure(struct m_device *device, int force) {
+	struct m_configState *config = &device->config;
+	struct m_deviceInfo *info = &device->info;
+	unsigned long long hash = deviceConfigHash(device);
+
+	if (! force && config->valid && info->valid && config->hash == hash
+			&& strcmp(config->firmwareVersion, info->firmwareVersion) == 0
+			&& strcmp(config->datasetVersion, info->datasetVersion) == 0) {
+		logMessage(LOG_INFO, "configuration of device='%s' unchanged, not sending it again\n", device->name);
+		device->verifyPending = 1;
+		device->verifyFailures = 0;
+		return;
+	}
+
+	device->reconfigurePending = 0;
+
+	config->valid = 0;
+
+	if (device->configureFn(device) == SSP_RESPONSE_OK && info->valid) {
+		config->valid = 1;
+		config->hash = hash;
+		strcpy(config->firmwareVersion, info->firmwareVersion);
+		strcpy(config->datasetVersion, info->datasetVersion);
+	} else {
+		logMessage(LOG_WARNING, "configuration of device='%s' incomplete, it is sent again on the next start\n",
+				device->name);
+	}
+
+	stateSave(device->metacash);
+}
+
+/**
+ * \brief Initializes and configures the device.
+ */
+void deviceStartup(struct m_device *device) {
+	if (mcSspInitializeDevice(&device->sspC, device->key, device)) {
+		return;
+	}
+
+	deviceConfigure(device, 0);
+
+	if (device->enableFn) {
+		device->enableFn(device);
+	}
+}
+
+/**
+ * \brief Task function which runs deviceStartup() for the device in data (async transport only).
+ */
+void taskDeviceStartup(struct m_task *task) {
+	struct m_metacash *metacash = task->metacash;
+	struct m_device *device = task->data;
+
+	long long start = clockMonotonicMs();
+	deviceStartup(device);
+	logMessage(LOG_INFO, "startup of device='%s' took %lld ms\n", device->name, clockMonotonicMs() - start);
+
+	if (--metacash->startupPending == 0) {
+		setupFinished(metacash);
+	}
+}
+
+/**
+ * \brief Called after the device reported a reset, the device info is read again and the
+ * configuration and the settings needed after every start are sent again (they may have
+ * been lost, see deviceConfigure()).
+ */
+void deviceAfterReset(struct m_device *device) {
+	// a reset unit stays disabled until it is enabled again
+	device->enabled = 0;
+
+	// the firmware may have been updated
+	if (mcSspReadDeviceInfo(device) != SSP_RESPONSE_OK) {
+		logMessage(LOG_WARNING, "could not read the device info of device='%s' after the reset\n", device->name);
+	}
+
+	deviceConfigure(device, 1);
+
+	if (device->enableFn) {
+		device->enableFn(device);
+	}
+}
+
+/**
+ * \brief Called after each poll of the device, confirms a warm start (see deviceConfigure()).
+ * \details The first successful poll confirms the skipped configuration, a power cycled device
+ * would have reported its reset in it. After VERIFY_POLL_FAILURES failed polls the device could
+ * have been reset unnoticed, it is configured again with the next successful poll. Either way
+ * the requests for the device are processed from then on.
+ */
+void deviceVerifyPoll(struct m_device *device, int ok) {
+	struct m_metacash *metacash = device->metacash;
+
+	if (ok && device->reconfigurePending) {
+		logMessage(LOG_NOTICE, "sending the configuration of device='%s' again, the warm start hasn't been confirmed\n",
+				device->name);
+		deviceConfigure(device, 1);
+		if (device->enableFn) {
+			device->enableFn(device);
+		}
+	}
+
+	if (! device->verifyPending) {
+		return;
+	}
+
+	if (ok) {
+		logMessage(LOG_INFO, "warm start of device='%s' confirmed by the first poll\n", device->name);
+	} else if (++device->verifyFailures >= VERIFY_POLL_FAILURES) {
+		logMessage(LOG_WARNING, "warm start of device='%s' not confirmed after %d failed polls, configuring it again once it answers\n",
+				device->name, device->verifyFailures);
+		device->reconfigurePending = 1;
+	} else {
+		return;
+	}
+
+	device->verifyPending = 0;
+
+	// the requests received meanwhile have only been queued
+	if (! metacash->hwThread.running && device->queue.length > 0) {
+		queueKick(metacash, device);
+	}
+}
+
+/**
+ * \brief Adds the coin acceptance to the configuration hash of the hopper.
+ */
+unsigned long long hopperConfigHash(struct m_device *device, unsigned long long hash) {
+	int acceptCoins = device->metacash->acceptCoins;
+
+	return configHashBytes(hash, &acceptCoins, sizeof(acceptCoins));
+}
+
+/**
+ * \brief Enables or disables the acceptance of each coin (see -c).
+ */
+SSP_RESPONSE_ENUM hopperConfigure(struct m_device *device) {
+	SSP6_SETUP_REQUEST_DATA *sspSetupReq = &device->sspSetupReq;
+	SSP_RESPONSE_ENUM result = SSP_RESPONSE_OK;
+	int accept;
+
+	if (device->metacash->acceptCoins) {
+		logMessage(LOG_WARNING, "coins will be accepted");
+		accept = ENABLED;
+	} else {
+		logMessage(LOG_NOTICE, "coins will not be accepted");
+		accept = DISABLED;
+	}
+
+	// SMART Hopper configuration
+	for (unsigned int i = 0; i < sspSetupReq->NumberOfChannels; i++) {
+		SSP_RESPONSE_ENUM resp = ssp6_set_coinmech_inhibits(&device->sspC, sspSetupReq->ChannelData[i].value,
+				sspSetupReq->ChannelData[i].cc, accept);
+		if (resp != SSP_RESPONSE_OK) {
+			result = resp;
+		}
+	}
+
+	return result;
+}
+
+/**
+ * \brief Adds the refill mode and the routes to the configuration hash of the validator.
+ */
+unsigned long long validatorConfigHash(struct m_device *device, unsigned long long hash) {
+	hash = configHashBytes(hash, "refill", 6);
+
+	return configHashBytes(hash, validatorRoutes, sizeof(validatorRoutes));
+}
+
+/**
+ * \brief Sets the refill mode and the routing of the banknotes.
+ */
+SSP_RESPONSE_ENUM validatorConfigure(struct m_device *device) {
+	SSP_RESPONSE_ENUM result = SSP_RESPONSE_OK;
+
+	// SMART Payout configuration
+
+	// reject notes unfit for storage.
+	// if this is not enabled, notes unfit for storage will be silently redirected
+	// to the cashbox of the validator from which no payout can be done.
+	if ((result = mc_ssp_set_refill_mode(&device->sspC)) != SSP_RESPONSE_OK) {
+		logMessage(LOG_WARNING, "setting refill mode failed");
+	}
+
+	// setup the routing of the banknotes in the validator
+	for (unsigned int i = 0; i < sizeof(validatorRoutes) / sizeof(validatorRoutes[0]); i++) {
+		SSP_RESPONSE_ENUM resp = ssp6_set_route(&device->sspC, validatorRoutes[i].value, CURRENCY,
+				validatorRoutes[i].cashbox ? SSP_OPTION_ROUTE_CASHBOX : SSP_OPTION_ROUTE_STORAGE);
+		if (resp != SSP_RESPONSE_OK) {
+			result = resp;
+		}
+	}
+
+	return result;
+}
+
+/**
+ * \brief Disables all channels and enables the payout unit, the validator forgets both when it resets.
+ */
+SSP_RESPONSE_ENUM validatorEnable(struct m_device *device) {
+	SSP_RESPONSE_ENUM resp;
+
+	device->channelInhibits = 0x0; // disable all channels
+
+	// set the inhibits in the hardware
+	if ((resp = ssp6_set_inhibits(&device->sspC, device->channelInhibits, 0x0)) != SSP_RESPONSE_OK) {
+		logMessage(LOG_ERR, "Inhibits Failed\n");
+		return resp;
+	}
+
+	//enable the payout unit
+	if ((resp = ssp6_enable_payout(&device->sspC, device->sspSetupReq.UnitType)) != SSP_RESPONSE_OK) {
+		logMessage(LOG_ERR, "Enable Payout Failed\n");
+		return resp;
+	}
+
+	return SSP_RESPONSE_OK;
+}
+
+/**
+ * \brief Reads the configuration applied before the restart from the state file (-S).
+ * \details One line per device: address, hash, firmware version and dataset version, separated by tabs.
+ */
+void stateLoad(struct m_metacash *metacash) {
+	if (metacash->stateFile == NULL) {
+		return;
+	}
+
+	FILE *file = fopen(metacash->stateFile, "r");
+	if (file == NULL) {
+		if (errno != ENOENT) {
+			logMessage(LOG_WARNING, "could not read state file %s: %s\n", metacash->stateFile, strerror(errno));
+		}
+		return;
+	}
+
+	char line[256];
+	while (fgets(line, sizeof(line), file)) {
+		struct m_configState config = { 0 };
+		unsigned int address;
+
+		if (sscanf(line, "%x\t%llx\t%99[^\t]\t%99[^\n]", &address, &config.hash, config.firmwareVersion,
+				config.datasetVersion) != 4) {
+			continue;
+		}
+
+		struct m_device *device = deviceByAddress(metacash, address);
+		if (device) {
+			config.valid = 1;
+			device->config = config;
+		}
+	}
+
+	fclose(file);
+}
+
+/**
+ * \brief Writes the configuration applied to the devices to the state file (-S).
+ * \details Written to <file>.tmp first and renamed, so a crash leaves either the old or the new state.
+ */
+void stateSave(struct m_metacash *metacash) {
+	if (metacash->stateFile == NULL) {
+		return;
+	}
+
+	char *tmp = NULL;
+	if (asprintf(&tmp, "%s.tmp", metacash->stateFile) < 0) {
+		return;
+	}
+
+	FILE *file = fopen(tmp, "w");
+	if (file == NULL) {
+		logMessage(LOG_WARNING, "could not write state file %s: %s\n", tmp, strerror(errno));
+		free(tmp);
+		return;
+	}
+
+	struct m_device *devices[] = { &metacash->hopper, &metacash->validator };
+	for (unsigned int i = 0; i < sizeof(devices) / sizeof(devices[0]); i++) {
+		struct m_configState *config = &devices[i]->config;
+		if (config->valid) {
+			fprintf(file, "%02x\t%016llx\t%s\t%s\n", devices[i]->sspC.SSPAddress, config->hash,
+					config->firmwareVersion, config->datasetVersion);
+		}
+	}
+
+	int failed = fflush(file) != 0 || fsync(fileno(file)) != 0;
+	failed |= fclose(file) != 0;
+	if (failed || rename(tmp, metacash->stateFile) != 0) {
+		logMessage(LOG_WARNING, "could not write state file %s: %s\n", metacash->stateFile, strerror(errno));
+		unlink(tmp);
+	}
+
+	free(tmp);
+}
+
+/**
+ * \brief Returns the level cache entry of the denomination, NULL if there is none.
+ */
+struct m_level *levelsFind(struct m_level *levels, unsigned int count, long value, const char *cc) {
+	for (unsigned int i = 0; i < count; i++) {
+		if (levels[i].value == value && strcmp(levels[i].cc, cc) == 0) {
+			return &levels[i];
+		}
+	}
+	return NULL;
+}
+
+/**
+ * \brief Reads the levels from the device into its level cache.
+ * \details If the cache was valid before, the denominations whose level changed are published
+ * with a "levels-changed" event. With check!=0 nothing should have changed (periodic
+ * comparison with the hardware), so changes are reported as drift.
+ */
+SSP_RESPONSE_ENUM levelsSync(struct m_device *device, int check) {
+	struct m_levelCache *cache = &device->levels;
+	struct m_level levels[MAX_LEVELS];
+	unsigned int count = 0;
+
+	SSP_RESPONSE_ENUM resp = mc_ssp_get_all_levels(&device->sspC, levels, &count);
+	if (resp != SSP_RESPONSE_OK) {
+		return resp;
+	}
+
+	if (cache->valid) {
+		char buffer[JSON_BUFFER_SIZE];
+		struct m_json json;
+		int changes = 0;
+
+		jsonInit(&json, buffer, sizeof(buffer));
+		jsonRaw(&json, "{\"event\":\"levels-changed\",\"levels\":[");
+
+		for (unsigned int i = 0; i < count; i++) {
+			struct m_level *old = levelsFind(cache->level, cache->count, levels[i].value, levels[i].cc);
+			long delta = levels[i].level - (old ? old->level : 0);
+			if (delta == 0) {
+				continue;
+			}
+			if (changes++ > 0) {
+				jsonRaw(&json, ",");
+			}
+			jsonRaw(&json, "{\"value\":");
+			jsonInt(&json, levels[i].value);
+			jsonRaw(&json, ",\"level\":");
+			jsonInt(&json, levels[i].level);
+			jsonRaw(&json, ",\"delta\":");
+			jsonInt(&json, delta);
+			jsonRaw(&json, ",\"cc\":");
+			jsonString(&json, levels[i].cc);
+			jsonRaw(&json, "}");
+		}
+		// denominations the device does not report anymore
+		for (unsigned int i = 0; i < cache->count; i++) {
+			if (cache->level[i].level == 0 || levelsFind(levels, count, cache->level[i].value, cache->level[i].cc)) {
+				continue;
+			}
+			if (changes++ > 0) {
+				jsonRaw(&json, ",");
+			}
+			jsonRaw(&json, "{\"value\":");
+			jsonInt(&json, cache->level[i].value);
+			jsonRaw(&json, ",\"level\":0,\"delta\":");
+			jsonInt(&json, - cache->level[i].level);
+			jsonRaw(&json, ",\"cc\":");
+			jsonString(&json, cache->level[i].cc);
+			jsonRaw(&json, "}");
+		}
+
+		jsonRaw(&json, check ? "],\"drift\":true}" : "]}");
+
+		if (changes > 0 && ! json.overflow) {
+			if (check) {
+				logMessage(LOG_WARNING, "levels of device='%s' drifted from the cached ones\n", device->name);
+			}
+			eventsAdd(eventsOf(device), json.buffer, json.length);
+		}
+	}
+
+	memcpy(cache->level, levels, count * sizeof(levels[0]));
+	cache->count = count;
+	cache->valid = 1;
+	cache->stale = 0;
+	cache->lastCheck = clockMonotonicMs();
+
+	return SSP_RESPONSE_OK;
+}
+
+/**
+ * \brief Returns !=0 if the event tells that the levels of the device have changed.
+ */
+int isLevelChangeEvent(unsigned char event) {
+	switch (event) {
+	case SSP_POLL_DISPENSED:
+	case SSP_POLL_FLOATED:
+	case SSP_POLL_CASHBOX_PAID:
+	case SSP_POLL_COIN_CREDIT:
+	case SSP_POLL_STORED:
+	case SSP_POLL_EMPTY:
+	case SSP_POLL_SMART_EMPTIED:
+	case SSP_POLL_INCOMPLETE_PAYOUT:
+	case SSP_POLL_INCOMPLETE_FLOAT:
+	case SSP_POLL_RESET:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/**
+ * \brief Keeps the level cache of the device up to date after a poll.
+ * \details The levels are read again once the device is idle after an event changed them,
+ * so a payout costs one GET ALL LEVELS no matter how often the clients ask. Every
+ * LEVEL_CHECK_INTERVAL ms the cache is compared with the hardware anyway.
+ */
+void levelsAfterPoll(struct m_device *device, SSP_POLL_DATA6 *poll) {
+	struct m_levelCache *cache = &device->levels;
+
+	if (! cache->valid) {
+		return;
+	}
+
+	int busy = device->operationPending;
+	for (unsigned int i = 0; i < poll->event_count; ++i) {
+		if (isLevelChangeEvent(poll->events[i].event)) {
+			cache->stale = 1;
+		}
+		if (isInFlightEvent(poll->events[i].event)) {
+			busy = 1;
+		}
+	}
+
+	if (busy) {
+		return;
+	}
+
+	if (cache->stale) {
+		levelsSync(device, 0);
+	} else if (clockMonotonicMs() - cache->lastCheck >= LEVEL_CHECK_INTERVAL) {
+		levelsSync(device, 1);
+	}
+}
+
+/**
+ * \brief Value in cents stored in the device according to the level cache, -1 if the cache is not up to date.
+ */
+long long levelsTotal(struct m_device *device) {
+	struct m_levelCache *cache = &device->levels;
+
+	if (! cache->valid || cache->stale) {
+		return -1;
+	}
+
+	long long total = 0;
+	for (unsigned int i = 0; i < cache->count; i++) {
+		total += (long long) cache->level[i].value * cache->level[i].level;
+	}
+	return total;
+}
+
+/**
+ * \brief Forgets the denominations of the previous plan.
+ */
+void solverInit(struct m_solver *solver) {
+	solver->count = 0;
+}
+
+/**
+ * \brief Adds the cached levels of the device, returns !=0 if the cache is not up to date.
+ */
+int solverAdd(struct m_solver *solver, struct m_device *device) {
+	struct m_levelCache *cache = &device->levels;
+
+	if (! cache->valid || cache->stale) {
+		return 1;
+	}
+
+	for (unsigned int i = 0; i < cache->count && solver->count < SOLVER_MAX_DENOMINATIONS; i++) {
+		if (cache->level[i].level <= 0 || cache->level[i].value <= 0 || strcmp(cache->level[i].cc, CURRENCY) != 0) {
+			continue;
+		}
+		struct m_solverDenomination *denomination = &solver->denomination[solver->count++];
+		denomination->device = device;
+		denomination->value = cache->level[i].value;
+		denomination->available = cache->level[i].level;
+		denomination->count = 0;
+	}
+
+	return 0;
+}
+
+/**
+ * \brief Greatest common divisor.
+ */
+long gcd(long a, long b) {
+	while (b != 0) {
+		long t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/**
+ * \brief Plans the amount with the denominations added, returns SOLVER_OK if it can be paid.
+ * \details The partial amounts are counted in units of the greatest common divisor of the values,
+ * so a pass is O(amount / unit). Within a pass the pieces of a denomination are chosen with a
+ * sliding window minimum per residue class, which keeps it linear no matter how many are available.
+ */
+int solverPlan(struct m_solver *solver, long amount) {
+	long long total = 0;
+	long unit = 0;
+
+	for (unsigned int i = 0; i < solver->count; i++) {
+		total += (long long) solver->denomination[i].value * solver->denomination[i].available;
+		unit = gcd(solver->denomination[i].value, unit);
+		solver->denomination[i].count = 0;
+	}
+
+	if (amount <= 0) {
+		return amount == 0 ? SOLVER_OK : SOLVER_NO_EXACT;
+	}
+	if (total < amount) {
+		return SOLVER_NOT_ENOUGH;
+	}
+	if (amount % unit != 0) {
+		return SOLVER_NO_EXACT;
+	}
+	if (amount / unit >= SOLVER_MAX_STATES) {
+		return SOLVER_TOO_LARGE;
+	}
+
+	unsigned int states = amount / unit + 1;
+
+	solver->best[0] = 0;
+	for (unsigned int x = 1; x < states; x++) {
+		solver->best[x] = UINT_MAX;
+	}
+
+	for (unsigned int i = 0; i < solver->count; i++) {
+		unsigned int step = solver->denomination[i].value / unit;
+		long available = solver->denomination[i].available;
+
+		for (unsigned int residue = 0; residue < step && residue < states; residue++) {
+			// window holds the candidates t (pieces = j - t) with increasing best[t] - t
+			unsigned int first = 0;
+			unsigned int last = 0;
+
+			for (unsigned int j = 0, x = residue; x < states; j++, x += step) {
+				if (solver->best[x] != UINT_MAX) {
+					long long value = (long long) solver->best[x] - j;
+					while (last > first && (long long) solver->best[residue + solver->window[last - 1] * step]
+							- solver->window[last - 1] >= value) {
+						last--;
+					}
+					solver->window[last++] = j;
+				}
+				while (last > first && j - solver->window[first] > available) {
+					first++;
+				}
+
+				if (last > first) {
+					unsigned int t = solver->window[first];
+					solver->next[x] = solver->best[residue + t * step] + (j - t);
+					solver->take[i][x] = j - t;
+				} else {
+					solver->next[x] = UINT_MAX;
+					solver->take[i][x] = 0;
+				}
 			}
-			break;
-		default:
-			// fallback only. in case we got a message which is not handled above.
-			// if you can see this have a look in the SSP reference manual what
-			// the message is about.
-			publishValidatorEvent("{\"event\":\"unknown\",\"id\":\"0x%02X\"}", poll->events[i].event);
-			break;
 		}
+
+		memcpy(solver->best, solver->next, states * sizeof(solver->best[0]));
+	}
+
+	if (solver->best[states - 1] == UINT_MAX) {
+		return SOLVER_NO_EXACT;
+	}
+
+	unsigned int x = states - 1;
+	for (unsigned int i = solver->count; i-- > 0;) {
+		solver->denomination[i].count = solver->take[i][x];
+		x -= solver->take[i][x] * (solver->denomination[i].value / unit);
 	}
+
+	return SOLVER_OK;
 }
 
 /**
- * \brief Initializes and configures redis, libevent and the hardware.
+ * \brief Appends the planned pieces of the device (all devices if NULL) as JSON array.
  */
-void setup(struct m_metacash *metacash) {
-	// initialize libEvent
-	metacash->eventBase = event_base_new();
+void jsonPlan(struct m_json *json, struct m_solver *solver, struct m_device *device) {
+	int first = 1;
+
+	jsonRaw(json, "[");
+	for (unsigned int i = 0; i < solver->count; i++) {
+		struct m_solverDenomination *denomination = &solver->denomination[i];
+		if (denomination->count == 0 || (device && denomination->device != device)) {
+			continue;
+		}
+		jsonRaw(json, first ? "{\"value\":" : ",{\"value\":");
+		jsonInt(json, denomination->value);
+		jsonRaw(json, ",\"count\":");
+		jsonInt(json, denomination->count);
+		jsonRaw(json, ",\"cc\":");
+		jsonString(json, CURRENCY);
+		jsonRaw(json, "}");
+		first = 0;
+	}
+	jsonRaw(json, "]");
+}
 
-	// connect to redis
-	redisPublishCtx = connectRedis(metacash); // establish connection for publishing
-	redisSubscribeCtx = connectRedis(metacash); // establich connection for subscribing
+/**
+ * \brief Milliseconds since the epoch, used for the journal records.
+ */
+long long clockRealtimeMs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-	// setup redis
-	if (redisPublishCtx && redisSubscribeCtx) {
-		redisLibeventAttach(redisPublishCtx, metacash->eventBase);
-		redisAsyncSetConnectCallback(redisPublishCtx, cbOnConnectPublishContext);
-		redisAsyncSetDisconnectCallback(redisPublishCtx, cbOnDisconnectPublishContext);
+/**
+ * \brief Returns !=0 if the record type starts an operation which moves money.
+ */
+int journalIsOperation(unsigned char type) {
+	return type == JOURNAL_PAYOUT || type == JOURNAL_FLOAT || type == JOURNAL_EMPTY || type == JOURNAL_SMART_EMPTY;
+}
 
-		redisLibeventAttach(redisSubscribeCtx, metacash->eventBase);
-		redisAsyncSetConnectCallback(redisSubscribeCtx, cbOnConnectSubscribeContext);
-		redisAsyncSetDisconnectCallback(redisSubscribeCtx, cbOnDisconnectSubscribeContext);
-	} else {
-		die("could not establish connection to redis", 1);
-		// never reached, already exited
-	}
+/**
+ * \brief Returns !=0 if the record type finishes the operation of the device.
+ */
+int journalIsOperationEnd(unsigned char type) {
+	return type == JOURNAL_DISPENSED || type == JOURNAL_FLOATED || type == JOURNAL_EMPTIED
+			|| type == JOURNAL_INCOMPLETE || type == JOURNAL_INTERRUPTED || type == JOURNAL_REJECTED;
+}
 
-	// setup libevent triggered check if we should quit (every 500ms more or less)
-	{
-		struct timeval interval;
-		interval.tv_sec = 0;
-		interval.tv_usec = 500000;
+/**
+ * \brief Returns the slot in journal.open with the unfinished operation of the device, a free slot
+ * if the device has none.
+ */
+struct m_journalRecord *journalOpenSlot(uint8_t device) {
+	struct m_journalRecord *free = NULL;
 
-		event_set(&metacash->evCheckQuit, 0, EV_PERSIST, cbOnCheckQuitEvent, metacash); // provide metacash in privdata
-		event_base_set(metacash->eventBase, &metacash->evCheckQuit);
-		evtimer_add(&metacash->evCheckQuit, &interval);
+	for (unsigned int i = 0; i < sizeof(journal.open) / sizeof(journal.open[0]); i++) {
+		if (journal.open[i].type != 0 && journal.open[i].device == device) {
+			return &journal.open[i];
+		}
+		if (journal.open[i].type == 0 && free == NULL) {
+			free = &journal.open[i];
+		}
 	}
 
-	// try to initialize the hardware only if we successfully have opened the device
-	if (metacash->deviceAvailable) {
-		// prepare the device structures
-		mcSspSetupCommand(&metacash->validator.sspC, metacash->validator.id);
-		mcSspSetupCommand(&metacash->hopper.sspC, metacash->hopper.id);
+	return free;
+}
 
-		// initialize the devices
-		mcSspInitializeDevice(&metacash->validator.sspC,
-				metacash->validator.key, &metacash->validator);
-		mcSspInitializeDevice(&metacash->hopper.sspC, metacash->hopper.key,
-				&metacash->hopper);
+/**
+ * \brief Updates journal.open with the record, the caller holds journal.lock (or is journalScan()).
+ */
+void journalTrackLocked(const struct m_journalRecord *record) {
+	struct m_journalRecord *open = journalOpenSlot(record->device);
+	if (open && journalIsOperation(record->type)) {
+		*open = *record;
+	} else if (open && journalIsOperationEnd(record->type)) {
+		open->type = 0;
+	}
+}
 
-		{
-			if(metacash->acceptCoins) {
-				syslog(LOG_WARNING, "coins will be accepted");
-
-				// SMART Hopper configuration
-				for (unsigned int i = 0; i < metacash->hopper.sspSetupReq.NumberOfChannels; i++) {
-					ssp6_set_coinmech_inhibits(&metacash->hopper.sspC,
-							metacash->hopper.sspSetupReq.ChannelData[i].value,
-							metacash->hopper.sspSetupReq.ChannelData[i].cc, ENABLED);
-				}
-			} else {
-				syslog(LOG_NOTICE, "coins will not be accepted");
+/**
+ * \brief Finds the end of the journal and the operations which have not been finished.
+ * \details The first slot which is not a valid successor of the previous record ends the
+ * journal, it was either never written or torn by a crash and is overwritten next.
+ */
+void journalScan() {
+	uint64_t capacity = (journal.size - sizeof(struct m_journalHeader)) / sizeof(struct m_journalRecord);
+	uint64_t i;
 
-				// SMART Hopper configuration
-				for (unsigned int i = 0; i < metacash->hopper.sspSetupReq.NumberOfChannels; i++) {
-					ssp6_set_coinmech_inhibits(&metacash->hopper.sspC,
-							metacash->hopper.sspSetupReq.ChannelData[i].value,
-							metacash->hopper.sspSetupReq.ChannelData[i].cc, DISABLED);
-				}
-			}
+	memset(journal.open, 0, sizeof(journal.open));
+	journal.sequence = 0;
+
+	for (i = 0; i < capacity; i++) {
+		struct m_journalRecord *record = &journal.records[i];
+		if (record->sequence != journal.sequence + 1 || record->checksum != journalChecksum(record)) {
+			break;
 		}
+		journal.sequence = record->sequence;
+		journalTrackLocked(record);
+	}
 
-		{
-			// SMART Payout configuration
-
-			// reject notes unfit for storage.
-			// if this is not enabled, notes unfit for storage will be silently redirected
-			// to the cashbox of the validator from which no payout can be done.
-			if (mc_ssp_set_refill_mode(&metacash->validator.sspC)
-					!= SSP_RESPONSE_OK) {
-				syslog(LOG_WARNING, "setting refill mode failed");
-			}
+	journal.next = i;
+	journal.committed = i;
 
-			// setup the routing of the banknotes in the validator (amounts are in cent)
-			ssp6_set_route(&metacash->validator.sspC, 500, CURRENCY,
-					SSP_OPTION_ROUTE_CASHBOX); // 5 euro
-			ssp6_set_route(&metacash->validator.sspC, 1000, CURRENCY,
-					SSP_OPTION_ROUTE_CASHBOX); // 10 euro
-			ssp6_set_route(&metacash->validator.sspC, 2000, CURRENCY,
-					SSP_OPTION_ROUTE_CASHBOX); // 20 euro
-			ssp6_set_route(&metacash->validator.sspC, 5000, CURRENCY,
-					SSP_OPTION_ROUTE_STORAGE); // 50 euro
-			ssp6_set_route(&metacash->validator.sspC, 10000, CURRENCY,
-					SSP_OPTION_ROUTE_STORAGE); // 100 euro
-			ssp6_set_route(&metacash->validator.sspC, 20000, CURRENCY,
-					SSP_OPTION_ROUTE_STORAGE); // 200 euro
-			ssp6_set_route(&metacash->validator.sspC, 50000, CURRENCY,
-					SSP_OPTION_ROUTE_STORAGE); // 500 euro
-
-			metacash->validator.channelInhibits = 0x0; // disable all channels
-
-			// set the inhibits in the hardware
-			if (ssp6_set_inhibits(&metacash->validator.sspC, metacash->validator.channelInhibits, 0x0)
-					!= SSP_RESPONSE_OK) {
-				syslog(LOG_ERR, "Inhibits Failed\n");
-				return;
-			}
+	if (i < capacity && journal.records[i].sequence != 0) {
+		logMessage(LOG_WARNING, "journal '%s' ends with a torn record at slot %llu\n", journal.path,
+				(unsigned long long) i);
+	}
+	logMessage(LOG_INFO, "journal '%s' has %llu records\n", journal.path, (unsigned long long) i);
+}
 
-			//enable the payout unit
-			if (ssp6_enable_payout(&metacash->validator.sspC,
-					metacash->validator.sspSetupReq.UnitType)
-					!= SSP_RESPONSE_OK) {
-				syslog(LOG_ERR, "Enable Payout Failed\n");
-				return;
-			}
-		}
+/**
+ * \brief Opens (or creates) the journal file and maps it, returns 0 on success.
+ */
+int journalMap(const char *path) {
+	size_t size = sizeof(struct m_journalHeader) + (size_t) JOURNAL_CAPACITY * sizeof(struct m_journalRecord);
 
-		syslog(LOG_INFO, "setup finished successfully\n");
+	int fd = open(path, O_RDWR | O_CREAT, 0640);
+	if (fd < 0) {
+		logMessage(LOG_ERR, "journalMap: could not open '%s': %s\n", path, strerror(errno));
+		return -1;
 	}
 
-	// setup libevent triggered polling of the hardware (every second more or less)
-	{
-		struct timeval interval;
-		interval.tv_sec = 1;
-		interval.tv_usec = 0;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (st.st_size != 0 && (size_t) st.st_size != size)) {
+		logMessage(LOG_ERR, "journalMap: '%s' is not a journal of %zu bytes\n", path, size);
+		close(fd);
+		return -1;
+	}
+	// allocate the blocks now, running out of disk space later would be a SIGBUS in the middle of a payout
+	int fresh = st.st_size == 0;
+	if (fresh && posix_fallocate(fd, 0, size) != 0) {
+		logMessage(LOG_ERR, "journalMap: could not allocate '%s'\n", path);
+		close(fd);
+		return -1;
+	}
+
+	void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		logMessage(LOG_ERR, "journalMap: could not map '%s': %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
 
-		event_set(&metacash->evPoll, 0, EV_PERSIST, cbOnPollEvent, metacash); // provide metacash in privdata
-		event_base_set(metacash->eventBase, &metacash->evPoll);
-		evtimer_add(&metacash->evPoll, &interval);
+	struct m_journalHeader *header = map;
+	if (fresh) {
+		memcpy(header->magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+		header->version = JOURNAL_VERSION;
+		header->recordSize = sizeof(struct m_journalRecord);
+		header->capacity = JOURNAL_CAPACITY;
+		msync(map, sizeof(struct m_journalHeader), MS_SYNC);
+	} else if (memcmp(header->magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0 || header->version != JOURNAL_VERSION
+			|| header->recordSize != sizeof(struct m_journalRecord) || header->capacity != JOURNAL_CAPACITY) {
+		logMessage(LOG_ERR, "journalMap: '%s' has an unknown format\n", path);
+		munmap(map, size);
+		close(fd);
+		return -1;
 	}
+
+	journal.fd = fd;
+	journal.map = map;
+	journal.size = size;
+	journal.records = (struct m_journalRecord *) ((char *) map + sizeof(struct m_journalHeader));
+
+	return 0;
 }
 
 /**
- * \brief Opens the serial device.
+ * \brief Opens the journal and recovers its state, returns 0 on success.
  */
-int mcSspOpenSerialDevice(struct m_metacash *metacash) {
-	// open the serial device
-	syslog(LOG_INFO, "opening serial device: %s\n", metacash->serialDevice);
+int journalOpen(const char *path) {
+	journal.path = strdup(path);
 
-	{
-		struct stat buffer;
-		int fildes = open(metacash->serialDevice, O_RDWR);
-		if (fildes <= 0) {
-			syslog(LOG_ERR, "opening device %s failed: %s\n", metacash->serialDevice, strerror(errno));
-			return 1;
-		}
+	if (journalMap(path)) {
+		free(journal.path);
+		journal.path = NULL;
+		return -1;
+	}
 
-		fstat(fildes, &buffer); // TODO: error handling
+	journalScan();
+	return 0;
+}
 
-		close(fildes);
+/**
+ * \brief Writes the records which are not on disk yet, the caller holds journal.lock.
+ */
+void journalCommitLocked() {
+	if (journal.committed == journal.next) {
+		return;
+	}
 
-		switch (buffer.st_mode & S_IFMT) {
-		case S_IFCHR:
-			break;
-		default:
-			syslog(LOG_ERR, "file %s is not a device\n", metacash->serialDevice);
-			return 1;
-		}
+	// msync wants a page aligned address
+	long pageSize = sysconf(_SC_PAGESIZE);
+	char *from = (char *) &journal.records[journal.committed];
+	char *to = (char *) &journal.records[journal.next];
+	char *start = (char *) journal.map + (((from - (char *) journal.map) / pageSize) * pageSize);
+
+	if (msync(start, to - start, MS_SYNC) != 0) {
+		logMessage(LOG_ERR, "journalCommit: msync failed: %s\n", strerror(errno));
+		return;
 	}
+	journal.committed = journal.next;
+}
 
-	if (open_ssp_port(metacash->serialDevice) == 0) {
-		syslog(LOG_ERR, "could not open serial device %s\n",
-				metacash->serialDevice);
-		return 1;
+/**
+ * \brief Writes all records which are not on disk yet.
+ */
+void journalCommit() {
+	if (! journal.path) {
+		return;
 	}
-	return 0;
+
+	pthread_mutex_lock(&journal.lock);
+	journalCommitLocked();
+	pthread_mutex_unlock(&journal.lock);
 }
 
 /**
- * \brief Closes the serial device.
+ * \brief Callback function for libEvent, the periodic group commit of the journal.
  */
-void mcSspCloseSerialDevice(struct m_metacash *metacash) {
-	close_ssp_port();
+void cbOnJournalCommit(int fd, short event, void *privdata) {
+	journalCommit();
 }
 
 /**
- * \brief Issues a poll command to the hardware and dispatches the response to the event handler function of the device.
+ * \brief Moves the full journal to <file>.1 and starts a new one, the caller holds journal.lock.
+ * \details The operations which are still open are copied to the start of the new journal (with
+ * a new sequence), so a crash right after the rotation still finds and reports them.
  */
-void mcSspPollDevice(struct m_device *device, struct m_metacash *metacash) {
-	SSP_POLL_DATA6 poll;
+void journalRotateLocked() {
+	journalCommitLocked();
+	munmap(journal.map, journal.size);
+	close(journal.fd);
+
+	char *rotated = NULL;
+	if (asprintf(&rotated, "%s.1", journal.path) < 0 || rename(journal.path, rotated) != 0) {
+		die("journalRotate: could not rotate the journal", 1);
+		// never reached, already exited
+	}
+	free(rotated);
 
-	hardwareWaitTime();
+	if (journalMap(journal.path)) {
+		die("journalRotate: could not create a new journal", 1);
+		// never reached, already exited
+	}
+	journal.next = 0;
+	journal.committed = 0;
+	journal.sequence = 0;
 
-	// poll the unit
-	SSP_RESPONSE_ENUM resp;
-	if ((resp = ssp6_poll(&device->sspC, &poll)) != SSP_RESPONSE_OK) {
-		if (resp == SSP_RESPONSE_TIMEOUT) {
-			// If the poll timed out, then give up
-			syslog(LOG_WARNING, "SSP Poll Timeout\n");
-			return;
-		} else {
-			if (resp == SSP_RESPONSE_KEY_NOT_SET) {
-				// The unit has responded with key not set, so we should try to negotiate one
-				if (ssp6_setup_encryption(&device->sspC, device->key)
-						!= SSP_RESPONSE_OK) {
-					syslog(LOG_ERR, "Encryption Failed\n");
-				} else {
-					syslog(LOG_INFO, "Encryption Setup\n");
-				}
-			} else {
-				syslog(LOG_ERR, "SSP Poll Error: 0x%x\n", resp);
-			}
-		}
-	} else {
-		if (poll.event_count > 0) {
-			syslog(LOG_INFO, "parsing poll response from \"%s\" now (%d events)\n",
-					device->name, poll.event_count);
-			device->eventHandlerFn(device, metacash, &poll);
-		} else {
-			//printf("polling \"%s\" returned no events\n", device->name);
+	for (unsigned int i = 0; i < sizeof(journal.open) / sizeof(journal.open[0]); i++) {
+		if (journal.open[i].type == 0) {
+			continue;
 		}
+		struct m_journalRecord *record = &journal.records[journal.next++];
+		*record = journal.open[i];
+		record->sequence = ++journal.sequence;
+		record->checksum = journalChecksum(record);
 	}
+	journalCommitLocked();
+
+	logMessage(LOG_NOTICE, "journal '%s' was full and has been rotated, %llu open operations carried over\n",
+			journal.path, (unsigned long long) journal.next);
 }
 
 /**
- * \brief Initializes an ITL hardware device via SSP
+ * \brief Appends a record to the journal.
+ * \details With sync!=0 the record is on disk once the function returns, otherwise it is
+ * written with the next group commit.
  */
-void mcSspInitializeDevice(SSP_COMMAND *sspC, unsigned long long key,
-		struct m_device *device) {
-	SSP6_SETUP_REQUEST_DATA *sspSetupReq = &device->sspSetupReq;
-	syslog(LOG_NOTICE, "initializing device (id=0x%02X, '%s')\n", sspC->SSPAddress, device->name);
-
-	//check device is present
-	if (ssp6_sync(sspC) != SSP_RESPONSE_OK) {
-		syslog(LOG_ERR, "No device found\n");
+void journalAppend(unsigned char type, struct m_device *device, long long amount, long long requested,
+		long long total, const char *cc, const char *correlId, int sync) {
+	if (! journal.path) {
 		return;
 	}
-	syslog(LOG_INFO, "device found\n");
 
-	//try to setup encryption using the default key
-	if (ssp6_setup_encryption(sspC, key) != SSP_RESPONSE_OK) {
-		syslog(LOG_ERR, "Encryption failed\n");
-		return;
+	pthread_mutex_lock(&journal.lock);
+
+	if (journal.next == JOURNAL_CAPACITY) {
+		journalRotateLocked();
 	}
-	syslog(LOG_INFO, "encryption setup\n");
 
-	// Make sure we are using ssp version 6
-	if (ssp6_host_protocol(sspC, 0x06) != SSP_RESPONSE_OK) {
-		syslog(LOG_ERR, "Host Protocol Failed\n");
-		return;
+	struct m_journalRecord *record = &journal.records[journal.next];
+	memset(record, 0, sizeof(*record));
+	record->sequence = journal.sequence + 1;
+	record->time = clockRealtimeMs();
+	record->amount = amount;
+	record->requested = requested;
+	record->total = total;
+	record->type = type;
+	record->device = device->id;
+	snprintf(record->cc, sizeof(record->cc), "%s", cc ? cc : "");
+	snprintf(record->correlId, sizeof(record->correlId), "%s", correlId ? correlId : "");
+	record->checksum = journalChecksum(record);
+
+	journal.sequence = record->sequence;
+	journal.next++;
+	journalTrackLocked(record);
+
+	if (sync || journal.next - journal.committed >= JOURNAL_COMMIT_RECORDS) {
+		journalCommitLocked();
 	}
-	syslog(LOG_INFO, "host protocol verified\n");
 
-	// Collect some information about the device
-	if (ssp6_setup_request(sspC, sspSetupReq) != SSP_RESPONSE_OK) {
-		syslog(LOG_ERR, "Setup Request Failed\n");
-		return;
+	pthread_mutex_unlock(&journal.lock);
+}
+
+/**
+ * \brief Journals the intent of the command to start an operation, before the SSP command is sent.
+ * \details Operations are rare and the money may be on its way as soon as the device has the command,
+ * so this is not left to the group commit.
+ */
+void journalOperation(struct m_command *cmd, unsigned char type, long long amount) {
+	journalAppend(type, cmd->device, amount, 0, levelsTotal(cmd->device), CURRENCY, cmd->correlId, 1);
+}
+
+/**
+ * \brief Journals the answer of the device to the operation journaled by journalOperation().
+ * \details Without an answer the operation is left open, the device may have received the command
+ * and be paying: the next poll events or journalRecover() finish it.
+ */
+void journalOperationResult(struct m_command *cmd, SSP_RESPONSE_ENUM resp) {
+	if (resp == SSP_RESPONSE_OK) {
+		journalAppend(JOURNAL_ACCEPTED, cmd->device, 0, 0, -1, CURRENCY, cmd->correlId, 0);
+	} else if (resp != SSP_RESPONSE_TIMEOUT) {
+		journalAppend(JOURNAL_REJECTED, cmd->device, 0, 0, -1, CURRENCY, cmd->correlId, 0);
 	}
+}
 
-	syslog(LOG_INFO, "channels:\n");
-	for (unsigned int i = 0; i < sspSetupReq->NumberOfChannels; i++) {
-		syslog(LOG_INFO, "channel %d: %d %s\n", i + 1, sspSetupReq->ChannelData[i].value,
-				sspSetupReq->ChannelData[i].cc);
+/**
+ * \brief Journals the events of the poll which credit money or finish an operation.
+ */
+void journalAfterPoll(struct m_device *device, SSP_POLL_DATA6 *poll) {
+	for (unsigned int i = 0; i < poll->event_count; ++i) {
+		long data1 = poll->events[i].data1;
+		long data2 = poll->events[i].data2;
+		const char *cc = poll->events[i].cc;
+
+		switch (poll->events[i].event) {
+		case SSP_POLL_CREDIT:
+			// the credit event only tells the channel
+			if (data1 > 0 && data1 <= device->sspSetupReq.NumberOfChannels) {
+				journalAppend(JOURNAL_CREDIT, device, device->sspSetupReq.ChannelData[data1 - 1].value * 100,
+						0, -1, device->sspSetupReq.ChannelData[data1 - 1].cc, NULL, 0);
+			}
+			break;
+		case SSP_POLL_COIN_CREDIT:
+			journalAppend(JOURNAL_COIN_CREDIT, device, data1, 0, -1, cc, NULL, 0);
+			break;
+		case SSP_POLL_DISPENSED:
+			journalAppend(JOURNAL_DISPENSED, device, data1, 0, -1, cc, NULL, 0);
+			break;
+		case SSP_POLL_FLOATED:
+			journalAppend(JOURNAL_FLOATED, device, data1, 0, -1, cc, NULL, 0);
+			break;
+		case SSP_POLL_EMPTY:
+		case SSP_POLL_SMART_EMPTIED:
+			journalAppend(JOURNAL_EMPTIED, device, data1, 0, -1, cc, NULL, 0);
+			break;
+		case SSP_POLL_INCOMPLETE_PAYOUT:
+		case SSP_POLL_INCOMPLETE_FLOAT:
+			journalAppend(JOURNAL_INCOMPLETE, device, data1, data2, -1, cc, NULL, 0);
+			break;
+		case SSP_POLL_TIMEOUT:
+			journalAppend(JOURNAL_INCOMPLETE, device, data1, 0, -1, cc, NULL, 0);
+			break;
+		case SSP_POLL_JAMMED:
+			journalAppend(JOURNAL_INCOMPLETE, device, 0, 0, -1, "", NULL, 0);
+			break;
+		default:
+			break;
+		}
 	}
+}
 
-	char version[100];
-	mc_ssp_get_firmware_version(sspC, &version[0]);
-	syslog(LOG_INFO, "full firmware version: %s\n", version);
+/**
+ * \brief Reports the operations the journal considers unfinished since the last run.
+ * \details Called once the level caches have been read: the difference to the value stored
+ * before the operation started is what has left the device (coins or notes credited
+ * meanwhile make it look smaller). An "interrupted" event is published to the "payout-event"
+ * topic and journaled, so the operation is only reported once.
+ */
+void journalRecover(struct m_metacash *metacash) {
+	if (! journal.path) {
+		return;
+	}
 
-	mc_ssp_get_dataset_version(sspC, &version[0]);
-	syslog(LOG_INFO, "full dataset version : %s\n", version);
+	for (unsigned int i = 0; i < sizeof(journal.open) / sizeof(journal.open[0]); i++) {
+		struct m_journalRecord *open = &journal.open[i];
+		if (open->type == 0) {
+			continue;
+		}
 
-	//enable the device
-	if (ssp6_enable(sspC) != SSP_RESPONSE_OK) {
-		syslog(LOG_ERR, "Enable Failed\n");
+		struct m_device *device = open->device == metacash->hopper.id ? &metacash->hopper : &metacash->validator;
+		long long now = levelsTotal(device);
+		long long paid = open->total >= 0 && now >= 0 ? open->total - now : -1;
+
+		logMessage(LOG_WARNING, "journal: %s of %lld from msgId='%s' for device='%s' was interrupted, %lld paid\n",
+				journalTypeName(open->type), (long long) open->amount, open->correlId, device->name, paid);
+		publishPayoutEvent("{\"event\":\"interrupted\",\"operation\":\"%s\",\"device\":\"%s\",\"correlId\":\"%s\","
+				"\"amount\":%lld,\"paid\":%lld}", journalTypeName(open->type), deviceMask(metacash, device)
+				== DEVICE_HOPPER ? "hopper" : "validator", open->correlId, (long long) open->amount, paid);
+		journalAppend(JOURNAL_INTERRUPTED, device, paid, open->amount, now, open->cc, open->correlId, 1);
+
+		open->type = 0;
+	}
+}
+
+/**
+ * \brief Writes the outstanding records and closes the journal.
+ */
+void journalClose() {
+	if (! journal.path) {
 		return;
 	}
 
-	syslog(LOG_NOTICE, "device has been successfully initialized (id=0x%02X, '%s')\n", sspC->SSPAddress, device->name);
+	journalCommit();
+	munmap(journal.map, journal.size);
+	close(journal.fd);
+	free(journal.path);
+	journal.path = NULL;
 }
 
 /**
@@ -2088,7 +8109,7 @@ SSP_RESPONSE_ENUM mc_ssp_smart_empty(SSP_COMMAND *sspC) {
 }
 
 
-SSP_RESPONSE_ENUM mc_ssp_cashbox_payout_operation_data(SSP_COMMAND *sspC, char **json) {
+SSP_RESPONSE_ENUM mc_ssp_cashbox_payout_operation_data(SSP_COMMAND *sspC, struct m_json *json) {
 	sspC->CommandDataLength = 1;
 	sspC->CommandData[0] = SSP_CMD_CASHBOX_PAYOUT_OPERATION_DATA;
 
@@ -2114,9 +8135,6 @@ SSP_RESPONSE_ENUM mc_ssp_cashbox_payout_operation_data(SSP_COMMAND *sspC, char *
 	i++; // move onto numCounters
 	int numCounters = sspC->ResponseData[i];
 
-	/* Create StringBuffer 'object' (struct) */
-	SB *sb = getStringBuffer();
-
 	int j; // current counter
 	for (j = 0; j < numCounters; ++j) {
 		int k;
@@ -2143,17 +8161,10 @@ SSP_RESPONSE_ENUM mc_ssp_cashbox_payout_operation_data(SSP_COMMAND *sspC, char *
 					sspC->ResponseData[i];
 		}
 
-		char *response = NULL;
-		asprintf(&response,
-				"{\"value\":%d,\"level\":%d,\"cc\":\"%s\"}", value, level, cc);
-
 		if(j > 0) {
-			char *sep = ",";
-			sb->append( sb, sep); // json array seperator
+			jsonRaw(json, ","); // json array seperator
 		}
-		sb->append( sb, response);
-
-		free(response);
+		jsonLevel(json, value, level, cc);
 	}
 
 	/* quantity of unknown coins */
@@ -2165,24 +8176,12 @@ SSP_RESPONSE_ENUM mc_ssp_cashbox_payout_operation_data(SSP_COMMAND *sspC, char *
 					(((unsigned long) sspC->ResponseData[i])
 							<< (8 * k));
 		}
-		char *response = NULL;
-		asprintf(&response,
-				",{\"value\":0,\"level\":%d}", qtyUnknown);
 		// json array seperator and value are constant here
-
-		sb->append( sb, response);
-
-		free(response);
+		jsonRaw(json, ",{\"value\":0,\"level\":");
+		jsonInt(json, qtyUnknown);
+		jsonRaw(json, "}");
 	}
 
-	/* Call toString() function to get catenated list */
-	char *result = sb->toString( sb );
-
-	asprintf(json, "%s", result);
-
-	/* Dispose of StringBuffer's memory */
-	sb->dispose( &sb ); /* Note: Need to pass ADDRESS of struct pointer to dispose() */
-
 	return resp;
 }
 
@@ -2251,7 +8250,7 @@ SSP_RESPONSE_ENUM mc_ssp_set_denomination_level(SSP_COMMAND *sspC, int amount, i
 /**
  * \brief Implements the "GET ALL LEVELS" command from the SSP Protocol.
  */
-SSP_RESPONSE_ENUM mc_ssp_get_all_levels(SSP_COMMAND *sspC, char **json) {
+SSP_RESPONSE_ENUM mc_ssp_get_all_levels(SSP_COMMAND *sspC, struct m_level *levels, unsigned int *count) {
 	sspC->CommandDataLength = 1;
 	sspC->CommandData[0] = SSP_CMD_GET_ALL_LEVELS;
 
@@ -2272,9 +8271,9 @@ SSP_RESPONSE_ENUM mc_ssp_get_all_levels(SSP_COMMAND *sspC, char **json) {
 
 	i++; // move onto numCounters
 	int numCounters = sspC->ResponseData[i];
-
-	/* Create StringBuffer 'object' (struct) */
-	SB *sb = getStringBuffer();
+	if (numCounters > MAX_LEVELS) {
+		numCounters = MAX_LEVELS;
+	}
 
 	int j; // current counter
 	for (j = 0; j < numCounters; ++j) {
@@ -2302,26 +8301,11 @@ SSP_RESPONSE_ENUM mc_ssp_get_all_levels(SSP_COMMAND *sspC, char **json) {
 					sspC->ResponseData[i];
 		}
 
-		char *response = NULL;
-		asprintf(&response,
-				"{\"value\":%d,\"level\":%d,\"cc\":\"%s\"}", value, level, cc);
-
-		if(j > 0) {
-			char *sep = ",";
-			sb->append( sb, sep); // json array seperator
-		}
-		sb->append( sb, response);
-
-		free(response);
+		levels[j].value = value;
+		levels[j].level = level;
+		memcpy(levels[j].cc, cc, sizeof(cc));
 	}
-
-	/* Call toString() function to get catenated list */
-	char *result = sb->toString( sb );
-
-	asprintf(json, "%s", result);
-
-	/* Dispose of StringBuffer's memory */
-	sb->dispose( &sb ); /* Note: Need to pass ADDRESS of struct pointer to dispose() */
+	*count = numCounters;
 
 	return resp;
 }
@@ -2432,10 +8416,10 @@ SSP_RESPONSE_ENUM mc_ssp_channel_security_data(SSP_COMMAND *sspC) {
 	if(resp == SSP_RESPONSE_OK) {
 		int numChannels = sspC->ResponseData[1];
 
-		syslog(LOG_DEBUG, "security status: numChannels=%d\n", numChannels);
-		syslog(LOG_DEBUG, "0 = unused, 1 = low, 2 = std, 3 = high, 4 = inhibited\n");
+		logMessage(LOG_DEBUG, "security status: numChannels=%d\n", numChannels);
+		logMessage(LOG_DEBUG, "0 = unused, 1 = low, 2 = std, 3 = high, 4 = inhibited\n");
 		for(int i = 0; i < numChannels; i++) {
-			syslog(LOG_DEBUG, "security status: channel %d -> %d\n", 1 + i, sspC->ResponseData[2 + i]);
+			logMessage(LOG_DEBUG, "security status: channel %d -> %d\n", 1 + i, sspC->ResponseData[2 + i]);
 		}
 	}
 
@@ -0,0 +1,175 @@
+/** \file payoutjournal.c
+ *  \brief Prints the transaction journal written by payoutd -j.
+ *
+ *  In a nutshell:
+ *  - every valid record is printed as a JSON object on a line of its own, ex.
+ *    {"seq":12,"time":1475923014337,"type":"payout","device":16,"amount":150,"cc":"EUR","total":5340,"correlId":"4711"}
+ *  - reading stops at the first record which is not a valid successor of the previous one (see payoutjournal.h)
+ *  - with -o only the operations which have not been finished at the end of the journal are printed
+ *  - a summary (number of records, torn record) is written to stderr
+ *  - main() function supports arguments -o and the journal file
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "payoutjournal.h"
+
+/** \brief Maximum number of devices tracked for -o */
+#define MAX_DEVICES 8
+
+/**
+ * \brief Prints the string quoted and escaped as a JSON string, at most length bytes of it.
+ * \details The correlId is the unescaped msgId of the request and may contain anything.
+ */
+void printString(const char *string, size_t length) {
+	putchar('"');
+	for (size_t i = 0; i < length && string[i]; i++) {
+		unsigned char c = string[i];
+		if (c == '"' || c == '\\') {
+			printf("\\%c", c);
+		} else if (c < 0x20) {
+			printf("\\u%04x", c);
+		} else {
+			putchar(c);
+		}
+	}
+	putchar('"');
+}
+
+/**
+ * \brief Prints the record as a JSON line.
+ */
+void printRecord(const struct m_journalRecord *record) {
+	const char *name = journalTypeName(record->type);
+
+	printf("{\"seq\":%llu,\"time\":%lld,\"type\":", (unsigned long long) record->sequence, (long long) record->time);
+	if (name) {
+		printf("\"%s\"", name);
+	} else {
+		printf("%u", record->type);
+	}
+	printf(",\"device\":%u,\"amount\":%lld", record->device, (long long) record->amount);
+	if (record->requested) {
+		printf(",\"requested\":%lld", (long long) record->requested);
+	}
+	if (record->cc[0]) {
+		printf(",\"cc\":\"%.3s\"", record->cc);
+	}
+	if (record->total >= 0) {
+		printf(",\"total\":%lld", (long long) record->total);
+	}
+	if (record->correlId[0]) {
+		printf(",\"correlId\":");
+		printString(record->correlId, sizeof(record->correlId) - 1);
+	}
+	printf("}\n");
+}
+
+/**
+ * \brief Returns !=0 if the record type starts an operation, see journalIsOperation() in payoutd.c.
+ */
+int isOperation(unsigned char type) {
+	return type == JOURNAL_PAYOUT || type == JOURNAL_FLOAT || type == JOURNAL_EMPTY || type == JOURNAL_SMART_EMPTY;
+}
+
+/**
+ * \brief Returns !=0 if the record type finishes an operation, see journalIsOperationEnd() in payoutd.c.
+ */
+int isOperationEnd(unsigned char type) {
+	return type == JOURNAL_DISPENSED || type == JOURNAL_FLOATED || type == JOURNAL_EMPTIED
+			|| type == JOURNAL_INCOMPLETE || type == JOURNAL_INTERRUPTED || type == JOURNAL_REJECTED;
+}
+
+int main(int argc, char *argv[]) {
+	int openOnly = 0;
+	int c;
+
+	while ((c = getopt(argc, argv, "o")) != -1) {
+		switch (c) {
+		case 'o':
+			openOnly = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-o] <journal file>\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind + 1 != argc) {
+		fprintf(stderr, "usage: %s [-o] <journal file>\n", argv[0]);
+		return 1;
+	}
+
+	FILE *file = fopen(argv[optind], "rb");
+	if (file == NULL) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	struct m_journalHeader header;
+	if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0) {
+		fprintf(stderr, "%s: not a journal\n", argv[optind]);
+		fclose(file);
+		return 1;
+	}
+	if (header.version != JOURNAL_VERSION || header.recordSize != sizeof(struct m_journalRecord)) {
+		fprintf(stderr, "%s: unsupported journal version %u (record size %u)\n", argv[optind], header.version,
+				header.recordSize);
+		fclose(file);
+		return 1;
+	}
+
+	struct m_journalRecord open[MAX_DEVICES];
+	memset(open, 0, sizeof(open));
+
+	struct m_journalRecord record;
+	uint64_t count = 0;
+	int torn = 0;
+
+	while (count < header.capacity && fread(&record, sizeof(record), 1, file) == 1) {
+		if (record.sequence != count + 1 || record.checksum != journalChecksum(&record)) {
+			torn = record.sequence != 0;
+			break;
+		}
+		count++;
+
+		if (! openOnly) {
+			printRecord(&record);
+			continue;
+		}
+
+		// same bookkeeping as journalScan() in payoutd.c
+		struct m_journalRecord *slot = NULL;
+		for (unsigned int i = 0; i < MAX_DEVICES; i++) {
+			if (open[i].type != 0 && open[i].device == record.device) {
+				slot = &open[i];
+				break;
+			}
+			if (open[i].type == 0 && slot == NULL) {
+				slot = &open[i];
+			}
+		}
+		if (slot && isOperation(record.type)) {
+			*slot = record;
+		} else if (slot && isOperationEnd(record.type) && slot->type != 0 && slot->device == record.device) {
+			slot->type = 0;
+		}
+	}
+
+	if (openOnly) {
+		for (unsigned int i = 0; i < MAX_DEVICES; i++) {
+			if (open[i].type != 0) {
+				printRecord(&open[i]);
+			}
+		}
+	}
+
+	fprintf(stderr, "%llu of %llu records used%s\n", (unsigned long long) count,
+			(unsigned long long) header.capacity, torn ? ", ends with a torn record" : "");
+
+	fclose(file);
+	return 0;
+}
@@ -0,0 +1,123 @@
+/** \file payoutjournal.h
+ *  \brief Binary layout of the transaction journal written by payoutd (-j) and read by payoutjournal.
+ *
+ *  The journal is a file of fixed size: a m_journalHeader followed by JOURNAL_CAPACITY
+ *  m_journalRecord slots which are filled in order. A record is valid if its checksum
+ *  matches and its sequence is the one of the previous record + 1, the first invalid
+ *  slot is the end of the journal (everything after it is left over from a crash).
+ *  All numbers are stored in the byte order of the host.
+ */
+
+#ifndef PAYOUTJOURNAL_H
+#define PAYOUTJOURNAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/** \brief Magic at the start of the journal file */
+#define JOURNAL_MAGIC "PAYOUTJ"
+/** \brief Version of the layout below */
+#define JOURNAL_VERSION 1
+/** \brief Number of records in a journal file, a full journal is rotated to <file>.1 */
+#define JOURNAL_CAPACITY 65536
+
+/** \brief do-payout about to be sent to the device, journaled before the command */
+#define JOURNAL_PAYOUT 1
+/** \brief do-float about to be sent to the device, journaled before the command */
+#define JOURNAL_FLOAT 2
+/** \brief empty about to be sent to the device, journaled before the command */
+#define JOURNAL_EMPTY 3
+/** \brief smart-empty about to be sent to the device, journaled before the command */
+#define JOURNAL_SMART_EMPTY 4
+/** \brief a note has been credited ("credit" event) */
+#define JOURNAL_CREDIT 5
+/** \brief a coin has been credited ("coin credit" event) */
+#define JOURNAL_COIN_CREDIT 6
+/** \brief a payout has finished ("dispensed" event) */
+#define JOURNAL_DISPENSED 7
+/** \brief a float has finished ("floated" event) */
+#define JOURNAL_FLOATED 8
+/** \brief an empty or smart empty has finished ("empty" or "smart emptied" event) */
+#define JOURNAL_EMPTIED 9
+/** \brief a payout or float stopped early ("incomplete payout", "incomplete float", "timeout" or "jammed" event) */
+#define JOURNAL_INCOMPLETE 10
+/** \brief an operation was still open in the journal when payoutd started again */
+#define JOURNAL_INTERRUPTED 11
+/** \brief the device has accepted the operation journaled before, the money is on its way */
+#define JOURNAL_ACCEPTED 12
+/** \brief the device has refused the operation journaled before, nothing has been moved */
+#define JOURNAL_REJECTED 13
+
+/**
+ * \brief The header of the journal file, it has the size of one record.
+ */
+struct m_journalHeader {
+	/** \brief JOURNAL_MAGIC */
+	char magic[8];
+	/** \brief JOURNAL_VERSION */
+	uint32_t version;
+	/** \brief sizeof(struct m_journalRecord) */
+	uint32_t recordSize;
+	/** \brief Number of record slots following the header */
+	uint64_t capacity;
+	/** \brief Unused, zero */
+	unsigned char reserved[104];
+};
+
+/**
+ * \brief A single journal entry.
+ */
+struct m_journalRecord {
+	/** \brief Number of the record, starts with 1 for each journal file */
+	uint64_t sequence;
+	/** \brief Time of the record in ms since the epoch */
+	int64_t time;
+	/** \brief Amount of the operation or event in cents */
+	int64_t amount;
+	/** \brief Requested amount of an incomplete payout/float, otherwise 0 */
+	int64_t requested;
+	/** \brief Value stored in the device before the operation started in cents, -1 if unknown */
+	int64_t total;
+	/** \brief The type of the record (JOURNAL_*) */
+	uint8_t type;
+	/** \brief The SSP address of the device */
+	uint8_t device;
+	/** \brief Unused, zero */
+	uint8_t reserved[2];
+	/** \brief The country code, zero terminated */
+	char cc[4];
+	/** \brief The msgId of the request which started the operation (empty for events), zero terminated */
+	char correlId[76];
+	/** \brief journalChecksum() of all bytes before */
+	uint32_t checksum;
+};
+
+_Static_assert(sizeof(struct m_journalHeader) == 128, "journal header must be 128 bytes");
+_Static_assert(sizeof(struct m_journalRecord) == 128, "journal record must be 128 bytes");
+
+/**
+ * \brief FNV-1a hash of the record without the checksum itself.
+ */
+static inline uint32_t journalChecksum(const struct m_journalRecord *record) {
+	const unsigned char *p = (const unsigned char *) record;
+	uint32_t hash = 2166136261u;
+
+	for (size_t i = 0; i < offsetof(struct m_journalRecord, checksum); i++) {
+		hash ^= p[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+/**
+ * \brief Name of the record type, NULL if unknown.
+ */
+static inline const char *journalTypeName(uint8_t type) {
+	static const char *names[] = { NULL, "payout", "float", "empty", "smart-empty", "credit", "coin credit",
+			"dispensed", "floated", "emptied", "incomplete", "interrupted", "accepted", "rejected" };
+
+	return type < sizeof(names) / sizeof(names[0]) ? names[type] : NULL;
+}
+
+#endif
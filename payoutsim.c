@@ -0,0 +1,1039 @@
+/** \file payoutsim.c
+ *  \brief Simulates a SMART Hopper and a NV200 on a pseudo terminal, so payoutd can be run and load tested without hardware.
+ *
+ *  In a nutshell:
+ *  - a pty pair is opened and the name of the slave side is printed (or linked with -L), payoutd is started with -d <that name>
+ *  - the simulator speaks the real SSP framing on the master side: STX, byte stuffing, CRC, sequence bit and retransmission
+ *    of the last reply when the host repeats a frame (see simOnFrame())
+ *  - the encryption is negotiated like on the hardware (SET GENERATOR, SET MODULUS, REQUEST KEY EXCHANGE), encrypted frames
+ *    are decrypted, checked against the packet counter and answered encrypted (see simDecrypt() and simEncrypt())
+ *  - both devices keep their levels, execute payouts, floats and empties over a few polls and report them with the same
+ *    events the hardware does (see simPoll()), with -i coins and notes are inserted periodically
+ *  - -d/-j/-b add a reply delay, jitter and the time the bytes would need on the serial line
+ *  - -e/-c/-k drop replies, corrupt their CRC or forget the key (the host then sees KEY NOT SET) with the given rate in per mille
+ *  - main() function supports arguments -L (symlink to the pty), -d, -j, -b, -e, -c, -k, -i (insert interval in ms), -s (random seed),
+ *    -v (log every frame) and -?
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libitlssp/ssp_commands.h"
+#include "libitlssp/Encryption.h"
+#include "libitlssp/Random.h"
+
+// these are defined by payoutd.c as well, see there
+#define SSP_CMD_GET_FIRMWARE_VERSION 0x20
+#define SSP_CMD_GET_DATASET_VERSION 0x21
+#define SSP_CMD_GET_ALL_LEVELS 0x22
+#define SSP_CMD_SET_DENOMINATION_LEVEL 0x34
+#define SSP_CMD_LAST_REJECT_NOTE 0x17
+#define SSP_CMD_CONFIGURE_BEZEL 0x54
+#define SSP_CMD_SMART_EMPTY 0x52
+#define SSP_CMD_CASHBOX_PAYOUT_OPERATION_DATA 0x53
+#define SSP_CMD_SET_REFILL_MODE 0x30
+#define SSP_CMD_DISPLAY_OFF 0x4
+#define SSP_CMD_DISPLAY_ON 0x3
+
+/** \brief The fixed part of the encryption key, the same as the DEFAULT_KEY of payoutd */
+#define SIM_FIXED_KEY 0x0123456701234567ULL
+
+/** \brief Maximum number of denominations of a simulated device */
+#define SIM_MAX_DENOMINATIONS 8
+
+/** \brief Number of polls a payout, float or empty is reported as running before it completes */
+#define SIM_OPERATION_POLLS 3
+
+/** \brief Currency of all simulated denominations */
+#define SIM_CURRENCY "EUR"
+
+/**
+ * \brief A denomination of a simulated device.
+ */
+struct m_simDenomination {
+	unsigned int value;
+	unsigned int level;
+	unsigned int cashbox; // moved to the cashbox by floats and empties so far
+};
+
+/**
+ * \brief A payout, float or empty which is running on a simulated device.
+ */
+struct m_simOperation {
+	unsigned char busyEvent; // reported while running, 0 if the device is idle
+	unsigned char doneEvent; // reported once it completed
+	int withValue; // the events carry a country count, value and country code
+	unsigned int value;
+	int pollsLeft;
+	unsigned int take[SIM_MAX_DENOMINATIONS]; // removed from the levels once completed
+	int toCashbox;
+};
+
+/**
+ * \brief State of one simulated SSP slave.
+ */
+struct m_simDevice {
+	unsigned char address;
+	const char *name;
+	unsigned char unitType; // 0x03 SMART Hopper, 0x06 SMART Payout
+	const char *firmwareVersion; // 16 characters
+	const char *datasetVersion; // 8 characters
+
+	int enabled;
+	int resetPending; // report SSP_POLL_RESET with the next poll
+
+	unsigned long long generator;
+	unsigned long long modulus;
+	unsigned long long slaveRandom;
+	SSP_FULL_KEY key;
+	int keySet;
+	unsigned int count; // encrypted packet counter
+
+	int hasLast;
+	unsigned char lastSeq;
+	unsigned char lastReply[2 * 255 + 6];
+	size_t lastReplyLength;
+
+	unsigned int denominationCount;
+	struct m_simDenomination denomination[SIM_MAX_DENOMINATIONS];
+	struct m_simOperation operation;
+	unsigned char lastRejectReason;
+
+	unsigned char events[255];
+	unsigned int eventsLength;
+};
+
+/**
+ * \brief Receive state of the (shared) bus.
+ */
+struct m_simRx {
+	unsigned char data[255 + 5];
+	unsigned int length;
+	unsigned int expected;
+	int stuff;
+};
+
+/**
+ * \brief Configuration and state of the simulator.
+ */
+struct m_sim {
+	int master;
+	int slave;
+	const char *link;
+
+	int delay; // ms before each reply
+	int jitter; // up to this many ms on top of the delay
+	long baud; // 0 = bytes take no time on the line
+	int dropRate; // per mille of replies which are not sent
+	int corruptRate; // per mille of replies with a wrong CRC
+	int keyLossRate; // per mille of encrypted commands answered with KEY NOT SET
+	int insertInterval; // ms between two inserted coins/notes, 0 = off
+	unsigned int seed;
+	int verbose;
+
+	long long nextInsert;
+	unsigned long frames;
+
+	struct m_simDevice hopper;
+	struct m_simDevice validator;
+	struct m_simRx rx;
+};
+
+static volatile sig_atomic_t quit = 0;
+
+/**
+ * \brief Signal handler for SIGINT and SIGTERM.
+ */
+void simOnSignal(int sig) {
+	quit = 1;
+}
+
+/**
+ * \brief Returns the milliseconds of the monotonic clock.
+ */
+long long simClockMs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * \brief Sleeps for the given number of microseconds.
+ */
+void simSleepUs(long long us) {
+	if (us <= 0) {
+		return;
+	}
+	struct timespec ts = { .tv_sec = us / 1000000, .tv_nsec = (us % 1000000) * 1000 };
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR && ! quit) {
+	}
+}
+
+/**
+ * \brief Returns !=0 with a probability of rate per mille.
+ */
+int simChance(struct m_sim *sim, int rate) {
+	return rate > 0 && (rand_r(&sim->seed) % 1000) < (unsigned int) rate;
+}
+
+/**
+ * \brief Appends a little endian value of the given size to the buffer.
+ */
+unsigned int simPut(unsigned char *buffer, unsigned int offset, unsigned long long value, int bytes) {
+	for (int i = 0; i < bytes; i++) {
+		buffer[offset++] = (unsigned char) (value >> (8 * i));
+	}
+	return offset;
+}
+
+/**
+ * \brief Reads a little endian value of the given size from the buffer.
+ */
+unsigned long long simGet(const unsigned char *buffer, int bytes) {
+	unsigned long long value = 0;
+	for (int i = 0; i < bytes; i++) {
+		value |= ((unsigned long long) buffer[i]) << (8 * i);
+	}
+	return value;
+}
+
+/**
+ * \brief Initializes a simulated device with its denominations.
+ */
+void simDeviceInit(struct m_simDevice *device, unsigned char address, const char *name, unsigned char unitType,
+		const char *firmwareVersion, const char *datasetVersion, const unsigned int *values, unsigned int count,
+		unsigned int level) {
+	memset(device, 0, sizeof(*device));
+	device->address = address;
+	device->name = name;
+	device->unitType = unitType;
+	device->firmwareVersion = firmwareVersion;
+	device->datasetVersion = datasetVersion;
+	device->resetPending = 1;
+	device->denominationCount = count;
+	for (unsigned int i = 0; i < count; i++) {
+		device->denomination[i].value = values[i];
+		device->denomination[i].level = level;
+	}
+}
+
+/**
+ * \brief Returns the index of the denomination with the value, -1 if the device has none.
+ */
+int simFindDenomination(struct m_simDevice *device, unsigned int value) {
+	for (unsigned int i = 0; i < device->denominationCount; i++) {
+		if (device->denomination[i].value == value) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/**
+ * \brief Plans which coins/notes to take for the amount, largest denominations first.
+ * \return 0 if the amount can be paid, 1 if there is not enough value and 2 if the exact amount can't be paid.
+ */
+int simPlan(struct m_simDevice *device, unsigned int amount, unsigned int *take) {
+	unsigned long total = 0;
+	for (unsigned int i = 0; i < device->denominationCount; i++) {
+		total += (unsigned long) device->denomination[i].value * device->denomination[i].level;
+		take[i] = 0;
+	}
+	if (total < amount) {
+		return 1;
+	}
+
+	unsigned int left = amount;
+	for (int i = device->denominationCount - 1; i >= 0; i--) {
+		struct m_simDenomination *d = &device->denomination[i];
+		unsigned int n = left / d->value;
+		take[i] = n < d->level ? n : d->level;
+		left -= take[i] * d->value;
+	}
+	return left == 0 ? 0 : 2;
+}
+
+/**
+ * \brief Queues an event for the next poll, with (withValue) or without the country/value data.
+ */
+void simQueueEvent(struct m_simDevice *device, unsigned char event, int withValue, unsigned long value) {
+	unsigned int needed = withValue ? 9 : 1;
+	if (device->eventsLength + needed > 200) {
+		return; // the host does not poll, just forget about it
+	}
+
+	device->events[device->eventsLength++] = event;
+	if (withValue) {
+		device->events[device->eventsLength++] = 1; // one country
+		device->eventsLength = simPut(device->events, device->eventsLength, value, 4);
+		memcpy(&device->events[device->eventsLength], SIM_CURRENCY, 3);
+		device->eventsLength += 3;
+	}
+}
+
+/**
+ * \brief Queues an event with one data byte (e.g. the channel) for the next poll.
+ */
+void simQueueEventByte(struct m_simDevice *device, unsigned char event, unsigned char data) {
+	if (device->eventsLength + 2 > 200) {
+		return;
+	}
+	device->events[device->eventsLength++] = event;
+	device->events[device->eventsLength++] = data;
+}
+
+/**
+ * \brief Starts a payout, float or empty which completes after SIM_OPERATION_POLLS polls.
+ */
+void simStartOperation(struct m_simDevice *device, unsigned char busyEvent, unsigned char doneEvent, int withValue,
+		unsigned int value, const unsigned int *take, int toCashbox) {
+	struct m_simOperation *op = &device->operation;
+	op->busyEvent = busyEvent;
+	op->doneEvent = doneEvent;
+	op->withValue = withValue;
+	op->value = value;
+	op->pollsLeft = SIM_OPERATION_POLLS;
+	op->toCashbox = toCashbox;
+	memcpy(op->take, take, sizeof(op->take));
+}
+
+/**
+ * \brief Builds the response to a POLL command: the pending events and the progress of a running operation.
+ */
+unsigned char simPoll(struct m_simDevice *device, unsigned char *reply) {
+	unsigned char length = 1;
+	struct m_simOperation *op = &device->operation;
+
+	if (device->resetPending) {
+		device->resetPending = 0;
+		reply[length++] = SSP_POLL_RESET;
+	}
+
+	if (op->busyEvent) {
+		if (--op->pollsLeft > 0) {
+			simQueueEvent(device, op->busyEvent, op->withValue, op->value);
+		} else {
+			for (unsigned int i = 0; i < device->denominationCount; i++) {
+				device->denomination[i].level -= op->take[i];
+				if (op->toCashbox) {
+					device->denomination[i].cashbox += op->take[i];
+				}
+			}
+			simQueueEvent(device, op->doneEvent, op->withValue, op->value);
+			op->busyEvent = 0;
+		}
+	}
+
+	memcpy(&reply[length], device->events, device->eventsLength);
+	length += device->eventsLength;
+	device->eventsLength = 0;
+
+	return length;
+}
+
+/**
+ * \brief Inserts a random coin (hopper) or note (validator) into an enabled device.
+ */
+void simInsert(struct m_sim *sim, struct m_simDevice *device) {
+	if (! device->enabled || device->operation.busyEvent) {
+		return;
+	}
+
+	unsigned int i = rand_r(&sim->seed) % device->denominationCount;
+	struct m_simDenomination *d = &device->denomination[i];
+	d->level++;
+
+	if (device->unitType == 0x03) {
+		// unlike the payout events coin credit has no country count
+		if (device->eventsLength + 8 <= 200) {
+			device->events[device->eventsLength++] = SSP_POLL_COIN_CREDIT;
+			device->eventsLength = simPut(device->events, device->eventsLength, d->value, 4);
+			memcpy(&device->events[device->eventsLength], SIM_CURRENCY, 3);
+			device->eventsLength += 3;
+		}
+	} else {
+		simQueueEventByte(device, SSP_POLL_READ, i + 1);
+		simQueueEventByte(device, SSP_POLL_CREDIT, i + 1);
+		simQueueEvent(device, SSP_POLL_STORED, 0, 0);
+	}
+}
+
+/**
+ * \brief Appends the levels of all denominations in the GET ALL LEVELS/CASHBOX PAYOUT OPERATION DATA format.
+ */
+unsigned char simPutLevels(struct m_simDevice *device, unsigned char *reply, unsigned char length, int cashbox) {
+	reply[length++] = device->denominationCount;
+	for (unsigned int i = 0; i < device->denominationCount; i++) {
+		struct m_simDenomination *d = &device->denomination[i];
+		length = simPut(reply, length, cashbox ? d->cashbox : d->level, 2);
+		length = simPut(reply, length, d->value, 4);
+		memcpy(&reply[length], SIM_CURRENCY, 3);
+		length += 3;
+	}
+	return length;
+}
+
+/**
+ * \brief Appends the SETUP REQUEST response of the device.
+ */
+unsigned char simPutSetup(struct m_simDevice *device, unsigned char *reply, unsigned char length) {
+	unsigned int n = device->denominationCount;
+
+	reply[length++] = device->unitType;
+	memcpy(&reply[length], device->firmwareVersion + 4, 4); // e.g. "0110" of "SH30011060000000"
+	length += 4;
+	memcpy(&reply[length], SIM_CURRENCY, 3);
+	length += 3;
+
+	if (device->unitType == 0x03) {
+		reply[length++] = 6; // protocol version
+		reply[length++] = n;
+		for (unsigned int i = 0; i < n; i++) {
+			length = simPut(reply, length, device->denomination[i].value, 2);
+		}
+	} else {
+		// value multiplier (obsolete), channels, channel values and security
+		length = simPut(reply, length, 0, 3);
+		reply[length++] = n;
+		for (unsigned int i = 0; i < n; i++) {
+			reply[length++] = device->denomination[i].value / 100;
+		}
+		for (unsigned int i = 0; i < n; i++) {
+			reply[length++] = 2; // standard security
+		}
+		// real value multiplier 100 (big endian) and the protocol version
+		reply[length++] = 0;
+		reply[length++] = 0;
+		reply[length++] = 100;
+		reply[length++] = 6;
+	}
+
+	for (unsigned int i = 0; i < n; i++) {
+		memcpy(&reply[length], SIM_CURRENCY, 3);
+		length += 3;
+	}
+	if (device->unitType != 0x03) {
+		for (unsigned int i = 0; i < n; i++) {
+			length = simPut(reply, length, device->denomination[i].value / 100, 4);
+		}
+	}
+	return length;
+}
+
+/**
+ * \brief Executes a command on the device.
+ * \return The length of the reply (the first byte is the SSP response code).
+ */
+unsigned char simExecute(struct m_simDevice *device, const unsigned char *data, unsigned char length,
+		unsigned char *reply) {
+	unsigned int take[SIM_MAX_DENOMINATIONS];
+	int hopper = device->unitType == 0x03;
+	unsigned char n = 1;
+
+	reply[0] = SSP_RESPONSE_OK;
+
+	switch (data[0]) {
+	case SSP_CMD_SYNC:
+	case SSP_CMD_SET_INHIBITS:
+	case SSP_CMD_DISPLAY_ON:
+	case SSP_CMD_DISPLAY_OFF:
+	case SSP_CMD_SET_ROUTING:
+	case SSP_CMD_SET_COINMECH_INHIBITS:
+	case SSP_CMD_RUN_CALIBRATION:
+	case SSP_CMD_CONFIGURE_BEZEL:
+	case SSP_CMD_SET_REFILL_MODE:
+	case SSP_CMD_HOLD:
+		break;
+	case SSP_CMD_RESET:
+		device->enabled = 0;
+		device->keySet = 0;
+		device->resetPending = 1;
+		device->operation.busyEvent = 0;
+		device->eventsLength = 0;
+		break;
+	case SSP_CMD_HOST_PROTOCOL:
+		if (length < 2 || data[1] > 6) {
+			reply[0] = SSP_RESPONSE_FAILURE;
+		}
+		break;
+	case SSP_CMD_ENABLE:
+		device->enabled = 1;
+		break;
+	case SSP_CMD_DISABLE:
+		device->enabled = 0;
+		break;
+	case SSP_CMD_ENABLE_PAYOUT_DEVICE:
+	case SSP_CMD_DISABLE_PAYOUT_DEVICE:
+		if (hopper) {
+			reply[0] = SSP_RESPONSE_UNKNOWN_COMMAND;
+		}
+		break;
+	case SSP_CMD_SETUP_REQUEST:
+		n = simPutSetup(device, reply, n);
+		break;
+	case SSP_CMD_POLL:
+		n = simPoll(device, reply);
+		break;
+	case SSP_CMD_GET_FIRMWARE_VERSION:
+		memcpy(&reply[n], device->firmwareVersion, 16);
+		n += 16;
+		break;
+	case SSP_CMD_GET_DATASET_VERSION:
+		memcpy(&reply[n], device->datasetVersion, 8);
+		n += 8;
+		break;
+	case SSP_CMD_CHANNEL_SECURITY:
+		reply[n++] = device->denominationCount;
+		for (unsigned int i = 0; i < device->denominationCount; i++) {
+			reply[n++] = 2;
+		}
+		break;
+	case SSP_CMD_LAST_REJECT_NOTE:
+		reply[n++] = device->lastRejectReason;
+		break;
+	case SSP_CMD_GET_ALL_LEVELS:
+		n = simPutLevels(device, reply, n, 0);
+		break;
+	case SSP_CMD_CASHBOX_PAYOUT_OPERATION_DATA:
+		n = simPutLevels(device, reply, n, 1);
+		n = simPut(reply, n, 0, 4); // no unknown coins
+		break;
+	case SSP_CMD_SET_DENOMINATION_LEVEL: {
+		if (length < 10) {
+			reply[0] = SSP_RESPONSE_INCORRECT_PARAMETERS;
+			break;
+		}
+		int i = simFindDenomination(device, simGet(&data[3], 4));
+		if (i < 0) {
+			reply[0] = SSP_RESPONSE_INVALID_PARAMETER;
+			break;
+		}
+		unsigned int level = simGet(&data[1], 2);
+		// a level of 0 clears the denomination, everything else is added
+		device->denomination[i].level = level == 0 ? 0 : device->denomination[i].level + level;
+		break;
+	}
+	case SSP_CMD_PAYOUT_VALUE:
+	case SSP_CMD_FLOAT: {
+		int isFloat = data[0] == SSP_CMD_FLOAT;
+		if (length < (isFloat ? 11 : 9)) {
+			reply[0] = SSP_RESPONSE_INCORRECT_PARAMETERS;
+			break;
+		}
+		unsigned int value = simGet(&data[isFloat ? 3 : 1], 4);
+		unsigned char option = data[isFloat ? 10 : 8];
+		int result;
+
+		if (device->operation.busyEvent) {
+			result = 3;
+		} else if (! device->enabled) {
+			result = 4;
+		} else if (isFloat) {
+			unsigned int total = 0;
+			for (unsigned int i = 0; i < device->denominationCount; i++) {
+				total += device->denomination[i].value * device->denomination[i].level;
+			}
+			// everything above the requested value goes to the cashbox
+			result = total < value ? 1 : simPlan(device, total - value, take);
+		} else {
+			result = simPlan(device, value, take);
+		}
+
+		if (result != 0) {
+			reply[0] = SSP_RESPONSE_COMMAND_NOT_PROCESSED;
+			reply[n++] = result;
+		} else if (option == SSP6_OPTION_BYTE_DO) {
+			if (isFloat) {
+				simStartOperation(device, SSP_POLL_FLOATING, SSP_POLL_FLOATED, 1, value, take, 1);
+			} else {
+				simStartOperation(device, SSP_POLL_DISPENSING, SSP_POLL_DISPENSED, 1, value, take, 0);
+			}
+		}
+		break;
+	}
+	case SSP_CMD_EMPTY:
+	case SSP_CMD_SMART_EMPTY:
+		if (device->operation.busyEvent) {
+			reply[0] = SSP_RESPONSE_COMMAND_NOT_PROCESSED;
+			reply[n++] = 3;
+			break;
+		}
+		{
+			unsigned int total = 0;
+			for (unsigned int i = 0; i < device->denominationCount; i++) {
+				take[i] = device->denomination[i].level;
+				total += device->denomination[i].value * take[i];
+			}
+			if (data[0] == SSP_CMD_EMPTY) {
+				simStartOperation(device, SSP_POLL_EMPTYING, SSP_POLL_EMPTY, 0, 0, take, 1);
+			} else {
+				simStartOperation(device, SSP_POLL_SMART_EMPTYING, SSP_POLL_SMART_EMPTIED, 1, total, take, 1);
+			}
+		}
+		break;
+	default:
+		reply[0] = SSP_RESPONSE_UNKNOWN_COMMAND;
+		break;
+	}
+
+	return n;
+}
+
+/**
+ * \brief Handles the commands of the key exchange, returns 0 if the command isn't one of them.
+ */
+int simKeyExchange(struct m_simDevice *device, const unsigned char *data, unsigned char length,
+		unsigned char *reply, unsigned char *replyLength) {
+	if (data[0] != SSP_CMD_SET_GENERATOR && data[0] != SSP_CMD_SET_MODULUS && data[0] != SSP_CMD_REQ_KEY_EXCHANGE) {
+		return 0;
+	}
+
+	*replyLength = 1;
+	if (length < 9) {
+		reply[0] = SSP_RESPONSE_INCORRECT_PARAMETERS;
+		return 1;
+	}
+
+	unsigned long long value = simGet(&data[1], 8);
+	reply[0] = SSP_RESPONSE_OK;
+
+	switch (data[0]) {
+	case SSP_CMD_SET_GENERATOR:
+		device->generator = value;
+		device->keySet = 0;
+		break;
+	case SSP_CMD_SET_MODULUS:
+		device->modulus = value;
+		device->keySet = 0;
+		break;
+	default:
+		if (device->generator == 0 || device->modulus == 0) {
+			reply[0] = SSP_RESPONSE_KEY_NOT_SET;
+			break;
+		}
+		device->slaveRandom = GenerateRandomNumber() % MAX_RANDOM_INTEGER;
+		*replyLength = simPut(reply, 1, XpowYmodN(device->generator, device->slaveRandom, device->modulus), 8);
+		device->key.FixedKey = SIM_FIXED_KEY;
+		device->key.EncryptKey = XpowYmodN(value, device->slaveRandom, device->modulus);
+		device->keySet = 1;
+		device->count = 0;
+		break;
+	}
+	return 1;
+}
+
+/**
+ * \brief Decrypts the data of an encrypted frame in place.
+ * \return The length of the command, 0 if the CRC or the packet counter don't match.
+ */
+unsigned char simDecrypt(struct m_simDevice *device, unsigned char *data, unsigned char length) {
+	unsigned char plain[255];
+	unsigned char encrypted = length - 1;
+
+	if (encrypted < C_MAX_KEY_LENGTH || encrypted % C_MAX_KEY_LENGTH != 0) {
+		return 0;
+	}
+	if (aes_decrypt(C_AES_MODE_ECB, (unsigned char *) &device->key, C_MAX_KEY_LENGTH, NULL, 0, plain, &data[1],
+			encrypted) != E_AES_SUCCESS) {
+		return 0;
+	}
+
+	unsigned short crc = cal_crc_loop_CCITT_A(encrypted - 2, plain, CRC_SSP_SEED, CRC_SSP_POLY);
+	if (plain[encrypted - 2] != (crc & 0xFF) || plain[encrypted - 1] != (crc >> 8) || plain[0] + 7 > encrypted) {
+		return 0;
+	}
+	if (simGet(&plain[1], 4) != device->count) {
+		return 0;
+	}
+	device->count++;
+
+	memcpy(data, &plain[5], plain[0]);
+	return plain[0];
+}
+
+/**
+ * \brief Encrypts the reply in place, in the same way EncryptSSPPacket() does.
+ * \return The length of the encrypted reply (including the STEX).
+ */
+unsigned char simEncrypt(struct m_sim *sim, struct m_simDevice *device, unsigned char *data, unsigned char length) {
+	unsigned char plain[255];
+	unsigned int total = length + 7;
+
+	if (total % C_MAX_KEY_LENGTH != 0) {
+		total += C_MAX_KEY_LENGTH - total % C_MAX_KEY_LENGTH;
+	}
+
+	plain[0] = length;
+	simPut(plain, 1, device->count, 4);
+	memcpy(&plain[5], data, length);
+	for (unsigned int i = 5 + length; i < total - 2; i++) {
+		plain[i] = rand_r(&sim->seed);
+	}
+	unsigned short crc = cal_crc_loop_CCITT_A(total - 2, plain, CRC_SSP_SEED, CRC_SSP_POLY);
+	plain[total - 2] = crc & 0xFF;
+	plain[total - 1] = crc >> 8;
+
+	data[0] = SSP_STEX;
+	aes_encrypt(C_AES_MODE_ECB, (unsigned char *) &device->key, C_MAX_KEY_LENGTH, NULL, 0, plain, &data[1], total);
+	return total + 1;
+}
+
+/**
+ * \brief Builds the complete (stuffed) frame for the reply into device->lastReply.
+ */
+void simFrame(struct m_simDevice *device, unsigned char addressSeq, const unsigned char *data, unsigned char length) {
+	unsigned char raw[255 + 4];
+	unsigned int n = 0;
+
+	raw[n++] = addressSeq;
+	raw[n++] = length;
+	memcpy(&raw[n], data, length);
+	n += length;
+	unsigned short crc = cal_crc_loop_CCITT_A(n, raw, CRC_SSP_SEED, CRC_SSP_POLY);
+	raw[n++] = crc & 0xFF;
+	raw[n++] = crc >> 8;
+
+	size_t j = 0;
+	device->lastReply[j++] = SSP_STX;
+	for (unsigned int i = 0; i < n; i++) {
+		device->lastReply[j++] = raw[i];
+		if (raw[i] == SSP_STX) {
+			device->lastReply[j++] = SSP_STX;
+		}
+	}
+	device->lastReplyLength = j;
+}
+
+/**
+ * \brief Sends the last reply of the device after the configured delay, applying the error injection.
+ */
+void simSendReply(struct m_sim *sim, struct m_simDevice *device, size_t requestLength) {
+	long long us = sim->delay * 1000LL;
+	if (sim->jitter > 0) {
+		us += (rand_r(&sim->seed) % (sim->jitter * 1000));
+	}
+	if (sim->baud > 0) {
+		// 8 data bits, 2 stop bits and the start bit
+		us += (long long) (requestLength + device->lastReplyLength) * 11 * 1000000 / sim->baud;
+	}
+	simSleepUs(us);
+
+	if (simChance(sim, sim->dropRate)) {
+		if (sim->verbose) {
+			fprintf(stderr, "%s: dropping reply\n", device->name);
+		}
+		return;
+	}
+
+	unsigned char frame[sizeof(device->lastReply)];
+	memcpy(frame, device->lastReply, device->lastReplyLength);
+	if (simChance(sim, sim->corruptRate)) {
+		if (sim->verbose) {
+			fprintf(stderr, "%s: corrupting reply\n", device->name);
+		}
+		// the last byte is always the upper half of the CRC (a stuffed 0x7F would stay 0x7F 0x7F)
+		frame[device->lastReplyLength - 1] ^= 0x01;
+	}
+
+	size_t written = 0;
+	while (written < device->lastReplyLength) {
+		ssize_t n = write(sim->master, frame + written, device->lastReplyLength - written);
+		if (n < 0) {
+			if (errno == EINTR || errno == EAGAIN) {
+				continue;
+			}
+			fprintf(stderr, "writing the reply failed: %s\n", strerror(errno));
+			return;
+		}
+		written += n;
+	}
+}
+
+/**
+ * \brief Handles a complete frame received from the host.
+ */
+void simOnFrame(struct m_sim *sim, const unsigned char *frame, unsigned int frameLength) {
+	unsigned char address = frame[1] & 0x7F;
+	unsigned char seq = frame[1] & 0x80;
+	unsigned char length = frame[2];
+	struct m_simDevice *device = NULL;
+
+	if (address == sim->hopper.address) {
+		device = &sim->hopper;
+	} else if (address == sim->validator.address) {
+		device = &sim->validator;
+	} else {
+		return; // not for us
+	}
+
+	unsigned short crc = cal_crc_loop_CCITT_A(length + 2, (unsigned char *) &frame[1], CRC_SSP_SEED, CRC_SSP_POLY);
+	if (frame[3 + length] != (crc & 0xFF) || frame[4 + length] != (crc >> 8)) {
+		if (sim->verbose) {
+			fprintf(stderr, "%s: CRC error, ignoring frame\n", device->name);
+		}
+		return;
+	}
+
+	sim->frames++;
+
+	unsigned char data[255];
+	memcpy(data, &frame[3], length);
+
+	// the host repeats a frame (same sequence bit) if it didn't get our reply, so just send that again
+	if (device->hasLast && seq == device->lastSeq && data[0] != SSP_CMD_SYNC) {
+		if (sim->verbose) {
+			fprintf(stderr, "%s: repeating the last reply\n", device->name);
+		}
+		simSendReply(sim, device, frameLength);
+		return;
+	}
+
+	unsigned char reply[255];
+	unsigned char replyLength;
+	int encrypted = data[0] == SSP_STEX;
+
+	if (encrypted && (! device->keySet || simChance(sim, sim->keyLossRate))) {
+		if (sim->verbose && device->keySet) {
+			fprintf(stderr, "%s: forgetting the key\n", device->name);
+		}
+		device->keySet = 0;
+		reply[0] = SSP_RESPONSE_KEY_NOT_SET;
+		replyLength = 1;
+		encrypted = 0;
+	} else {
+		if (encrypted && (length = simDecrypt(device, data, length)) == 0) {
+			if (sim->verbose) {
+				fprintf(stderr, "%s: could not decrypt frame, ignoring it\n", device->name);
+			}
+			return;
+		}
+		if (! simKeyExchange(device, data, length, reply, &replyLength)) {
+			replyLength = simExecute(device, data, length, reply);
+		}
+	}
+
+	if (sim->verbose) {
+		fprintf(stderr, "%s: cmd=0x%02X%s len=%d -> 0x%02X len=%d\n", device->name, data[0],
+				encrypted ? " (encrypted)" : "", length, reply[0], replyLength);
+	}
+
+	if (encrypted) {
+		replyLength = simEncrypt(sim, device, reply, replyLength);
+	}
+
+	simFrame(device, frame[1], reply, replyLength);
+	device->hasLast = 1;
+	device->lastSeq = seq;
+
+	simSendReply(sim, device, frameLength);
+}
+
+/**
+ * \brief Feeds a byte received from the host into the frame decoder (removes the byte stuffing).
+ */
+void simRxByte(struct m_sim *sim, unsigned char c) {
+	struct m_simRx *rx = &sim->rx;
+
+	if (rx->stuff) {
+		rx->stuff = 0;
+		if (c != SSP_STX) {
+			// a single STX: a new frame started
+			rx->length = 0;
+			rx->data[rx->length++] = SSP_STX;
+		}
+	} else if (c == SSP_STX) {
+		if (rx->length == 0) {
+			rx->data[rx->length++] = SSP_STX;
+			return;
+		}
+		rx->stuff = 1;
+		return;
+	} else if (rx->length == 0) {
+		return; // garbage between frames
+	}
+
+	rx->data[rx->length++] = c;
+	if (rx->length == 3) {
+		rx->expected = rx->data[2] + 5;
+	}
+	if (rx->length >= 3 && rx->length == rx->expected) {
+		simOnFrame(sim, rx->data, rx->length);
+		rx->length = 0;
+	}
+}
+
+/**
+ * \brief Opens the pty pair, the slave side is kept open so the master does not see a hangup when payoutd closes it.
+ */
+int simOpenPty(struct m_sim *sim) {
+	sim->master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (sim->master < 0 || grantpt(sim->master) != 0 || unlockpt(sim->master) != 0) {
+		fprintf(stderr, "opening the pty failed: %s\n", strerror(errno));
+		return 1;
+	}
+
+	const char *name = ptsname(sim->master);
+	sim->slave = open(name, O_RDWR | O_NOCTTY);
+	if (sim->slave < 0) {
+		fprintf(stderr, "opening %s failed: %s\n", name, strerror(errno));
+		return 1;
+	}
+
+	struct termios options;
+	tcgetattr(sim->slave, &options);
+	cfmakeraw(&options);
+	tcsetattr(sim->slave, TCSANOW, &options);
+
+	if (sim->link) {
+		unlink(sim->link);
+		if (symlink(name, sim->link) != 0) {
+			fprintf(stderr, "linking %s to %s failed: %s\n", sim->link, name, strerror(errno));
+			return 1;
+		}
+	}
+
+	printf("%s\n", sim->link ? sim->link : name);
+	fflush(stdout);
+	return 0;
+}
+
+/**
+ * \brief Parses the command line arguments.
+ */
+int simParseCmdLine(int argc, char *argv[], struct m_sim *sim) {
+	int opt;
+	while ((opt = getopt(argc, argv, "L:d:j:b:e:c:k:i:s:v")) != -1) {
+		switch (opt) {
+		case 'L':
+			sim->link = optarg;
+			break;
+		case 'd':
+			sim->delay = atoi(optarg);
+			break;
+		case 'j':
+			sim->jitter = atoi(optarg);
+			break;
+		case 'b':
+			sim->baud = atol(optarg);
+			break;
+		case 'e':
+			sim->dropRate = atoi(optarg);
+			break;
+		case 'c':
+			sim->corruptRate = atoi(optarg);
+			break;
+		case 'k':
+			sim->keyLossRate = atoi(optarg);
+			break;
+		case 'i':
+			sim->insertInterval = atoi(optarg);
+			break;
+		case 's':
+			sim->seed = strtoul(optarg, NULL, 10);
+			break;
+		case 'v':
+			sim->verbose = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-L link] [-d delay ms] [-j jitter ms] [-b baud] [-e drop permille] "
+					"[-c corrupt permille] [-k key loss permille] [-i insert interval ms] [-s seed] [-v]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (sim->delay < 0 || sim->jitter < 0 || sim->baud < 0 || sim->insertInterval < 0) {
+		fprintf(stderr, "negative times are not supported\n");
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	static const unsigned int coins[] = { 1, 2, 5, 10, 20, 50, 100, 200 };
+	static const unsigned int notes[] = { 500, 1000, 2000, 5000, 10000, 20000, 50000 };
+	struct m_sim sim;
+
+	memset(&sim, 0, sizeof(sim));
+	sim.seed = time(NULL);
+
+	if (simParseCmdLine(argc, argv, &sim)) {
+		return 1;
+	}
+
+	simDeviceInit(&sim.hopper, 0x10, "hopper", 0x03, "SH30011060000000", "EUR01010", coins,
+			sizeof(coins) / sizeof(coins[0]), 50);
+	simDeviceInit(&sim.validator, 0x00, "validator", 0x06, "NV02042040000000", "EUR01610", notes,
+			sizeof(notes) / sizeof(notes[0]), 5);
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = simOnSignal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	if (simOpenPty(&sim)) {
+		return 1;
+	}
+
+	fprintf(stderr, "simulating SMART Hopper (0x%02X) and NV200 (0x%02X)\n", sim.hopper.address, sim.validator.address);
+
+	sim.nextInsert = simClockMs() + sim.insertInterval;
+
+	while (! quit) {
+		struct pollfd pfd = { .fd = sim.master, .events = POLLIN };
+		int timeout = -1;
+
+		if (sim.insertInterval > 0) {
+			long long now = simClockMs();
+			if (now >= sim.nextInsert) {
+				simInsert(&sim, rand_r(&sim.seed) % 2 ? &sim.hopper : &sim.validator);
+				sim.nextInsert = now + sim.insertInterval;
+			}
+			timeout = sim.nextInsert - now;
+		}
+
+		int rc = poll(&pfd, 1, timeout);
+		if (rc < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "poll failed: %s\n", strerror(errno));
+			break;
+		}
+		if (rc == 0) {
+			continue;
+		}
+
+		unsigned char buffer[256];
+		ssize_t n = read(sim.master, buffer, sizeof(buffer));
+		if (n < 0) {
+			if (errno == EINTR || errno == EAGAIN) {
+				continue;
+			}
+			fprintf(stderr, "reading from the pty failed: %s\n", strerror(errno));
+			break;
+		}
+		for (ssize_t i = 0; i < n; i++) {
+			simRxByte(&sim, buffer[i]);
+		}
+	}
+
+	fprintf(stderr, "%lu frames handled\n", sim.frames);
+
+	if (sim.link) {
+		unlink(sim.link);
+	}
+	close(sim.slave);
+	close(sim.master);
+	return 0;
+}
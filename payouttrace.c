@@ -0,0 +1,437 @@
+/** \file payouttrace.c
+ *  \brief Analyzes the SSP frame trace written by payoutd -F.
+ *
+ *  In a nutshell:
+ *  - the transmissions and responses of the trace (see libitlssp/ssp_trace.h) are matched per device address
+ *  - every command is printed as a JSON object on a line of its own (times in us), ex.
+ *    {"time":1520331,"address":16,"cmd":"poll","seq":128,"rtt":3120,"duration":3120,"retries":0,"result":"ok","response":"0xf0","gap":52010,"pacing":49870,"host":2140}
+ *  - "rtt" is the time the device took to answer the last transmission, "duration" includes the retries
+ *  - "gap" is the time since the previous command to the device finished, "pacing" the part of it payoutd waited
+ *    for the frame gap (see pacingWait() in payoutd.c) and "host" the rest (processing or nothing to do)
+ *  - a retry storm is a run of at least STORM_COMMANDS commands to a device which all needed retries or failed
+ *  - with -s only a summary per device (count, retries, failures, p50/p99/max of the times) and the storms is printed
+ *  - main() function supports arguments -s and the trace file
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libitlssp/SSPComs.h"
+#include "libitlssp/ssp_trace.h"
+
+/** \brief Number of SSP addresses */
+#define MAX_ADDRESSES 128
+/** \brief Minimum number of consecutive commands with retries or failures reported as retry storm */
+#define STORM_COMMANDS 3
+/** \brief Maximum number of retry storms listed in the summary */
+#define MAX_STORMS 64
+
+/**
+ * \brief Times in ns collected for the percentiles of the summary.
+ */
+struct m_samples {
+	/** \brief The values */
+	unsigned long long *values;
+	/** \brief Number of values */
+	size_t count;
+};
+
+/**
+ * \brief A run of commands which needed retries or failed.
+ */
+struct m_storm {
+	/** \brief The SSP address of the device */
+	unsigned int address;
+	/** \brief Time of the first transmission of the first command in ns */
+	unsigned long long start;
+	/** \brief Time the last command finished in ns */
+	unsigned long long end;
+	/** \brief Number of commands */
+	unsigned long commands;
+	/** \brief Number of retransmissions */
+	unsigned long retries;
+	/** \brief Number of commands without a valid response */
+	unsigned long failures;
+};
+
+/**
+ * \brief Everything known about a device address.
+ */
+struct m_address {
+	/** \brief If !=0 a command has been transmitted and not finished yet */
+	int pending;
+	/** \brief The first byte of the command data (the command) */
+	unsigned char command;
+	/** \brief Sequence bit of the command */
+	unsigned char seqBit;
+	/** \brief Time of the first transmission in ns */
+	unsigned long long txTime;
+	/** \brief Time of the last transmission in ns */
+	unsigned long long lastTxTime;
+	/** \brief Time the command waited for the frame gap in ns */
+	unsigned long long waited;
+	/** \brief Time the previous command finished in ns, 0 if none */
+	unsigned long long lastEnd;
+	/** \brief Gap to the previous command in ns, -1 if there is none */
+	long long gap;
+	/** \brief Number of finished commands */
+	unsigned long commands;
+	/** \brief Number of retransmissions */
+	unsigned long retries;
+	/** \brief Number of commands without a valid response */
+	unsigned long failures;
+	/** \brief Number of commands which were transmitted but never finished */
+	unsigned long unfinished;
+	/** \brief The retry storm going on right now */
+	struct m_storm storm;
+	/** \brief Response time of the device */
+	struct m_samples rtt;
+	/** \brief Time from the first transmission until the command finished */
+	struct m_samples duration;
+	/** \brief Gap between two commands */
+	struct m_samples gaps;
+	/** \brief Part of the gap waited for the frame gap */
+	struct m_samples pacing;
+	/** \brief Part of the gap not waited for the frame gap */
+	struct m_samples host;
+};
+
+struct m_address addresses[MAX_ADDRESSES];
+struct m_storm storms[MAX_STORMS];
+unsigned int stormCount = 0;
+unsigned long stormsDropped = 0;
+
+/**
+ * \brief Name of the command, NULL if unknown.
+ */
+const char *commandName(unsigned char command) {
+	static const char *names[256] = {
+		[SSP_CMD_RESET] = "reset",
+		[SSP_CMD_SET_INHIBITS] = "set inhibits",
+		[SSP_CMD_SETUP_REQUEST] = "setup request",
+		[SSP_CMD_HOST_PROTOCOL] = "host protocol",
+		[SSP_CMD_POLL] = "poll",
+		[SSP_CMD_REJECT_NOTE] = "reject note",
+		[SSP_CMD_DISABLE] = "disable",
+		[SSP_CMD_ENABLE] = "enable",
+		[SSP_CMD_SERIAL_NUMBER] = "serial number",
+		[SSP_CMD_UNIT_DATA] = "unit data",
+		[SSP_CMD_CHANNEL_VALUES] = "channel values",
+		[SSP_CMD_CHANNEL_SECURITY] = "channel security",
+		[SSP_CMD_SYNC] = "sync",
+		[SSP_CMD_LAST_REJECT] = "last reject",
+		[SSP_CMD_HOLD] = "hold",
+		[SSP_CMD_ENABLE_HIGHER_PROTOCOL] = "enable higher protocol",
+		[SSP_CMD_PAYOUT_VALUE] = "payout amount",
+		[SSP_CMD_SET_COIN_AMOUNT] = "set denomination level",
+		[SSP_CMD_GET_COIN_AMOUNT] = "get denomination level",
+		[SSP_CMD_HALT_PAYOUT] = "halt payout",
+		[SSP_CMD_SET_ROUTING] = "set denomination route",
+		[SSP_CMD_GET_ROUTING] = "get denomination route",
+		[SSP_CMD_FLOAT] = "float amount",
+		[SSP_CMD_MINIMUM_PAYOUT] = "get minimum payout",
+		[SSP_CMD_EMPTY] = "empty",
+		[SSP_CMD_SET_COIN_INHIBIT] = "set coin mech inhibits",
+		[SSP_CMD_ENABLE_PAYOUT_DEVICE] = "enable payout device",
+		[SSP_CMD_DISABLE_PAYOUT_DEVICE] = "disable payout device",
+	};
+
+	return names[command];
+}
+
+/**
+ * \brief Describes how the command finished.
+ */
+const char *resultName(const SSP_TRACE_RECORD *record) {
+	if (record->Type == SSP_TRACE_RX) {
+		return "ok";
+	}
+
+	switch (record->Status) {
+	case PORT_ERROR:
+		return "port error";
+	case SSP_CMD_TIMEOUT:
+		return "timeout";
+	case SSP_PACKET_ERROR:
+		if (record->PacketError == SSP_PACKET_ERROR_CRC) {
+			return "crc";
+		}
+		if (record->PacketError == SSP_PACKET_ERROR_COUNTER) {
+			return "counter";
+		}
+		return "packet error";
+	default:
+		return "failed";
+	}
+}
+
+/**
+ * \brief Adds a value to the samples, the array is allocated for capacity values on first use.
+ */
+void samplesAdd(struct m_samples *samples, unsigned long long value, size_t capacity) {
+	if (samples->values == NULL) {
+		samples->values = malloc(capacity * sizeof(samples->values[0]));
+		if (samples->values == NULL) {
+			perror("malloc");
+			exit(1);
+		}
+	}
+	if (samples->count < capacity) {
+		samples->values[samples->count++] = value;
+	}
+}
+
+int compareValues(const void *a, const void *b) {
+	unsigned long long x = *(const unsigned long long *) a;
+	unsigned long long y = *(const unsigned long long *) b;
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * \brief Prints "name":{"p50":..,"p99":..,"max":..} of the samples in us.
+ */
+void printSamples(const char *name, struct m_samples *samples) {
+	printf("\"%s\":{", name);
+	if (samples->count) {
+		qsort(samples->values, samples->count, sizeof(samples->values[0]), compareValues);
+		printf("\"p50\":%llu,\"p99\":%llu,\"max\":%llu", samples->values[(samples->count - 1) / 2] / 1000,
+				samples->values[(samples->count - 1) * 99 / 100] / 1000,
+				samples->values[samples->count - 1] / 1000);
+	}
+	printf("}");
+}
+
+/**
+ * \brief Ends the retry storm of the device, it is kept if it was long enough.
+ */
+void stormEnd(struct m_address *address) {
+	if (address->storm.commands >= STORM_COMMANDS) {
+		if (stormCount < MAX_STORMS) {
+			storms[stormCount++] = address->storm;
+		} else {
+			stormsDropped++;
+		}
+	}
+	address->storm.commands = 0;
+}
+
+/**
+ * \brief Finishes the command in flight of the device with the RX or FAIL record.
+ */
+void commandEnd(struct m_address *address, const SSP_TRACE_RECORD *record, unsigned long long origin,
+		size_t capacity, int summaryOnly) {
+	int failed = record->Type != SSP_TRACE_RX;
+	unsigned long long rtt = record->Time - address->lastTxTime;
+	unsigned long long duration = record->Time - address->txTime;
+
+	address->commands++;
+	address->retries += record->Retry;
+	address->failures += failed;
+	if (! failed) {
+		samplesAdd(&address->rtt, rtt, capacity);
+	}
+	samplesAdd(&address->duration, duration, capacity);
+
+	unsigned long long pacing = 0;
+	if (address->gap >= 0) {
+		pacing = address->waited < (unsigned long long) address->gap ? address->waited : (unsigned long long) address->gap;
+		samplesAdd(&address->gaps, address->gap, capacity);
+		samplesAdd(&address->pacing, pacing, capacity);
+		samplesAdd(&address->host, address->gap - pacing, capacity);
+	}
+
+	if (record->Retry || failed) {
+		if (address->storm.commands == 0) {
+			address->storm.address = record->Address;
+			address->storm.start = address->txTime;
+			address->storm.retries = 0;
+			address->storm.failures = 0;
+		}
+		address->storm.commands++;
+		address->storm.retries += record->Retry;
+		address->storm.failures += failed;
+		address->storm.end = record->Time;
+	} else {
+		stormEnd(address);
+	}
+
+	if (! summaryOnly) {
+		const char *name = commandName(address->command);
+
+		printf("{\"time\":%llu,\"address\":%u,\"cmd\":", (address->txTime - origin) / 1000, record->Address);
+		if (name) {
+			printf("\"%s\"", name);
+		} else {
+			printf("\"0x%02x\"", address->command);
+		}
+		printf(",\"seq\":%u", address->seqBit);
+		if (! failed) {
+			printf(",\"rtt\":%llu", rtt / 1000);
+		}
+		printf(",\"duration\":%llu,\"retries\":%u,\"result\":\"%s\"", duration / 1000, record->Retry,
+				resultName(record));
+		if (! failed && record->Length) {
+			printf(",\"response\":\"0x%02x\"", record->Data[0]);
+		}
+		if (address->gap >= 0) {
+			printf(",\"gap\":%llu,\"pacing\":%llu,\"host\":%llu", (unsigned long long) address->gap / 1000,
+					pacing / 1000, (address->gap - pacing) / 1000);
+		}
+		printf("}\n");
+	}
+
+	address->pending = 0;
+	address->lastEnd = record->Time;
+}
+
+/**
+ * \brief Prints the summary as one JSON object.
+ */
+void printSummary(unsigned long long records, unsigned long long lost, unsigned long long torn,
+		unsigned long long origin) {
+	printf("{\"records\":%llu,\"lost\":%llu,\"torn\":%llu,\"devices\":[", records, lost, torn);
+	int first = 1;
+	for (unsigned int i = 0; i < MAX_ADDRESSES; i++) {
+		struct m_address *address = &addresses[i];
+		if (address->commands == 0 && address->unfinished == 0) {
+			continue;
+		}
+		printf("%s{\"address\":%u,\"commands\":%lu,\"retries\":%lu,\"failures\":%lu,\"unfinished\":%lu,",
+				first ? "" : ",", i, address->commands, address->retries, address->failures,
+				address->unfinished);
+		printSamples("rtt", &address->rtt);
+		printf(",");
+		printSamples("duration", &address->duration);
+		printf(",");
+		printSamples("gap", &address->gaps);
+		printf(",");
+		printSamples("pacing", &address->pacing);
+		printf(",");
+		printSamples("host", &address->host);
+		printf("}");
+		first = 0;
+	}
+	printf("],\"storms\":[");
+	for (unsigned int i = 0; i < stormCount; i++) {
+		printf("%s{\"address\":%u,\"time\":%llu,\"duration\":%llu,\"commands\":%lu,\"retries\":%lu,\"failures\":%lu}",
+				i ? "," : "", storms[i].address, (storms[i].start - origin) / 1000,
+				(storms[i].end - storms[i].start) / 1000, storms[i].commands, storms[i].retries,
+				storms[i].failures);
+	}
+	printf("]");
+	if (stormsDropped) {
+		printf(",\"stormsDropped\":%lu", stormsDropped);
+	}
+	printf("}\n");
+}
+
+int main(int argc, char *argv[]) {
+	int summaryOnly = 0;
+	int c;
+
+	while ((c = getopt(argc, argv, "s")) != -1) {
+		switch (c) {
+		case 's':
+			summaryOnly = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-s] <trace file>\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind + 1 != argc) {
+		fprintf(stderr, "usage: %s [-s] <trace file>\n", argv[0]);
+		return 1;
+	}
+
+	FILE *file = fopen(argv[optind], "rb");
+	if (file == NULL) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	SSP_TRACE_HEADER header;
+	if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.Magic, SSP_TRACE_MAGIC, sizeof(SSP_TRACE_MAGIC)) != 0) {
+		fprintf(stderr, "%s: not a frame trace\n", argv[optind]);
+		fclose(file);
+		return 1;
+	}
+	if (header.Version != SSP_TRACE_VERSION || header.RecordSize != sizeof(SSP_TRACE_RECORD) || header.Capacity == 0) {
+		fprintf(stderr, "%s: unsupported trace version %u (record size %u)\n", argv[optind], header.Version,
+				header.RecordSize);
+		fclose(file);
+		return 1;
+	}
+
+	SSP_TRACE_RECORD *records = malloc(header.Capacity * sizeof(SSP_TRACE_RECORD));
+	if (records == NULL || fread(records, sizeof(SSP_TRACE_RECORD), header.Capacity, file) != header.Capacity) {
+		fprintf(stderr, "%s: truncated trace\n", argv[optind]);
+		free(records);
+		fclose(file);
+		return 1;
+	}
+	fclose(file);
+
+	// the ring holds the last Capacity records, everything before has been overwritten
+	unsigned long long next = header.Next;
+	unsigned long long start = next > header.Capacity ? next - header.Capacity : 0;
+	unsigned long long used = 0;
+	unsigned long long torn = 0;
+	unsigned long long origin = 0;
+
+	for (unsigned long long n = start; n < next; n++) {
+		const SSP_TRACE_RECORD *record = &records[n % header.Capacity];
+		if (record->Sequence != n + 1 || record->Address >= MAX_ADDRESSES) {
+			torn++;
+			continue;
+		}
+		if (used++ == 0) {
+			origin = record->Time;
+		}
+
+		struct m_address *address = &addresses[record->Address];
+		switch (record->Type) {
+		case SSP_TRACE_WAIT:
+			address->waited += record->Value;
+			break;
+		case SSP_TRACE_TX:
+			if (address->pending) {
+				address->unfinished++;
+			}
+			address->pending = 1;
+			address->command = record->Length ? record->Data[0] : 0;
+			address->seqBit = record->SeqBit;
+			address->txTime = record->Time;
+			address->lastTxTime = record->Time;
+			address->gap = address->lastEnd ? (long long) (record->Time - address->lastEnd) : -1;
+			break;
+		case SSP_TRACE_RETRY:
+			address->lastTxTime = record->Time;
+			break;
+		case SSP_TRACE_RX:
+		case SSP_TRACE_FAIL:
+			if (address->pending) {
+				commandEnd(address, record, origin, header.Capacity, summaryOnly);
+				address->waited = 0;
+			}
+			break;
+		}
+	}
+
+	for (unsigned int i = 0; i < MAX_ADDRESSES; i++) {
+		stormEnd(&addresses[i]);
+		addresses[i].unfinished += addresses[i].pending;
+	}
+
+	if (summaryOnly) {
+		printSummary(used, start, torn, origin);
+	}
+
+	fprintf(stderr, "%llu records used, %llu overwritten%s\n", used, start, torn ? ", some records torn" : "");
+
+	free(records);
+	return 0;
+}
@@ -0,0 +1,13 @@
+#!/bin/bash
+
+# runs payoutd against the simulated devices of payoutsim instead of the hardware,
+# arguments are passed to payoutsim (e.g. -d 20 -e 10 for 20ms latency and 1% lost replies)
+
+export LD_LIBRARY_PATH=.
+
+./payoutsim -L /tmp/payoutsim "$@" &
+SIM=$!
+trap "kill $SIM" EXIT
+
+sleep 1
+./payoutd -d /tmp/payoutsim